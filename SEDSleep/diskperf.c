@@ -40,6 +40,12 @@ Notes:
 #include <ntddscsi.h>
 #include "ntintsafe.h"
 
+#include "sedsleepioctl.h"
+#include "../common/sedtrace.h"
+#include "../common/sedgate.h"
+#include "../common/sedopal.h"
+#include "../common/sedpbkdf2.h"
+#include "../common/sedunlock.h"
 
 #include "send5.h"
 #include "send7.h"
@@ -57,14 +63,160 @@ Notes:
 
 #define SEDSLEEP_SCSI_BUFFER_SIZE 2048
 
-#define IOCTL_HURR_DURR_IM_A_GOAT      CTL_CODE(FILE_DEVICE_DISK, 0x4628, METHOD_BUFFERED, FILE_READ_DATA)
-
 typedef enum _ATACOMMAND {
     IF_RECV = 0x5c,
     IF_SEND = 0x5e,
     IDENTIFY = 0xec,
 } ATACOMMAND;
 
+//
+// Pass-through failures worth another go. Drives can report busy or not
+// ready for the first commands after they power up. Each command is
+// retried on its own, backing off exponentially, until it works, fails
+// for good, runs out of attempts or hits the unlock deadline. An empty
+// ComPacket from IF-RECV is a good reply; polling until the response is
+// ready is left to the unlock session.
+//
+
+typedef enum _SEDSLEEP_COMMAND_RESULT {
+    SedSleepCommandOk,
+    SedSleepCommandRetry,
+    SedSleepCommandFatal
+} SEDSLEEP_COMMAND_RESULT;
+
+#define SEDSLEEP_COMMAND_ATTEMPTS       12
+#define SEDSLEEP_BACKOFF_INITIAL_US     50
+#define SEDSLEEP_BACKOFF_MAX_US         20000
+
+//
+// SCSI status and sense keys, as in scsi.h
+//
+
+#define SEDSLEEP_SCSISTAT_CHECK_CONDITION   0x02
+#define SEDSLEEP_SCSISTAT_BUSY              0x08
+#define SEDSLEEP_SCSISTAT_QUEUE_FULL        0x28
+
+#define SEDSLEEP_SENSE_NOT_READY            0x02
+#define SEDSLEEP_SENSE_UNIT_ATTENTION       0x06
+#define SEDSLEEP_SENSE_ABORTED_COMMAND      0x0b
+
+#define SEDSLEEP_ASC_LUN_NOT_READY          0x04
+#define SEDSLEEP_ASCQ_CAUSE_NOT_REPORTABLE  0x00
+#define SEDSLEEP_ASCQ_BECOMING_READY        0x01
+#define SEDSLEEP_ASCQ_OPERATION_IN_PROGRESS 0x07
+
+//
+// ATA status register bits, for the ATA transport
+//
+
+#define SEDSLEEP_ATA_STATUS_ERROR           0x01
+#define SEDSLEEP_ATA_STATUS_BUSY            0x80
+
+//
+// Prepared unlock commands. Every packet the resume path sends is built,
+// and the read back appended, when the commands are provisioned (or at
+// DriverEntry for the compiled in ones); an unlock only copies each one
+// and stamps the session numbers on it. One unlock is a single session,
+// SedUnlockRun sending StartSession, every command and EndSession.
+//
+// The block is reference counted, so provisioning can replace it while
+// an unlock is still using the old one. It holds the credential, so it is
+// wiped before it is freed.
+//
+
+#define SEDSLEEP_MAX_COMMANDS   (SEDSLEEP_PROVISION_MAX_RANGES + 1)
+C_ASSERT(SEDSLEEP_MAX_COMMANDS == SEDSLEEP_UNLOCK_MAX_COMMANDS);
+C_ASSERT(SEDSLEEP_MAX_COMMANDS == SED_UNLOCK_MAX_METHODS);
+
+typedef struct _SEDSLEEP_COMMAND_IMAGE {
+    ULONG Offset;                   // of the ComPacket in Data
+    ULONG Length;                   // ComPacket length, headers included
+    BOOLEAN Verify;                 // Set holds the columns to read back
+    SED_OPAL_SET Set;
+} SEDSLEEP_COMMAND_IMAGE, * PSEDSLEEP_COMMAND_IMAGE;
+
+typedef struct _SEDSLEEP_UNLOCK_IMAGES {
+    LONG ReferenceCount;
+    ULONG CommandCount;
+    SEDSLEEP_COMMAND_IMAGE StartSession;
+    SEDSLEEP_COMMAND_IMAGE EndSession;
+    SEDSLEEP_COMMAND_IMAGE Command[SEDSLEEP_MAX_COMMANDS];
+    ULONG DataLength;
+    UCHAR Data[ANYSIZE_ARRAY];
+} SEDSLEEP_UNLOCK_IMAGES, * PSEDSLEEP_UNLOCK_IMAGES;
+
+//
+// The unlock session itself is common/sedunlock.c, run over the
+// pass-through through this transport. Status is what the last command
+// that failed came back with.
+//
+
+typedef struct _DISKPERF_OPAL_TRANSPORT {
+    SED_TRANSPORT Transport;
+    PDEVICE_OBJECT DeviceObject;
+    NTSTATUS Status;
+} DISKPERF_OPAL_TRANSPORT, * PDISKPERF_OPAL_TRANSPORT;
+
+//
+// How the unlock commands reach the drive: SCSI SECURITY PROTOCOL IN/OUT,
+// which the port driver translates for ATA drives where it can, or ATA
+// TRUSTED SEND/RECEIVE for controllers that do not
+//
+
+#define DISKPERF_TRANSPORT_SCSI     0
+#define DISKPERF_TRANSPORT_ATA      1
+
+//
+// Per drive settings from Parameters\Drives\<serial number> under the
+// service key, read once at DriverEntry and applied when the disk starts.
+// Present says which values were there; anything else keeps its default.
+//
+
+#define DISKPERF_POLICY_ENABLE          0x00000001
+#define DISKPERF_POLICY_LAZY            0x00000002
+#define DISKPERF_POLICY_DEADLINE        0x00000004
+#define DISKPERF_POLICY_RETRIES         0x00000008
+#define DISKPERF_POLICY_COMMAND_TIMEOUT 0x00000010
+#define DISKPERF_POLICY_TRANSPORT       0x00000020
+#define DISKPERF_POLICY_RANGES          0x00000040
+#define DISKPERF_POLICY_MBR_DONE        0x00000080
+#define DISKPERF_POLICY_STANDBY         0x00000100
+#define DISKPERF_POLICY_HIBERNATE       0x00000200
+
+typedef struct _DISKPERF_POLICY {
+    ULONG Present;                  // DISKPERF_POLICY_xxx
+    BOOLEAN Enable;
+    BOOLEAN Lazy;
+    BOOLEAN MbrDone;
+    BOOLEAN Standby;
+    BOOLEAN Hibernate;
+    UCHAR RangeCount;
+    UCHAR Range[SEDSLEEP_PROVISION_MAX_RANGES];
+    ULONG DeadlineMs;
+    ULONG Retries;
+    ULONG CommandTimeout;
+    ULONG Transport;
+} DISKPERF_POLICY, * PDISKPERF_POLICY;
+
+//
+// Drives we have been told about, hashed by serial number. Entries stay
+// until unload, only what they point to changes.
+//
+
+#define DISKPERF_DRIVE_BUCKETS  32
+
+typedef struct _DISKPERF_DRIVE {
+    struct _DISKPERF_DRIVE* Next;
+    CHAR SerialNumber[SEDTRACE_SERIAL_LENGTH];
+    DISKPERF_POLICY Policy;
+    PSEDSLEEP_UNLOCK_IMAGES Images;
+} DISKPERF_DRIVE, * PDISKPERF_DRIVE;
+
+C_ASSERT(SEDSLEEP_PROVISION_SERIAL_LENGTH == SEDTRACE_SERIAL_LENGTH);
+
+#define DISKPERF_IMAGES_SCRATCH_SIZE                                            \
+    (FIELD_OFFSET(SEDSLEEP_UNLOCK_IMAGES, Data) + (2 + SEDSLEEP_MAX_COMMANDS) * SEDSLEEP_SCSI_BUFFER_SIZE)
+
 //
 // Macro used to convert a ULONG into a 4 byte array (as big-endian)
 //
@@ -74,6 +226,246 @@ typedef enum _ATACOMMAND {
          ((UNALIGNED UCHAR *)(UCharArray))[1] = ((UNALIGNED UCHAR *)&(ULongValue))[2]; \
          ((UNALIGNED UCHAR *)(UCharArray))[0] = ((UNALIGNED UCHAR *)&(ULongValue))[3];
 
+//
+// Per processor counter shard. A processor only ever updates its own shard
+// (at DISPATCH_LEVEL, so it cannot migrate half way through), so no
+// interlocked operations are needed on the IO path. Each shard is padded to
+// a cache line so neighbouring processors never share one.
+//
+// Issued is bumped on the processor that sends the IRP down and Completed on
+// the processor that sees it complete, so only the sums over all shards are
+// meaningful. The queue depth is the difference of the two sums.
+//
+
+typedef struct DECLSPEC_CACHEALIGN _DISKPERF_COUNTER_SHARD {
+    ULONG64 BytesRead;
+    ULONG64 BytesWritten;
+    ULONG64 ReadTime;           // performance counter ticks
+    ULONG64 WriteTime;          // performance counter ticks
+    ULONG   ReadCount;
+    ULONG   WriteCount;
+    ULONG   SplitCount;
+    ULONG   Issued;
+    ULONG   Completed;
+} DISKPERF_COUNTER_SHARD, * PDISKPERF_COUNTER_SHARD;
+
+C_ASSERT(sizeof(DISKPERF_COUNTER_SHARD) % SYSTEM_CACHE_ALIGNMENT_SIZE == 0);
+
+//
+// Per processor latency histograms, one per SEDSLEEP_LATENCY_CLASS. These are
+// only allocated once latency collection is first enabled. Like the counter
+// shards they are only ever touched by their own processor.
+//
+
+typedef struct DECLSPEC_CACHEALIGN _DISKPERF_LATENCY_SHARD {
+    ULONG   Buckets[SedSleepLatencyClassCount][SEDSLEEP_LATENCY_BUCKETS];
+    ULONG64 TotalMicroseconds[SedSleepLatencyClassCount];
+    ULONG64 MaxMicroseconds[SedSleepLatencyClassCount];
+} DISKPERF_LATENCY_SHARD, * PDISKPERF_LATENCY_SHARD;
+
+//
+// Flags stashed in our own stack location of a read/write IRP, so the
+// completion routine knows what was recorded when it was sent down
+//
+
+#define DISKPERF_IRP_COUNTED    0x1     // issue counted in DiskCounters
+#define DISKPERF_IRP_TIMED      0x2     // record latency in LatencyShards
+#define DISKPERF_IRP_RESUME     0x4     // arrived while the gate was closed
+
+#define DISKPERF_DEFAULT_RESUME_WINDOW_MS 30000
+
+//
+// Unlock defaults, see SEDSLEEP_UNLOCK_CONTROL. The deadline bounds how
+// long read/write IO can be held at the gate after resume.
+//
+
+#define DISKPERF_DEFAULT_UNLOCK_DEADLINE_MS 15000
+#define DISKPERF_DEFAULT_UNLOCK_RETRIES     2
+#define DISKPERF_DEFAULT_COMMAND_TIMEOUT    2
+
+//
+// Buses self-encrypting drives sit on, one bit per STORAGE_BUS_TYPE. USB,
+// SD, virtual and the like are left alone unless the registry says so.
+//
+
+#define DISKPERF_BUS_TYPE_BIT(t)            (1UL << (t))
+
+#define DISKPERF_DEFAULT_ATTACH_BUS_TYPES   (DISKPERF_BUS_TYPE_BIT(BusTypeScsi) | \
+                                             DISKPERF_BUS_TYPE_BIT(BusTypeAta) |  \
+                                             DISKPERF_BUS_TYPE_BIT(BusTypeRAID) | \
+                                             DISKPERF_BUS_TYPE_BIT(BusTypeSas) |  \
+                                             DISKPERF_BUS_TYPE_BIT(BusTypeSata) | \
+                                             DISKPERF_BUS_TYPE_BIT(BusTypeNvme))
+
+//
+// Synchronous queries to the disk below (device number, name, descriptor)
+// reuse a few IRPs and buffers allocated at load instead of building an
+// IRP, and often allocating a buffer, for every one. The IRPs have room for
+// stacks up to DISKPERF_QUERY_STACK_SIZE deep; deeper stacks, or more
+// queries at once than there are slots, get an IRP of their own.
+//
+
+#define DISKPERF_QUERY_SLOTS        4
+#define DISKPERF_QUERY_STACK_SIZE   12
+#define DISKPERF_QUERY_BUFFER_SIZE  512
+
+typedef struct _DISKPERF_QUERY {
+    PIRP Irp;
+    PUCHAR Buffer;              // system buffer, METHOD_BUFFERED only
+    LONG Slot;                  // -1 if allocated for this query alone
+} DISKPERF_QUERY, * PDISKPERF_QUERY;
+
+C_ASSERT(SEDTRACE_LATENCY_BUCKETS == SEDSLEEP_LATENCY_BUCKETS);
+C_ASSERT(SEDTRACE_LATENCY_SUB_BUCKETS == SEDSLEEP_LATENCY_SUB_BUCKETS);
+
+//
+// Ring buffer of timing events around sleep and resume. Writers are the
+// power path and the unlock, never the read/write path (apart from the one
+// FirstIo event per resume), so a shared interlocked index is fine here.
+// Each slot's Sequence is written last, so a reader can tell a complete
+// event from one being overwritten.
+//
+
+#define DISKPERF_TRACE_EVENTS   256
+
+C_ASSERT((DISKPERF_TRACE_EVENTS & (DISKPERF_TRACE_EVENTS - 1)) == 0);
+
+typedef struct _DISKPERF_TRACE_RING {
+    LONG Next;
+    SEDTRACE_EVENT Events[DISKPERF_TRACE_EVENTS];
+} DISKPERF_TRACE_RING, * PDISKPERF_TRACE_RING;
+
+//
+// Timing events and pass-through command capture. Read/write IO never
+// looks at either, so they get an allocation of their own instead of
+// making the device extension several pages long. A disk that could not
+// get one is simply not traced.
+//
+
+typedef struct _DISKPERF_TRACE {
+
+    DISKPERF_TRACE_RING Ring;
+
+    //
+    // SEDTRACE_COMMAND records packed into CaptureBuffer. The buffer only
+    // exists while capture is enabled.
+    //
+
+    KSPIN_LOCK CaptureLock;
+    PUCHAR CaptureBuffer;
+    ULONG CaptureSize;
+    ULONG CaptureUsed;
+    ULONG CaptureSequence;
+    ULONG CaptureDropped;
+
+} DISKPERF_TRACE, * PDISKPERF_TRACE;
+
+//
+// Driver build reported in traces, so the analyzer can compare builds.
+// Override on the compiler command line with something more useful,
+// e.g. a git revision.
+//
+
+#ifndef SEDSLEEP_BUILD_ID
+#define SEDSLEEP_BUILD_ID __DATE__ " " __TIME__
+#endif
+
+//
+// Unlock state and buffers. Only allocated for drives that may need
+// unlocking on resume, see DiskPerfPrepareUnlock; the rest never close
+// their gate and have no use for any of it.
+//
+
+typedef struct _DISKPERF_UNLOCK {
+
+    //
+    // Pass-through data buffer. It comes first and the context is more
+    // than a page, so it starts page aligned and satisfies any alignment
+    // requirement the adapter has.
+    //
+
+    UCHAR ScsiDataBuffer[PAGE_SIZE];
+
+    UCHAR ScsiSendBuffer[SEDSLEEP_SCSI_BUFFER_SIZE];
+    UCHAR ScsiRecvBuffer[SEDSLEEP_SCSI_BUFFER_SIZE];
+
+    //
+    // Unlock command being sent, stamped with the session numbers
+    //
+
+    UCHAR OpalCommandBuffer[SEDSLEEP_SCSI_BUFFER_SIZE];
+
+    struct _DEVICE_EXTENSION* DeviceExtension;
+
+    //
+    // Unlock worker queue link. UnlockIdleEvent is signalled whenever no
+    // unlock is queued or running for this device. WakePending is set from
+    // the S3 IRP until the first S0 or D0 IRP arrives.
+    //
+
+    LIST_ENTRY UnlockLink;
+    LONG UnlockQueued;
+    KEVENT UnlockIdleEvent;
+    LONG WakePending;
+
+    //
+    // Unlock deadline. UnlockTimer is armed when the unlock is queued; if
+    // it fires first the gate is failed with GateStatus. UnlockDeadline is
+    // the same point in performance counter ticks, for the worker.
+    //
+
+    KTIMER UnlockTimer;
+    KDPC UnlockDpc;
+    LONGLONG UnlockDeadline;
+
+    //
+    // What the TPer said about itself in reply to Properties, asked once
+    // on the first unlock. Drives that talk asynchronously get the method
+    // call and EndSession queued back to back.
+    //
+
+    SED_OPAL_PROPERTIES TPerProperties;
+    BOOLEAN TPerPropertiesKnown;
+
+    //
+    // Pending IOCTL_HURR_DURR_IM_A_GOAT requests, linked through
+    // Tail.Overlay.ListEntry and completed when the unlock is done.
+    // RequestLock also covers clearing UnlockQueued and CancelRequested at
+    // the end of an unlock, so a request either joins the unlock that is
+    // running or queues the next one.
+    //
+
+    KSPIN_LOCK RequestLock;
+    LIST_ENTRY Requests;
+    LONG CancelRequested;
+
+    //
+    // Progress of the running unlock or result of the last one, written by
+    // the worker. QueueTime is when it was queued, in counter ticks.
+    //
+
+    LONGLONG QueueTime;
+    SEDSLEEP_UNLOCK_RESULT Result;
+
+} DISKPERF_UNLOCK, * PDISKPERF_UNLOCK;
+
+/*
+Layout of Per Processor Counters is a contiguous, cache aligned block of memory:
+    Processor 0                     Processor N-1
++----------------------+     +----------------------+
+|DISKPERF_COUNTER_SHARD| ... |DISKPERF_COUNTER_SHARD|
++----------------------+     +----------------------+
+where N is the maximum processor count, so hot-added processors always
+have a shard of their own.
+*/
+
+//
+// Device State bits
+//
+
+#define DISKPERF_STATE_NAMED        0x1     // registered, PhysicalDeviceName is set
+#define DISKPERF_STATE_FIRST_IO     0x2     // next read/write is the first since wake
+
 //
 // Device Extension
 //
@@ -81,28 +473,67 @@ typedef enum _ATACOMMAND {
 typedef struct _DEVICE_EXTENSION {
 
     //
-    // Back pointer to device object
+    // Everything read/write IO reads on the way down and back up comes
+    // first and fits in one cache line, so a busy disk does not drag the
+    // rest of the extension through the cache. The parked path also
+    // reads Unlock and UnlockFlags.
     //
 
+    PDEVICE_OBJECT TargetDeviceObject;
     PDEVICE_OBJECT DeviceObject;
 
     //
-    // Target Device Object
+    // Read/write IO is held at the gate from sleep until the drive has been
+    // unlocked again. Parked IRPs are linked through DriverContext[0].
     //
 
-    PDEVICE_OBJECT TargetDeviceObject;
+    SED_GATE Gate;
 
     //
-    // Physical device object
+    // Per processor counters and latency histograms, see below
+    //
+
+    PDISKPERF_COUNTER_SHARD DiskCounters;
+    PDISKPERF_LATENCY_SHARD LatencyShards;
+
+    //
+    // Unlock state, NULL for a drive that is never unlocked
     //
-    PDEVICE_OBJECT PhysicalDeviceObject;
+
+    PDISKPERF_UNLOCK Unlock;
+
+    LONG CountersEnabled;
+    LONG LatencyEnabled;
+    LONG State;
+    ULONG UnlockFlags;
 
     //
-    // RemoveLock prevents removal of a device while it is busy.
+    // RemoveLock prevents removal of a device while it is busy. It is
+    // written by every IRP, so it is kept off the line above.
     //
 
     IO_REMOVE_LOCK RemoveLock;
 
+    //
+    // IO latency histograms, per processor like the counters. IO arriving
+    // within ResumeWindowTicks of ResumeTime goes into the resume histogram.
+    //
+
+    LONGLONG ResumeTime;
+    LONGLONG ResumeWindowTicks;
+    ULONG ResumeWindowMs;
+
+    //
+    // What IO failed at the gate completes with
+    //
+
+    NTSTATUS GateStatus;
+
+    //
+    // Physical device object
+    //
+    PDEVICE_OBJECT PhysicalDeviceObject;
+
     //
     // Disk number for reference in WMI
     //
@@ -128,10 +559,20 @@ typedef struct _DEVICE_EXTENSION {
     //
 
     ULONG   Processors;
-    PDISK_PERFORMANCE DiskCounters;    // per processor counters
-    LARGE_INTEGER LastIdleClock;
-    LONG QueueDepth;
-    LONG CountersEnabled;
+
+    //
+    // Timing events and command capture, NULL if they could not be
+    // allocated
+    //
+
+    PDISKPERF_TRACE Trace;
+
+    //
+    // Drive identity from the storage device descriptor
+    //
+
+    CHAR SerialNumber[SEDTRACE_SERIAL_LENGTH];
+    CHAR ProductId[SEDTRACE_MODEL_LENGTH];
 
     //
     // must synchronize paging path notifications
@@ -146,29 +587,193 @@ typedef struct _DEVICE_EXTENSION {
     UNICODE_STRING PhysicalDeviceName;
     WCHAR PhysicalDeviceNameBuffer[DISKPERF_MAXSTR];
 
-    UCHAR Sleepy;
-    KMUTEX SleepMutex;
+    //
+    // Unlock settings, from the policy and IOCTL_SEDSLEEP_SET_UNLOCK. They
+    // are kept whether or not there is an unlock context.
+    //
 
-    UCHAR ScsiSendBuffer[SEDSLEEP_SCSI_BUFFER_SIZE];
-    UCHAR ScsiRecvBuffer[SEDSLEEP_SCSI_BUFFER_SIZE];
+    ULONG UnlockDeadlineMs;
+    ULONG UnlockRetries;
+    ULONG CommandTimeout;
+    ULONG Transport;
+
+    //
+    // Policy says to leave this drive alone: the gate stays open on S3
+    // and nothing is unlocked on resume
+    //
+
+    BOOLEAN UnlockDisabled;
 
 } DEVICE_EXTENSION, * PDEVICE_EXTENSION;
 
-#define DEVICE_EXTENSION_SIZE sizeof(DEVICE_EXTENSION)
-#define PROCESSOR_COUNTERS_SIZE FIELD_OFFSET(DISK_PERFORMANCE, QueryTime)
+C_ASSERT(FIELD_OFFSET(DEVICE_EXTENSION, UnlockFlags) + sizeof(ULONG) <= SYSTEM_CACHE_ALIGNMENT_SIZE);
 
-/*
-Layout of Per Processor Counters is a contiguous block of memory:
-    Processor 1
-+-----------------------+     +-----------------------+
-|PROCESSOR_COUNTERS_SIZE| ... |PROCESSOR_COUNTERS_SIZE|
-+-----------------------+     +-----------------------+
-where PROCESSOR_COUNTERS_SIZE is less than sizeof(DISK_PERFORMANCE) since
-we only put those we actually use for counting.
-*/
+#define DEVICE_EXTENSION_SIZE sizeof(DEVICE_EXTENSION)
 
 UNICODE_STRING DiskPerfRegistryPath;
 
+//
+// Performance counter frequency, used to convert counter ticks to the
+// 100ns units reported in DISK_PERFORMANCE
+//
+
+LARGE_INTEGER DiskPerfFrequency;
+
+//
+// Unlock worker. The power path only queues a device here; the worker
+// thread has the (slow, blocking) pass-through conversation with the
+// drive and then opens the gate, so resume is never held up by it.
+//
+
+LIST_ENTRY DiskPerfUnlockQueue;
+KSPIN_LOCK DiskPerfUnlockLock;
+KEVENT     DiskPerfUnlockEvent;
+PKTHREAD   DiskPerfUnlockThread;
+BOOLEAN    DiskPerfUnlockStop;
+
+//
+// Provisioned drives, and the compiled in commands for everything else
+//
+
+PDISKPERF_DRIVE         DiskPerfDrives[DISKPERF_DRIVE_BUCKETS];
+KSPIN_LOCK              DiskPerfDriveLock;
+PSEDSLEEP_UNLOCK_IMAGES DiskPerfBuiltinImages;
+
+//
+// Password hashing implementations that passed the self test at load.
+// AVX2 is never used, the filter derives one drive's PIN at a time.
+//
+
+ULONG   DiskPerfPbkdf2Features;
+BOOLEAN DiskPerfPbkdf2Usable;
+
+//
+// Which disks get a filter device at all. The rest are never attached to,
+// so their IO does not go through the filter.
+//
+
+ULONG   DiskPerfAttachBusTypes = DISKPERF_DEFAULT_ATTACH_BUS_TYPES;
+BOOLEAN DiskPerfAttachRemovable;
+
+//
+// Query IRPs and buffers, a bit per slot in use
+//
+
+DISKPERF_QUERY DiskPerfQueries[DISKPERF_QUERY_SLOTS];
+LONG           DiskPerfQueriesBusy;
+
+//
+// Converts performance counter ticks to 100ns units without overflowing
+// for large tick counts
+//
+
+FORCEINLINE
+LONGLONG
+DiskPerfTicksTo100ns(
+    IN ULONG64 Ticks
+)
+{
+    ULONG64 frequency = (ULONG64)DiskPerfFrequency.QuadPart;
+
+    return (LONGLONG)((Ticks / frequency) * 10000000 +
+        ((Ticks % frequency) * 10000000) / frequency);
+}
+
+//
+// Returns the counter shard of the current processor. Must be called at
+// DISPATCH_LEVEL so the caller cannot be moved to another processor while
+// it is updating the shard.
+//
+
+FORCEINLINE
+PDISKPERF_COUNTER_SHARD
+DiskPerfCurrentShard(
+    IN PDEVICE_EXTENSION DeviceExtension
+)
+{
+    ULONG processor = KeGetCurrentProcessorNumberEx(NULL);
+
+    NT_ASSERT(KeGetCurrentIrql() >= DISPATCH_LEVEL);
+    NT_ASSERT(processor < DeviceExtension->Processors);
+
+    return &DeviceExtension->DiskCounters[processor];
+}
+
+//
+// Record a timing event in the device's trace ring
+//
+
+FORCEINLINE
+VOID
+DiskPerfTraceEvent(
+    IN PDEVICE_EXTENSION DeviceExtension,
+    IN SEDTRACE_EVENT_TYPE Event,
+    IN USHORT Arg16,
+    IN ULONG Arg32
+)
+{
+    PDISKPERF_TRACE_RING ring;
+    PSEDTRACE_EVENT slot;
+    LONG sequence;
+
+    if (DeviceExtension->Trace == NULL) {
+        return;
+    }
+
+    ring = &DeviceExtension->Trace->Ring;
+    sequence = InterlockedIncrement(&ring->Next);
+    slot = &ring->Events[(sequence - 1) & (DISKPERF_TRACE_EVENTS - 1)];
+
+    InterlockedExchange((PLONG)&slot->Sequence, 0);
+    slot->Timestamp = KeQueryPerformanceCounter(NULL).QuadPart;
+    slot->Event = (USHORT)Event;
+    slot->Arg16 = Arg16;
+    slot->Arg32 = Arg32;
+    InterlockedExchange((PLONG)&slot->Sequence, sequence);
+}
+
+//
+// An unlock is given up once it is cancelled, but only if no IO is held
+// waiting for it: the gate is open already, or the disk is going away
+//
+
+FORCEINLINE
+BOOLEAN
+DiskPerfUnlockCancelled(
+    IN PDEVICE_EXTENSION DeviceExtension
+)
+{
+    LONG state = SED_GATE_LOAD(&DeviceExtension->Gate.State);
+
+    return DeviceExtension->Unlock->CancelRequested &&
+        (state == SED_GATE_OPEN || state == SED_GATE_REMOVED);
+}
+
+//
+// Maps a latency in microseconds onto its log-linear histogram bucket,
+// see SEDSLEEP_LATENCY_BUCKET_FLOOR
+//
+
+FORCEINLINE
+ULONG
+DiskPerfLatencyBucket(
+    IN ULONG64 Microseconds
+)
+{
+    ULONG msb;
+    ULONG bucket;
+
+    if (Microseconds < SEDSLEEP_LATENCY_SUB_BUCKETS) {
+        return (ULONG)Microseconds;
+    }
+
+    msb = (ULONG)RtlFindMostSignificantBit(Microseconds);
+    bucket = (msb - 1) * SEDSLEEP_LATENCY_SUB_BUCKETS +
+        (ULONG)((Microseconds >> (msb - 2)) & (SEDSLEEP_LATENCY_SUB_BUCKETS - 1));
+
+    return min(bucket, SEDSLEEP_LATENCY_BUCKETS - 1);
+}
+
 
 //
 // Function declarations
@@ -227,9 +832,312 @@ DiskPerfSyncFilterWithTarget(
     IN PDEVICE_OBJECT TargetDevice
 );
 
-#if DBG
+IO_COMPLETION_ROUTINE DiskPerfIoCompletion;
 
-ULONG DiskPerfDebug = 0;
+IO_COMPLETION_ROUTINE DiskPerfPowerCompletion;
+
+KSTART_ROUTINE DiskPerfUnlockWorker;
+
+NTSTATUS
+DiskPerfSendReadWrite(
+    IN PDEVICE_EXTENSION DeviceExtension,
+    IN PIRP Irp
+);
+
+VOID
+DiskPerfReleaseParked(
+    IN PDEVICE_EXTENSION DeviceExtension,
+    IN PSED_GATE_ENTRY List,
+    IN NTSTATUS Status
+);
+
+PSED_GATE_ENTRY
+DiskPerfOrderParked(
+    IN PSED_GATE_ENTRY List
+);
+
+BOOLEAN
+DiskPerfClassifyTransition(
+    IN PDEVICE_EXTENSION DeviceExtension,
+    IN PIO_STACK_LOCATION IrpSp,
+    OUT SEDTRACE_TRANSITION* Transition
+);
+
+BOOLEAN
+DiskPerfUnlockNow(
+    IN PDEVICE_EXTENSION DeviceExtension
+);
+
+VOID
+DiskPerfQueueUnlock(
+    IN PDEVICE_EXTENSION DeviceExtension,
+    IN BOOLEAN Requested
+);
+
+KDEFERRED_ROUTINE DiskPerfUnlockTimeout;
+
+DRIVER_CANCEL DiskPerfCancelUnlockRequest;
+
+VOID
+DiskPerfCompleteUnlockRequests(
+    IN PDEVICE_EXTENSION DeviceExtension,
+    IN NTSTATUS Status,
+    IN BOOLEAN Finished
+);
+
+VOID
+DiskPerfCancelUnlock(
+    IN PDEVICE_EXTENSION DeviceExtension,
+    IN NTSTATUS Status
+);
+
+VOID
+DiskPerfQueryUnlock(
+    IN PDEVICE_EXTENSION DeviceExtension,
+    OUT PSEDSLEEP_UNLOCK_RESULT Result
+);
+
+VOID
+DiskPerfUnlockDevice(
+    IN PDEVICE_EXTENSION DeviceExtension
+);
+
+NTSTATUS
+DiskPerfSetUnlock(
+    IN PDEVICE_EXTENSION DeviceExtension,
+    IN PSEDSLEEP_UNLOCK_CONTROL Control
+);
+
+NTSTATUS
+DiskPerfProvision(
+    IN PDEVICE_EXTENSION DeviceExtension,
+    IN PSEDSLEEP_PROVISION Provision
+);
+
+NTSTATUS
+DiskPerfBuildImages(
+    IN PSEDSLEEP_PROVISION Provision,
+    OUT PSEDSLEEP_UNLOCK_IMAGES* Images
+);
+
+VOID
+DiskPerfCheckPbkdf2(
+    VOID
+);
+
+NTSTATUS
+DiskPerfDeriveCredential(
+    IN PDEVICE_EXTENSION DeviceExtension,
+    IN OUT PSEDSLEEP_PROVISION Provision,
+    IN PCHAR SerialNumber
+);
+
+NTSTATUS
+DiskPerfQueryRawSerial(
+    IN PDEVICE_EXTENSION DeviceExtension,
+    OUT PUCHAR Serial
+);
+
+NTSTATUS
+DiskPerfBuildBuiltinImages(
+    OUT PSEDSLEEP_UNLOCK_IMAGES* Images
+);
+
+PSEDSLEEP_UNLOCK_IMAGES
+DiskPerfReferenceImages(
+    IN PDEVICE_EXTENSION DeviceExtension
+);
+
+VOID
+DiskPerfDereferenceImages(
+    IN PSEDSLEEP_UNLOCK_IMAGES Images
+);
+
+PDISKPERF_DRIVE
+DiskPerfFindDrive(
+    IN PCSTR SerialNumber
+);
+
+VOID
+DiskPerfLoadPolicies(
+    IN PUNICODE_STRING RegistryPath
+);
+
+VOID
+DiskPerfLoadPolicy(
+    IN HANDLE DrivesKey,
+    IN PUNICODE_STRING Name
+);
+
+NTSTATUS
+DiskPerfQueryValue(
+    IN HANDLE Key,
+    IN PCWSTR Name,
+    IN ULONG Type,
+    OUT PVOID Buffer,
+    IN ULONG Size,
+    OUT PULONG Length
+);
+
+VOID
+DiskPerfApplyPolicy(
+    IN PDEVICE_EXTENSION DeviceExtension
+);
+
+VOID
+DiskPerfPrepareUnlock(
+    IN PDEVICE_EXTENSION DeviceExtension
+);
+
+ULONG
+DiskPerfHashSerial(
+    IN PCSTR SerialNumber
+);
+
+PSEDSLEEP_UNLOCK_IMAGES
+DiskPerfAllocateImages(
+    VOID
+);
+
+PUCHAR
+DiskPerfImageSpace(
+    IN PSEDSLEEP_UNLOCK_IMAGES Images,
+    OUT PULONG Room
+);
+
+NTSTATUS
+DiskPerfAddImage(
+    IN PSEDSLEEP_UNLOCK_IMAGES Images,
+    OUT PSEDSLEEP_COMMAND_IMAGE Image,
+    IN ULONG Length,
+    IN BOOLEAN Method
+);
+
+NTSTATUS
+DiskPerfCopyImage(
+    IN PSEDSLEEP_UNLOCK_IMAGES Images,
+    OUT PSEDSLEEP_COMMAND_IMAGE Image,
+    IN const UCHAR* Source,
+    IN ULONG Length,
+    IN BOOLEAN Method
+);
+
+NTSTATUS
+DiskPerfFinishImages(
+    IN PSEDSLEEP_UNLOCK_IMAGES Scratch,
+    OUT PSEDSLEEP_UNLOCK_IMAGES* Images
+);
+
+VOID
+DiskPerfQueryCounters(
+    IN PDEVICE_EXTENSION DeviceExtension,
+    OUT PDISK_PERFORMANCE TotalCounters
+);
+
+NTSTATUS
+DiskPerfSetLatency(
+    IN PDEVICE_EXTENSION DeviceExtension,
+    IN PSEDSLEEP_LATENCY_CONTROL Control
+);
+
+VOID
+DiskPerfQueryLatency(
+    IN PDEVICE_EXTENSION DeviceExtension,
+    OUT PSEDSLEEP_LATENCY_HISTOGRAMS Histograms
+);
+
+NTSTATUS
+DiskPerfQueryTrace(
+    IN PDEVICE_EXTENSION DeviceExtension,
+    IN ULONG FirstSequence,
+    OUT PUCHAR Buffer,
+    IN ULONG Length,
+    OUT PULONG Written
+);
+
+VOID
+DiskPerfQueryIdentity(
+    IN PDEVICE_OBJECT DeviceObject
+);
+
+NTSTATUS
+DiskPerfQueryDescriptor(
+    IN PDEVICE_OBJECT TargetDeviceObject,
+    IN PDISKPERF_QUERY Query,
+    OUT PULONG DescriptorLength
+);
+
+BOOLEAN
+DiskPerfShouldAttach(
+    IN PDEVICE_OBJECT PhysicalDeviceObject,
+    OUT PCHAR SerialNumber,
+    OUT PCHAR ProductId
+);
+
+VOID
+DiskPerfAllocateQueries(
+    VOID
+);
+
+VOID
+DiskPerfFreeQueries(
+    VOID
+);
+
+PDISKPERF_QUERY
+DiskPerfAcquireQuery(
+    IN PDEVICE_OBJECT TargetDeviceObject
+);
+
+VOID
+DiskPerfReleaseQuery(
+    IN PDISKPERF_QUERY Query
+);
+
+NTSTATUS
+DiskPerfSendQuery(
+    IN PDEVICE_OBJECT TargetDeviceObject,
+    IN PDISKPERF_QUERY Query,
+    IN ULONG IoControlCode,
+    IN ULONG InputLength,
+    IN ULONG OutputLength,
+    OUT PULONG_PTR Information
+);
+
+NTSTATUS
+DiskPerfSetCapture(
+    IN PDEVICE_EXTENSION DeviceExtension,
+    IN PSEDSLEEP_CAPTURE_CONTROL Control
+);
+
+NTSTATUS
+DiskPerfQueryCapture(
+    IN PDEVICE_EXTENSION DeviceExtension,
+    OUT PUCHAR Buffer,
+    IN ULONG Length,
+    OUT PULONG Written
+);
+
+VOID
+DiskPerfCaptureCommand(
+    IN PDEVICE_EXTENSION DeviceExtension,
+    IN PSCSI_PASS_THROUGH_DIRECT Sptd,
+    IN PUCHAR Sense,
+    IN PUCHAR Data,
+    IN NTSTATUS Status,
+    IN LONGLONG Start,
+    IN LONGLONG End
+);
+
+VOID
+DiskPerfRedactCommand(
+    IN OUT PUCHAR Data,
+    IN ULONG Length
+);
+
+#if DBG
+
+ULONG DiskPerfDebug = 0;
 
 VOID
 DiskPerfDebugPrint(
@@ -247,17 +1155,59 @@ DiskPerfDebugPrint(
 #endif
 
 
-VOID SEDSleepUnlockDrive(
+NTSTATUS SEDSleepUnlockDrive(
     IN PDEVICE_OBJECT DeviceObject
 );
 
-VOID SEDSleepSendOPALCommand(
+VOID SEDSleepOpenOpal(
     IN PDEVICE_OBJECT DeviceObject,
-    UCHAR* src,
-    size_t len
+    OUT SED_UNLOCK* unlock,
+    OUT PDISKPERF_OPAL_TRANSPORT transport
 );
 
-VOID SEDSleepSendSCSICommand(
+int SEDSleepOpalIfSend(
+    SED_TRANSPORT* Transport,
+    uint8_t Protocol,
+    uint16_t ComId,
+    const void* Data,
+    uint32_t Length
+);
+
+int SEDSleepOpalIfRecv(
+    SED_TRANSPORT* Transport,
+    uint8_t Protocol,
+    uint16_t ComId,
+    void* Data,
+    uint32_t Length
+);
+
+void SEDSleepOpalClose(
+    SED_TRANSPORT* Transport
+);
+
+int SEDSleepOpalWait(
+    void* Context,
+    uint32_t Microseconds
+);
+
+NTSTATUS SEDSleepOpalStatus(
+    IN PDEVICE_EXTENSION deviceExtension,
+    IN PDISKPERF_OPAL_TRANSPORT transport,
+    int result
+);
+
+VOID SEDSleepImagePacket(
+    PSEDSLEEP_UNLOCK_IMAGES images,
+    PSEDSLEEP_COMMAND_IMAGE image,
+    SED_UNLOCK_PACKET* packet
+);
+
+VOID SEDSleepQueryProperties(
+    IN PDEVICE_OBJECT DeviceObject,
+    IN SED_UNLOCK* unlock
+);
+
+NTSTATUS SEDSleepSendSCSICommand(
     IN PDEVICE_OBJECT DeviceObject,
     ATACOMMAND cmd,
     UCHAR protocol,
@@ -266,24 +1216,16 @@ VOID SEDSleepSendSCSICommand(
     size_t len
 );
 
+SEDSLEEP_COMMAND_RESULT SEDSleepClassifyCommand(
+    NTSTATUS status,
+    UCHAR scsiStatus,
+    const UCHAR* sense,
+    ULONG senseLength
+);
 
-_Success_(return != NULL)
-_Post_maybenull_
-_Must_inspect_result_
-__drv_allocatesMem(Mem)
-_Post_writable_byte_size_(*BytesAllocated)
-_When_(((PoolType & 0x1)) != 0, _IRQL_requires_max_(APC_LEVEL))
-_When_(((PoolType & 0x1)) == 0, _IRQL_requires_max_(DISPATCH_LEVEL))
-_When_((PoolType& NonPagedPoolMustSucceed) != 0,
-    __drv_reportError("Must succeed pool allocations are forbidden. "
-        "Allocation failures cause a system crash"))
-    PVOID
-    DsmpAllocateAlignedPool(
-        _In_ IN POOL_TYPE PoolType,
-        _In_ IN SIZE_T NumberOfBytes,
-        _In_ IN ULONG AlignmentMask,
-        _Out_ OUT SIZE_T* BytesAllocated
-    );
+VOID SEDSleepBackoff(
+    ULONG microseconds
+);
 
 /*
 //
@@ -297,10 +1239,13 @@ _When_((PoolType& NonPagedPoolMustSucceed) != 0,
 #pragma alloc_text (PAGE, DiskPerfAddDevice)
 #pragma alloc_text (PAGE, DiskPerfDispatchPnp)
 #pragma alloc_text (PAGE, DiskPerfStartDevice)
+#pragma alloc_text (PAGE, DiskPerfPrepareUnlock)
 #pragma alloc_text (PAGE, DiskPerfRemoveDevice)
 #pragma alloc_text (PAGE, DiskPerfUnload)
 #pragma alloc_text (PAGE, DiskPerfRegisterDevice)
 #pragma alloc_text (PAGE, DiskPerfSyncFilterWithTarget)
+#pragma alloc_text (PAGE, DiskPerfAcquireQuery)
+#pragma alloc_text (PAGE, DiskPerfSendQuery)
 #endif*/
 
 
@@ -336,6 +1281,61 @@ Return Value:
 
     ULONG               ulIndex;
     PDRIVER_DISPATCH* dispatch;
+    HANDLE              threadHandle;
+    NTSTATUS            status;
+
+    KeQueryPerformanceCounter(&DiskPerfFrequency);
+
+    //
+    // Start the unlock worker
+    //
+
+    InitializeListHead(&DiskPerfUnlockQueue);
+    KeInitializeSpinLock(&DiskPerfUnlockLock);
+    KeInitializeEvent(&DiskPerfUnlockEvent, SynchronizationEvent, FALSE);
+
+    status = PsCreateSystemThread(&threadHandle, THREAD_ALL_ACCESS, NULL, NULL, NULL,
+        DiskPerfUnlockWorker, NULL);
+    if (!NT_SUCCESS(status)) {
+        DebugPrint((1, "DiskPerf: Cannot create unlock worker %x\n", status));
+        return status;
+    }
+
+    status = ObReferenceObjectByHandle(threadHandle, THREAD_ALL_ACCESS, *PsThreadType,
+        KernelMode, (PVOID*)&DiskPerfUnlockThread, NULL);
+    if (!NT_SUCCESS(status)) {
+
+        //
+        // Without the thread object DiskPerfUnload could not wait for the
+        // worker, so stop it here, through the handle, and fail the load
+        //
+
+        DebugPrint((1, "DiskPerf: Cannot reference unlock worker %x\n", status));
+        DiskPerfUnlockThread = NULL;
+        DiskPerfUnlockStop = TRUE;
+        KeSetEvent(&DiskPerfUnlockEvent, IO_NO_INCREMENT, FALSE);
+        ZwWaitForSingleObject(threadHandle, FALSE, NULL);
+        ZwClose(threadHandle);
+        return status;
+    }
+    ZwClose(threadHandle);
+
+    //
+    // Prepare the compiled in unlock commands. Without them only
+    // provisioned drives can be unlocked, which is no reason to keep the
+    // disks from starting.
+    //
+
+    KeInitializeSpinLock(&DiskPerfDriveLock);
+
+    status = DiskPerfBuildBuiltinImages(&DiskPerfBuiltinImages);
+    if (!NT_SUCCESS(status)) {
+        DebugPrint((1, "DiskPerf: Cannot prepare the unlock commands %x\n", status));
+    }
+
+    DiskPerfCheckPbkdf2();
+    DiskPerfLoadPolicies(RegistryPath);
+    DiskPerfAllocateQueries();
 
     //
     // Remember registry path
@@ -441,6 +1441,8 @@ Return Value:
     NTSTATUS                status;
     PDEVICE_OBJECT          filterDeviceObject;
     PDEVICE_EXTENSION       deviceExtension;
+    CHAR                    serial[SEDTRACE_SERIAL_LENGTH];
+    CHAR                    product[SEDTRACE_MODEL_LENGTH];
     //PCHAR                   buffer;
     //ULONG                   buffersize;
 
@@ -453,6 +1455,15 @@ Return Value:
     DebugPrint((2, "DiskPerfAddDevice: DriverObject 0x%p DeviceObject 0x%p\n",
         DriverObject, PhysicalDeviceObject));
 
+    //
+    // Leave disks that cannot need unlocking out of it altogether. Not
+    // attaching is fine for a filter, the stack just builds without us.
+    //
+
+    if (!DiskPerfShouldAttach(PhysicalDeviceObject, serial, product)) {
+        return STATUS_SUCCESS;
+    }
+
     status = IoCreateDevice(DriverObject,
         DEVICE_EXTENSION_SIZE,
         NULL,
@@ -472,6 +1483,27 @@ Return Value:
 
     RtlZeroMemory(deviceExtension, DEVICE_EXTENSION_SIZE);
 
+    RtlCopyMemory(deviceExtension->SerialNumber, serial, sizeof(serial));
+    RtlCopyMemory(deviceExtension->ProductId, product, sizeof(product));
+
+    //
+    // Allocate the per processor counters. Counting is only an aid, so carry
+    // on without it rather than failing the disk if this does not work out.
+    //
+
+    deviceExtension->Processors = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    deviceExtension->DiskCounters = ExAllocatePool(NonPagedPoolNxCacheAligned,
+        deviceExtension->Processors * sizeof(DISKPERF_COUNTER_SHARD));
+    if (deviceExtension->DiskCounters != NULL) {
+        RtlZeroMemory(deviceExtension->DiskCounters,
+            deviceExtension->Processors * sizeof(DISKPERF_COUNTER_SHARD));
+    }
+    else {
+        DebugPrint((1, "DiskPerfAddDevice: Cannot allocate counters for %d processors\n",
+            deviceExtension->Processors));
+        deviceExtension->Processors = 0;
+    }
+
     //
     // Attaches the device object to the highest device object in the chain and
     // return the previously highest device object, which is passed to
@@ -484,8 +1516,10 @@ Return Value:
         IoAttachDeviceToDeviceStack(filterDeviceObject, PhysicalDeviceObject);
 
     if (deviceExtension->TargetDeviceObject == NULL) {
-        ExFreePool(deviceExtension->DiskCounters);
-        deviceExtension->DiskCounters = NULL;
+        if (deviceExtension->DiskCounters != NULL) {
+            ExFreePool(deviceExtension->DiskCounters);
+            deviceExtension->DiskCounters = NULL;
+        }
         IoDeleteDevice(filterDeviceObject);
         DebugPrint((1, "DiskPerfAddDevice: Unable to attach 0x%p to target 0x%p\n",
             filterDeviceObject, PhysicalDeviceObject));
@@ -510,7 +1544,39 @@ Return Value:
     KeInitializeEvent(&deviceExtension->PagingPathCountEvent,
         NotificationEvent, TRUE);
 
-    KeInitializeMutex(&deviceExtension->SleepMutex, 0);
+    SedGateInitialize(&deviceExtension->Gate, TRUE);
+
+    //
+    // The unlock context itself waits for the start, when it is known
+    // whether the drive needs one
+    //
+
+    deviceExtension->UnlockDeadlineMs = DISKPERF_DEFAULT_UNLOCK_DEADLINE_MS;
+    deviceExtension->UnlockRetries = DISKPERF_DEFAULT_UNLOCK_RETRIES;
+    deviceExtension->CommandTimeout = DISKPERF_DEFAULT_COMMAND_TIMEOUT;
+    deviceExtension->GateStatus = STATUS_IO_DEVICE_ERROR;
+
+    //
+    // Like the counters, tracing is only an aid
+    //
+
+    deviceExtension->Trace = ExAllocatePool(NonPagedPoolNx, sizeof(DISKPERF_TRACE));
+    if (deviceExtension->Trace != NULL) {
+        RtlZeroMemory(deviceExtension->Trace, sizeof(DISKPERF_TRACE));
+        KeInitializeSpinLock(&deviceExtension->Trace->CaptureLock);
+    }
+    else {
+        DebugPrint((1, "DiskPerfAddDevice: Cannot allocate the trace ring\n"));
+    }
+
+    //
+    // No resume yet, so make sure nothing falls into the resume window
+    //
+
+    deviceExtension->ResumeTime = MAXLONGLONG;
+    deviceExtension->ResumeWindowMs = DISKPERF_DEFAULT_RESUME_WINDOW_MS;
+    deviceExtension->ResumeWindowTicks =
+        (DiskPerfFrequency.QuadPart * DISKPERF_DEFAULT_RESUME_WINDOW_MS) / 1000;
 
     //
     // default to DO_POWER_PAGABLE
@@ -856,6 +1922,13 @@ Return Value:
     //
     DiskPerfRegisterDevice(DeviceObject);
 
+    DiskPerfQueryIdentity(DeviceObject);
+    DiskPerfApplyPolicy(deviceExtension);
+
+    if (NT_SUCCESS(status)) {
+        DiskPerfPrepareUnlock(deviceExtension);
+    }
+
     //
     // Complete the Irp
     //
@@ -899,6 +1972,22 @@ Return Value:
 
     deviceExtension = (PDEVICE_EXTENSION)DeviceObject->DeviceExtension;
 
+    //
+    // Nothing gets through the gate from now on. IRPs parked at it hold
+    // the remove lock, so they have to be failed before waiting for it.
+    //
+
+    DiskPerfReleaseParked(deviceExtension, SedGateRemove(&deviceExtension->Gate),
+        STATUS_DELETE_PENDING);
+
+    //
+    // Pending unlock IOCTLs hold it too, and with the gate gone there is
+    // no point in finishing the unlock
+    //
+
+    if (deviceExtension->Unlock != NULL) {
+        DiskPerfCancelUnlock(deviceExtension, STATUS_DELETE_PENDING);
+    }
 
     //
     // Call Remove lock and wait to ensure all outstanding operations
@@ -918,6 +2007,30 @@ Return Value:
     //
 
     IoDetachDevice(deviceExtension->TargetDeviceObject);
+
+    if (deviceExtension->DiskCounters != NULL) {
+        ExFreePool(deviceExtension->DiskCounters);
+        deviceExtension->DiskCounters = NULL;
+    }
+
+    if (deviceExtension->LatencyShards != NULL) {
+        ExFreePool(deviceExtension->LatencyShards);
+        deviceExtension->LatencyShards = NULL;
+    }
+
+    if (deviceExtension->Trace != NULL) {
+        if (deviceExtension->Trace->CaptureBuffer != NULL) {
+            ExFreePool(deviceExtension->Trace->CaptureBuffer);
+        }
+        ExFreePool(deviceExtension->Trace);
+        deviceExtension->Trace = NULL;
+    }
+
+    if (deviceExtension->Unlock != NULL) {
+        ExFreePool(deviceExtension->Unlock);
+        deviceExtension->Unlock = NULL;
+    }
+
     IoDeleteDevice(DeviceObject);
 
     return status;
@@ -963,22 +2076,40 @@ DiskPerfDispatchPower(
     IN PDEVICE_OBJECT DeviceObject,
     IN PIRP Irp
 )
-{
-    PDEVICE_EXTENSION deviceExtension;
-    NTSTATUS            status;
-    PIO_STACK_LOCATION irpSp = IoGetCurrentIrpStackLocation(Irp);
-    deviceExtension = (PDEVICE_EXTENSION)DeviceObject->DeviceExtension;
 
-    status = DiskPerfForwardIrpSynchronous(DeviceObject, Irp);
-    if (!NT_SUCCESS(status))
-    {
-        DebugPrint((3, "DiskPerfDispatchPower: Failed to forward"));
-        Irp->IoStatus.Status = status;
-        IoCompleteRequest(Irp, IO_NO_INCREMENT);
-        return status;
-    }
+/*++
 
-    status = IoAcquireRemoveLock(&deviceExtension->RemoveLock, Irp);
+Routine Description:
+
+    Power dispatch. Entering a sleep state the drive loses power in (S3,
+    hybrid sleep, hibernation or fast startup, see
+    DiskPerfClassifyTransition) closes the gate, since the drive locks
+    itself when it loses power. The S0 IRP and, while the gate is closed,
+    D0 IRPs are sent down with a completion routine that queues the
+    unlock and lets the IRP carry on completing, so the rest of the system
+    resumes while we unlock; read/write IO waits at the gate meanwhile.
+    Whichever of the two completes first starts the unlock, the disk is
+    ready for commands as soon as its own D0 IRP is done. Everything else
+    is passed straight down.
+
+Arguments:
+
+    DeviceObject
+    Irp
+
+Return Value:
+
+    NTSTATUS
+
+--*/
+
+{
+    PDEVICE_EXTENSION   deviceExtension = (PDEVICE_EXTENSION)DeviceObject->DeviceExtension;
+    PIO_STACK_LOCATION  irpSp = IoGetCurrentIrpStackLocation(Irp);
+    SEDTRACE_TRANSITION transition;
+    NTSTATUS            status;
+
+    status = IoAcquireRemoveLock(&deviceExtension->RemoveLock, Irp);
 
     if (!NT_SUCCESS(status))
     {
@@ -988,679 +2119,4539 @@ DiskPerfDispatchPower(
         return status;
     }
 
-    //if (deviceExtension->PhysicalDeviceNameBuffer[0] != 0)
+    //
+    // Every disk gets a resume window, whether or not it has anything
+    // to unlock
+    //
+
+    if (irpSp->MinorFunction == IRP_MN_SET_POWER &&
+        irpSp->Parameters.Power.Type == SystemPowerState &&
+        irpSp->Parameters.Power.State.SystemState == PowerSystemWorking)
+    {
+        deviceExtension->ResumeTime = KeQueryPerformanceCounter(NULL).QuadPart;
+    }
+
+    if (irpSp->MinorFunction == IRP_MN_SET_POWER &&
+        irpSp->Parameters.Power.Type == SystemPowerState &&
+        deviceExtension->Unlock != NULL &&
+        !deviceExtension->UnlockDisabled &&
+        DiskPerfClassifyTransition(deviceExtension, irpSp, &transition))
     {
-        if (irpSp->MinorFunction == IRP_MN_SET_POWER)
+        //
+        // Let an unlock still running from the last resume finish first,
+        // so it cannot open the gate on a drive that is locked again.
+        // Only close when the drive loses power, so we don't end up
+        // redundantly unlocking the drive and stalling IO.
+        //
+        // Hibernation comes back through the same S0 and D0 IRPs as S3.
+        // The boot loader has read the hiberfile by then, through pre-boot
+        // authentication, so the unlock finds the drive open already.
+        //
+        // A lazy drive nobody touched since the last resume is still
+        // closed and locked; it goes through the same sleep and wake.
+        //
+
+        KeWaitForSingleObject(&deviceExtension->Unlock->UnlockIdleEvent, Executive, KernelMode, FALSE, NULL);
+        if (SedGateClose(&deviceExtension->Gate) ||
+            SedGateIsClosed(&deviceExtension->Gate))
         {
-            if (irpSp->Parameters.Power.Type == SystemPowerState)
-            {
-                if (irpSp->Parameters.Power.State.SystemState == PowerSystemWorking)
-                {
-                    // Block read/writes until drive is unlocked via Sleepy, protected by SleepMutex
-                    KeWaitForSingleObject(&deviceExtension->SleepMutex, Executive, KernelMode, FALSE, NULL);
-                    if (deviceExtension->Sleepy)
-                    {
-                        SEDSleepUnlockDrive(DeviceObject);
-                        deviceExtension->Sleepy = FALSE;
-                    }
-                    KeReleaseMutex(&deviceExtension->SleepMutex, FALSE);
-                }
-                else if (irpSp->Parameters.Power.State.SystemState == PowerSystemSleeping3)
-                {
-                    // Only flag as Sleepy when entering S3, so we don't end up redundantly unlocking the drive and stalling IO
-                    deviceExtension->Sleepy = TRUE;
-                }
-            }
+            InterlockedExchange(&deviceExtension->Unlock->WakePending, TRUE);
+            DiskPerfTraceEvent(deviceExtension, SedTraceEventSleep, (USHORT)transition,
+                irpSp->Parameters.Power.State.SystemState);
         }
     }
+    else if (irpSp->MinorFunction == IRP_MN_SET_POWER &&
+        deviceExtension->Unlock != NULL &&
+        ((irpSp->Parameters.Power.Type == SystemPowerState &&
+          irpSp->Parameters.Power.State.SystemState == PowerSystemWorking) ||
+         (irpSp->Parameters.Power.Type == DevicePowerState &&
+          irpSp->Parameters.Power.State.DeviceState == PowerDeviceD0)))
+    {
+        //
+        // The resume starts with whichever of the two gets here first
+        //
 
-    //
-    // Complete the Irp
-    //
-    Irp->IoStatus.Status = status;
-    IoCompleteRequest(Irp, IO_NO_INCREMENT);
+        if (InterlockedExchange(&deviceExtension->Unlock->WakePending, FALSE))
+        {
+            DiskPerfTraceEvent(deviceExtension, SedTraceEventWake, 0, 0);
+            InterlockedOr(&deviceExtension->State, DISKPERF_STATE_FIRST_IO);
+        }
+
+        if (SedGateIsClosed(&deviceExtension->Gate))
+        {
+            //
+            // The completion routine releases the remove lock
+            //
+
+            IoCopyCurrentIrpStackLocationToNext(Irp);
+            IoSetCompletionRoutine(Irp, DiskPerfPowerCompletion, deviceExtension,
+                TRUE, TRUE, TRUE);
+
+            return IoCallDriver(deviceExtension->TargetDeviceObject, Irp);
+        }
+    }
+
+    IoSkipCurrentIrpStackLocation(Irp);
+    status = IoCallDriver(deviceExtension->TargetDeviceObject, Irp);
     IoReleaseRemoveLock(&deviceExtension->RemoveLock, Irp);
 
     return status;
 
-
 } // end DiskPerfDispatchPower
 
-NTSTATUS
-DiskPerfForwardIrpSynchronous(
-    IN PDEVICE_OBJECT DeviceObject,
-    IN PIRP Irp
+
+BOOLEAN
+DiskPerfClassifyTransition(
+    IN PDEVICE_EXTENSION DeviceExtension,
+    IN PIO_STACK_LOCATION IrpSp,
+    OUT SEDTRACE_TRANSITION* Transition
 )
 
 /*++
 
 Routine Description:
 
-    This routine sends the Irp to the next driver in line
-    when the Irp needs to be processed by the lower drivers
-    prior to being processed by this one.
+    Work out which kind of transition a set system power IRP starts, from
+    the state it asks for and the state the system is headed for in the
+    end (hybrid sleep asks for S3 on the way to S4, fast startup for S4 on
+    the way to S5), and whether the drive's policy treats it as one that
+    takes power from the drive.
 
 Arguments:
 
-    DeviceObject
-    Irp
+    DeviceExtension - The device.
+    IrpSp           - The set system power IRP's stack location.
+    Transition      - Receives the kind of transition, for the trace.
 
 Return Value:
 
-    NTSTATUS
+    TRUE if the drive has to be unlocked when it powers back up
 
 --*/
 
 {
-    PDEVICE_EXTENSION   deviceExtension;
-    KEVENT event;
-    NTSTATUS status;
-
-    KeInitializeEvent(&event, NotificationEvent, FALSE);
-    deviceExtension = (PDEVICE_EXTENSION)DeviceObject->DeviceExtension;
+    SYSTEM_POWER_STATE_CONTEXT context = IrpSp->Parameters.Power.SystemPowerStateContext;
+    ULONG                      flags = DeviceExtension->UnlockFlags;
 
-    //
-    // copy the irpstack for the next device
-    //
-
-    IoCopyCurrentIrpStackLocationToNext(Irp);
-
-    //
-    // set a completion routine
-    //
+    switch (IrpSp->Parameters.Power.State.SystemState) {
 
-    IoSetCompletionRoutine(Irp, DiskPerfIrpCompletion,
-        &event, TRUE, TRUE, TRUE);
+    case PowerSystemSleeping1:
+    case PowerSystemSleeping2:
+        *Transition = SedTraceTransitionSleep;
+        return (flags & SEDSLEEP_UNLOCK_STANDBY) != 0;
 
-    //
-    // call the next lower device
-    //
+    case PowerSystemSleeping3:
+        *Transition = (context.TargetSystemState == PowerSystemHibernate) ?
+            SedTraceTransitionHybridSleep : SedTraceTransitionSleep;
+        return TRUE;
 
-    status = IoCallDriver(deviceExtension->TargetDeviceObject, Irp);
+    case PowerSystemHibernate:
+        *Transition = (context.TargetSystemState == PowerSystemShutdown) ?
+            SedTraceTransitionFastStartup : SedTraceTransitionHibernate;
+        return (flags & SEDSLEEP_UNLOCK_SKIP_HIBERNATE) == 0;
 
-    //
-    // wait for the actual completion
-    //
-    __analysis_assume(status != STATUS_PENDING);
-    __analysis_assume(IoGetCurrentIrpStackLocation(Irp)->MinorFunction != IRP_MN_START_DEVICE);
-    if (status == STATUS_PENDING) {
-        KeWaitForSingleObject(&event, Executive, KernelMode, FALSE, NULL);
-        status = Irp->IoStatus.Status;
+    default:
+        *Transition = SedTraceTransitionUnknown;
+        return FALSE;
     }
-
-    return status;
-
-} // end DiskPerfForwardIrpSynchronous()
+}
 
 
 NTSTATUS
-DiskPerfCreate(
+DiskPerfPowerCompletion(
     IN PDEVICE_OBJECT DeviceObject,
-    IN PIRP Irp
+    IN PIRP Irp,
+    IN PVOID Context
 )
 
 /*++
 
 Routine Description:
 
-    This routine services open commands. It establishes
-    the driver's existance by returning status success.
+    Completion routine for the S0 and D0 IRPs. The lower drivers have
+    powered the disk back up, so queue the unlock and let the IRP go on up
+    the stack.
 
 Arguments:
 
-    DeviceObject - Context for the activity.
-    Irp          - The device control argument block.
+    DeviceObject - Our device.
+    Irp          - The S0 or D0 set power IRP.
+    Context      - Our device extension.
 
 Return Value:
 
-    NT Status
+    STATUS_CONTINUE_COMPLETION
 
 --*/
 
 {
-    PAGED_CODE();
+    PDEVICE_EXTENSION  deviceExtension = (PDEVICE_EXTENSION)Context;
+    PIO_STACK_LOCATION irpSp = IoGetCurrentIrpStackLocation(Irp);
 
     UNREFERENCED_PARAMETER(DeviceObject);
 
-    Irp->IoStatus.Status = STATUS_SUCCESS;
+    if (irpSp->Parameters.Power.Type == DevicePowerState) {
+        DiskPerfTraceEvent(deviceExtension, SedTraceEventDeviceD0, 0, (ULONG)Irp->IoStatus.Status);
 
-    IoCompleteRequest(Irp, IO_NO_INCREMENT);
-    return STATUS_SUCCESS;
+        //
+        // A disk that failed to power up cannot take commands yet; the S0
+        // IRP will still queue the unlock
+        //
 
-} // end DiskPerfCreate()
+        if (NT_SUCCESS(Irp->IoStatus.Status) &&
+            DiskPerfUnlockNow(deviceExtension)) {
+            DiskPerfQueueUnlock(deviceExtension, FALSE);
+        }
+    }
+    else {
+        DiskPerfTraceEvent(deviceExtension, SedTraceEventWakeDone, 0, (ULONG)Irp->IoStatus.Status);
+
+        //
+        // Even if S0 failed the drive may have lost power, so try the
+        // unlock anyway; the gate only opens once it has run
+        //
 
+        if (DiskPerfUnlockNow(deviceExtension)) {
+            DiskPerfQueueUnlock(deviceExtension, FALSE);
+        }
+    }
 
-NTSTATUS
-DiskPerfReadWrite(
-    IN PDEVICE_OBJECT DeviceObject,
-    IN PIRP Irp
+    if (Irp->PendingReturned) {
+        IoMarkIrpPending(Irp);
+    }
+
+    IoReleaseRemoveLock(&deviceExtension->RemoveLock, Irp);
+
+    return STATUS_CONTINUE_COMPLETION;
+
+} // end DiskPerfPowerCompletion
+
+
+BOOLEAN
+DiskPerfUnlockNow(
+    IN PDEVICE_EXTENSION DeviceExtension
 )
 
 /*++
 
 Routine Description:
 
-    This is the driver entry point for read and write requests
-    to disks to which the diskperf driver has attached.
-    This driver collects statistics and then sets a completion
-    routine so that it can collect additional information when
-    the request completes. Then it calls the next driver below
-    it.
+    Whether the S0 or D0 completion should queue the unlock. A lazy drive
+    is left locked until IO arrives for it, unless some already has: IO
+    parked before the wake did not start the unlock, so it is started
+    here for it.
+
+--*/
+
+{
+    PVOID state;
+
+    if (!(DeviceExtension->UnlockFlags & SEDSLEEP_UNLOCK_LAZY)) {
+        return TRUE;
+    }
+
+    state = SED_GATE_LOAD(&DeviceExtension->Gate.State);
+
+    return SED_GATE_IS_CLOSED(state) && state != NULL;
+}
+
+
+VOID
+DiskPerfQueueUnlock(
+    IN PDEVICE_EXTENSION DeviceExtension,
+    IN BOOLEAN Requested
+)
+
+/*++
+
+Routine Description:
+
+    Hand the device to the unlock worker, unless it is already queued or
+    the gate has been opened since it closed (both the D0 and the S0 IRP
+    call this, the first one wins). The queued device holds a remove lock
+    reference until the worker is done with it. Callable at DISPATCH_LEVEL.
 
 Arguments:
 
-    DeviceObject
-    Irp
+    DeviceExtension - The device to unlock.
+    Requested       - An unlock IOCTL is pending, so unlock even if the
+                      gate is open. The deadline then runs from now rather
+                      than from resume.
 
 Return Value:
 
-    NTSTATUS
+    None
 
 --*/
 
 {
-    PDEVICE_EXTENSION  deviceExtension = DeviceObject->DeviceExtension;
-    PIO_STACK_LOCATION currentIrpStack = IoGetCurrentIrpStackLocation(Irp);
-    UNREFERENCED_PARAMETER(currentIrpStack);
-    //LONG               queueLen;
-    //PLARGE_INTEGER     timeStamp;
-    NTSTATUS           status;
-
-    //
-    // As processors may be  dynamically  added, ensure
-    // that there's a context for the current processor
-    //
-    //
-    // Acquire the remove lock so that device will not be removed while
-    // processing this irp.
-    //
-    status = IoAcquireRemoveLock(&deviceExtension->RemoveLock, Irp);
+    PDISKPERF_UNLOCK unlock = DeviceExtension->Unlock;
+    KIRQL            oldIrql;
+    BOOLEAN          waiting;
 
-    if (!NT_SUCCESS(status))
-    {
-        DebugPrint((3, "DiskPerfReadWrite: Remove lock failed IOCTL Irp type [%x]\n",
-            currentIrpStack->Parameters.DeviceIoControl.IoControlCode));
-        Irp->IoStatus.Status = status;
-        IoCompleteRequest(Irp, IO_NO_INCREMENT);
-        return status;
+    if (unlock == NULL ||
+        InterlockedCompareExchange(&unlock->UnlockQueued, TRUE, FALSE) != FALSE) {
+        return;
     }
 
     //
-    // Device is not initialized properly. Blindly pass the irp along
+    // Already unlocked by whoever got here first. The worker opens the gate
+    // before clearing UnlockQueued, so this cannot miss a closed gate. An
+    // unlock IOCTL may have joined while UnlockQueued was set here, so that
+    // is checked under the same lock the IOCTL inserts under.
     //
-    if (deviceExtension->PhysicalDeviceNameBuffer[0] == 0)
-    {
-        status = DiskPerfSendToNextDriver(DeviceObject, Irp);
-        IoReleaseRemoveLock(&deviceExtension->RemoveLock, Irp);
-        return (status);
+
+    if (!Requested && !SedGateIsClosed(&DeviceExtension->Gate)) {
+        KeAcquireSpinLock(&unlock->RequestLock, &oldIrql);
+        waiting = !IsListEmpty(&unlock->Requests);
+        if (!waiting) {
+            InterlockedExchange(&unlock->UnlockQueued, FALSE);
+        }
+        KeReleaseSpinLock(&unlock->RequestLock, oldIrql);
+
+        if (!waiting) {
+            return;
+        }
+        Requested = TRUE;
     }
-    
+
     //
-    // Copy current stack to next stack.
+    // Being removed, in which case the gate is failed by remove
     //
 
-    IoCopyCurrentIrpStackLocationToNext(Irp);
-
+    if (!NT_SUCCESS(IoAcquireRemoveLock(&DeviceExtension->RemoveLock,
+        &unlock->UnlockLink))) {
+        InterlockedExchange(&unlock->UnlockQueued, FALSE);
+        DiskPerfCompleteUnlockRequests(DeviceExtension, STATUS_DELETE_PENDING, FALSE);
+        return;
+    }
 
+    KeClearEvent(&unlock->UnlockIdleEvent);
 
-    // Block any super early read/write access until the unlocking has completed
-    if (deviceExtension->Sleepy)
-    {
-        do
-        {
-            KeWaitForSingleObject(&deviceExtension->SleepMutex, Executive, KernelMode, FALSE, NULL);
-            if (!deviceExtension->Sleepy)
-            {
-                KeReleaseMutex(&deviceExtension->SleepMutex, FALSE);
-                break;
-            }
-            KeReleaseMutex(&deviceExtension->SleepMutex, FALSE);
-        } while (1);
+    unlock->QueueTime = KeQueryPerformanceCounter(NULL).QuadPart;
+    if (!Requested) {
+        DeviceExtension->ResumeTime = unlock->QueueTime;
     }
 
-
-    //
     //
-    // Return the results of the call to the disk driver.
+    // The deadline runs from here, so it also covers waiting in the queue
     //
 
-    status = IoCallDriver(deviceExtension->TargetDeviceObject,
-        Irp);
-    IoReleaseRemoveLock(&deviceExtension->RemoveLock, Irp);
-    return status;
+    if (DeviceExtension->UnlockDeadlineMs != 0) {
+        LARGE_INTEGER dueTime;
 
-} // end DiskPerfReadWrite()
+        unlock->UnlockDeadline = unlock->QueueTime +
+            (DiskPerfFrequency.QuadPart * DeviceExtension->UnlockDeadlineMs) / 1000;
+        dueTime.QuadPart = -10000LL * DeviceExtension->UnlockDeadlineMs;
+        KeSetTimer(&unlock->UnlockTimer, dueTime, &unlock->UnlockDpc);
+    }
+    else {
+        unlock->UnlockDeadline = MAXLONGLONG;
+    }
 
+    KeAcquireSpinLock(&DiskPerfUnlockLock, &oldIrql);
+    InsertTailList(&DiskPerfUnlockQueue, &unlock->UnlockLink);
+    KeReleaseSpinLock(&DiskPerfUnlockLock, oldIrql);
 
-NTSTATUS
-DiskPerfDeviceControl(
-    PDEVICE_OBJECT DeviceObject,
-    PIRP Irp
+    KeSetEvent(&DiskPerfUnlockEvent, IO_NO_INCREMENT, FALSE);
+}
+
+
+VOID
+DiskPerfUnlockWorker(
+    IN PVOID Context
 )
 
 /*++
 
 Routine Description:
 
-    This device control dispatcher handles only the disk performance
-    device control. All others are passed down to the disk drivers.
-    The disk performane device control returns a current snapshot of
-    the performance data.
+    Unlock worker thread. Unlocks queued devices one at a time, opens their
+    gates and sends on whatever was parked at them.
 
 Arguments:
 
-    DeviceObject - Context for the activity.
-    Irp          - The device control argument block.
+    Context - Not used.
 
 Return Value:
 
-    Status is returned.
+    None
 
 --*/
 
 {
-    PDEVICE_EXTENSION  deviceExtension = DeviceObject->DeviceExtension;
-    PIO_STACK_LOCATION currentIrpStack = IoGetCurrentIrpStackLocation(Irp);
-    NTSTATUS    status;
+    PDEVICE_EXTENSION deviceExtension;
+    PLIST_ENTRY       entry;
+    KIRQL             oldIrql;
 
+    UNREFERENCED_PARAMETER(Context);
 
-    //
-    // Acquire the remove lock so that device will not be removed while
-    // processing this irp.
-    //
-    status = IoAcquireRemoveLock(&deviceExtension->RemoveLock, Irp);
+    for (;;) {
+        KeWaitForSingleObject(&DiskPerfUnlockEvent, Executive, KernelMode, FALSE, NULL);
 
-    DebugPrint((3, "DiskPerfDeviceControl: DeviceObject 0x%p Irp 0x%p Code %x\n",
-        DeviceObject, Irp, currentIrpStack->Parameters.DeviceIoControl.IoControlCode));
+        for (;;) {
+            KeAcquireSpinLock(&DiskPerfUnlockLock, &oldIrql);
+            entry = IsListEmpty(&DiskPerfUnlockQueue) ? NULL : RemoveHeadList(&DiskPerfUnlockQueue);
+            KeReleaseSpinLock(&DiskPerfUnlockLock, oldIrql);
 
-    if (!NT_SUCCESS(status))
-    {
-        DebugPrint((3, "DiskPerfControl: Remove lock failed IOCTL Irp type [%x]\n",
-            currentIrpStack->Parameters.DeviceIoControl.IoControlCode));
-        Irp->IoStatus.Status = status;
-        IoCompleteRequest(Irp, IO_NO_INCREMENT);
-        return status;
-    }
+            if (entry == NULL) {
+                break;
+            }
 
+            deviceExtension = CONTAINING_RECORD(entry, DISKPERF_UNLOCK, UnlockLink)->DeviceExtension;
 
-    if (currentIrpStack->Parameters.DeviceIoControl.IoControlCode ==
-        IOCTL_HURR_DURR_IM_A_GOAT) {
-        
+            DiskPerfUnlockDevice(deviceExtension);
+        }
 
-        SEDSleepUnlockDrive(DeviceObject);
+        if (DiskPerfUnlockStop) {
+            break;
+        }
+    }
 
-        //
-        // Complete request.
-        //
+    PsTerminateSystemThread(STATUS_SUCCESS);
+}
 
-        Irp->IoStatus.Status = status;
-        //
-        // Release the remove lock
-        //
-        IoReleaseRemoveLock(&deviceExtension->RemoveLock, Irp);
-        IoCompleteRequest(Irp, IO_NO_INCREMENT);
-        return status;
 
+VOID
+DiskPerfUnlockDevice(
+    IN PDEVICE_EXTENSION DeviceExtension
+)
+
+/*++
+
+Routine Description:
+
+    Unlock one queued device, retrying up to UnlockRetries times as long as
+    the deadline has not passed and nobody cancelled it, then open or fail
+    the gate and complete the unlock IOCTLs waiting for it. Drops the
+    remove lock reference taken by DiskPerfQueueUnlock.
+
+Arguments:
+
+    DeviceExtension - The device to unlock.
+
+Return Value:
+
+    None
+
+--*/
+
+{
+    PDISKPERF_UNLOCK unlock = DeviceExtension->Unlock;
+    NTSTATUS         status;
+    ULONG            attempt;
+    ULONG            sequence;
+    KIRQL            oldIrql;
+
+    KeAcquireSpinLock(&unlock->RequestLock, &oldIrql);
+    sequence = unlock->Result.Sequence + 1;
+    RtlZeroMemory(&unlock->Result, sizeof(unlock->Result));
+    unlock->Result.Version = SEDSLEEP_UNLOCK_RESULT_VERSION;
+    unlock->Result.Flags = SEDSLEEP_UNLOCK_RESULT_RUNNING;
+    unlock->Result.Sequence = sequence;
+    unlock->Result.Status = STATUS_PENDING;
+    KeReleaseSpinLock(&unlock->RequestLock, oldIrql);
+
+    DiskPerfTraceEvent(DeviceExtension, SedTraceEventUnlockStart, 0, 0);
+
+    for (attempt = 0; ; attempt++) {
+        unlock->Result.Attempts = attempt + 1;
+        status = SEDSleepUnlockDrive(DeviceExtension->DeviceObject);
+        if (NT_SUCCESS(status) ||
+            status == STATUS_ACCESS_DENIED ||
+            status == STATUS_CANCELLED ||
+            attempt >= DeviceExtension->UnlockRetries ||
+            KeQueryPerformanceCounter(NULL).QuadPart >= unlock->UnlockDeadline) {
+            break;
+        }
+
+        if (DiskPerfUnlockCancelled(DeviceExtension)) {
+            status = STATUS_CANCELLED;
+            break;
+        }
+
+        DebugPrint((1, "DiskPerfUnlockDevice: Unlock failed %x, retrying\n", status));
     }
 
-    else {
+    DiskPerfTraceEvent(DeviceExtension, SedTraceEventUnlockDone, 0, (ULONG)status);
 
-        //
-        // Set current stack back one.
-        // We aren't doing anything with this IRP
-        // so mark it pending
-        //
+    //
+    // Make sure the timeout DPC is not still to run before the device can
+    // go away. Whether the timer was armed is decided by this unlock's
+    // deadline, not UnlockDeadlineMs, which may have been changed since.
+    //
 
-        IoMarkIrpPending(Irp);
-        IoSkipCurrentIrpStackLocation(Irp);
+    if (!KeCancelTimer(&unlock->UnlockTimer) &&
+        unlock->UnlockDeadline != MAXLONGLONG) {
+        KeFlushQueuedDpcs();
+    }
+
+    if (NT_SUCCESS(status)) {
 
         //
-        // Pass unrecognized device control requests
-        // down to next driver layer. We ignore the 
-        // return status since we need to return 
-        // STATUS_PENDING due to the mark pending
-        // call above.
+        // The deadline may have failed the gate while the last attempt was
+        // still going. The drive is unlocked now, so close and open it again
+        // rather than failing IO until the next sleep.
         //
 
-        IoCallDriver(deviceExtension->TargetDeviceObject, Irp);
+        if (SED_GATE_LOAD(&DeviceExtension->Gate.State) == SED_GATE_FAILED) {
+            SedGateClose(&DeviceExtension->Gate);
+        }
 
         //
-        // Release the remove lock
+        // Open before clearing Queued, so the later of the D0 and S0
+        // completions sees the gate open and does not unlock again. An
+        // unlock asked for by IOCTL may find it open already.
         //
-        IoReleaseRemoveLock(&deviceExtension->RemoveLock, Irp);
-
-        return (STATUS_PENDING);
 
+        if (SedGateIsClosed(&DeviceExtension->Gate)) {
+            DiskPerfReleaseParked(DeviceExtension, SedGateOpen(&DeviceExtension->Gate),
+                STATUS_SUCCESS);
+            DiskPerfTraceEvent(DeviceExtension, SedTraceEventGateOpen, 0, 0);
+        }
+    }
+    else if (SedGateIsClosed(&DeviceExtension->Gate)) {
+        DeviceExtension->GateStatus = STATUS_IO_DEVICE_ERROR;
+        DiskPerfReleaseParked(DeviceExtension, SedGateFail(&DeviceExtension->Gate),
+            STATUS_IO_DEVICE_ERROR);
+        DiskPerfTraceEvent(DeviceExtension, SedTraceEventGateFail, 0, STATUS_IO_DEVICE_ERROR);
     }
-} // end DiskPerfDeviceControl()
 
+    //
+    // Clears UnlockQueued
+    //
 
-NTSTATUS
-DiskPerfShutdownFlush(
-    IN PDEVICE_OBJECT DeviceObject,
-    IN PIRP Irp
+    DiskPerfCompleteUnlockRequests(DeviceExtension, status, TRUE);
+
+    KeSetEvent(&unlock->UnlockIdleEvent, IO_NO_INCREMENT, FALSE);
+    IoReleaseRemoveLock(&DeviceExtension->RemoveLock, &unlock->UnlockLink);
+}
+
+
+VOID
+DiskPerfUnlockTimeout(
+    IN PKDPC Dpc,
+    IN PVOID DeferredContext,
+    IN PVOID SystemArgument1,
+    IN PVOID SystemArgument2
 )
 
 /*++
 
 Routine Description:
 
-    This routine is called for a shutdown and flush IRPs.  These are sent by the
-    system before it actually shuts down or when the file system does a flush.
+    The unlock deadline passed. Fail the IO parked at the gate, and any
+    that arrives until the unlock finishes after all or the drive sleeps
+    again, instead of leaving it waiting on the drive.
 
 Arguments:
 
-    DriverObject - Pointer to device object to being shutdown by system.
-    Irp          - IRP involved.
+    DeferredContext - Our device extension.
 
 Return Value:
 
-    NT Status
+    None
 
 --*/
 
 {
-    PDEVICE_EXTENSION  deviceExtension = DeviceObject->DeviceExtension;
+    PDEVICE_EXTENSION deviceExtension = (PDEVICE_EXTENSION)DeferredContext;
 
-    DebugPrint((2, "DiskPerfShutdownFlush: DeviceObject 0x%p Irp 0x%p\n",
-        DeviceObject, Irp));
+    UNREFERENCED_PARAMETER(Dpc);
+    UNREFERENCED_PARAMETER(SystemArgument1);
+    UNREFERENCED_PARAMETER(SystemArgument2);
 
-    IoSkipCurrentIrpStackLocation(Irp);
-    return IoCallDriver(deviceExtension->TargetDeviceObject, Irp);
+    //
+    // An unlock asked for by IOCTL with the gate open holds up nothing
+    //
 
-} // end DiskPerfShutdownFlush()
+    if (!SedGateIsClosed(&deviceExtension->Gate)) {
+        return;
+    }
+
+    DebugPrint((1, "DiskPerfUnlockTimeout: Disk %d not unlocked after %dms\n",
+        deviceExtension->DiskNumber, deviceExtension->UnlockDeadlineMs));
+
+    deviceExtension->GateStatus = STATUS_IO_TIMEOUT;
+    DiskPerfReleaseParked(deviceExtension, SedGateFail(&deviceExtension->Gate),
+        STATUS_IO_TIMEOUT);
+    DiskPerfTraceEvent(deviceExtension, SedTraceEventGateFail, 0, STATUS_IO_TIMEOUT);
+}
 
 
 VOID
-DiskPerfUnload(
-    IN PDRIVER_OBJECT DriverObject
+DiskPerfCancelUnlockRequest(
+    IN PDEVICE_OBJECT DeviceObject,
+    IN PIRP Irp
 )
 
 /*++
 
 Routine Description:
 
-    Free all the allocated resources, etc.
+    Cancel routine for a pending unlock IOCTL. The unlock itself carries
+    on; IOCTL_SEDSLEEP_CANCEL_UNLOCK is what stops it.
 
 Arguments:
 
-    DriverObject - pointer to a driver object.
+    DeviceObject - Our device.
+    Irp          - The IOCTL_HURR_DURR_IM_A_GOAT request.
 
 Return Value:
 
-    VOID.
+    None
 
 --*/
+
 {
-    PAGED_CODE();
+    PDEVICE_EXTENSION deviceExtension = DeviceObject->DeviceExtension;
+    KIRQL             oldIrql;
 
-    UNREFERENCED_PARAMETER(DriverObject);
+    IoReleaseCancelSpinLock(Irp->CancelIrql);
 
-    return;
+    KeAcquireSpinLock(&deviceExtension->Unlock->RequestLock, &oldIrql);
+    RemoveEntryList(&Irp->Tail.Overlay.ListEntry);
+    KeReleaseSpinLock(&deviceExtension->Unlock->RequestLock, oldIrql);
+
+    Irp->IoStatus.Status = STATUS_CANCELLED;
+    Irp->IoStatus.Information = 0;
+    IoReleaseRemoveLock(&deviceExtension->RemoveLock, Irp);
+    IoCompleteRequest(Irp, IO_NO_INCREMENT);
 }
 
 
-NTSTATUS
-DiskPerfRegisterDevice(
-    IN PDEVICE_OBJECT DeviceObject
+VOID
+DiskPerfCompleteUnlockRequests(
+    IN PDEVICE_EXTENSION DeviceExtension,
+    IN NTSTATUS Status,
+    IN BOOLEAN Finished
 )
 
 /*++
 
 Routine Description:
 
-    Routine to initialize a proper name for the device object, and
-    register it with WMI
+    Complete every pending unlock IOCTL. Callable at DISPATCH_LEVEL.
 
 Arguments:
 
-    DeviceObject - pointer to a device object to be initialized.
+    DeviceExtension - The device.
+    Status          - How the unlock ended, or why the requests are
+                      completed without it.
+    Finished        - Called by the worker at the end of an unlock. The
+                      result is filled in and UnlockQueued cleared under
+                      the request lock, and requests with room for it get
+                      the result.
 
 Return Value:
 
-    Status of the initialization. NOTE: If the registration fails,
-    the device name in the DeviceExtension will be left as empty.
+    None
 
 --*/
 
 {
-    NTSTATUS                status;
-    IO_STATUS_BLOCK         ioStatus;
-    KEVENT                  event;
-    PDEVICE_EXTENSION       deviceExtension;
-    PIRP                    irp;
-    STORAGE_DEVICE_NUMBER   number;
-    //ULONG                   registrationFlag = 0;
+    PDISKPERF_UNLOCK       unlock = DeviceExtension->Unlock;
+    SEDSLEEP_UNLOCK_RESULT result;
+    LIST_ENTRY             requests;
+    PLIST_ENTRY            entry;
+    PIO_STACK_LOCATION     irpSp;
+    PIRP                   irp;
+    KIRQL                  oldIrql;
+
+    InitializeListHead(&requests);
+    RtlZeroMemory(&result, sizeof(result));
+
+    KeAcquireSpinLock(&unlock->RequestLock, &oldIrql);
+
+    if (Finished) {
+        unlock->Result.Status = Status;
+        unlock->Result.Flags = (Status == STATUS_CANCELLED) ? SEDSLEEP_UNLOCK_RESULT_CANCELLED : 0;
+        unlock->Result.DurationMicroseconds =
+            (ULONG64)((KeQueryPerformanceCounter(NULL).QuadPart - unlock->QueueTime) * 1000000) /
+            DiskPerfFrequency.QuadPart;
+        result = unlock->Result;
+
+        InterlockedExchange(&unlock->UnlockQueued, FALSE);
+        unlock->CancelRequested = FALSE;
+    }
 
-    PAGED_CODE();
+    while (!IsListEmpty(&unlock->Requests)) {
+        entry = RemoveHeadList(&unlock->Requests);
+        irp = CONTAINING_RECORD(entry, IRP, Tail.Overlay.ListEntry);
 
-    DebugPrint((2, "DiskPerfRegisterDevice: DeviceObject 0x%p\n",
-        DeviceObject));
-    deviceExtension = DeviceObject->DeviceExtension;
+        //
+        // Being cancelled; the cancel routine is about to take it off a
+        // list, so leave it one of its own
+        //
 
-    KeInitializeEvent(&event, NotificationEvent, FALSE);
+        if (IoSetCancelRoutine(irp, NULL) == NULL) {
+            InitializeListHead(entry);
+            continue;
+        }
 
-    //
-    // Request for the device number
-    //
-    irp = IoBuildDeviceIoControlRequest(
-        IOCTL_STORAGE_GET_DEVICE_NUMBER,
-        deviceExtension->TargetDeviceObject,
-        NULL,
-        0,
-        &number,
-        sizeof(number),
-        FALSE,
-        &event,
-        &ioStatus);
-    if (!irp) {
-        DiskPerfLogError(
-            DeviceObject,
-            256,
-            STATUS_SUCCESS,
-            IO_ERR_INSUFFICIENT_RESOURCES);
-        DebugPrint((3, "DiskPerfRegisterDevice: Fail to build irp\n"));
-        return STATUS_INSUFFICIENT_RESOURCES;
+        InsertTailList(&requests, entry);
     }
 
-    status = IoCallDriver(deviceExtension->TargetDeviceObject, irp);
-    if (status == STATUS_PENDING) {
-        KeWaitForSingleObject(&event, Executive, KernelMode, FALSE, NULL);
-        status = ioStatus.Status;
+    KeReleaseSpinLock(&unlock->RequestLock, oldIrql);
+
+    while (!IsListEmpty(&requests)) {
+        entry = RemoveHeadList(&requests);
+        irp = CONTAINING_RECORD(entry, IRP, Tail.Overlay.ListEntry);
+        irpSp = IoGetCurrentIrpStackLocation(irp);
+
+        if (Finished &&
+            irpSp->Parameters.DeviceIoControl.OutputBufferLength >= sizeof(SEDSLEEP_UNLOCK_RESULT)) {
+            RtlCopyMemory(irp->AssociatedIrp.SystemBuffer, &result, sizeof(SEDSLEEP_UNLOCK_RESULT));
+            irp->IoStatus.Status = STATUS_SUCCESS;
+            irp->IoStatus.Information = sizeof(SEDSLEEP_UNLOCK_RESULT);
+        }
+        else {
+            irp->IoStatus.Status = Status;
+            irp->IoStatus.Information = 0;
+        }
+
+        IoReleaseRemoveLock(&DeviceExtension->RemoveLock, irp);
+        IoCompleteRequest(irp, IO_NO_INCREMENT);
     }
+}
 
-    if (NT_SUCCESS(status)) {
 
-        //
-        // Remember the disk number for use as parameter in DiskIoNotifyRoutine
-        //
-        deviceExtension->DiskNumber = number.DeviceNumber;
+VOID
+DiskPerfCancelUnlock(
+    IN PDEVICE_EXTENSION DeviceExtension,
+    IN NTSTATUS Status
+)
 
-        //
-        // Create device name for each partition
-        //
+/*++
 
-        RtlStringCbPrintfW(
-            deviceExtension->PhysicalDeviceNameBuffer,
-            sizeof(deviceExtension->PhysicalDeviceNameBuffer),
-            L"\\Device\\Harddisk%d\\Partition%d",
-            number.DeviceNumber, number.PartitionNumber);
+Routine Description:
 
-        RtlInitUnicodeString(&deviceExtension->PhysicalDeviceName, &deviceExtension->PhysicalDeviceNameBuffer[0]);
+    Ask the running unlock to stop, see DiskPerfUnlockCancelled, and
+    complete the unlock IOCTLs waiting for it with Status.
 
-        //
-        // Set default name for physical disk
-        //
-        RtlCopyMemory(
-            &(deviceExtension->StorageManagerName[0]),
-            L"PhysDisk",
-            8 * sizeof(WCHAR));
-        DebugPrint((3, "DiskPerfRegisterDevice: Device name %ws\n",
-            deviceExtension->PhysicalDeviceNameBuffer));
+Arguments:
+
+    DeviceExtension - The device.
+    Status          - STATUS_CANCELLED, or STATUS_DELETE_PENDING on remove.
+
+Return Value:
+
+    None
+
+--*/
+
+{
+    PDISKPERF_UNLOCK unlock = DeviceExtension->Unlock;
+    KIRQL            oldIrql;
+
+    KeAcquireSpinLock(&unlock->RequestLock, &oldIrql);
+    if (unlock->UnlockQueued) {
+        unlock->CancelRequested = TRUE;
     }
-    else {
+    KeReleaseSpinLock(&unlock->RequestLock, oldIrql);
 
-        // request for partition's information failed, try volume
+    DiskPerfCompleteUnlockRequests(DeviceExtension, Status, FALSE);
+}
 
-        ULONG           outputSize = sizeof(MOUNTDEV_NAME);
-        PMOUNTDEV_NAME  output;
-        VOLUME_NUMBER   volumeNumber;
-        ULONG           nameSize;
 
-        output = ExAllocatePool(PagedPool, outputSize);
-        if (!output) {
-            DiskPerfLogError(
-                DeviceObject,
-                257,
-                STATUS_SUCCESS,
-                IO_ERR_INSUFFICIENT_RESOURCES);
-            return STATUS_INSUFFICIENT_RESOURCES;
-        }
+VOID
+DiskPerfQueryUnlock(
+    IN PDEVICE_EXTENSION DeviceExtension,
+    OUT PSEDSLEEP_UNLOCK_RESULT Result
+)
 
-        KeInitializeEvent(&event, NotificationEvent, FALSE);
-        irp = IoBuildDeviceIoControlRequest(
-            IOCTL_MOUNTDEV_QUERY_DEVICE_NAME,
-            deviceExtension->TargetDeviceObject, NULL, 0,
-            output, outputSize, FALSE, &event, &ioStatus);
-        if (!irp) {
-            ExFreePool(output);
-            DiskPerfLogError(
-                DeviceObject,
-                258,
-                STATUS_SUCCESS,
-                IO_ERR_INSUFFICIENT_RESOURCES);
-            return STATUS_INSUFFICIENT_RESOURCES;
-        }
+/*++
 
-        status = IoCallDriver(deviceExtension->TargetDeviceObject, irp);
-        if (status == STATUS_PENDING) {
-            KeWaitForSingleObject(&event, Executive, KernelMode, FALSE, NULL);
-            status = ioStatus.Status;
-        }
+Routine Description:
 
-        if (status == STATUS_BUFFER_OVERFLOW) {
-            outputSize = sizeof(MOUNTDEV_NAME) + output->NameLength;
-            ExFreePool(output);
-            output = ExAllocatePool(PagedPool, outputSize);
+    Snapshot the progress of the running unlock, or the result of the last
+    one. Zero with the version set if there has not been one yet.
 
-            if (!output) {
-                DiskPerfLogError(
-                    DeviceObject,
-                    258,
-                    STATUS_SUCCESS,
-                    IO_ERR_INSUFFICIENT_RESOURCES);
-                return STATUS_INSUFFICIENT_RESOURCES;
-            }
+Arguments:
 
-            KeInitializeEvent(&event, NotificationEvent, FALSE);
-            irp = IoBuildDeviceIoControlRequest(
-                IOCTL_MOUNTDEV_QUERY_DEVICE_NAME,
-                deviceExtension->TargetDeviceObject, NULL, 0,
-                output, outputSize, FALSE, &event, &ioStatus);
-            if (!irp) {
-                ExFreePool(output);
-                DiskPerfLogError(
-                    DeviceObject, 259,
-                    STATUS_SUCCESS,
-                    IO_ERR_INSUFFICIENT_RESOURCES);
-                return STATUS_INSUFFICIENT_RESOURCES;
-            }
+    DeviceExtension - The device.
+    Result          - Receives the result.
 
-            status = IoCallDriver(deviceExtension->TargetDeviceObject, irp);
-            if (status == STATUS_PENDING) {
-                KeWaitForSingleObject(
-                    &event,
-                    Executive,
-                    KernelMode,
-                    FALSE,
-                    NULL
-                );
-                status = ioStatus.Status;
-            }
-        }
-        if (!NT_SUCCESS(status)) {
-            ExFreePool(output);
-            DiskPerfLogError(
-                DeviceObject,
-                260,
-                STATUS_SUCCESS,
-                IO_ERR_CONFIGURATION_ERROR);
-            return status;
-        }
+Return Value:
 
-        //
-        // Since we get the volume name instead of the disk number,
-        // set it to a dummy value
-        // Todo: Instead of passing the disk number back to the user app.
-        // for tracing, pass the STORAGE_DEVICE_NUMBER structure instead.
+    None
 
-        deviceExtension->DiskNumber = (ULONG)-1;
+--*/
 
-        nameSize = min(output->NameLength, sizeof(deviceExtension->PhysicalDeviceNameBuffer) - sizeof(WCHAR));
+{
+    PDISKPERF_UNLOCK unlock = DeviceExtension->Unlock;
+    KIRQL            oldIrql;
 
-        RtlStringCbCopyW(deviceExtension->PhysicalDeviceNameBuffer, nameSize, output->Name);
+    KeAcquireSpinLock(&unlock->RequestLock, &oldIrql);
 
-        RtlInitUnicodeString(&deviceExtension->PhysicalDeviceName, &deviceExtension->PhysicalDeviceNameBuffer[0]);
+    *Result = unlock->Result;
+    Result->Version = SEDSLEEP_UNLOCK_RESULT_VERSION;
+    if (Result->Flags & SEDSLEEP_UNLOCK_RESULT_RUNNING) {
+        Result->DurationMicroseconds =
+            (ULONG64)((KeQueryPerformanceCounter(NULL).QuadPart - unlock->QueueTime) * 1000000) /
+            DiskPerfFrequency.QuadPart;
+    }
 
-        ExFreePool(output);
+    KeReleaseSpinLock(&unlock->RequestLock, oldIrql);
+}
 
-        //
-        // Now, get the VOLUME_NUMBER information
-        //
-        outputSize = sizeof(VOLUME_NUMBER);
-        RtlZeroMemory(&volumeNumber, outputSize);
-
-        KeInitializeEvent(&event, NotificationEvent, FALSE);
-        irp = IoBuildDeviceIoControlRequest(
-            IOCTL_VOLUME_QUERY_VOLUME_NUMBER,
-            deviceExtension->TargetDeviceObject, NULL, 0,
-            &volumeNumber,
-            sizeof(VOLUME_NUMBER),
-            FALSE, &event, &ioStatus);
-        if (!irp) {
-            DiskPerfLogError(
-                DeviceObject,
-                265,
-                STATUS_SUCCESS,
-                IO_ERR_INSUFFICIENT_RESOURCES);
-            return STATUS_INSUFFICIENT_RESOURCES;
-        }
-        status = IoCallDriver(deviceExtension->TargetDeviceObject, irp);
-        if (status == STATUS_PENDING) {
-            KeWaitForSingleObject(&event, Executive,
-                KernelMode, FALSE, NULL);
-            status = ioStatus.Status;
-        }
-        if (!NT_SUCCESS(status) ||
-            volumeNumber.VolumeManagerName[0] == (WCHAR)UNICODE_NULL) {
+NTSTATUS
+DiskPerfSetUnlock(
+    IN PDEVICE_EXTENSION DeviceExtension,
+    IN PSEDSLEEP_UNLOCK_CONTROL Control
+)
 
-            RtlCopyMemory(
-                &deviceExtension->StorageManagerName[0],
-                L"LogiDisk",
+/*++
+
+Routine Description:
+
+    Change the unlock deadline, retry budget and policy. Takes effect
+    from the next resume.
+
+Arguments:
+
+    DeviceExtension - The device to control.
+    Control         - New settings, see SEDSLEEP_UNLOCK_CONTROL.
+
+Return Value:
+
+    NTSTATUS
+
+--*/
+
+{
+    if (Control->CommandTimeout > SEDSLEEP_UNLOCK_MAX_COMMAND_TIMEOUT ||
+        Control->Retries > SEDSLEEP_UNLOCK_MAX_RETRIES ||
+        (Control->Flags & ~(SEDSLEEP_UNLOCK_LAZY | SEDSLEEP_UNLOCK_NO_PIPELINE |
+                            SEDSLEEP_UNLOCK_STANDBY | SEDSLEEP_UNLOCK_SKIP_HIBERNATE)) != 0) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    DeviceExtension->UnlockDeadlineMs = Control->DeadlineMs;
+    DeviceExtension->UnlockRetries = Control->Retries;
+    DeviceExtension->UnlockFlags = Control->Flags;
+    if (Control->CommandTimeout != 0) {
+        DeviceExtension->CommandTimeout = Control->CommandTimeout;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+
+ULONG
+DiskPerfHashSerial(
+    IN PCSTR SerialNumber
+)
+{
+    ULONG hash = 2166136261;
+    ULONG i;
+
+    for (i = 0; i < SEDTRACE_SERIAL_LENGTH && SerialNumber[i] != 0; i++) {
+        hash = (hash ^ (UCHAR)SerialNumber[i]) * 16777619;
+    }
+
+    return hash & (DISKPERF_DRIVE_BUCKETS - 1);
+}
+
+
+PDISKPERF_DRIVE
+DiskPerfFindDrive(
+    IN PCSTR SerialNumber
+)
+
+/*++
+
+Routine Description:
+
+    Look a drive up by serial number. The caller holds DiskPerfDriveLock.
+
+--*/
+
+{
+    PDISKPERF_DRIVE drive;
+
+    for (drive = DiskPerfDrives[DiskPerfHashSerial(SerialNumber)];
+        drive != NULL;
+        drive = drive->Next) {
+
+        if (strncmp(drive->SerialNumber, SerialNumber, SEDTRACE_SERIAL_LENGTH) == 0) {
+            return drive;
+        }
+    }
+
+    return NULL;
+}
+
+
+PSEDSLEEP_UNLOCK_IMAGES
+DiskPerfReferenceImages(
+    IN PDEVICE_EXTENSION DeviceExtension
+)
+
+/*++
+
+Routine Description:
+
+    Find the unlock commands for a disk: the provisioned ones if there are
+    any, otherwise the compiled in ones. Release them with
+    DiskPerfDereferenceImages.
+
+--*/
+
+{
+    PSEDSLEEP_UNLOCK_IMAGES images = DiskPerfBuiltinImages;
+    PDISKPERF_DRIVE         drive;
+    KIRQL                   irql;
+
+    KeAcquireSpinLock(&DiskPerfDriveLock, &irql);
+
+    if (DeviceExtension->SerialNumber[0] != 0) {
+        drive = DiskPerfFindDrive(DeviceExtension->SerialNumber);
+        if (drive != NULL && drive->Images != NULL) {
+            images = drive->Images;
+        }
+    }
+
+    if (images != NULL) {
+        InterlockedIncrement(&images->ReferenceCount);
+    }
+
+    KeReleaseSpinLock(&DiskPerfDriveLock, irql);
+
+    return images;
+}
+
+
+VOID
+DiskPerfDereferenceImages(
+    IN PSEDSLEEP_UNLOCK_IMAGES Images
+)
+{
+    if (InterlockedDecrement(&Images->ReferenceCount) == 0) {
+        RtlSecureZeroMemory(Images, FIELD_OFFSET(SEDSLEEP_UNLOCK_IMAGES, Data) + Images->DataLength);
+        ExFreePool(Images);
+    }
+}
+
+
+PSEDSLEEP_UNLOCK_IMAGES
+DiskPerfAllocateImages(
+    VOID
+)
+
+/*++
+
+Routine Description:
+
+    Scratch block to build the images in, with room for every command at
+    its largest. DiskPerfFinishImages copies it to one of the right size.
+
+--*/
+
+{
+    PSEDSLEEP_UNLOCK_IMAGES images;
+    ULONG                   size = DISKPERF_IMAGES_SCRATCH_SIZE;
+
+    images = ExAllocatePool(PagedPool, size);
+    if (images != NULL) {
+        RtlZeroMemory(images, FIELD_OFFSET(SEDSLEEP_UNLOCK_IMAGES, Data));
+    }
+
+    return images;
+}
+
+
+PUCHAR
+DiskPerfImageSpace(
+    IN PSEDSLEEP_UNLOCK_IMAGES Images,
+    OUT PULONG Room
+)
+{
+    *Room = min(DISKPERF_IMAGES_SCRATCH_SIZE - FIELD_OFFSET(SEDSLEEP_UNLOCK_IMAGES, Data) -
+        Images->DataLength, SEDSLEEP_SCSI_BUFFER_SIZE);
+
+    return Images->Data + Images->DataLength;
+}
+
+
+NTSTATUS
+DiskPerfAddImage(
+    IN PSEDSLEEP_UNLOCK_IMAGES Images,
+    OUT PSEDSLEEP_COMMAND_IMAGE Image,
+    IN ULONG Length,
+    IN BOOLEAN Method
+)
+
+/*++
+
+Routine Description:
+
+    Take the ComPacket just written at DiskPerfImageSpace into the block.
+    Length may include padding; only the ComPacket itself is kept. For a
+    method call inside the session, a Set gets a Get of the same columns
+    appended, so the reply tells us whether it took without another round
+    trip.
+
+Arguments:
+
+    Images - Block being built.
+    Image  - Describes the command once it is in.
+    Length - Bytes written.
+    Method - Whether this is the method call rather than session control.
+
+Return Value:
+
+    NTSTATUS
+
+--*/
+
+{
+    PUCHAR   packet;
+    ULONG    room;
+    uint32_t length;
+
+    packet = DiskPerfImageSpace(Images, &room);
+
+    if (Length < SED_OPAL_PAYLOAD_OFFSET || Length > room ||
+        SedOpalGet32(packet + SED_OPAL_COMPACKET_LENGTH) > Length - SED_OPAL_COMPACKET_HEADER) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    length = SED_OPAL_COMPACKET_HEADER + SedOpalGet32(packet + SED_OPAL_COMPACKET_LENGTH);
+
+    RtlZeroMemory(Image, sizeof(*Image));
+
+    if (Method) {
+        if (SedOpalParseSet(packet, length, &Image->Set) == SED_OPAL_OK &&
+            Image->Set.Count != 0 &&
+            SedOpalAppendGet(packet, room, &Image->Set, &length) == SED_OPAL_OK) {
+            Image->Verify = TRUE;
+        }
+        else {
+            DebugPrint((1, "DiskPerfAddImage: Not a Set, checking the status only\n"));
+        }
+    }
+
+    Image->Offset = Images->DataLength;
+    Image->Length = length;
+    Images->DataLength += ALIGN_UP_BY(length, sizeof(ULONG64));
+
+    return STATUS_SUCCESS;
+}
+
+
+NTSTATUS
+DiskPerfCopyImage(
+    IN PSEDSLEEP_UNLOCK_IMAGES Images,
+    OUT PSEDSLEEP_COMMAND_IMAGE Image,
+    IN const UCHAR* Source,
+    IN ULONG Length,
+    IN BOOLEAN Method
+)
+{
+    ULONG  room;
+    PUCHAR packet = DiskPerfImageSpace(Images, &room);
+
+    //
+    // The captured commands are padded out well past the ComPacket
+    //
+
+    if (Length >= SED_OPAL_COMPACKET_HEADER) {
+        Length = min(Length,
+            SED_OPAL_COMPACKET_HEADER + SedOpalGet32(Source + SED_OPAL_COMPACKET_LENGTH));
+    }
+
+    if (Length > room) {
+        return STATUS_BUFFER_OVERFLOW;
+    }
+
+    RtlCopyMemory(packet, Source, Length);
+    return DiskPerfAddImage(Images, Image, Length, Method);
+}
+
+
+NTSTATUS
+DiskPerfFinishImages(
+    IN PSEDSLEEP_UNLOCK_IMAGES Scratch,
+    OUT PSEDSLEEP_UNLOCK_IMAGES* Images
+)
+
+/*++
+
+Routine Description:
+
+    Move a built block out of scratch into nonpaged pool of just the right
+    size, and wipe and free the scratch block.
+
+--*/
+
+{
+    ULONG size = FIELD_OFFSET(SEDSLEEP_UNLOCK_IMAGES, Data) + Scratch->DataLength;
+
+    *Images = ExAllocatePool(NonPagedPoolNx, size);
+    if (*Images != NULL) {
+        RtlCopyMemory(*Images, Scratch, size);
+        (*Images)->ReferenceCount = 1;
+    }
+
+    RtlSecureZeroMemory(Scratch, DISKPERF_IMAGES_SCRATCH_SIZE);
+    ExFreePool(Scratch);
+
+    return (*Images != NULL) ? STATUS_SUCCESS : STATUS_INSUFFICIENT_RESOURCES;
+}
+
+
+NTSTATUS
+DiskPerfBuildBuiltinImages(
+    OUT PSEDSLEEP_UNLOCK_IMAGES* Images
+)
+
+/*++
+
+Routine Description:
+
+    Prepare the commands captured from sedutil and compiled in: set
+    locking range 0 read/write, then MBRDone.
+
+--*/
+
+{
+    PSEDSLEEP_UNLOCK_IMAGES scratch;
+    NTSTATUS                status;
+
+    PAGED_CODE();
+
+    *Images = NULL;
+
+    scratch = DiskPerfAllocateImages();
+    if (scratch == NULL) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    scratch->CommandCount = 2;
+
+    status = DiskPerfCopyImage(scratch, &scratch->StartSession, send5_bin, send5_bin_len, FALSE);
+    if (NT_SUCCESS(status)) {
+        status = DiskPerfCopyImage(scratch, &scratch->EndSession, send9_bin, send9_bin_len, FALSE);
+    }
+    if (NT_SUCCESS(status)) {
+        status = DiskPerfCopyImage(scratch, &scratch->Command[0], send7_bin, send7_bin_len, TRUE);
+    }
+    if (NT_SUCCESS(status)) {
+        status = DiskPerfCopyImage(scratch, &scratch->Command[1], send7mbr_bin, send7mbr_bin_len, TRUE);
+    }
+
+    if (!NT_SUCCESS(status)) {
+        RtlSecureZeroMemory(scratch, DISKPERF_IMAGES_SCRATCH_SIZE);
+        ExFreePool(scratch);
+        return status;
+    }
+
+    return DiskPerfFinishImages(scratch, Images);
+}
+
+
+NTSTATUS
+DiskPerfBuildImages(
+    IN PSEDSLEEP_PROVISION Provision,
+    OUT PSEDSLEEP_UNLOCK_IMAGES* Images
+)
+
+/*++
+
+Routine Description:
+
+    Build the unlock commands for a provisioned drive: StartSession to the
+    Locking SP as the given authority, a Set of ReadLocked and WriteLocked
+    off for each locking range, MBRDone on if asked for, and EndSession.
+
+Arguments:
+
+    Provision - Validated provisioning request.
+    Images    - Receives the block, with one reference.
+
+Return Value:
+
+    NTSTATUS
+
+--*/
+
+{
+    static const UCHAR noAuthority[8] = { 0 };
+    PSEDSLEEP_UNLOCK_IMAGES scratch;
+    SED_OPAL_SET            set;
+    PUCHAR                  packet;
+    ULONG                   room;
+    uint32_t                length;
+    ULONG                   i;
+    NTSTATUS                status = STATUS_SUCCESS;
+
+    PAGED_CODE();
+
+    *Images = NULL;
+
+    scratch = DiskPerfAllocateImages();
+    if (scratch == NULL) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    packet = DiskPerfImageSpace(scratch, &room);
+    if (SedOpalBuildStartSession(packet, room, SED_UNLOCK_COMID, SED_UNLOCK_HOST_SESSION, SedUnlockLockingSp,
+        RtlEqualMemory(Provision->Authority, noAuthority, 8) ? SedUnlockAdmin1 : Provision->Authority,
+        Provision->Credential, Provision->CredentialLength, &length) != SED_OPAL_OK) {
+        status = STATUS_BUFFER_OVERFLOW;
+    }
+    if (NT_SUCCESS(status)) {
+        status = DiskPerfAddImage(scratch, &scratch->StartSession, length, FALSE);
+    }
+
+    if (NT_SUCCESS(status)) {
+        packet = DiskPerfImageSpace(scratch, &room);
+        if (SedOpalBuildEndSession(packet, room, SED_UNLOCK_COMID, &length) != SED_OPAL_OK) {
+            status = STATUS_BUFFER_OVERFLOW;
+        }
+    }
+    if (NT_SUCCESS(status)) {
+        status = DiskPerfAddImage(scratch, &scratch->EndSession, length, FALSE);
+    }
+
+    for (i = 0; i <= Provision->RangeCount && NT_SUCCESS(status); i++) {
+
+        if (i < Provision->RangeCount) {
+            SedUnlockRangeSet(&set, Provision->Range[i]);
+        }
+        else if (Provision->Flags & SEDSLEEP_PROVISION_MBR_DONE) {
+            SedUnlockMbrDoneSet(&set);
+        }
+        else {
+            break;
+        }
+
+        packet = DiskPerfImageSpace(scratch, &room);
+        if (SedOpalBuildSet(packet, room, SED_UNLOCK_COMID, &set, &length) != SED_OPAL_OK) {
+            status = STATUS_BUFFER_OVERFLOW;
+            break;
+        }
+
+        status = DiskPerfAddImage(scratch, &scratch->Command[scratch->CommandCount], length, TRUE);
+        scratch->CommandCount++;
+    }
+
+    if (!NT_SUCCESS(status)) {
+        RtlSecureZeroMemory(scratch, DISKPERF_IMAGES_SCRATCH_SIZE);
+        ExFreePool(scratch);
+        return status;
+    }
+
+    return DiskPerfFinishImages(scratch, Images);
+}
+
+
+NTSTATUS
+DiskPerfProvision(
+    IN PDEVICE_EXTENSION DeviceExtension,
+    IN PSEDSLEEP_PROVISION Provision
+)
+
+/*++
+
+Routine Description:
+
+    Store (or clear) the unlock commands for a drive. Everything is built
+    here, so the resume path only has to look the drive up.
+
+Arguments:
+
+    DeviceExtension - The disk the request was sent to.
+    Provision       - The request, see SEDSLEEP_PROVISION.
+
+Return Value:
+
+    NTSTATUS
+
+--*/
+
+{
+    CHAR                    serial[SEDTRACE_SERIAL_LENGTH];
+    PSEDSLEEP_UNLOCK_IMAGES images = NULL;
+    PSEDSLEEP_UNLOCK_IMAGES old;
+    PDISKPERF_DRIVE         drive;
+    PDISKPERF_DRIVE         newDrive;
+    ULONG                   bucket;
+    KIRQL                   irql;
+    NTSTATUS                status;
+
+    PAGED_CODE();
+
+    if (Provision->Version == 0 ||
+        Provision->Version > SEDSLEEP_PROVISION_VERSION ||
+        (Provision->Flags & ~(SEDSLEEP_PROVISION_MBR_DONE | SEDSLEEP_PROVISION_CLEAR |
+                              SEDSLEEP_PROVISION_DERIVE)) != 0 ||
+        (Provision->Version < 2 && (Provision->Flags & SEDSLEEP_PROVISION_DERIVE)) ||
+        Provision->CredentialLength > SEDSLEEP_PROVISION_MAX_CREDENTIAL ||
+        Provision->RangeCount > SEDSLEEP_PROVISION_MAX_RANGES) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    RtlCopyMemory(serial,
+        (Provision->SerialNumber[0] != 0) ? Provision->SerialNumber : DeviceExtension->SerialNumber,
+        sizeof(serial));
+    serial[sizeof(serial) - 1] = 0;
+
+    if (serial[0] == 0) {
+        return STATUS_INVALID_DEVICE_STATE;
+    }
+
+    //
+    // Ranges and MBRDone not given with the credential come from the
+    // drive's policy, if it has any
+    //
+
+    if (Provision->RangeCount == 0 && !(Provision->Flags & SEDSLEEP_PROVISION_MBR_DONE)) {
+        KeAcquireSpinLock(&DiskPerfDriveLock, &irql);
+
+        drive = DiskPerfFindDrive(serial);
+        if (drive != NULL && (drive->Policy.Present & DISKPERF_POLICY_RANGES)) {
+            Provision->RangeCount = drive->Policy.RangeCount;
+            RtlCopyMemory(Provision->Range, drive->Policy.Range, sizeof(Provision->Range));
+        }
+        if (drive != NULL && drive->Policy.MbrDone) {
+            Provision->Flags |= SEDSLEEP_PROVISION_MBR_DONE;
+        }
+
+        KeReleaseSpinLock(&DiskPerfDriveLock, irql);
+    }
+
+    if (!(Provision->Flags & SEDSLEEP_PROVISION_CLEAR) &&
+        (Provision->CredentialLength == 0 ||
+         (Provision->RangeCount == 0 && !(Provision->Flags & SEDSLEEP_PROVISION_MBR_DONE)))) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if (!(Provision->Flags & SEDSLEEP_PROVISION_CLEAR) &&
+        (Provision->Flags & SEDSLEEP_PROVISION_DERIVE)) {
+        status = DiskPerfDeriveCredential(DeviceExtension, Provision, serial);
+        if (!NT_SUCCESS(status)) {
+            return status;
+        }
+    }
+
+    if (!(Provision->Flags & SEDSLEEP_PROVISION_CLEAR)) {
+        status = DiskPerfBuildImages(Provision, &images);
+        if (!NT_SUCCESS(status)) {
+            return status;
+        }
+    }
+
+    newDrive = ExAllocatePool(NonPagedPoolNx, sizeof(DISKPERF_DRIVE));
+    if (newDrive == NULL) {
+        if (images != NULL) {
+            DiskPerfDereferenceImages(images);
+        }
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    KeAcquireSpinLock(&DiskPerfDriveLock, &irql);
+
+    drive = DiskPerfFindDrive(serial);
+    if (drive == NULL) {
+        drive = newDrive;
+        newDrive = NULL;
+
+        RtlZeroMemory(drive, sizeof(DISKPERF_DRIVE));
+        RtlCopyMemory(drive->SerialNumber, serial, sizeof(serial));
+
+        bucket = DiskPerfHashSerial(serial);
+        drive->Next = DiskPerfDrives[bucket];
+        DiskPerfDrives[bucket] = drive;
+    }
+
+    DebugPrint((1, "DiskPerfProvision: %s %s, %d commands\n", serial,
+        (images != NULL) ? "provisioned" : "cleared",
+        (images != NULL) ? images->CommandCount : 0));
+
+    old = drive->Images;
+    drive->Images = images;
+
+    KeReleaseSpinLock(&DiskPerfDriveLock, irql);
+
+    if (newDrive != NULL) {
+        ExFreePool(newDrive);
+    }
+    if (old != NULL) {
+        DiskPerfDereferenceImages(old);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+
+VOID
+DiskPerfCheckPbkdf2(
+    VOID
+)
+
+/*++
+
+Routine Description:
+
+    Run the password hashing self test once at load. If the SHA extensions
+    get it wrong the scalar code is used; if that is wrong too, passwords
+    are refused rather than turned into a PIN that would not unlock.
+
+Arguments:
+
+    None
+
+Return Value:
+
+    None
+
+--*/
+
+{
+    XSTATE_SAVE xstate;
+    ULONG       features = SedPbkdf2Features() & SED_PBKDF2_FEATURE_SHANI;
+
+    if (features != 0) {
+        if (NT_SUCCESS(KeSaveExtendedProcessorState(XSTATE_MASK_LEGACY, &xstate))) {
+            if (SedPbkdf2SelfTest(features) != SED_PBKDF2_OK) {
+                DebugPrint((0, "DiskPerfCheckPbkdf2: SHA-NI self test failed\n"));
+                features = 0;
+            }
+            KeRestoreExtendedProcessorState(&xstate);
+        }
+        else {
+            features = 0;
+        }
+    }
+
+    DiskPerfPbkdf2Usable = (SedPbkdf2SelfTest(0) == SED_PBKDF2_OK);
+    DiskPerfPbkdf2Features = DiskPerfPbkdf2Usable ? features : 0;
+
+    DebugPrint((1, "DiskPerfCheckPbkdf2: %s, features %x\n",
+        DiskPerfPbkdf2Usable ? "ok" : "self test failed", DiskPerfPbkdf2Features));
+}
+
+
+NTSTATUS
+DiskPerfDeriveCredential(
+    IN PDEVICE_EXTENSION DeviceExtension,
+    IN OUT PSEDSLEEP_PROVISION Provision,
+    IN PCHAR SerialNumber
+)
+
+/*++
+
+Routine Description:
+
+    Replace the password in Credential with the PIN sedutil sets for it,
+    PBKDF2 salted with the drive's serial number.
+
+    sedutil salts with the serial as IDENTIFY reports it, leading spaces
+    and all, while SerialNumber has been trimmed. For this drive the
+    default salt is read from the descriptor again; another drive's
+    serial is used as the request spelled it.
+
+Arguments:
+
+    DeviceExtension - The device the request came to.
+    Provision       - The request, with SEDSLEEP_PROVISION_DERIVE.
+    SerialNumber    - The drive's serial number, for the default salt.
+
+Return Value:
+
+    NTSTATUS
+
+--*/
+
+{
+    static const SED_HASH hashes[] = { SedHashSha1, SedHashSha256, SedHashSha512 };
+    XSTATE_SAVE           xstate;
+    SED_PBKDF2_JOB        job;
+    UCHAR                 salt[SEDSLEEP_PROVISION_SALT_LENGTH];
+    UCHAR                 key[SED_PBKDF2_SEDUTIL_KEY];
+    ULONG                 features = DiskPerfPbkdf2Features;
+    ULONG                 i;
+    int                   result;
+    NTSTATUS              status;
+
+    PAGED_CODE();
+
+    if (!DiskPerfPbkdf2Usable) {
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    if (Provision->Hash >= sizeof(hashes) / sizeof(hashes[0])) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    RtlCopyMemory(salt, Provision->Salt, sizeof(salt));
+    for (i = 0; i < sizeof(salt) && salt[i] == 0; i++) {
+    }
+    if (i == sizeof(salt) &&
+        strncmp(SerialNumber, DeviceExtension->SerialNumber, SEDTRACE_SERIAL_LENGTH) == 0) {
+        status = DiskPerfQueryRawSerial(DeviceExtension, salt);
+        if (!NT_SUCCESS(status)) {
+            return status;
+        }
+    } else if (i == sizeof(salt)) {
+        RtlFillMemory(salt, sizeof(salt), ' ');
+        for (i = 0; i < sizeof(salt) && SerialNumber[i] != 0; i++) {
+            salt[i] = SerialNumber[i];
+        }
+    }
+
+    job.Hash = hashes[Provision->Hash];
+    job.Password = Provision->Credential;
+    job.PasswordLength = Provision->CredentialLength;
+    job.Salt = salt;
+    job.SaltLength = sizeof(salt);
+    job.Iterations = (Provision->Iterations != 0) ? Provision->Iterations : SED_PBKDF2_SEDUTIL_ITERATIONS;
+    job.Key = key;
+    job.KeyLength = sizeof(key);
+
+    if (features != 0 &&
+        !NT_SUCCESS(KeSaveExtendedProcessorState(XSTATE_MASK_LEGACY, &xstate))) {
+        features = 0;
+    }
+
+    result = SedPbkdf2(&job, 1, features);
+
+    if (features != 0) {
+        KeRestoreExtendedProcessorState(&xstate);
+    }
+
+    if (result == SED_PBKDF2_OK) {
+        RtlCopyMemory(Provision->Credential, key, sizeof(key));
+        Provision->CredentialLength = sizeof(key);
+    }
+
+    RtlSecureZeroMemory(key, sizeof(key));
+    return (result == SED_PBKDF2_OK) ? STATUS_SUCCESS : STATUS_INVALID_PARAMETER;
+}
+
+
+NTSTATUS
+DiskPerfQueryRawSerial(
+    IN PDEVICE_EXTENSION DeviceExtension,
+    OUT PUCHAR Serial
+)
+
+/*++
+
+Routine Description:
+
+    Read the drive's serial number untrimmed, as the storage device
+    descriptor has it, padded with spaces to the salt length.
+
+Arguments:
+
+    DeviceExtension - The drive.
+    Serial          - SEDSLEEP_PROVISION_SALT_LENGTH bytes.
+
+Return Value:
+
+    NTSTATUS
+
+--*/
+
+{
+    PDISKPERF_QUERY             query;
+    PSTORAGE_DEVICE_DESCRIPTOR  descriptor;
+    PCHAR                       source;
+    NTSTATUS                    status;
+    ULONG                       descriptorLength;
+    ULONG                       i;
+
+    PAGED_CODE();
+
+    query = DiskPerfAcquireQuery(DeviceExtension->TargetDeviceObject);
+    if (query == NULL) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    descriptor = (PSTORAGE_DEVICE_DESCRIPTOR)query->Buffer;
+
+    status = DiskPerfQueryDescriptor(DeviceExtension->TargetDeviceObject,
+        query, &descriptorLength);
+
+    if (NT_SUCCESS(status)) {
+        if (descriptor->SerialNumberOffset == 0 ||
+            descriptor->SerialNumberOffset >= descriptorLength) {
+            status = STATUS_INVALID_DEVICE_STATE;
+        } else {
+            source = (PCHAR)descriptor + descriptor->SerialNumberOffset;
+            RtlFillMemory(Serial, SEDSLEEP_PROVISION_SALT_LENGTH, ' ');
+            for (i = 0; i < SEDSLEEP_PROVISION_SALT_LENGTH &&
+                        descriptor->SerialNumberOffset + i < descriptorLength &&
+                        source[i] != 0; i++) {
+                Serial[i] = source[i];
+            }
+        }
+    }
+
+    DiskPerfReleaseQuery(query);
+    return status;
+}
+
+
+VOID
+DiskPerfLoadPolicies(
+    IN PUNICODE_STRING RegistryPath
+)
+
+/*++
+
+Routine Description:
+
+    Read which disks to attach to from the Parameters key under the
+    service key, and every drive's policy from Parameters\Drives into the
+    drive table. Runs once, at DriverEntry; a drive without a key, or a key
+    that cannot be read, gets the defaults.
+
+        AttachBusTypes  DWORD, bit n set attaches to STORAGE_BUS_TYPE n
+        AttachRemovable DWORD, also attach to removable media
+
+Arguments:
+
+    RegistryPath - The service key.
+
+Return Value:
+
+    None
+
+--*/
+
+{
+    OBJECT_ATTRIBUTES      attributes;
+    UNICODE_STRING         name;
+    HANDLE                 serviceKey;
+    HANDLE                 parametersKey;
+    HANDLE                 drivesKey;
+    PKEY_BASIC_INFORMATION info;
+    ULONG                  infoSize = sizeof(KEY_BASIC_INFORMATION) + 256 * sizeof(WCHAR);
+    ULONG                  value;
+    ULONG                  length;
+    ULONG                  index;
+    NTSTATUS               status;
+
+    PAGED_CODE();
+
+    InitializeObjectAttributes(&attributes, RegistryPath,
+        OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE, NULL, NULL);
+    status = ZwOpenKey(&serviceKey, KEY_READ, &attributes);
+    if (!NT_SUCCESS(status)) {
+        return;
+    }
+
+    RtlInitUnicodeString(&name, L"Parameters");
+    InitializeObjectAttributes(&attributes, &name,
+        OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE, serviceKey, NULL);
+    status = ZwOpenKey(&parametersKey, KEY_READ, &attributes);
+    ZwClose(serviceKey);
+    if (!NT_SUCCESS(status)) {
+        return;
+    }
+
+    if (NT_SUCCESS(DiskPerfQueryValue(parametersKey, L"AttachBusTypes", REG_DWORD,
+        &value, sizeof(value), &length))) {
+        DiskPerfAttachBusTypes = value;
+    }
+    if (NT_SUCCESS(DiskPerfQueryValue(parametersKey, L"AttachRemovable", REG_DWORD,
+        &value, sizeof(value), &length))) {
+        DiskPerfAttachRemovable = (value != 0);
+    }
+
+    RtlInitUnicodeString(&name, L"Drives");
+    InitializeObjectAttributes(&attributes, &name,
+        OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE, parametersKey, NULL);
+    status = ZwOpenKey(&drivesKey, KEY_READ, &attributes);
+    ZwClose(parametersKey);
+    if (!NT_SUCCESS(status)) {
+        return;
+    }
+
+    info = ExAllocatePool(PagedPool, infoSize);
+    if (info != NULL) {
+        for (index = 0; ; index++) {
+            status = ZwEnumerateKey(drivesKey, index, KeyBasicInformation, info, infoSize, &length);
+            if (status == STATUS_NO_MORE_ENTRIES) {
+                break;
+            }
+            if (!NT_SUCCESS(status)) {
+                continue;
+            }
+
+            name.Buffer = info->Name;
+            name.Length = (USHORT)info->NameLength;
+            name.MaximumLength = (USHORT)info->NameLength;
+
+            DiskPerfLoadPolicy(drivesKey, &name);
+        }
+
+        ExFreePool(info);
+    }
+
+    ZwClose(drivesKey);
+}
+
+
+VOID
+DiskPerfLoadPolicy(
+    IN HANDLE DrivesKey,
+    IN PUNICODE_STRING Name
+)
+
+/*++
+
+Routine Description:
+
+    Read one drive's policy. The key name is the serial number as the
+    disk reports it. Values, all optional:
+
+        Enable          DWORD, 0 leaves the drive alone, 1 attaches to it
+                        whatever its bus
+        Lazy            DWORD, unlock on first IO rather than on resume
+        DeadlineMs      DWORD, see SEDSLEEP_UNLOCK_CONTROL
+        Retries         DWORD
+        CommandTimeout  DWORD, seconds
+        Transport       DWORD, 0 SCSI, 1 ATA pass-through
+        Ranges          BINARY, locking range numbers to unlock
+        MbrDone         DWORD, also set MBRDone
+        Standby         DWORD, also unlock after S1 and S2
+        Hibernate       DWORD, 0 leaves the gate open across hibernation
+                        and fast startup
+
+    Ranges and MbrDone are used by provisioning that does not give any.
+    Values out of range are ignored.
+
+--*/
+
+{
+    OBJECT_ATTRIBUTES attributes;
+    ANSI_STRING       serial;
+    HANDLE            key;
+    PDISKPERF_DRIVE   drive;
+    ULONG             bucket;
+    ULONG             value;
+    ULONG             length;
+    NTSTATUS          status;
+
+    PAGED_CODE();
+
+    drive = ExAllocatePool(NonPagedPoolNx, sizeof(DISKPERF_DRIVE));
+    if (drive == NULL) {
+        return;
+    }
+    RtlZeroMemory(drive, sizeof(DISKPERF_DRIVE));
+
+    serial.Buffer = drive->SerialNumber;
+    serial.Length = 0;
+    serial.MaximumLength = sizeof(drive->SerialNumber) - 1;
+
+    status = RtlUnicodeStringToAnsiString(&serial, Name, FALSE);
+    if (!NT_SUCCESS(status) || serial.Length == 0 || DiskPerfFindDrive(drive->SerialNumber) != NULL) {
+        ExFreePool(drive);
+        return;
+    }
+
+    InitializeObjectAttributes(&attributes, Name,
+        OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE, DrivesKey, NULL);
+    status = ZwOpenKey(&key, KEY_READ, &attributes);
+    if (!NT_SUCCESS(status)) {
+        ExFreePool(drive);
+        return;
+    }
+
+    if (NT_SUCCESS(DiskPerfQueryValue(key, L"Enable", REG_DWORD, &value, sizeof(value), &length))) {
+        drive->Policy.Present |= DISKPERF_POLICY_ENABLE;
+        drive->Policy.Enable = (value != 0);
+    }
+
+    if (NT_SUCCESS(DiskPerfQueryValue(key, L"Lazy", REG_DWORD, &value, sizeof(value), &length))) {
+        drive->Policy.Present |= DISKPERF_POLICY_LAZY;
+        drive->Policy.Lazy = (value != 0);
+    }
+
+    if (NT_SUCCESS(DiskPerfQueryValue(key, L"DeadlineMs", REG_DWORD, &value, sizeof(value), &length))) {
+        drive->Policy.Present |= DISKPERF_POLICY_DEADLINE;
+        drive->Policy.DeadlineMs = value;
+    }
+
+    if (NT_SUCCESS(DiskPerfQueryValue(key, L"Retries", REG_DWORD, &value, sizeof(value), &length)) &&
+        value <= SEDSLEEP_UNLOCK_MAX_RETRIES) {
+        drive->Policy.Present |= DISKPERF_POLICY_RETRIES;
+        drive->Policy.Retries = value;
+    }
+
+    if (NT_SUCCESS(DiskPerfQueryValue(key, L"CommandTimeout", REG_DWORD, &value, sizeof(value), &length)) &&
+        value != 0 && value <= SEDSLEEP_UNLOCK_MAX_COMMAND_TIMEOUT) {
+        drive->Policy.Present |= DISKPERF_POLICY_COMMAND_TIMEOUT;
+        drive->Policy.CommandTimeout = value;
+    }
+
+    if (NT_SUCCESS(DiskPerfQueryValue(key, L"Transport", REG_DWORD, &value, sizeof(value), &length)) &&
+        value <= DISKPERF_TRANSPORT_ATA) {
+        drive->Policy.Present |= DISKPERF_POLICY_TRANSPORT;
+        drive->Policy.Transport = value;
+    }
+
+    if (NT_SUCCESS(DiskPerfQueryValue(key, L"Ranges", REG_BINARY,
+        drive->Policy.Range, sizeof(drive->Policy.Range), &length)) && length != 0) {
+        drive->Policy.Present |= DISKPERF_POLICY_RANGES;
+        drive->Policy.RangeCount = (UCHAR)length;
+    }
+
+    if (NT_SUCCESS(DiskPerfQueryValue(key, L"MbrDone", REG_DWORD, &value, sizeof(value), &length))) {
+        drive->Policy.Present |= DISKPERF_POLICY_MBR_DONE;
+        drive->Policy.MbrDone = (value != 0);
+    }
+
+    if (NT_SUCCESS(DiskPerfQueryValue(key, L"Standby", REG_DWORD, &value, sizeof(value), &length))) {
+        drive->Policy.Present |= DISKPERF_POLICY_STANDBY;
+        drive->Policy.Standby = (value != 0);
+    }
+
+    if (NT_SUCCESS(DiskPerfQueryValue(key, L"Hibernate", REG_DWORD, &value, sizeof(value), &length))) {
+        drive->Policy.Present |= DISKPERF_POLICY_HIBERNATE;
+        drive->Policy.Hibernate = (value != 0);
+    }
+
+    ZwClose(key);
+
+    DebugPrint((1, "DiskPerfLoadPolicy: %s policy %x\n", drive->SerialNumber, drive->Policy.Present));
+
+    //
+    // Nothing else can see the table yet
+    //
+
+    bucket = DiskPerfHashSerial(drive->SerialNumber);
+    drive->Next = DiskPerfDrives[bucket];
+    DiskPerfDrives[bucket] = drive;
+}
+
+
+NTSTATUS
+DiskPerfQueryValue(
+    IN HANDLE Key,
+    IN PCWSTR Name,
+    IN ULONG Type,
+    OUT PVOID Buffer,
+    IN ULONG Size,
+    OUT PULONG Length
+)
+
+/*++
+
+Routine Description:
+
+    Read a value of the given type and at most Size bytes.
+
+--*/
+
+{
+    UCHAR                           raw[FIELD_OFFSET(KEY_VALUE_PARTIAL_INFORMATION, Data) + 64];
+    PKEY_VALUE_PARTIAL_INFORMATION  info = (PKEY_VALUE_PARTIAL_INFORMATION)raw;
+    UNICODE_STRING                  name;
+    ULONG                           length;
+    NTSTATUS                        status;
+
+    PAGED_CODE();
+
+    RtlInitUnicodeString(&name, Name);
+
+    status = ZwQueryValueKey(Key, &name, KeyValuePartialInformation, info, sizeof(raw), &length);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    if (info->Type != Type || info->DataLength > Size ||
+        (Type == REG_DWORD && info->DataLength != sizeof(ULONG))) {
+        return STATUS_OBJECT_TYPE_MISMATCH;
+    }
+
+    RtlCopyMemory(Buffer, info->Data, info->DataLength);
+    *Length = info->DataLength;
+    return STATUS_SUCCESS;
+}
+
+
+VOID
+DiskPerfApplyPolicy(
+    IN PDEVICE_EXTENSION DeviceExtension
+)
+
+/*++
+
+Routine Description:
+
+    Apply the policy for the disk, if there is one, once its serial number
+    is known. Settings changed by IOCTL_SEDSLEEP_SET_UNLOCK since are
+    overridden when the disk is started again.
+
+--*/
+
+{
+    DISKPERF_POLICY policy;
+    PDISKPERF_DRIVE drive;
+    KIRQL           irql;
+
+    if (DeviceExtension->SerialNumber[0] == 0) {
+        return;
+    }
+
+    KeAcquireSpinLock(&DiskPerfDriveLock, &irql);
+
+    drive = DiskPerfFindDrive(DeviceExtension->SerialNumber);
+    if (drive != NULL) {
+        policy = drive->Policy;
+    }
+
+    KeReleaseSpinLock(&DiskPerfDriveLock, irql);
+
+    if (drive == NULL) {
+        return;
+    }
+
+    if (policy.Present & DISKPERF_POLICY_ENABLE) {
+        DeviceExtension->UnlockDisabled = !policy.Enable;
+    }
+    if (policy.Present & DISKPERF_POLICY_LAZY) {
+        DeviceExtension->UnlockFlags = policy.Lazy ?
+            (DeviceExtension->UnlockFlags | SEDSLEEP_UNLOCK_LAZY) :
+            (DeviceExtension->UnlockFlags & ~SEDSLEEP_UNLOCK_LAZY);
+    }
+    if (policy.Present & DISKPERF_POLICY_STANDBY) {
+        DeviceExtension->UnlockFlags = policy.Standby ?
+            (DeviceExtension->UnlockFlags | SEDSLEEP_UNLOCK_STANDBY) :
+            (DeviceExtension->UnlockFlags & ~SEDSLEEP_UNLOCK_STANDBY);
+    }
+    if (policy.Present & DISKPERF_POLICY_HIBERNATE) {
+        DeviceExtension->UnlockFlags = policy.Hibernate ?
+            (DeviceExtension->UnlockFlags & ~SEDSLEEP_UNLOCK_SKIP_HIBERNATE) :
+            (DeviceExtension->UnlockFlags | SEDSLEEP_UNLOCK_SKIP_HIBERNATE);
+    }
+    if (policy.Present & DISKPERF_POLICY_DEADLINE) {
+        DeviceExtension->UnlockDeadlineMs = policy.DeadlineMs;
+    }
+    if (policy.Present & DISKPERF_POLICY_RETRIES) {
+        DeviceExtension->UnlockRetries = policy.Retries;
+    }
+    if (policy.Present & DISKPERF_POLICY_COMMAND_TIMEOUT) {
+        DeviceExtension->CommandTimeout = policy.CommandTimeout;
+    }
+    if (policy.Present & DISKPERF_POLICY_TRANSPORT) {
+        DeviceExtension->Transport = policy.Transport;
+    }
+
+    DebugPrint((1, "DiskPerfApplyPolicy: %s policy %x%s\n", DeviceExtension->SerialNumber,
+        policy.Present, DeviceExtension->UnlockDisabled ? ", disabled" : ""));
+}
+
+
+VOID
+DiskPerfPrepareUnlock(
+    IN PDEVICE_EXTENSION DeviceExtension
+)
+
+/*++
+
+Routine Description:
+
+    Give a started disk its unlock context, unless policy leaves it alone
+    or it kept one from an earlier start. A drive that answers Level 0
+    Discovery without a Locking feature, or turns the command down, can
+    never be locked and goes without. One that could not answer just now
+    keeps it, to be on the safe side.
+
+--*/
+
+{
+    PDISKPERF_UNLOCK unlock;
+    const uint8_t*   feature;
+    uint32_t         featureLength;
+    NTSTATUS         status;
+    int              result;
+
+    PAGED_CODE();
+
+    if (DeviceExtension->UnlockDisabled || DeviceExtension->Unlock != NULL) {
+        return;
+    }
+
+    unlock = ExAllocatePool(NonPagedPoolNx, sizeof(DISKPERF_UNLOCK));
+    if (unlock == NULL) {
+        DebugPrint((1, "DiskPerfPrepareUnlock: Cannot allocate unlock context for %s\n",
+            DeviceExtension->SerialNumber));
+        return;
+    }
+
+    RtlZeroMemory(unlock, sizeof(DISKPERF_UNLOCK));
+    unlock->DeviceExtension = DeviceExtension;
+    unlock->UnlockDeadline = MAXLONGLONG;
+    KeInitializeEvent(&unlock->UnlockIdleEvent, NotificationEvent, TRUE);
+    KeInitializeTimer(&unlock->UnlockTimer);
+    KeInitializeDpc(&unlock->UnlockDpc, DiskPerfUnlockTimeout, DeviceExtension);
+    KeInitializeSpinLock(&unlock->RequestLock);
+    InitializeListHead(&unlock->Requests);
+    unlock->Result.Version = SEDSLEEP_UNLOCK_RESULT_VERSION;
+
+    //
+    // The pass-through goes through the context, so it is set before the
+    // discovery. Nothing else uses it until the start IRP has completed.
+    //
+
+    DeviceExtension->Unlock = unlock;
+
+    status = SEDSleepSendSCSICommand(DeviceExtension->DeviceObject, IF_RECV, 1,
+        SED_OPAL_DISCOVERY_COMID, NULL, 0);
+    if (NT_SUCCESS(status)) {
+        result = SedOpalFindFeature(unlock->ScsiRecvBuffer, SEDSLEEP_SCSI_BUFFER_SIZE,
+            SED_OPAL_FEATURE_LOCKING, &feature, &featureLength);
+        if (result == SED_OPAL_END ||
+            (result == SED_OPAL_OK &&
+             (featureLength == 0 || !(feature[0] & SED_OPAL_LOCKING_SUPPORTED)))) {
+            status = STATUS_NOT_SUPPORTED;
+        }
+    }
+
+    if (NT_SUCCESS(status) || status == STATUS_IO_TIMEOUT || status == STATUS_DEVICE_BUSY) {
+        DebugPrint((1, "DiskPerfPrepareUnlock: %s may need unlocking (%x)\n",
+            DeviceExtension->SerialNumber, status));
+        return;
+    }
+
+    DebugPrint((1, "DiskPerfPrepareUnlock: %s cannot lock (%x)\n",
+        DeviceExtension->SerialNumber, status));
+
+    DeviceExtension->Unlock = NULL;
+    ExFreePool(unlock);
+}
+
+
+VOID
+DiskPerfReleaseParked(
+    IN PDEVICE_EXTENSION DeviceExtension,
+    IN PSED_GATE_ENTRY List,
+    IN NTSTATUS Status
+)
+
+/*++
+
+Routine Description:
+
+    Deal with the IRPs released from the gate: send them on if the gate
+    opened, otherwise fail them with Status. Sent on IRPs go in
+    DiskPerfOrderParked order, so paging and interactive IO recovers first;
+    all of them are sent from this one thread.
+
+Arguments:
+
+    DeviceExtension - The device the IRPs were sent to.
+    List            - What SedGateOpen/Fail/Remove returned.
+    Status          - STATUS_SUCCESS to send them on, or the failure status.
+
+Return Value:
+
+    None
+
+--*/
+
+{
+    PIRP irp;
+
+    List = SedGateReverse(List);
+    if (NT_SUCCESS(Status)) {
+        List = DiskPerfOrderParked(List);
+    }
+
+    while (List != NULL) {
+        irp = CONTAINING_RECORD(List, IRP, Tail.Overlay.DriverContext);
+        List = List->Next;
+
+        if (NT_SUCCESS(Status)) {
+            DiskPerfSendReadWrite(DeviceExtension, irp);
+        }
+        else {
+            irp->IoStatus.Status = Status;
+            irp->IoStatus.Information = 0;
+            IoCompleteRequest(irp, IO_NO_INCREMENT);
+            IoReleaseRemoveLock(&DeviceExtension->RemoveLock, irp);
+        }
+    }
+}
+
+
+PSED_GATE_ENTRY
+DiskPerfOrderParked(
+    IN PSED_GATE_ENTRY List
+)
+
+/*++
+
+Routine Description:
+
+    Order released IRPs for sending: paging IO first, then by IO priority
+    hint from critical down to very low, each class in arrival order. A
+    single pass into per class lists, so it stays linear however much
+    piled up at the gate.
+
+Arguments:
+
+    List - Parked IRPs in arrival order.
+
+Return Value:
+
+    The same IRPs in the order to send them.
+
+--*/
+
+{
+    PSED_GATE_ENTRY  head[1 + MaxIoPriorityTypes] = { 0 };
+    PSED_GATE_ENTRY* tail[1 + MaxIoPriorityTypes];
+    PSED_GATE_ENTRY  next;
+    PSED_GATE_ENTRY  ordered = NULL;
+    PSED_GATE_ENTRY* last = &ordered;
+    PIRP             irp;
+    ULONG            class;
+
+    //
+    // Class 0 is paging IO, class 1 + n is priority hint MaxIoPriorityTypes - 1 - n
+    //
+
+    for (class = 0; class <= MaxIoPriorityTypes; class++) {
+        tail[class] = &head[class];
+    }
+
+    while (List != NULL) {
+        next = List->Next;
+        irp = CONTAINING_RECORD(List, IRP, Tail.Overlay.DriverContext);
+
+        if (irp->Flags & IRP_PAGING_IO) {
+            class = 0;
+        }
+        else {
+            class = MaxIoPriorityTypes - (ULONG)IoGetIoPriorityHint(irp);
+        }
+
+        List->Next = NULL;
+        *tail[class] = List;
+        tail[class] = &List->Next;
+        List = next;
+    }
+
+    for (class = 0; class <= MaxIoPriorityTypes; class++) {
+        if (head[class] != NULL) {
+            *last = head[class];
+            last = tail[class];
+        }
+    }
+
+    return ordered;
+}
+
+NTSTATUS
+DiskPerfForwardIrpSynchronous(
+    IN PDEVICE_OBJECT DeviceObject,
+    IN PIRP Irp
+)
+
+/*++
+
+Routine Description:
+
+    This routine sends the Irp to the next driver in line
+    when the Irp needs to be processed by the lower drivers
+    prior to being processed by this one.
+
+Arguments:
+
+    DeviceObject
+    Irp
+
+Return Value:
+
+    NTSTATUS
+
+--*/
+
+{
+    PDEVICE_EXTENSION   deviceExtension;
+    KEVENT event;
+    NTSTATUS status;
+
+    KeInitializeEvent(&event, NotificationEvent, FALSE);
+    deviceExtension = (PDEVICE_EXTENSION)DeviceObject->DeviceExtension;
+
+    //
+    // copy the irpstack for the next device
+    //
+
+    IoCopyCurrentIrpStackLocationToNext(Irp);
+
+    //
+    // set a completion routine
+    //
+
+    IoSetCompletionRoutine(Irp, DiskPerfIrpCompletion,
+        &event, TRUE, TRUE, TRUE);
+
+    //
+    // call the next lower device
+    //
+
+    status = IoCallDriver(deviceExtension->TargetDeviceObject, Irp);
+
+    //
+    // wait for the actual completion
+    //
+    __analysis_assume(status != STATUS_PENDING);
+    __analysis_assume(IoGetCurrentIrpStackLocation(Irp)->MinorFunction != IRP_MN_START_DEVICE);
+    if (status == STATUS_PENDING) {
+        KeWaitForSingleObject(&event, Executive, KernelMode, FALSE, NULL);
+        status = Irp->IoStatus.Status;
+    }
+
+    return status;
+
+} // end DiskPerfForwardIrpSynchronous()
+
+
+NTSTATUS
+DiskPerfCreate(
+    IN PDEVICE_OBJECT DeviceObject,
+    IN PIRP Irp
+)
+
+/*++
+
+Routine Description:
+
+    This routine services open commands. It establishes
+    the driver's existance by returning status success.
+
+Arguments:
+
+    DeviceObject - Context for the activity.
+    Irp          - The device control argument block.
+
+Return Value:
+
+    NT Status
+
+--*/
+
+{
+    PAGED_CODE();
+
+    UNREFERENCED_PARAMETER(DeviceObject);
+
+    Irp->IoStatus.Status = STATUS_SUCCESS;
+
+    IoCompleteRequest(Irp, IO_NO_INCREMENT);
+    return STATUS_SUCCESS;
+
+} // end DiskPerfCreate()
+
+
+NTSTATUS
+DiskPerfReadWrite(
+    IN PDEVICE_OBJECT DeviceObject,
+    IN PIRP Irp
+)
+
+/*++
+
+Routine Description:
+
+    This is the driver entry point for read and write requests
+    to disks to which the diskperf driver has attached.
+    This driver collects statistics and then sets a completion
+    routine so that it can collect additional information when
+    the request completes. Then it calls the next driver below
+    it.
+
+Arguments:
+
+    DeviceObject
+    Irp
+
+Return Value:
+
+    NTSTATUS
+
+--*/
+
+{
+    PDEVICE_EXTENSION  deviceExtension = DeviceObject->DeviceExtension;
+    PIO_STACK_LOCATION currentIrpStack = IoGetCurrentIrpStackLocation(Irp);
+    PLARGE_INTEGER     timeStamp;
+    ULONG              flags = 0;
+    int                first = 0;
+    BOOLEAN            held;
+    NTSTATUS           status;
+
+    //
+    // As processors may be  dynamically  added, ensure
+    // that there's a context for the current processor
+    //
+    //
+    // Acquire the remove lock so that device will not be removed while
+    // processing this irp.
+    //
+    status = IoAcquireRemoveLock(&deviceExtension->RemoveLock, Irp);
+
+    if (!NT_SUCCESS(status))
+    {
+        DebugPrint((3, "DiskPerfReadWrite: Remove lock failed IOCTL Irp type [%x]\n",
+            currentIrpStack->Parameters.DeviceIoControl.IoControlCode));
+        Irp->IoStatus.Status = status;
+        IoCompleteRequest(Irp, IO_NO_INCREMENT);
+        return status;
+    }
+
+    //
+    // Device is not initialized properly. Blindly pass the irp along
+    //
+    if (!(deviceExtension->State & DISKPERF_STATE_NAMED))
+    {
+        status = DiskPerfSendToNextDriver(DeviceObject, Irp);
+        IoReleaseRemoveLock(&deviceExtension->RemoveLock, Irp);
+        return (status);
+    }
+    
+    if ((deviceExtension->State & DISKPERF_STATE_FIRST_IO) &&
+        (InterlockedAnd(&deviceExtension->State, ~DISKPERF_STATE_FIRST_IO) & DISKPERF_STATE_FIRST_IO)) {
+        DiskPerfTraceEvent(deviceExtension, SedTraceEventFirstIo, 0, 0);
+    }
+
+    //
+    // Copy current stack to next stack.
+    //
+
+    IoCopyCurrentIrpStackLocationToNext(Irp);
+
+    //
+    // Our own stack location is now free for us to use, so stash the
+    // arrival time and what we are recording in it for the completion
+    // routine. Taking the time before the sleep gate means time spent
+    // waiting for the unlock shows up in the counters and histograms,
+    // which is exactly what we want to see around resume.
+    //
+
+    if (deviceExtension->CountersEnabled > 0 &&
+        deviceExtension->DiskCounters != NULL) {
+        flags |= DISKPERF_IRP_COUNTED;
+    }
+
+    if (deviceExtension->LatencyEnabled > 0 &&
+        deviceExtension->LatencyShards != NULL) {
+        flags |= DISKPERF_IRP_TIMED;
+        if (!SedGateIsOpen(&deviceExtension->Gate)) {
+            flags |= DISKPERF_IRP_RESUME;
+        }
+    }
+
+    if (flags != 0) {
+        timeStamp = (PLARGE_INTEGER)&currentIrpStack->Parameters.Read;
+        *timeStamp = KeQueryPerformanceCounter(NULL);
+    }
+    currentIrpStack->Parameters.Others.Argument3 = (PVOID)(ULONG_PTR)flags;
+
+    //
+    // Hold any super early read/write access at the gate until the unlock
+    // has completed. A parked IRP is sent on (or failed) by whoever
+    // releases the gate, still holding our remove lock, possibly before
+    // we get to return; so past a gate that is not open the IRP is marked
+    // pending up front, and we hold a remove lock of our own for as long
+    // as we still touch the device.
+    //
+
+    if (SedGateIsOpen(&deviceExtension->Gate)) {
+        return DiskPerfSendReadWrite(deviceExtension, Irp);
+    }
+
+    IoMarkIrpPending(Irp);
+    held = NT_SUCCESS(IoAcquireRemoveLock(&deviceExtension->RemoveLock, &first));
+
+    switch (SedGateEnter(&deviceExtension->Gate,
+        (PSED_GATE_ENTRY)Irp->Tail.Overlay.DriverContext, &first)) {
+
+    case SedGateResultParked:
+
+        //
+        // A lazy drive is left locked on resume; the first IO to wait for
+        // it starts the unlock. IO between the S3 IRP and the drive losing
+        // power parks too, but must not start it: the drive is still
+        // unlocked and would relock behind an open gate. Until the S0 or
+        // D0 IRP has cleared WakePending, the completion of that IRP
+        // starts the unlock for whatever is parked.
+        //
+
+        if (first && held &&
+            (deviceExtension->UnlockFlags & SEDSLEEP_UNLOCK_LAZY) &&
+            InterlockedCompareExchange(&deviceExtension->Unlock->WakePending, FALSE, FALSE) == FALSE) {
+            DiskPerfQueueUnlock(deviceExtension, FALSE);
+        }
+        break;
+
+    case SedGateResultFail:
+        status = (SED_GATE_LOAD(&deviceExtension->Gate.State) == SED_GATE_REMOVED) ?
+            STATUS_DELETE_PENDING : deviceExtension->GateStatus;
+        Irp->IoStatus.Status = status;
+        Irp->IoStatus.Information = 0;
+        IoCompleteRequest(Irp, IO_NO_INCREMENT);
+        IoReleaseRemoveLock(&deviceExtension->RemoveLock, Irp);
+        break;
+
+    default:
+        DiskPerfSendReadWrite(deviceExtension, Irp);
+        break;
+    }
+
+    if (held) {
+        IoReleaseRemoveLock(&deviceExtension->RemoveLock, &first);
+    }
+
+    return STATUS_PENDING;
+
+} // end DiskPerfReadWrite()
+
+
+NTSTATUS
+DiskPerfSendReadWrite(
+    IN PDEVICE_EXTENSION DeviceExtension,
+    IN PIRP Irp
+)
+
+/*++
+
+Routine Description:
+
+    Send a read/write that has passed the gate down to the disk, with our
+    completion routine if anything is being recorded for it. The next
+    stack location has already been set up by DiskPerfReadWrite.
+
+Arguments:
+
+    DeviceExtension - Our device.
+    Irp             - The read/write, holding the remove lock.
+
+Return Value:
+
+    NTSTATUS from the lower driver.
+
+--*/
+
+{
+    PIO_STACK_LOCATION currentIrpStack = IoGetCurrentIrpStackLocation(Irp);
+    ULONG              flags;
+    NTSTATUS           status;
+
+    flags = (ULONG)(ULONG_PTR)currentIrpStack->Parameters.Others.Argument3;
+
+    if (flags != 0) {
+        if (flags & DISKPERF_IRP_COUNTED) {
+            KIRQL oldIrql;
+
+            KeRaiseIrql(DISPATCH_LEVEL, &oldIrql);
+            DiskPerfCurrentShard(DeviceExtension)->Issued++;
+            KeLowerIrql(oldIrql);
+        }
+
+        //
+        // The completion routine releases the remove lock
+        //
+
+        IoSetCompletionRoutine(Irp, DiskPerfIoCompletion, DeviceExtension->DeviceObject,
+            TRUE, TRUE, TRUE);
+
+        return IoCallDriver(DeviceExtension->TargetDeviceObject, Irp);
+    }
+
+    //
+    //
+    // Return the results of the call to the disk driver.
+    //
+
+    status = IoCallDriver(DeviceExtension->TargetDeviceObject,
+        Irp);
+    IoReleaseRemoveLock(&DeviceExtension->RemoveLock, Irp);
+    return status;
+
+} // end DiskPerfSendReadWrite()
+
+
+NTSTATUS
+DiskPerfIoCompletion(
+    IN PDEVICE_OBJECT DeviceObject,
+    IN PIRP Irp,
+    IN PVOID Context
+)
+
+/*++
+
+Routine Description:
+
+    This routine will get control from the system at the completion of an IRP.
+    It will calculate the difference between the time the IRP was started
+    and the current time, and add it to the current processor's shard of
+    the counters and/or latency histograms, depending on what was asked
+    for when the IRP was sent down.
+
+Arguments:
+
+    DeviceObject - for the IRP.
+    Irp          - The I/O request that just completed.
+    Context      - Not used.
+
+Return Value:
+
+    The IRP status.
+
+--*/
+
+{
+    PDEVICE_EXTENSION       deviceExtension = DeviceObject->DeviceExtension;
+    PIO_STACK_LOCATION      irpStack = IoGetCurrentIrpStackLocation(Irp);
+    PDISKPERF_COUNTER_SHARD shard;
+    PDISKPERF_LATENCY_SHARD latency;
+    LARGE_INTEGER           timeStamp;
+    LARGE_INTEGER           startTime;
+    LARGE_INTEGER           difference;
+    ULONG                   flags;
+    KIRQL                   oldIrql;
+
+    UNREFERENCED_PARAMETER(Context);
+
+    timeStamp = KeQueryPerformanceCounter(NULL);
+    startTime = *(PLARGE_INTEGER)&irpStack->Parameters.Read;
+    difference.QuadPart = timeStamp.QuadPart - startTime.QuadPart;
+    flags = (ULONG)(ULONG_PTR)irpStack->Parameters.Others.Argument3;
+
+    KeRaiseIrql(DISPATCH_LEVEL, &oldIrql);
+
+    if (flags & DISKPERF_IRP_COUNTED) {
+        shard = DiskPerfCurrentShard(deviceExtension);
+
+        if (irpStack->MajorFunction == IRP_MJ_READ) {
+            shard->BytesRead += Irp->IoStatus.Information;
+            shard->ReadCount++;
+            shard->ReadTime += difference.QuadPart;
+        }
+        else {
+            shard->BytesWritten += Irp->IoStatus.Information;
+            shard->WriteCount++;
+            shard->WriteTime += difference.QuadPart;
+        }
+
+        if (Irp->Flags & IRP_ASSOCIATED_IRP) {
+            shard->SplitCount++;
+        }
+
+        shard->Completed++;
+    }
+
+    if (flags & DISKPERF_IRP_TIMED) {
+        ULONG64 microseconds;
+        ULONG   latencyClass = SedSleepLatencySteady;
+
+        microseconds = (ULONG64)(difference.QuadPart * 1000000) /
+            (ULONG64)DiskPerfFrequency.QuadPart;
+
+        if ((flags & DISKPERF_IRP_RESUME) ||
+            (ULONG64)startTime.QuadPart - (ULONG64)deviceExtension->ResumeTime <
+            (ULONG64)deviceExtension->ResumeWindowTicks) {
+            latencyClass = SedSleepLatencyResume;
+        }
+
+        latency = &deviceExtension->LatencyShards[KeGetCurrentProcessorNumberEx(NULL)];
+        latency->Buckets[latencyClass][DiskPerfLatencyBucket(microseconds)]++;
+        latency->TotalMicroseconds[latencyClass] += microseconds;
+        if (microseconds > latency->MaxMicroseconds[latencyClass]) {
+            latency->MaxMicroseconds[latencyClass] = microseconds;
+        }
+    }
+
+    KeLowerIrql(oldIrql);
+
+    if (Irp->PendingReturned) {
+        IoMarkIrpPending(Irp);
+    }
+
+    IoReleaseRemoveLock(&deviceExtension->RemoveLock, Irp);
+
+    return STATUS_CONTINUE_COMPLETION;
+
+} // DiskPerfIoCompletion
+
+
+NTSTATUS
+DiskPerfDeviceControl(
+    PDEVICE_OBJECT DeviceObject,
+    PIRP Irp
+)
+
+/*++
+
+Routine Description:
+
+    This device control dispatcher handles only the disk performance
+    device control. All others are passed down to the disk drivers.
+    The disk performane device control returns a current snapshot of
+    the performance data.
+
+Arguments:
+
+    DeviceObject - Context for the activity.
+    Irp          - The device control argument block.
+
+Return Value:
+
+    Status is returned.
+
+--*/
+
+{
+    PDEVICE_EXTENSION  deviceExtension = DeviceObject->DeviceExtension;
+    PIO_STACK_LOCATION currentIrpStack = IoGetCurrentIrpStackLocation(Irp);
+    NTSTATUS    status;
+
+
+    //
+    // Acquire the remove lock so that device will not be removed while
+    // processing this irp.
+    //
+    status = IoAcquireRemoveLock(&deviceExtension->RemoveLock, Irp);
+
+    DebugPrint((3, "DiskPerfDeviceControl: DeviceObject 0x%p Irp 0x%p Code %x\n",
+        DeviceObject, Irp, currentIrpStack->Parameters.DeviceIoControl.IoControlCode));
+
+    if (!NT_SUCCESS(status))
+    {
+        DebugPrint((3, "DiskPerfControl: Remove lock failed IOCTL Irp type [%x]\n",
+            currentIrpStack->Parameters.DeviceIoControl.IoControlCode));
+        Irp->IoStatus.Status = status;
+        IoCompleteRequest(Irp, IO_NO_INCREMENT);
+        return status;
+    }
+
+
+    if (currentIrpStack->Parameters.DeviceIoControl.IoControlCode ==
+        IOCTL_HURR_DURR_IM_A_GOAT) {
+
+        PDISKPERF_UNLOCK unlock = deviceExtension->Unlock;
+        KIRQL            oldIrql;
+
+        if (unlock == NULL) {
+            DebugPrint((1, "DiskPerfDeviceControl: %s is never unlocked\n", deviceExtension->SerialNumber));
+            status = STATUS_INVALID_DEVICE_STATE;
+            Irp->IoStatus.Status = status;
+            IoReleaseRemoveLock(&deviceExtension->RemoveLock, Irp);
+            IoCompleteRequest(Irp, IO_NO_INCREMENT);
+            return status;
+        }
+
+        //
+        // Park the request with the unlock context; the worker completes
+        // it, still holding the remove lock, once the unlock is done
+        //
+
+        KeAcquireSpinLock(&unlock->RequestLock, &oldIrql);
+
+        IoSetCancelRoutine(Irp, DiskPerfCancelUnlockRequest);
+        if (Irp->Cancel && IoSetCancelRoutine(Irp, NULL) != NULL) {
+            KeReleaseSpinLock(&unlock->RequestLock, oldIrql);
+
+            status = STATUS_CANCELLED;
+            Irp->IoStatus.Status = status;
+            IoReleaseRemoveLock(&deviceExtension->RemoveLock, Irp);
+            IoCompleteRequest(Irp, IO_NO_INCREMENT);
+            return status;
+        }
+
+        IoMarkIrpPending(Irp);
+        InsertTailList(&unlock->Requests, &Irp->Tail.Overlay.ListEntry);
+
+        KeReleaseSpinLock(&unlock->RequestLock, oldIrql);
+
+        DiskPerfQueueUnlock(deviceExtension, TRUE);
+        return STATUS_PENDING;
+    }
+
+    else if (currentIrpStack->Parameters.DeviceIoControl.IoControlCode ==
+        IOCTL_SEDSLEEP_CANCEL_UNLOCK) {
+
+        if (deviceExtension->Unlock == NULL) {
+            status = STATUS_INVALID_DEVICE_STATE;
+        }
+        else {
+            DiskPerfCancelUnlock(deviceExtension, STATUS_CANCELLED);
+            status = STATUS_SUCCESS;
+        }
+
+        Irp->IoStatus.Status = status;
+        Irp->IoStatus.Information = 0;
+        IoReleaseRemoveLock(&deviceExtension->RemoveLock, Irp);
+        IoCompleteRequest(Irp, IO_NO_INCREMENT);
+        return status;
+    }
+
+    else if (currentIrpStack->Parameters.DeviceIoControl.IoControlCode ==
+        IOCTL_SEDSLEEP_QUERY_UNLOCK) {
+
+        if (currentIrpStack->Parameters.DeviceIoControl.OutputBufferLength <
+            sizeof(SEDSLEEP_UNLOCK_RESULT)) {
+
+            status = STATUS_BUFFER_TOO_SMALL;
+            Irp->IoStatus.Information = 0;
+        }
+        else if (deviceExtension->Unlock == NULL) {
+            status = STATUS_INVALID_DEVICE_STATE;
+            Irp->IoStatus.Information = 0;
+        }
+        else {
+            DiskPerfQueryUnlock(deviceExtension,
+                (PSEDSLEEP_UNLOCK_RESULT)Irp->AssociatedIrp.SystemBuffer);
+            status = STATUS_SUCCESS;
+            Irp->IoStatus.Information = sizeof(SEDSLEEP_UNLOCK_RESULT);
+        }
+
+        Irp->IoStatus.Status = status;
+        IoReleaseRemoveLock(&deviceExtension->RemoveLock, Irp);
+        IoCompleteRequest(Irp, IO_NO_INCREMENT);
+        return status;
+    }
+
+    else if (currentIrpStack->Parameters.DeviceIoControl.IoControlCode ==
+        IOCTL_DISK_PERFORMANCE) {
+
+        //
+        // Check that user buffer is sufficient for the performance data.
+        //
+
+        if (currentIrpStack->Parameters.DeviceIoControl.OutputBufferLength <
+            sizeof(DISK_PERFORMANCE)) {
+
+            status = STATUS_BUFFER_TOO_SMALL;
+            Irp->IoStatus.Information = 0;
+        }
+        else if (deviceExtension->DiskCounters == NULL) {
+
+            status = STATUS_UNSUCCESSFUL;
+            Irp->IoStatus.Information = 0;
+        }
+        else {
+
+            //
+            // The first query turns the counters on
+            //
+
+            if (deviceExtension->CountersEnabled <= 0) {
+                InterlockedCompareExchange(&deviceExtension->CountersEnabled, 1, 0);
+            }
+
+            DiskPerfQueryCounters(deviceExtension,
+                (PDISK_PERFORMANCE)Irp->AssociatedIrp.SystemBuffer);
+            Irp->IoStatus.Information = sizeof(DISK_PERFORMANCE);
+        }
+
+        Irp->IoStatus.Status = status;
+        IoReleaseRemoveLock(&deviceExtension->RemoveLock, Irp);
+        IoCompleteRequest(Irp, IO_NO_INCREMENT);
+        return status;
+
+    }
+
+    else if (currentIrpStack->Parameters.DeviceIoControl.IoControlCode ==
+        IOCTL_SEDSLEEP_QUERY_LATENCY) {
+
+        if (currentIrpStack->Parameters.DeviceIoControl.OutputBufferLength <
+            sizeof(SEDSLEEP_LATENCY_HISTOGRAMS)) {
+
+            status = STATUS_BUFFER_TOO_SMALL;
+            Irp->IoStatus.Information = 0;
+        }
+        else {
+
+            DiskPerfQueryLatency(deviceExtension,
+                (PSEDSLEEP_LATENCY_HISTOGRAMS)Irp->AssociatedIrp.SystemBuffer);
+            Irp->IoStatus.Information = sizeof(SEDSLEEP_LATENCY_HISTOGRAMS);
+        }
+
+        Irp->IoStatus.Status = status;
+        IoReleaseRemoveLock(&deviceExtension->RemoveLock, Irp);
+        IoCompleteRequest(Irp, IO_NO_INCREMENT);
+        return status;
+
+    }
+
+    else if (currentIrpStack->Parameters.DeviceIoControl.IoControlCode ==
+        IOCTL_SEDSLEEP_QUERY_TRACE) {
+
+        ULONG firstSequence = 0;
+        ULONG written = 0;
+
+        if (currentIrpStack->Parameters.DeviceIoControl.InputBufferLength >=
+            sizeof(SEDSLEEP_TRACE_QUERY)) {
+            firstSequence = ((PSEDSLEEP_TRACE_QUERY)Irp->AssociatedIrp.SystemBuffer)->FirstSequence;
+        }
+
+        status = DiskPerfQueryTrace(deviceExtension,
+            firstSequence,
+            (PUCHAR)Irp->AssociatedIrp.SystemBuffer,
+            currentIrpStack->Parameters.DeviceIoControl.OutputBufferLength,
+            &written);
+
+        Irp->IoStatus.Status = status;
+        Irp->IoStatus.Information = written;
+        IoReleaseRemoveLock(&deviceExtension->RemoveLock, Irp);
+        IoCompleteRequest(Irp, IO_NO_INCREMENT);
+        return status;
+
+    }
+
+    else if (currentIrpStack->Parameters.DeviceIoControl.IoControlCode ==
+        IOCTL_SEDSLEEP_SET_LATENCY) {
+
+        if (currentIrpStack->Parameters.DeviceIoControl.InputBufferLength <
+            sizeof(SEDSLEEP_LATENCY_CONTROL)) {
+
+            status = STATUS_INVALID_PARAMETER;
+        }
+        else {
+
+            status = DiskPerfSetLatency(deviceExtension,
+                (PSEDSLEEP_LATENCY_CONTROL)Irp->AssociatedIrp.SystemBuffer);
+        }
+
+        Irp->IoStatus.Status = status;
+        Irp->IoStatus.Information = 0;
+        IoReleaseRemoveLock(&deviceExtension->RemoveLock, Irp);
+        IoCompleteRequest(Irp, IO_NO_INCREMENT);
+        return status;
+
+    }
+
+    else if (currentIrpStack->Parameters.DeviceIoControl.IoControlCode ==
+        IOCTL_SEDSLEEP_SET_CAPTURE) {
+
+        if (currentIrpStack->Parameters.DeviceIoControl.InputBufferLength <
+            sizeof(SEDSLEEP_CAPTURE_CONTROL)) {
+
+            status = STATUS_INVALID_PARAMETER;
+        }
+        else {
+
+            status = DiskPerfSetCapture(deviceExtension,
+                (PSEDSLEEP_CAPTURE_CONTROL)Irp->AssociatedIrp.SystemBuffer);
+        }
+
+        Irp->IoStatus.Status = status;
+        Irp->IoStatus.Information = 0;
+        IoReleaseRemoveLock(&deviceExtension->RemoveLock, Irp);
+        IoCompleteRequest(Irp, IO_NO_INCREMENT);
+        return status;
+
+    }
+
+    else if (currentIrpStack->Parameters.DeviceIoControl.IoControlCode ==
+        IOCTL_SEDSLEEP_QUERY_CAPTURE) {
+
+        ULONG written = 0;
+
+        status = DiskPerfQueryCapture(deviceExtension,
+            (PUCHAR)Irp->AssociatedIrp.SystemBuffer,
+            currentIrpStack->Parameters.DeviceIoControl.OutputBufferLength,
+            &written);
+
+        Irp->IoStatus.Status = status;
+        Irp->IoStatus.Information = written;
+        IoReleaseRemoveLock(&deviceExtension->RemoveLock, Irp);
+        IoCompleteRequest(Irp, IO_NO_INCREMENT);
+        return status;
+
+    }
+
+    else if (currentIrpStack->Parameters.DeviceIoControl.IoControlCode ==
+        IOCTL_SEDSLEEP_SET_UNLOCK) {
+
+        if (currentIrpStack->Parameters.DeviceIoControl.InputBufferLength <
+            sizeof(SEDSLEEP_UNLOCK_CONTROL)) {
+
+            status = STATUS_INVALID_PARAMETER;
+        }
+        else {
+
+            status = DiskPerfSetUnlock(deviceExtension,
+                (PSEDSLEEP_UNLOCK_CONTROL)Irp->AssociatedIrp.SystemBuffer);
+        }
+
+        Irp->IoStatus.Status = status;
+        Irp->IoStatus.Information = 0;
+        IoReleaseRemoveLock(&deviceExtension->RemoveLock, Irp);
+        IoCompleteRequest(Irp, IO_NO_INCREMENT);
+        return status;
+
+    }
+
+    else if (currentIrpStack->Parameters.DeviceIoControl.IoControlCode ==
+        IOCTL_SEDSLEEP_PROVISION) {
+
+        SEDSLEEP_PROVISION provision;
+        ULONG              inputLength =
+            currentIrpStack->Parameters.DeviceIoControl.InputBufferLength;
+
+        if (inputLength < SEDSLEEP_PROVISION_V1_SIZE) {
+
+            status = STATUS_INVALID_PARAMETER;
+        }
+        else {
+
+            //
+            // Work on a copy, version 1 requests are shorter
+            //
+
+            inputLength = min(inputLength, sizeof(provision));
+            RtlZeroMemory(&provision, sizeof(provision));
+            RtlCopyMemory(&provision, Irp->AssociatedIrp.SystemBuffer, inputLength);
+
+            status = DiskPerfProvision(deviceExtension, &provision);
+
+            //
+            // Don't leave the credential (or password) lying around in the
+            // system buffer or on the stack
+            //
+
+            RtlSecureZeroMemory(&provision, sizeof(provision));
+            RtlSecureZeroMemory(Irp->AssociatedIrp.SystemBuffer, inputLength);
+        }
+
+        Irp->IoStatus.Status = status;
+        Irp->IoStatus.Information = 0;
+        IoReleaseRemoveLock(&deviceExtension->RemoveLock, Irp);
+        IoCompleteRequest(Irp, IO_NO_INCREMENT);
+        return status;
+
+    }
+
+    else if (currentIrpStack->Parameters.DeviceIoControl.IoControlCode ==
+        IOCTL_DISK_PERFORMANCE_OFF) {
+
+        //
+        // Turn counting back off, unless it is on for good
+        //
+
+        if (deviceExtension->EnabledAlways == 0) {
+            InterlockedCompareExchange(&deviceExtension->CountersEnabled, 0, 1);
+        }
+
+        Irp->IoStatus.Status = status;
+        Irp->IoStatus.Information = 0;
+        IoReleaseRemoveLock(&deviceExtension->RemoveLock, Irp);
+        IoCompleteRequest(Irp, IO_NO_INCREMENT);
+        return status;
+
+    }
+
+    else {
+
+        //
+        // Set current stack back one.
+        // We aren't doing anything with this IRP
+        // so mark it pending
+        //
+
+        IoMarkIrpPending(Irp);
+        IoSkipCurrentIrpStackLocation(Irp);
+
+        //
+        // Pass unrecognized device control requests
+        // down to next driver layer. We ignore the 
+        // return status since we need to return 
+        // STATUS_PENDING due to the mark pending
+        // call above.
+        //
+
+        IoCallDriver(deviceExtension->TargetDeviceObject, Irp);
+
+        //
+        // Release the remove lock
+        //
+        IoReleaseRemoveLock(&deviceExtension->RemoveLock, Irp);
+
+        return (STATUS_PENDING);
+
+    }
+} // end DiskPerfDeviceControl()
+
+
+VOID
+DiskPerfQueryCounters(
+    IN PDEVICE_EXTENSION DeviceExtension,
+    OUT PDISK_PERFORMANCE TotalCounters
+)
+
+/*++
+
+Routine Description:
+
+    Merge the per processor counter shards into a single DISK_PERFORMANCE.
+    The shards are read without any synchronisation, so a query that races
+    with IO completion may be off by the IRPs completing at that moment.
+
+Arguments:
+
+    DeviceExtension - The device whose counters are wanted.
+    TotalCounters   - Receives the merged counters.
+
+Return Value:
+
+    None
+
+--*/
+
+{
+    ULONG64 readTime = 0;
+    ULONG64 writeTime = 0;
+    ULONG   issued = 0;
+    ULONG   completed = 0;
+    ULONG   i;
+
+    RtlZeroMemory(TotalCounters, sizeof(DISK_PERFORMANCE));
+
+    for (i = 0; i < DeviceExtension->Processors; i++) {
+        PDISKPERF_COUNTER_SHARD shard = &DeviceExtension->DiskCounters[i];
+
+        TotalCounters->BytesRead.QuadPart += shard->BytesRead;
+        TotalCounters->BytesWritten.QuadPart += shard->BytesWritten;
+        TotalCounters->ReadCount += shard->ReadCount;
+        TotalCounters->WriteCount += shard->WriteCount;
+        TotalCounters->SplitCount += shard->SplitCount;
+        readTime += shard->ReadTime;
+        writeTime += shard->WriteTime;
+        issued += shard->Issued;
+        completed += shard->Completed;
+    }
+
+    TotalCounters->ReadTime.QuadPart = DiskPerfTicksTo100ns(readTime);
+    TotalCounters->WriteTime.QuadPart = DiskPerfTicksTo100ns(writeTime);
+    TotalCounters->QueueDepth = issued - completed;
+    TotalCounters->QueryTime.QuadPart =
+        DiskPerfTicksTo100ns(KeQueryPerformanceCounter(NULL).QuadPart);
+    TotalCounters->StorageDeviceNumber = DeviceExtension->DiskNumber;
+    RtlCopyMemory(
+        &TotalCounters->StorageManagerName[0],
+        &DeviceExtension->StorageManagerName[0],
+        8 * sizeof(WCHAR));
+}
+
+
+NTSTATUS
+DiskPerfSetLatency(
+    IN PDEVICE_EXTENSION DeviceExtension,
+    IN PSEDSLEEP_LATENCY_CONTROL Control
+)
+
+/*++
+
+Routine Description:
+
+    Turn latency collection on or off and/or reset the histograms. The
+    histograms are allocated the first time collection is turned on and
+    then kept until the device goes away, so the IO path never has to
+    worry about them disappearing underneath it.
+
+    Resetting races with IO completing on other processors, so a handful of
+    IRPs completing at that moment may be lost or survive the reset.
+
+Arguments:
+
+    DeviceExtension - The device to control.
+    Control         - What to do.
+
+Return Value:
+
+    NTSTATUS
+
+--*/
+
+{
+    SIZE_T size = DeviceExtension->Processors * sizeof(DISKPERF_LATENCY_SHARD);
+
+    if (Control->ResumeWindowMs != 0) {
+        DeviceExtension->ResumeWindowMs = Control->ResumeWindowMs;
+        DeviceExtension->ResumeWindowTicks =
+            (DiskPerfFrequency.QuadPart * Control->ResumeWindowMs) / 1000;
+    }
+
+    if (!(Control->Flags & SEDSLEEP_LATENCY_ENABLE)) {
+        InterlockedExchange(&DeviceExtension->LatencyEnabled, 0);
+    }
+
+    if (DeviceExtension->LatencyShards == NULL &&
+        (Control->Flags & SEDSLEEP_LATENCY_ENABLE)) {
+
+        PDISKPERF_LATENCY_SHARD shards;
+
+        if (size == 0) {
+            return STATUS_UNSUCCESSFUL;
+        }
+
+        shards = ExAllocatePool(NonPagedPoolNxCacheAligned, size);
+        if (shards == NULL) {
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        RtlZeroMemory(shards, size);
+
+        if (InterlockedCompareExchangePointer(
+                (PVOID volatile*)&DeviceExtension->LatencyShards,
+                shards, NULL) != NULL) {
+
+            //
+            // Somebody else got there first
+            //
+
+            ExFreePool(shards);
+        }
+    }
+
+    if ((Control->Flags & SEDSLEEP_LATENCY_RESET) &&
+        DeviceExtension->LatencyShards != NULL) {
+        RtlZeroMemory(DeviceExtension->LatencyShards, size);
+    }
+
+    if (Control->Flags & SEDSLEEP_LATENCY_ENABLE) {
+        InterlockedExchange(&DeviceExtension->LatencyEnabled, 1);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+
+VOID
+DiskPerfQueryLatency(
+    IN PDEVICE_EXTENSION DeviceExtension,
+    OUT PSEDSLEEP_LATENCY_HISTOGRAMS Histograms
+)
+
+/*++
+
+Routine Description:
+
+    Merge the per processor latency histograms.
+
+Arguments:
+
+    DeviceExtension - The device whose histograms are wanted.
+    Histograms      - Receives the merged histograms.
+
+Return Value:
+
+    None
+
+--*/
+
+{
+    PDISKPERF_LATENCY_SHARD shards = DeviceExtension->LatencyShards;
+    ULONG i;
+    ULONG c;
+    ULONG b;
+
+    RtlZeroMemory(Histograms, sizeof(SEDSLEEP_LATENCY_HISTOGRAMS));
+
+    Histograms->Version = SEDSLEEP_LATENCY_VERSION;
+    Histograms->ResumeWindowMs = DeviceExtension->ResumeWindowMs;
+    Histograms->DiskNumber = DeviceExtension->DiskNumber;
+    if (DeviceExtension->LatencyEnabled > 0) {
+        Histograms->Flags |= SEDSLEEP_LATENCY_ENABLE;
+    }
+
+    if (shards == NULL) {
+        return;
+    }
+
+    for (i = 0; i < DeviceExtension->Processors; i++) {
+        for (c = 0; c < SedSleepLatencyClassCount; c++) {
+            PSEDSLEEP_LATENCY_HISTOGRAM histogram = &Histograms->Class[c];
+
+            for (b = 0; b < SEDSLEEP_LATENCY_BUCKETS; b++) {
+                histogram->Buckets[b] += shards[i].Buckets[c][b];
+                histogram->Count += shards[i].Buckets[c][b];
+            }
+
+            histogram->TotalMicroseconds += shards[i].TotalMicroseconds[c];
+            histogram->MaxMicroseconds = max(histogram->MaxMicroseconds,
+                shards[i].MaxMicroseconds[c]);
+        }
+    }
+}
+
+
+PVOID
+DiskPerfTraceAppend(
+    IN PUCHAR Buffer,
+    IN ULONG Length,
+    IN OUT PULONG Offset,
+    IN SEDTRACE_RECORD_TYPE Type,
+    IN ULONG RecordLength
+)
+
+/*++
+
+Routine Description:
+
+    Reserve a zeroed trace record at the end of a trace chunk.
+
+Arguments:
+
+    Buffer       - The chunk being built.
+    Length       - Size of Buffer.
+    Offset       - Where the next record goes, updated on success.
+    Type         - Record type.
+    RecordLength - Record size including the SEDTRACE_RECORD header.
+
+Return Value:
+
+    The record, or NULL if it does not fit.
+
+--*/
+
+{
+    PSEDTRACE_RECORD record;
+
+    RecordLength = SEDTRACE_ALIGN(RecordLength);
+    if (Length < *Offset || Length - *Offset < RecordLength) {
+        return NULL;
+    }
+
+    record = (PSEDTRACE_RECORD)(Buffer + *Offset);
+    RtlZeroMemory(record, RecordLength);
+    record->Type = (uint16_t)Type;
+    record->Length = RecordLength;
+    *Offset += RecordLength;
+
+    return record;
+}
+
+
+PSEDTRACE_DEVICE
+DiskPerfTraceDevice(
+    IN PDEVICE_EXTENSION DeviceExtension,
+    IN PUCHAR Buffer,
+    IN ULONG Length,
+    IN OUT PULONG Offset
+)
+
+/*++
+
+Routine Description:
+
+    Append the DEVICE record that starts every trace chunk.
+
+Arguments:
+
+    DeviceExtension - The device the chunk describes.
+    Buffer          - The chunk being built.
+    Length          - Size of Buffer.
+    Offset          - Where the record goes, updated on success.
+
+Return Value:
+
+    The record, or NULL if it does not fit.
+
+--*/
+
+{
+    PSEDTRACE_DEVICE device;
+    LARGE_INTEGER    systemTime;
+
+    device = DiskPerfTraceAppend(Buffer, Length, Offset,
+        SedTraceRecordDevice, sizeof(SEDTRACE_DEVICE));
+    if (device == NULL) {
+        return NULL;
+    }
+
+    KeQuerySystemTime(&systemTime);
+    device->CaptureTime = systemTime.QuadPart;
+    device->TimestampFrequency = DiskPerfFrequency.QuadPart;
+    device->DiskNumber = DeviceExtension->DiskNumber;
+    RtlStringCbCopyA(device->DriverBuild, sizeof(device->DriverBuild), SEDSLEEP_BUILD_ID);
+    RtlCopyMemory(device->SerialNumber, DeviceExtension->SerialNumber, sizeof(device->SerialNumber));
+    RtlCopyMemory(device->Model, DeviceExtension->ProductId, sizeof(device->Model));
+
+    return device;
+}
+
+
+NTSTATUS
+DiskPerfQueryTrace(
+    IN PDEVICE_EXTENSION DeviceExtension,
+    IN ULONG FirstSequence,
+    OUT PUCHAR Buffer,
+    IN ULONG Length,
+    OUT PULONG Written
+)
+
+/*++
+
+Routine Description:
+
+    Build a trace chunk (see sedtrace.h) describing this device: who it is,
+    its counters, latency histograms and the timing events still in the
+    ring buffer. The chunk is built straight into the caller's buffer.
+
+Arguments:
+
+    DeviceExtension - The device to describe.
+    FirstSequence   - Oldest event sequence number wanted.
+    Buffer          - Receives the chunk.
+    Length          - Size of Buffer.
+    Written         - Receives the size of the chunk.
+
+Return Value:
+
+    STATUS_BUFFER_TOO_SMALL if the chunk did not fit.
+
+--*/
+
+{
+    PSEDTRACE_COUNTERS counters;
+    PSEDTRACE_EVENTS   events;
+    PSEDTRACE_EVENT    event;
+    DISK_PERFORMANCE   performance;
+    ULONG              offset = 0;
+    ULONG              count;
+    ULONG              i;
+    ULONG              j;
+
+    *Written = 0;
+
+    if (DiskPerfTraceDevice(DeviceExtension, Buffer, Length, &offset) == NULL) {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    if (DeviceExtension->DiskCounters != NULL) {
+        counters = DiskPerfTraceAppend(Buffer, Length, &offset,
+            SedTraceRecordCounters, sizeof(SEDTRACE_COUNTERS));
+        if (counters == NULL) {
+            return STATUS_BUFFER_TOO_SMALL;
+        }
+
+        DiskPerfQueryCounters(DeviceExtension, &performance);
+        counters->BytesRead = performance.BytesRead.QuadPart;
+        counters->BytesWritten = performance.BytesWritten.QuadPart;
+        counters->ReadTime = performance.ReadTime.QuadPart;
+        counters->WriteTime = performance.WriteTime.QuadPart;
+        counters->ReadCount = performance.ReadCount;
+        counters->WriteCount = performance.WriteCount;
+        counters->QueueDepth = performance.QueueDepth;
+        counters->SplitCount = performance.SplitCount;
+    }
+
+    if (DeviceExtension->LatencyShards != NULL) {
+        PDISKPERF_LATENCY_SHARD shards = DeviceExtension->LatencyShards;
+        ULONG c;
+        ULONG b;
+
+        for (c = 0; c < SedSleepLatencyClassCount; c++) {
+            PSEDTRACE_LATENCY latency;
+            PSEDTRACE_BUCKET  bucket;
+
+            //
+            // Reserve room for every bucket, then give back what was not used
+            //
+
+            latency = DiskPerfTraceAppend(Buffer, Length, &offset,
+                SedTraceRecordLatency,
+                sizeof(SEDTRACE_LATENCY) + SEDSLEEP_LATENCY_BUCKETS * sizeof(SEDTRACE_BUCKET));
+            if (latency == NULL) {
+                return STATUS_BUFFER_TOO_SMALL;
+            }
+
+            latency->LatencyClass = c;
+            latency->ResumeWindowMs = DeviceExtension->ResumeWindowMs;
+            bucket = (PSEDTRACE_BUCKET)(latency + 1);
+
+            for (b = 0; b < SEDSLEEP_LATENCY_BUCKETS; b++) {
+                ULONG64 total = 0;
+
+                for (i = 0; i < DeviceExtension->Processors; i++) {
+                    total += shards[i].Buckets[c][b];
+                }
+
+                if (total != 0) {
+                    bucket->Bucket = b;
+                    bucket->Count = (ULONG)min(total, MAXULONG);
+                    bucket++;
+                    latency->BucketCount++;
+                    latency->Count += total;
+                }
+            }
+
+            for (i = 0; i < DeviceExtension->Processors; i++) {
+                latency->TotalMicroseconds += shards[i].TotalMicroseconds[c];
+                latency->MaxMicroseconds = max(latency->MaxMicroseconds,
+                    shards[i].MaxMicroseconds[c]);
+            }
+
+            offset -= latency->Header.Length;
+            latency->Header.Length = SEDTRACE_ALIGN(sizeof(SEDTRACE_LATENCY) +
+                latency->BucketCount * sizeof(SEDTRACE_BUCKET));
+            offset += latency->Header.Length;
+        }
+    }
+
+    events = DiskPerfTraceAppend(Buffer, Length, &offset,
+        SedTraceRecordEvents,
+        sizeof(SEDTRACE_EVENTS) + DISKPERF_TRACE_EVENTS * sizeof(SEDTRACE_EVENT));
+    if (events == NULL) {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    //
+    // Copy out every complete event that is new enough, dropping any that
+    // changed underneath us, then put them in sequence order
+    //
+
+    event = (PSEDTRACE_EVENT)(events + 1);
+    count = 0;
+
+    for (i = 0; DeviceExtension->Trace != NULL && i < DISKPERF_TRACE_EVENTS; i++) {
+        PSEDTRACE_EVENT slot = &DeviceExtension->Trace->Ring.Events[i];
+        ULONG sequence = ReadULongAcquire((PULONG)&slot->Sequence);
+
+        if (sequence == 0 || sequence < FirstSequence) {
+            continue;
+        }
+
+        event[count] = *slot;
+        KeMemoryBarrier();
+        if (ReadULongAcquire((PULONG)&slot->Sequence) != sequence) {
+            continue;
+        }
+
+        event[count].Sequence = sequence;
+        count++;
+    }
+
+    for (i = 1; i < count; i++) {
+        SEDTRACE_EVENT key = event[i];
+
+        for (j = i; j > 0 && event[j - 1].Sequence > key.Sequence; j--) {
+            event[j] = event[j - 1];
+        }
+        event[j] = key;
+    }
+
+    events->EventCount = count;
+    offset -= events->Header.Length;
+    events->Header.Length = SEDTRACE_ALIGN(sizeof(SEDTRACE_EVENTS) +
+        count * sizeof(SEDTRACE_EVENT));
+    offset += events->Header.Length;
+
+    *Written = offset;
+    return STATUS_SUCCESS;
+}
+
+
+NTSTATUS
+DiskPerfSetCapture(
+    IN PDEVICE_EXTENSION DeviceExtension,
+    IN PSEDSLEEP_CAPTURE_CONTROL Control
+)
+
+/*++
+
+Routine Description:
+
+    Start or stop capturing pass-through commands. Starting when capture is
+    already running leaves the existing buffer and its contents alone.
+
+Arguments:
+
+    DeviceExtension - The device to capture.
+    Control         - What the caller wants.
+
+Return Value:
+
+    STATUS_INVALID_PARAMETER for a silly buffer size,
+    STATUS_INSUFFICIENT_RESOURCES if the buffer cannot be allocated.
+
+--*/
+
+{
+    PDISKPERF_TRACE trace = DeviceExtension->Trace;
+    PUCHAR          buffer;
+    ULONG           size;
+    KIRQL           oldIrql;
+
+    if (trace == NULL) {
+        return (Control->Flags & SEDSLEEP_CAPTURE_ENABLE) ?
+            STATUS_INSUFFICIENT_RESOURCES : STATUS_SUCCESS;
+    }
+
+    if (!(Control->Flags & SEDSLEEP_CAPTURE_ENABLE)) {
+
+        KeAcquireSpinLock(&trace->CaptureLock, &oldIrql);
+        buffer = trace->CaptureBuffer;
+        trace->CaptureBuffer = NULL;
+        trace->CaptureSize = 0;
+        trace->CaptureUsed = 0;
+        KeReleaseSpinLock(&trace->CaptureLock, oldIrql);
+
+        if (buffer != NULL) {
+            ExFreePool(buffer);
+        }
+
+        return STATUS_SUCCESS;
+    }
+
+    size = (Control->BufferSize != 0) ? Control->BufferSize : SEDSLEEP_CAPTURE_DEFAULT_SIZE;
+    if (size < sizeof(SEDTRACE_COMMAND) + SEDSLEEP_SCSI_BUFFER_SIZE ||
+        size > SEDSLEEP_CAPTURE_MAX_SIZE) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if (trace->CaptureBuffer != NULL) {
+        return STATUS_SUCCESS;
+    }
+
+    buffer = ExAllocatePool(NonPagedPoolNx, size);
+    if (buffer == NULL) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    KeAcquireSpinLock(&trace->CaptureLock, &oldIrql);
+    if (trace->CaptureBuffer == NULL) {
+        trace->CaptureBuffer = buffer;
+        trace->CaptureSize = size;
+        trace->CaptureUsed = 0;
+        trace->CaptureDropped = 0;
+        buffer = NULL;
+    }
+    KeReleaseSpinLock(&trace->CaptureLock, oldIrql);
+
+    //
+    // Lost a race with another enable
+    //
+
+    if (buffer != NULL) {
+        ExFreePool(buffer);
+    }
+
+    DebugPrint((3, "DiskPerfSetCapture: Capturing %d bytes for disk %d\n",
+        size, DeviceExtension->DiskNumber));
+
+    return STATUS_SUCCESS;
+}
+
+
+VOID
+DiskPerfCaptureCommand(
+    IN PDEVICE_EXTENSION DeviceExtension,
+    IN PSCSI_PASS_THROUGH_DIRECT Sptd,
+    IN PUCHAR Sense,
+    IN PUCHAR Data,
+    IN NTSTATUS Status,
+    IN LONGLONG Start,
+    IN LONGLONG End
+)
+
+/*++
+
+Routine Description:
+
+    Record a completed pass-through command in the capture buffer, if
+    capture is enabled. Commands that do not fit are counted as dropped.
+
+Arguments:
+
+    DeviceExtension - The device the command went to.
+    Sptd            - The pass-through request, after completion.
+    Sense           - Its sense buffer, Sptd->SenseInfoLength bytes.
+    Data            - Its data buffer, Sptd->DataTransferLength bytes.
+    Status          - How the pass-through IRP completed.
+    Start           - Performance counter when it was sent.
+    End             - Performance counter when it completed.
+
+Return Value:
+
+    None
+
+--*/
+
+{
+    PDISKPERF_TRACE   trace = DeviceExtension->Trace;
+    PSEDTRACE_COMMAND command;
+    ULONG             dataLength;
+    ULONG             recordLength;
+    KIRQL             oldIrql;
+
+    if (trace == NULL || trace->CaptureBuffer == NULL) {
+        return;
+    }
+
+    //
+    // Security protocol responses are mostly padding
+    //
+
+    dataLength = (Data != NULL) ? Sptd->DataTransferLength : 0;
+    while (dataLength != 0 && Data[dataLength - 1] == 0) {
+        dataLength--;
+    }
+
+    recordLength = SEDTRACE_ALIGN(sizeof(SEDTRACE_COMMAND) + dataLength);
+
+    KeAcquireSpinLock(&trace->CaptureLock, &oldIrql);
+
+    if (trace->CaptureBuffer == NULL) {
+        KeReleaseSpinLock(&trace->CaptureLock, oldIrql);
+        return;
+    }
+
+    trace->CaptureSequence++;
+
+    if (trace->CaptureSize - trace->CaptureUsed < recordLength) {
+        trace->CaptureDropped++;
+        KeReleaseSpinLock(&trace->CaptureLock, oldIrql);
+        return;
+    }
+
+    command = (PSEDTRACE_COMMAND)(trace->CaptureBuffer + trace->CaptureUsed);
+    RtlZeroMemory(command, recordLength);
+    command->Header.Type = SedTraceRecordCommand;
+    command->Header.Length = recordLength;
+    command->Timestamp = Start;
+    command->Elapsed = End - Start;
+    command->Sequence = trace->CaptureSequence;
+    command->Status = (ULONG)Status;
+    command->CdbLength = min(Sptd->CdbLength, SEDTRACE_CDB_LENGTH);
+    RtlCopyMemory(command->Cdb, Sptd->Cdb, command->CdbLength);
+    command->ScsiStatus = Sptd->ScsiStatus;
+    command->DataIn = (Sptd->DataIn == SCSI_IOCTL_DATA_IN);
+    command->SenseLength = min(Sptd->SenseInfoLength, SEDTRACE_SENSE_LENGTH);
+    RtlCopyMemory(command->Sense, Sense, command->SenseLength);
+    command->TransferLength = Sptd->DataTransferLength;
+    command->DataLength = dataLength;
+    command->Dropped = trace->CaptureDropped;
+    if (dataLength != 0) {
+        RtlCopyMemory(command + 1, Data, dataLength);
+        if (!command->DataIn) {
+            DiskPerfRedactCommand((PUCHAR)(command + 1), dataLength);
+        }
+    }
+
+    trace->CaptureUsed += recordLength;
+    trace->CaptureDropped = 0;
+
+    KeReleaseSpinLock(&trace->CaptureLock, oldIrql);
+}
+
+
+VOID
+DiskPerfRedactCommand(
+    IN OUT PUCHAR Data,
+    IN ULONG Length
+)
+
+/*++
+
+Routine Description:
+
+    Blank the HostChallenge of a StartSession being captured, which is the
+    drive PIN. Replay only needs the recorded responses, so nothing it uses
+    is lost. The tokens of the first SubPacket are stepped over by their
+    headers; the bytes of any name 0 = byte string pair are zeroed. The
+    record has had its trailing padding trimmed, so the walk stops at the
+    end of the data rather than trusting the header lengths.
+
+Arguments:
+
+    Data   - Copy of the IF-SEND data in the capture buffer.
+    Length - Its length.
+
+Return Value:
+
+    None
+
+--*/
+
+{
+    ULONG offset;
+    ULONG end;
+    ULONG header;
+    ULONG length;
+    ULONG named = 0;
+    UCHAR token;
+
+    //
+    // ComPacket, Packet and SubPacket headers take 56 bytes; the SubPacket
+    // length is the big-endian ULONG ending there
+    //
+
+    if (Length < 56) {
+        return;
+    }
+
+    end = ((ULONG)Data[52] << 24) | ((ULONG)Data[53] << 16) | ((ULONG)Data[54] << 8) | Data[55];
+    end = (end <= Length - 56) ? 56 + end : Length;
+
+    for (offset = 56; offset < end; offset += header + length) {
+        token = Data[offset];
+        length = 0;
+
+        if (token < 0x80 || token >= 0xF0) {
+            header = 1;                                 // tiny atom or control
+        }
+        else if (token < 0xC0) {
+            header = 1;                                 // short atom
+            length = token & 0x0F;
+        }
+        else if (token < 0xE0 && offset + 1 < end) {
+            header = 2;                                 // medium atom
+            length = ((ULONG)(token & 0x07) << 8) | Data[offset + 1];
+        }
+        else if (token < 0xE4 && offset + 3 < end) {
+            header = 4;                                 // long atom
+            length = ((ULONG)Data[offset + 1] << 16) | ((ULONG)Data[offset + 2] << 8) |
+                Data[offset + 3];
+        }
+        else {
+            return;
+        }
+
+        if (named == 2 &&
+            ((token & 0xE0) == 0xA0 || (token & 0xF0) == 0xD0 || (token & 0xFE) == 0xE2)) {
+            RtlZeroMemory(Data + offset + header, min(length, end - offset - header));
+        }
+
+        //
+        // START_NAME, then the tiny atom 0
+        //
+
+        named = (token == 0xF2) ? 1 : (named == 1 && token == 0x00) ? 2 : 0;
+    }
+}
+
+
+NTSTATUS
+DiskPerfQueryCapture(
+    IN PDEVICE_EXTENSION DeviceExtension,
+    OUT PUCHAR Buffer,
+    IN ULONG Length,
+    OUT PULONG Written
+)
+
+/*++
+
+Routine Description:
+
+    Move as many captured commands as fit into a trace chunk. Commands
+    handed out are removed from the capture buffer.
+
+Arguments:
+
+    DeviceExtension - The device being captured.
+    Buffer          - Receives the chunk.
+    Length          - Size of Buffer.
+    Written         - Receives the size of the chunk.
+
+Return Value:
+
+    STATUS_BUFFER_TOO_SMALL if not even the DEVICE record fits,
+    STATUS_INVALID_DEVICE_STATE if capture is not enabled.
+
+--*/
+
+{
+    PDISKPERF_TRACE trace = DeviceExtension->Trace;
+    ULONG           offset = 0;
+    ULONG           taken = 0;
+    KIRQL           oldIrql;
+
+    *Written = 0;
+
+    if (DiskPerfTraceDevice(DeviceExtension, Buffer, Length, &offset) == NULL) {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    if (trace == NULL) {
+        return STATUS_INVALID_DEVICE_STATE;
+    }
+
+    KeAcquireSpinLock(&trace->CaptureLock, &oldIrql);
+
+    if (trace->CaptureBuffer == NULL) {
+        KeReleaseSpinLock(&trace->CaptureLock, oldIrql);
+        return STATUS_INVALID_DEVICE_STATE;
+    }
+
+    //
+    // Records are copied whole, in capture order
+    //
+
+    while (taken < trace->CaptureUsed) {
+        PSEDTRACE_RECORD record = (PSEDTRACE_RECORD)(trace->CaptureBuffer + taken);
+
+        if (Length - offset < record->Length) {
+            break;
+        }
+
+        RtlCopyMemory(Buffer + offset, record, record->Length);
+        offset += record->Length;
+        taken += record->Length;
+    }
+
+    if (taken != 0) {
+        RtlMoveMemory(trace->CaptureBuffer,
+            trace->CaptureBuffer + taken,
+            trace->CaptureUsed - taken);
+        trace->CaptureUsed -= taken;
+    }
+
+    KeReleaseSpinLock(&trace->CaptureLock, oldIrql);
+
+    *Written = offset;
+    return STATUS_SUCCESS;
+}
+
+
+NTSTATUS
+DiskPerfShutdownFlush(
+    IN PDEVICE_OBJECT DeviceObject,
+    IN PIRP Irp
+)
+
+/*++
+
+Routine Description:
+
+    This routine is called for a shutdown and flush IRPs.  These are sent by the
+    system before it actually shuts down or when the file system does a flush.
+
+Arguments:
+
+    DriverObject - Pointer to device object to being shutdown by system.
+    Irp          - IRP involved.
+
+Return Value:
+
+    NT Status
+
+--*/
+
+{
+    PDEVICE_EXTENSION  deviceExtension = DeviceObject->DeviceExtension;
+
+    DebugPrint((2, "DiskPerfShutdownFlush: DeviceObject 0x%p Irp 0x%p\n",
+        DeviceObject, Irp));
+
+    IoSkipCurrentIrpStackLocation(Irp);
+    return IoCallDriver(deviceExtension->TargetDeviceObject, Irp);
+
+} // end DiskPerfShutdownFlush()
+
+
+VOID
+DiskPerfUnload(
+    IN PDRIVER_OBJECT DriverObject
+)
+
+/*++
+
+Routine Description:
+
+    Free all the allocated resources, etc.
+
+Arguments:
+
+    DriverObject - pointer to a driver object.
+
+Return Value:
+
+    VOID.
+
+--*/
+{
+    ULONG bucket;
+
+    PAGED_CODE();
+
+    UNREFERENCED_PARAMETER(DriverObject);
+
+    //
+    // Every device is gone by now, so the unlock queue is empty
+    //
+
+    if (DiskPerfUnlockThread != NULL) {
+        DiskPerfUnlockStop = TRUE;
+        KeSetEvent(&DiskPerfUnlockEvent, IO_NO_INCREMENT, FALSE);
+        KeWaitForSingleObject(DiskPerfUnlockThread, Executive, KernelMode, FALSE, NULL);
+        ObDereferenceObject(DiskPerfUnlockThread);
+        DiskPerfUnlockThread = NULL;
+    }
+
+    for (bucket = 0; bucket < DISKPERF_DRIVE_BUCKETS; bucket++) {
+        while (DiskPerfDrives[bucket] != NULL) {
+            PDISKPERF_DRIVE drive = DiskPerfDrives[bucket];
+
+            DiskPerfDrives[bucket] = drive->Next;
+            if (drive->Images != NULL) {
+                DiskPerfDereferenceImages(drive->Images);
+            }
+            ExFreePool(drive);
+        }
+    }
+
+    if (DiskPerfBuiltinImages != NULL) {
+        DiskPerfDereferenceImages(DiskPerfBuiltinImages);
+        DiskPerfBuiltinImages = NULL;
+    }
+
+    DiskPerfFreeQueries();
+
+    if (DiskPerfRegistryPath.Buffer != NULL) {
+        ExFreePool(DiskPerfRegistryPath.Buffer);
+        DiskPerfRegistryPath.Buffer = NULL;
+    }
+
+    return;
+}
+
+
+NTSTATUS
+DiskPerfRegisterDevice(
+    IN PDEVICE_OBJECT DeviceObject
+)
+
+/*++
+
+Routine Description:
+
+    Routine to initialize a proper name for the device object, and
+    register it with WMI
+
+Arguments:
+
+    DeviceObject - pointer to a device object to be initialized.
+
+Return Value:
+
+    Status of the initialization. NOTE: If the registration fails,
+    the device name in the DeviceExtension will be left as empty.
+
+--*/
+
+{
+    NTSTATUS                status;
+    PDEVICE_EXTENSION       deviceExtension;
+    PDISKPERF_QUERY         query;
+    PSTORAGE_DEVICE_NUMBER  number;
+    ULONG_PTR               information;
+    //ULONG                   registrationFlag = 0;
+
+    PAGED_CODE();
+
+    DebugPrint((2, "DiskPerfRegisterDevice: DeviceObject 0x%p\n",
+        DeviceObject));
+    deviceExtension = DeviceObject->DeviceExtension;
+
+    //
+    // Started before. The disk below keeps its device object, and so its
+    // number and name, until it is removed, which takes us with it.
+    //
+
+    if (deviceExtension->State & DISKPERF_STATE_NAMED) {
+        DebugPrint((3, "DiskPerfRegisterDevice: Device name %ws known\n",
+            deviceExtension->PhysicalDeviceNameBuffer));
+        return STATUS_SUCCESS;
+    }
+
+    query = DiskPerfAcquireQuery(deviceExtension->TargetDeviceObject);
+    if (query == NULL) {
+        DiskPerfLogError(
+            DeviceObject,
+            256,
+            STATUS_SUCCESS,
+            IO_ERR_INSUFFICIENT_RESOURCES);
+        DebugPrint((3, "DiskPerfRegisterDevice: Fail to build irp\n"));
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    //
+    // Request for the device number
+    //
+    status = DiskPerfSendQuery(deviceExtension->TargetDeviceObject, query,
+        IOCTL_STORAGE_GET_DEVICE_NUMBER, 0, sizeof(STORAGE_DEVICE_NUMBER), &information);
+
+    if (NT_SUCCESS(status)) {
+        number = (PSTORAGE_DEVICE_NUMBER)query->Buffer;
+
+        //
+        // Remember the disk number for use as parameter in DiskIoNotifyRoutine
+        //
+        deviceExtension->DiskNumber = number->DeviceNumber;
+
+        //
+        // Create device name for each partition
+        //
+
+        RtlStringCbPrintfW(
+            deviceExtension->PhysicalDeviceNameBuffer,
+            sizeof(deviceExtension->PhysicalDeviceNameBuffer),
+            L"\\Device\\Harddisk%d\\Partition%d",
+            number->DeviceNumber, number->PartitionNumber);
+
+        RtlInitUnicodeString(&deviceExtension->PhysicalDeviceName, &deviceExtension->PhysicalDeviceNameBuffer[0]);
+        InterlockedOr(&deviceExtension->State, DISKPERF_STATE_NAMED);
+
+        //
+        // Set default name for physical disk
+        //
+        RtlCopyMemory(
+            &(deviceExtension->StorageManagerName[0]),
+            L"PhysDisk",
+            8 * sizeof(WCHAR));
+        DebugPrint((3, "DiskPerfRegisterDevice: Device name %ws\n",
+            deviceExtension->PhysicalDeviceNameBuffer));
+    }
+    else {
+
+        // request for partition's information failed, try volume
+
+        PMOUNTDEV_NAME  output = (PMOUNTDEV_NAME)query->Buffer;
+        PVOLUME_NUMBER  volumeNumber = (PVOLUME_NUMBER)query->Buffer;
+        ULONG           nameSize;
+
+        //
+        // The query buffer takes names far longer than we keep, so there
+        // is no need to ask again with a bigger one on overflow
+        //
+
+        status = DiskPerfSendQuery(deviceExtension->TargetDeviceObject, query,
+            IOCTL_MOUNTDEV_QUERY_DEVICE_NAME, 0, DISKPERF_QUERY_BUFFER_SIZE, &information);
+        if (!NT_SUCCESS(status)) {
+            DiskPerfReleaseQuery(query);
+            DiskPerfLogError(
+                DeviceObject,
+                260,
+                STATUS_SUCCESS,
+                IO_ERR_CONFIGURATION_ERROR);
+            return status;
+        }
+
+        //
+        // Since we get the volume name instead of the disk number,
+        // set it to a dummy value
+        // Todo: Instead of passing the disk number back to the user app.
+        // for tracing, pass the STORAGE_DEVICE_NUMBER structure instead.
+
+        deviceExtension->DiskNumber = (ULONG)-1;
+
+        nameSize = min(output->NameLength, sizeof(deviceExtension->PhysicalDeviceNameBuffer) - sizeof(WCHAR));
+        nameSize = min(nameSize, DISKPERF_QUERY_BUFFER_SIZE - FIELD_OFFSET(MOUNTDEV_NAME, Name));
+
+        RtlStringCbCopyW(deviceExtension->PhysicalDeviceNameBuffer, nameSize, output->Name);
+
+        RtlInitUnicodeString(&deviceExtension->PhysicalDeviceName, &deviceExtension->PhysicalDeviceNameBuffer[0]);
+        InterlockedOr(&deviceExtension->State, DISKPERF_STATE_NAMED);
+
+        //
+        // Now, get the VOLUME_NUMBER information
+        //
+        RtlZeroMemory(volumeNumber, sizeof(VOLUME_NUMBER));
+
+        status = DiskPerfSendQuery(deviceExtension->TargetDeviceObject, query,
+            IOCTL_VOLUME_QUERY_VOLUME_NUMBER, 0, sizeof(VOLUME_NUMBER), &information);
+        if (!NT_SUCCESS(status) ||
+            volumeNumber->VolumeManagerName[0] == (WCHAR)UNICODE_NULL) {
+
+            RtlCopyMemory(
+                &deviceExtension->StorageManagerName[0],
+                L"LogiDisk",
                 8 * sizeof(WCHAR));
             if (NT_SUCCESS(status))
-                deviceExtension->DiskNumber = volumeNumber.VolumeNumber;
+                deviceExtension->DiskNumber = volumeNumber->VolumeNumber;
         }
         else {
             RtlCopyMemory(
                 &deviceExtension->StorageManagerName[0],
-                &volumeNumber.VolumeManagerName[0],
+                &volumeNumber->VolumeManagerName[0],
                 8 * sizeof(WCHAR));
-            deviceExtension->DiskNumber = volumeNumber.VolumeNumber;
+            deviceExtension->DiskNumber = volumeNumber->VolumeNumber;
         }
         DebugPrint((3, "DiskPerfRegisterDevice: Device name %ws\n",
             deviceExtension->PhysicalDeviceNameBuffer));
     }
 
+    DiskPerfReleaseQuery(query);
+
+    if (!NT_SUCCESS(status)) {
+        DiskPerfLogError(
+            DeviceObject,
+            261,
+            STATUS_SUCCESS,
+            IO_ERR_INTERNAL_ERROR);
+    }
+    return status;
+}
+
+VOID
+DiskPerfAllocateQueries(
+    VOID
+)
+
+/*++
+
+Routine Description:
+
+    Set up the query IRPs and buffers at load. A slot that cannot be
+    allocated is simply never used.
+
+--*/
+
+{
+    ULONG i;
+
+    for (i = 0; i < DISKPERF_QUERY_SLOTS; i++) {
+        DiskPerfQueries[i].Slot = (LONG)i;
+        DiskPerfQueries[i].Irp = IoAllocateIrp(DISKPERF_QUERY_STACK_SIZE, FALSE);
+        DiskPerfQueries[i].Buffer = ExAllocatePool(NonPagedPoolNx, DISKPERF_QUERY_BUFFER_SIZE);
+
+        if (DiskPerfQueries[i].Irp == NULL || DiskPerfQueries[i].Buffer == NULL) {
+            DebugPrint((1, "DiskPerfAllocateQueries: Cannot allocate query slot %d\n", i));
+            if (DiskPerfQueries[i].Irp != NULL) {
+                IoFreeIrp(DiskPerfQueries[i].Irp);
+                DiskPerfQueries[i].Irp = NULL;
+            }
+            if (DiskPerfQueries[i].Buffer != NULL) {
+                ExFreePool(DiskPerfQueries[i].Buffer);
+                DiskPerfQueries[i].Buffer = NULL;
+            }
+        }
+    }
+}
+
+
+VOID
+DiskPerfFreeQueries(
+    VOID
+)
+{
+    ULONG i;
+
+    for (i = 0; i < DISKPERF_QUERY_SLOTS; i++) {
+        if (DiskPerfQueries[i].Irp != NULL) {
+            IoFreeIrp(DiskPerfQueries[i].Irp);
+            DiskPerfQueries[i].Irp = NULL;
+        }
+        if (DiskPerfQueries[i].Buffer != NULL) {
+            ExFreePool(DiskPerfQueries[i].Buffer);
+            DiskPerfQueries[i].Buffer = NULL;
+        }
+    }
+}
+
+
+PDISKPERF_QUERY
+DiskPerfAcquireQuery(
+    IN PDEVICE_OBJECT TargetDeviceObject
+)
+
+/*++
+
+Routine Description:
+
+    Get an IRP and buffer for queries to TargetDeviceObject, from the
+    slots if one is free and deep enough for its stack, otherwise
+    allocated for the occasion. Give it back with DiskPerfReleaseQuery.
+
+Arguments:
+
+    TargetDeviceObject - Where the queries will be sent.
+
+Return Value:
+
+    The query, or NULL if out of memory
+
+--*/
+
+{
+    PDISKPERF_QUERY query;
+    ULONG           i;
+
+    PAGED_CODE();
+
+    for (i = 0; i < DISKPERF_QUERY_SLOTS; i++) {
+        if (DiskPerfQueries[i].Irp != NULL &&
+            TargetDeviceObject->StackSize <= DiskPerfQueries[i].Irp->StackSize &&
+            !InterlockedBitTestAndSet(&DiskPerfQueriesBusy, i)) {
+            return &DiskPerfQueries[i];
+        }
+    }
+
+    query = ExAllocatePool(NonPagedPoolNx, sizeof(DISKPERF_QUERY) + DISKPERF_QUERY_BUFFER_SIZE);
+    if (query == NULL) {
+        return NULL;
+    }
+
+    query->Irp = IoAllocateIrp(TargetDeviceObject->StackSize, FALSE);
+    if (query->Irp == NULL) {
+        ExFreePool(query);
+        return NULL;
+    }
+
+    query->Buffer = (PUCHAR)(query + 1);
+    query->Slot = -1;
+    return query;
+}
+
+
+VOID
+DiskPerfReleaseQuery(
+    IN PDISKPERF_QUERY Query
+)
+{
+    if (Query->Slot < 0) {
+        IoFreeIrp(Query->Irp);
+        ExFreePool(Query);
+        return;
+    }
+
+    InterlockedBitTestAndReset(&DiskPerfQueriesBusy, Query->Slot);
+}
+
+
+NTSTATUS
+DiskPerfSendQuery(
+    IN PDEVICE_OBJECT TargetDeviceObject,
+    IN PDISKPERF_QUERY Query,
+    IN ULONG IoControlCode,
+    IN ULONG InputLength,
+    IN ULONG OutputLength,
+    OUT PULONG_PTR Information
+)
+
+/*++
+
+Routine Description:
+
+    Send a METHOD_BUFFERED device control to TargetDeviceObject and wait
+    for it. The input is taken from, and the output left in, the query
+    buffer. The IRP is recycled with IoReuseIrp rather than freed, so the
+    completion routine stops the I/O manager from completing it.
+
+Arguments:
+
+    TargetDeviceObject - Where to send it.
+    Query              - From DiskPerfAcquireQuery for the same device.
+    IoControlCode      - The IOCTL.
+    InputLength        - Bytes of input at the start of the buffer.
+    OutputLength       - Bytes of output the buffer may take.
+    Information        - How many bytes of output were returned.
+
+Return Value:
+
+    NTSTATUS from the device
+
+--*/
+
+{
+    PIRP               irp = Query->Irp;
+    PIO_STACK_LOCATION irpSp;
+    KEVENT             event;
+    NTSTATUS           status;
+
+    PAGED_CODE();
+
+    ASSERT(METHOD_FROM_CTL_CODE(IoControlCode) == METHOD_BUFFERED);
+    ASSERT(InputLength <= DISKPERF_QUERY_BUFFER_SIZE && OutputLength <= DISKPERF_QUERY_BUFFER_SIZE);
+
+    KeInitializeEvent(&event, NotificationEvent, FALSE);
+
+    irp->AssociatedIrp.SystemBuffer = Query->Buffer;
+    irp->IoStatus.Status = STATUS_NOT_SUPPORTED;
+    irp->IoStatus.Information = 0;
+    irp->RequestorMode = KernelMode;
+    irp->Tail.Overlay.Thread = PsGetCurrentThread();
+
+    irpSp = IoGetNextIrpStackLocation(irp);
+    irpSp->MajorFunction = IRP_MJ_DEVICE_CONTROL;
+    irpSp->Parameters.DeviceIoControl.IoControlCode = IoControlCode;
+    irpSp->Parameters.DeviceIoControl.InputBufferLength = InputLength;
+    irpSp->Parameters.DeviceIoControl.OutputBufferLength = OutputLength;
+
+    IoSetCompletionRoutine(irp, DiskPerfIrpCompletion, &event, TRUE, TRUE, TRUE);
+
+    status = IoCallDriver(TargetDeviceObject, irp);
+    if (status == STATUS_PENDING) {
+        KeWaitForSingleObject(&event, Executive, KernelMode, FALSE, NULL);
+    }
+
+    status = irp->IoStatus.Status;
+    *Information = irp->IoStatus.Information;
+
+    IoReuseIrp(irp, STATUS_NOT_SUPPORTED);
+
+    return status;
+}
+
+
+
+VOID
+DiskPerfCopyDescriptorString(
+    IN PSTORAGE_DEVICE_DESCRIPTOR Descriptor,
+    IN ULONG DescriptorLength,
+    IN ULONG StringOffset,
+    OUT PCHAR Destination,
+    IN ULONG DestinationLength
+)
+
+/*++
+
+Routine Description:
+
+    Copy one of the strings out of a storage device descriptor, without
+    the leading and trailing spaces drives like to pad them with.
+
+--*/
+
+{
+    PCHAR  source;
+    size_t length = 0;
+
+    RtlZeroMemory(Destination, DestinationLength);
+
+    if (StringOffset == 0 || StringOffset >= DescriptorLength) {
+        return;
+    }
+
+    source = (PCHAR)Descriptor + StringOffset;
+    RtlStringCchLengthA(source, DescriptorLength - StringOffset, &length);
+
+    while (length > 0 && *source == ' ') {
+        source++;
+        length--;
+    }
+    while (length > 0 && source[length - 1] == ' ') {
+        length--;
+    }
+
+    length = min(length, DestinationLength - 1);
+    RtlCopyMemory(Destination, source, length);
+}
+
+
+VOID
+DiskPerfQueryIdentity(
+    IN PDEVICE_OBJECT DeviceObject
+)
+
+/*++
+
+Routine Description:
+
+    Remember the drive's serial number and product id, so traces can be
+    tied to a physical drive. Failure just leaves them empty. Usually
+    AddDevice already found them, and they cannot change while the stack
+    lasts, so this only asks when they are still missing.
+
+Arguments:
+
+    DeviceObject - pointer to the filter device object.
+
+Return Value:
+
+    None
+
+--*/
+
+{
+    PDEVICE_EXTENSION           deviceExtension = DeviceObject->DeviceExtension;
+    PDISKPERF_QUERY             query;
+    PSTORAGE_DEVICE_DESCRIPTOR  descriptor;
+    ULONG                       descriptorLength;
+
+    PAGED_CODE();
+
+    if (deviceExtension->SerialNumber[0] != 0) {
+        return;
+    }
+
+    query = DiskPerfAcquireQuery(deviceExtension->TargetDeviceObject);
+    if (query == NULL) {
+        return;
+    }
+
+    descriptor = (PSTORAGE_DEVICE_DESCRIPTOR)query->Buffer;
+
+    if (NT_SUCCESS(DiskPerfQueryDescriptor(deviceExtension->TargetDeviceObject,
+        query, &descriptorLength))) {
+
+        DiskPerfCopyDescriptorString(descriptor, descriptorLength,
+            descriptor->SerialNumberOffset,
+            deviceExtension->SerialNumber, sizeof(deviceExtension->SerialNumber));
+        DiskPerfCopyDescriptorString(descriptor, descriptorLength,
+            descriptor->ProductIdOffset,
+            deviceExtension->ProductId, sizeof(deviceExtension->ProductId));
+
+        DebugPrint((3, "DiskPerfQueryIdentity: Serial %s Product %s\n",
+            deviceExtension->SerialNumber, deviceExtension->ProductId));
+    }
+
+    DiskPerfReleaseQuery(query);
+}
+
+
+NTSTATUS
+DiskPerfQueryDescriptor(
+    IN PDEVICE_OBJECT TargetDeviceObject,
+    IN PDISKPERF_QUERY Query,
+    OUT PULONG DescriptorLength
+)
+
+/*++
+
+Routine Description:
+
+    Ask the device below for its storage device descriptor.
+
+Arguments:
+
+    TargetDeviceObject - Where to send the query.
+    Query              - From DiskPerfAcquireQuery, the descriptor is left
+                         in its buffer.
+    DescriptorLength   - How much of the descriptor was filled.
+
+Return Value:
+
+    NTSTATUS
+
+--*/
+
+{
+    PSTORAGE_PROPERTY_QUERY     property = (PSTORAGE_PROPERTY_QUERY)Query->Buffer;
+    ULONG_PTR                   information;
+    NTSTATUS                    status;
+
+    PAGED_CODE();
+
+    RtlZeroMemory(property, sizeof(STORAGE_PROPERTY_QUERY));
+    property->PropertyId = StorageDeviceProperty;
+    property->QueryType = PropertyStandardQuery;
+
+    status = DiskPerfSendQuery(TargetDeviceObject, Query, IOCTL_STORAGE_QUERY_PROPERTY,
+        sizeof(STORAGE_PROPERTY_QUERY), DISKPERF_QUERY_BUFFER_SIZE, &information);
+
+    if (NT_SUCCESS(status)) {
+        if (information < FIELD_OFFSET(STORAGE_DEVICE_DESCRIPTOR, RawDeviceProperties)) {
+            return STATUS_INFO_LENGTH_MISMATCH;
+        }
+        *DescriptorLength = (ULONG)min(information, DISKPERF_QUERY_BUFFER_SIZE);
+    }
+
+    return status;
+}
+
+
+BOOLEAN
+DiskPerfShouldAttach(
+    IN PDEVICE_OBJECT PhysicalDeviceObject,
+    OUT PCHAR SerialNumber,
+    OUT PCHAR ProductId
+)
+
+/*++
+
+Routine Description:
+
+    Decide at AddDevice whether a disk gets a filter device. The storage
+    port PDO answers the descriptor query from what it found when it
+    enumerated the disk, so this works before the stack is started.
+
+    A drive whose registry policy sets Enable is attached to (or not)
+    whatever its bus; otherwise the bus has to be in AttachBusTypes and
+    removable media needs AttachRemovable. A disk that cannot be asked is
+    attached to, as before.
+
+    The serial number and product id found are handed back for the new
+    device, so its start does not have to ask again.
+
+Arguments:
+
+    PhysicalDeviceObject - The disk PDO.
+    SerialNumber         - SEDTRACE_SERIAL_LENGTH bytes, empty if unknown.
+    ProductId            - SEDTRACE_MODEL_LENGTH bytes, empty if unknown.
+
+Return Value:
+
+    TRUE to attach
+
+--*/
+
+{
+    PDISKPERF_QUERY             query;
+    PSTORAGE_DEVICE_DESCRIPTOR  descriptor;
+    ULONG                       descriptorLength;
+    PCHAR                       serial = SerialNumber;
+    PDISKPERF_DRIVE             drive;
+    DISKPERF_POLICY             policy;
+    KIRQL                       irql;
+    BOOLEAN                     attach = TRUE;
+
+    PAGED_CODE();
+
+    RtlZeroMemory(SerialNumber, SEDTRACE_SERIAL_LENGTH);
+    RtlZeroMemory(ProductId, SEDTRACE_MODEL_LENGTH);
+
+    query = DiskPerfAcquireQuery(PhysicalDeviceObject);
+    if (query == NULL) {
+        return TRUE;
+    }
+
+    descriptor = (PSTORAGE_DEVICE_DESCRIPTOR)query->Buffer;
+
+    if (!NT_SUCCESS(DiskPerfQueryDescriptor(PhysicalDeviceObject, query, &descriptorLength))) {
+        DiskPerfReleaseQuery(query);
+        return TRUE;
+    }
+
+    DiskPerfCopyDescriptorString(descriptor, descriptorLength,
+        descriptor->SerialNumberOffset, SerialNumber, SEDTRACE_SERIAL_LENGTH);
+    DiskPerfCopyDescriptorString(descriptor, descriptorLength,
+        descriptor->ProductIdOffset, ProductId, SEDTRACE_MODEL_LENGTH);
+
+    RtlZeroMemory(&policy, sizeof(policy));
+    if (serial[0] != 0) {
+        KeAcquireSpinLock(&DiskPerfDriveLock, &irql);
+
+        drive = DiskPerfFindDrive(serial);
+        if (drive != NULL) {
+            policy = drive->Policy;
+        }
+
+        KeReleaseSpinLock(&DiskPerfDriveLock, irql);
+    }
+
+    if (policy.Present & DISKPERF_POLICY_ENABLE) {
+        attach = policy.Enable;
+    }
+    else if (descriptor->BusType >= 32 ||
+             !(DiskPerfAttachBusTypes & DISKPERF_BUS_TYPE_BIT(descriptor->BusType))) {
+        attach = FALSE;
+    }
+    else if (descriptor->RemovableMedia && !DiskPerfAttachRemovable) {
+        attach = FALSE;
+    }
+
+    DebugPrint((1, "DiskPerfShouldAttach: %s bus %d%s, %s\n", serial, descriptor->BusType,
+        descriptor->RemovableMedia ? " removable" : "", attach ? "attaching" : "leaving it alone"));
 
-    if (!NT_SUCCESS(status)) {
-        DiskPerfLogError(
-            DeviceObject,
-            261,
-            STATUS_SUCCESS,
-            IO_ERR_INTERNAL_ERROR);
-    }
-    return status;
+    DiskPerfReleaseQuery(query);
+    return attach;
 }
 
 
@@ -1802,42 +6793,338 @@ void HexDump(unsigned char* Bfr, size_t Count)
 }
 
 
-VOID SEDSleepUnlockDrive(
+NTSTATUS SEDSleepUnlockDrive(
     IN PDEVICE_OBJECT DeviceObject
 )
+
+/*++
+
+Routine Description:
+
+    Run every prepared unlock command for the drive (locking ranges first,
+    then MBRDone) in one session, see SedUnlockRun. Once a command fails,
+    or the unlock is cancelled, the rest are not sent unless they already
+    went out queued. The status of each goes into the unlock result.
+
+--*/
+
 {
-    // setlockingrange 0 rw
-    SEDSleepSendOPALCommand(DeviceObject, send7_bin, send7_bin_len);
-    // setmbrdone on
-    SEDSleepSendOPALCommand(DeviceObject, send7mbr_bin, send7mbr_bin_len);
+    PDEVICE_EXTENSION deviceExtension = (PDEVICE_EXTENSION)DeviceObject->DeviceExtension;
+    PSEDSLEEP_UNLOCK_IMAGES images;
+    DISKPERF_OPAL_TRANSPORT transport;
+    SED_UNLOCK unlock;
+    SED_UNLOCK_PACKET startSession;
+    SED_UNLOCK_PACKET endSession;
+    SED_UNLOCK_PACKET command[SEDSLEEP_MAX_COMMANDS];
+    int results[SEDSLEEP_MAX_COMMANDS];
+    uint32_t completed = 0;
+    NTSTATUS status;
+    int result;
+    ULONG i;
+
+    if (deviceExtension->Unlock == NULL)
+    {
+        DebugPrint((1, "SEDSleepUnlockDrive: %s is never unlocked\n", deviceExtension->SerialNumber));
+        return STATUS_INVALID_DEVICE_STATE;
+    }
+
+    SEDSleepOpenOpal(DeviceObject, &unlock, &transport);
+
+    if (!deviceExtension->Unlock->TPerPropertiesKnown)
+    {
+        SEDSleepQueryProperties(DeviceObject, &unlock);
+    }
+    unlock.Properties = deviceExtension->Unlock->TPerProperties;
+
+    images = DiskPerfReferenceImages(deviceExtension);
+    if (images == NULL)
+    {
+        DebugPrint((1, "SEDSleepUnlockDrive: No unlock commands for %s\n", deviceExtension->SerialNumber));
+        return STATUS_DEVICE_CONFIGURATION_ERROR;
+    }
+
+    SEDSleepImagePacket(images, &images->StartSession, &startSession);
+    SEDSleepImagePacket(images, &images->EndSession, &endSession);
+    for (i = 0; i < images->CommandCount; i++)
+    {
+        SEDSleepImagePacket(images, &images->Command[i], &command[i]);
+    }
+
+    deviceExtension->Unlock->Result.CommandCount = 0;
+
+    if (DiskPerfUnlockCancelled(deviceExtension))
+    {
+        DiskPerfDereferenceImages(images);
+        return STATUS_CANCELLED;
+    }
+
+    result = SedUnlockRun(&unlock, &startSession, command, images->CommandCount, &endSession,
+        results, &completed);
+
+    for (i = 0; i < completed; i++)
+    {
+        deviceExtension->Unlock->Result.CommandStatus[i] = SEDSleepOpalStatus(deviceExtension, &transport, results[i]);
+    }
+    deviceExtension->Unlock->Result.CommandCount = completed;
+
+    status = SEDSleepOpalStatus(deviceExtension, &transport, result);
+    if (!NT_SUCCESS(status))
+    {
+        DebugPrint((1, "SEDSleepUnlockDrive: Unlock failed %x after %d commands, method status %x\n",
+            status, completed, unlock.MethodStatus));
+    }
+
+    DiskPerfDereferenceImages(images);
+    return status;
 }
 
-VOID SEDSleepSendOPALCommand(
+VOID SEDSleepOpenOpal(
     IN PDEVICE_OBJECT DeviceObject,
-    UCHAR* src,
-    size_t len
+    OUT SED_UNLOCK* unlock,
+    OUT PDISKPERF_OPAL_TRANSPORT transport
+)
+
+/*++
+
+Routine Description:
+
+    Set up an unlock session over the pass-through. Commands are stamped
+    in the OPAL command buffer, and replies are received straight into the
+    pass-through receive buffer, so neither is copied again.
+
+--*/
+
+{
+    static const SED_TRANSPORT_OPS ops = {
+        SEDSleepOpalIfSend,
+        SEDSleepOpalIfRecv,
+        SEDSleepOpalClose
+    };
+    PDEVICE_EXTENSION deviceExtension = (PDEVICE_EXTENSION)DeviceObject->DeviceExtension;
+
+    RtlZeroMemory(transport, sizeof(*transport));
+    transport->Transport.Ops = &ops;
+    transport->Transport.Name = "pass-through";
+    transport->Transport.SerialNumber = deviceExtension->SerialNumber;
+    transport->DeviceObject = DeviceObject;
+    transport->Status = STATUS_SUCCESS;
+
+    RtlZeroMemory(unlock, sizeof(*unlock));
+    unlock->Transport = &transport->Transport;
+    unlock->ComId = SED_UNLOCK_COMID;
+    unlock->Command = deviceExtension->Unlock->OpalCommandBuffer;
+    unlock->Response = deviceExtension->Unlock->ScsiRecvBuffer;
+    unlock->BufferSize = SEDSLEEP_SCSI_BUFFER_SIZE;
+    unlock->NoPipeline = (deviceExtension->UnlockFlags & SEDSLEEP_UNLOCK_NO_PIPELINE) != 0;
+    unlock->MaxPolls = SEDSLEEP_COMMAND_ATTEMPTS;
+    unlock->Wait = SEDSleepOpalWait;
+    unlock->Context = deviceExtension;
+}
+
+int SEDSleepOpalIfSend(
+    SED_TRANSPORT* Transport,
+    uint8_t Protocol,
+    uint16_t ComId,
+    const void* Data,
+    uint32_t Length
+)
+{
+    PDISKPERF_OPAL_TRANSPORT transport = CONTAINING_RECORD(Transport, DISKPERF_OPAL_TRANSPORT, Transport);
+    NTSTATUS status;
+
+    if (Length > SEDSLEEP_SCSI_BUFFER_SIZE)
+    {
+        return SED_ERROR_INVALID;
+    }
+
+    status = SEDSleepSendSCSICommand(transport->DeviceObject, IF_SEND, Protocol, ComId, Data, Length);
+    if (!NT_SUCCESS(status))
+    {
+        transport->Status = status;
+        return SED_ERROR_IO;
+    }
+    return SED_OK;
+}
+
+int SEDSleepOpalIfRecv(
+    SED_TRANSPORT* Transport,
+    uint8_t Protocol,
+    uint16_t ComId,
+    void* Data,
+    uint32_t Length
+)
+
+/*++
+
+Routine Description:
+
+    The pass-through always receives a whole buffer into ScsiRecvBuffer,
+    which is normally where the caller wants it anyway.
+
+--*/
+
+{
+    PDISKPERF_OPAL_TRANSPORT transport = CONTAINING_RECORD(Transport, DISKPERF_OPAL_TRANSPORT, Transport);
+    PDEVICE_EXTENSION deviceExtension = (PDEVICE_EXTENSION)transport->DeviceObject->DeviceExtension;
+    PUCHAR received = deviceExtension->Unlock->ScsiRecvBuffer;
+    NTSTATUS status;
+
+    status = SEDSleepSendSCSICommand(transport->DeviceObject, IF_RECV, Protocol, ComId, NULL, 0);
+    if (!NT_SUCCESS(status))
+    {
+        transport->Status = status;
+        return SED_ERROR_IO;
+    }
+
+    if (Data != received)
+    {
+        RtlCopyMemory(Data, received, min(Length, SEDSLEEP_SCSI_BUFFER_SIZE));
+        if (Length > SEDSLEEP_SCSI_BUFFER_SIZE)
+        {
+            RtlZeroMemory((PUCHAR)Data + SEDSLEEP_SCSI_BUFFER_SIZE, Length - SEDSLEEP_SCSI_BUFFER_SIZE);
+        }
+    }
+    return SED_OK;
+}
+
+void SEDSleepOpalClose(
+    SED_TRANSPORT* Transport
+)
+{
+    UNREFERENCED_PARAMETER(Transport);
+}
+
+int SEDSleepOpalWait(
+    void* Context,
+    uint32_t Microseconds
+)
+
+/*++
+
+Routine Description:
+
+    Back off before polling the TPer again, unless the unlock has been
+    cancelled or the wait would run past the unlock deadline. Called with
+    no wait between commands, to stop once the unlock is cancelled.
+
+--*/
+
+{
+    PDEVICE_EXTENSION deviceExtension = (PDEVICE_EXTENSION)Context;
+
+    if (DiskPerfUnlockCancelled(deviceExtension))
+    {
+        return 1;
+    }
+
+    if (Microseconds == 0)
+    {
+        return 0;
+    }
+
+    if (deviceExtension->Unlock->UnlockQueued &&
+        KeQueryPerformanceCounter(NULL).QuadPart + (Microseconds * DiskPerfFrequency.QuadPart) / 1000000 >=
+            deviceExtension->Unlock->UnlockDeadline)
+    {
+        DebugPrint((1, "SEDSleepOpalWait: No time left to wait %dus\n", Microseconds));
+        return 1;
+    }
+
+    SEDSleepBackoff(Microseconds);
+    return 0;
+}
+
+NTSTATUS SEDSleepOpalStatus(
+    IN PDEVICE_EXTENSION deviceExtension,
+    IN PDISKPERF_OPAL_TRANSPORT transport,
+    int result
+)
+
+/*++
+
+Routine Description:
+
+    Turn an unlock session result into the NTSTATUS it has always been
+    reported as. NOT_AUTHORIZED means the credentials are wrong, which no
+    retry fixes.
+
+--*/
+
+{
+    switch (result)
+    {
+    case SED_OK:
+        return STATUS_SUCCESS;
+
+    case SED_ERROR_IO:
+    case SED_ERROR_DEVICE:
+        return NT_SUCCESS(transport->Status) ? STATUS_IO_DEVICE_ERROR : transport->Status;
+
+    case SED_ERROR_NOT_AUTHORIZED:
+        return STATUS_ACCESS_DENIED;
+
+    case SED_ERROR_TIMEOUT:
+        return DiskPerfUnlockCancelled(deviceExtension) ? STATUS_CANCELLED : STATUS_IO_TIMEOUT;
+
+    case SED_ERROR_INVALID:
+        return STATUS_INVALID_PARAMETER;
+
+    default:
+        return STATUS_DEVICE_PROTOCOL_ERROR;
+    }
+}
+
+VOID SEDSleepImagePacket(
+    PSEDSLEEP_UNLOCK_IMAGES images,
+    PSEDSLEEP_COMMAND_IMAGE image,
+    SED_UNLOCK_PACKET* packet
+)
+{
+    packet->Data = images->Data + image->Offset;
+    packet->Length = image->Length;
+    packet->Expected = image->Verify ? &image->Set : NULL;
+}
+
+VOID SEDSleepQueryProperties(
+    IN PDEVICE_OBJECT DeviceObject,
+    IN SED_UNLOCK* unlock
 )
+
+/*++
+
+Routine Description:
+
+    Ask the session manager for the TPer properties. Only a drive that
+    answered is remembered, one that could not take the command yet is
+    asked again next time; until then it is treated as synchronous.
+
+--*/
+
 {
-    DebugPrint((0, "Oh boi gonna send me some SCSI commands\n"));
     PDEVICE_EXTENSION deviceExtension = (PDEVICE_EXTENSION)DeviceObject->DeviceExtension;
-    SEDSleepSendSCSICommand(DeviceObject, IF_SEND, 1, 4100, send5_bin, send5_bin_len);
-    SEDSleepSendSCSICommand(DeviceObject, IF_RECV, 1, 4100, NULL, 0);
-    USHORT idThing;
-    memcpy(&idThing, deviceExtension->ScsiRecvBuffer + 84, sizeof(idThing));
-    DbgPrint("Got ID thing %x\n", idThing);
-    memcpy(src + 22, &idThing, sizeof(idThing));
-    memcpy(send9_bin + 22, &idThing, sizeof(idThing));
-    SEDSleepSendSCSICommand(DeviceObject, IF_SEND, 1, 4100, src, len);
-    SEDSleepSendSCSICommand(DeviceObject, IF_RECV, 1, 4100, NULL, 0);
-    DebugPrint((0, "Send9...\n"));
-    SEDSleepSendSCSICommand(DeviceObject, IF_SEND, 1, 4100, send9_bin, send9_bin_len);
-    SEDSleepSendSCSICommand(DeviceObject, IF_RECV, 1, 4100, NULL, 0);
-    HexDump(
-        deviceExtension->ScsiRecvBuffer,
-        SEDSLEEP_SCSI_BUFFER_SIZE);
-}
-
-VOID SEDSleepSendSCSICommand(
+    int result;
+
+    result = SedUnlockQueryProperties(unlock);
+    if (result != SED_OK && result != SED_ERROR_PROTOCOL)
+    {
+        DebugPrint((1, "SEDSleepQueryProperties: Properties failed %d\n", result));
+        return;
+    }
+
+    if (result == SED_ERROR_PROTOCOL)
+    {
+        DebugPrint((1, "SEDSleepQueryProperties: No usable Properties response\n"));
+    }
+
+    deviceExtension->Unlock->TPerProperties = unlock->Properties;
+
+    DebugPrint((1, "SEDSleepQueryProperties: MaxComPacketSize %d Asynchronous %d\n",
+        deviceExtension->Unlock->TPerProperties.MaxComPacketSize,
+        deviceExtension->Unlock->TPerProperties.Asynchronous));
+    deviceExtension->Unlock->TPerPropertiesKnown = TRUE;
+}
+
+NTSTATUS SEDSleepSendSCSICommand(
     IN PDEVICE_OBJECT DeviceObject,
     ATACOMMAND cmd,
     UCHAR protocol, 
@@ -1850,7 +7137,13 @@ VOID SEDSleepSendSCSICommand(
     KEVENT                  event;
     NTSTATUS status;
     PDEVICE_EXTENSION deviceExtension = (PDEVICE_EXTENSION)DeviceObject->DeviceExtension;
-    SIZE_T allocatedLength = 0;
+    ULONG timeout = deviceExtension->CommandTimeout;
+    LONGLONG remaining;
+    ULONG attempt;
+    ULONG backoff = SEDSLEEP_BACKOFF_INITIAL_US;
+    SEDSLEEP_COMMAND_RESULT result;
+    ATA_PASS_THROUGH_DIRECT aptd;
+    BOOLEAN ata = (deviceExtension->Transport == DISKPERF_TRANSPORT_ATA);
 
     DebugPrint((0, "SEDSleepSendSCSICommand: Device num %x Device name %wZ\n", deviceExtension->DiskNumber,
         &deviceExtension->PhysicalDeviceName));
@@ -1872,12 +7165,12 @@ VOID SEDSleepSendSCSICommand(
         default:
         {
             DbgPrint("SEDSleepSendSCSICommand: Bad command %x", cmd);
-            return;
+            return STATUS_INVALID_PARAMETER;
         }
 
         case IF_RECV:
         {
-            memset(deviceExtension->ScsiSendBuffer, 0, SEDSLEEP_SCSI_BUFFER_SIZE);
+            memset(deviceExtension->Unlock->ScsiSendBuffer, 0, SEDSLEEP_SCSI_BUFFER_SIZE);
             len = SEDSLEEP_SCSI_BUFFER_SIZE;
 
             sptdS.Sptd.Cdb[0] = 0xA2;                                /* Opcode */
@@ -1894,8 +7187,8 @@ VOID SEDSleepSendSCSICommand(
 
         case IF_SEND:
         {
-            memcpy(deviceExtension->ScsiSendBuffer, src, len);
-            memset(deviceExtension->ScsiSendBuffer + len, 0, SEDSLEEP_SCSI_BUFFER_SIZE - len);
+            memcpy(deviceExtension->Unlock->ScsiSendBuffer, src, len);
+            memset(deviceExtension->Unlock->ScsiSendBuffer + len, 0, SEDSLEEP_SCSI_BUFFER_SIZE - len);
 
             sptdS.Sptd.Cdb[0] = 0xB5;                                /* Opcode */
             sptdS.Sptd.Cdb[1] = protocol;                            /* Security Protocol */
@@ -1910,18 +7203,25 @@ VOID SEDSleepSendSCSICommand(
         }
     }
 
-    PUCHAR dataBuffer = DsmpAllocateAlignedPool(NonPagedPoolNx,
-        len,
-        DeviceObject->AlignmentRequirement,
-        &allocatedLength);
-    memcpy(dataBuffer, deviceExtension->ScsiSendBuffer, len);
+    PUCHAR dataBuffer = deviceExtension->Unlock->ScsiDataBuffer;
+    memcpy(dataBuffer, deviceExtension->Unlock->ScsiSendBuffer, len);
+
+    //
+    // Don't let one command run (much) past the unlock deadline
+    //
+
+    remaining = deviceExtension->Unlock->UnlockDeadline - KeQueryPerformanceCounter(NULL).QuadPart;
+    if (deviceExtension->Unlock->UnlockQueued && remaining < (LONGLONG)timeout * DiskPerfFrequency.QuadPart)
+    {
+        timeout = (remaining > 0) ? (ULONG)(remaining / DiskPerfFrequency.QuadPart) + 1 : 1;
+    }
 
     sptdS.Sptd.Length = sizeof(SCSI_PASS_THROUGH_DIRECT);
     sptdS.Sptd.CdbLength = 12;
     sptdS.Sptd.DataIn = (cmd == IF_RECV) ? SCSI_IOCTL_DATA_IN : SCSI_IOCTL_DATA_OUT;
     sptdS.Sptd.SenseInfoLength = sizeof(sptdS.sense);
     sptdS.Sptd.DataTransferLength = (ULONG)len;
-    sptdS.Sptd.TimeOutValue = 2;
+    sptdS.Sptd.TimeOutValue = timeout;
     sptdS.Sptd.DataBuffer = dataBuffer;
     sptdS.Sptd.SenseInfoOffset = offsetof(SptdStruct, sense);
 
@@ -1935,41 +7235,123 @@ VOID SEDSleepSendSCSICommand(
     if (!NT_SUCCESS(status))
     {
         DebugPrint((0, "SEDSleepSendSCSICommand: IoGetDeviceObjectPointer exploded"));
-        return;
+        return status;
     }
 #else
     PDEVICE_OBJECT driveDevice = deviceExtension->TargetDeviceObject;
 #endif
 
-    //memset(deviceExtension->ScsiRecvBuffer, 0, SEDSLEEP_SCSI_BUFFER_SIZE);
+    //memset(deviceExtension->Unlock->ScsiRecvBuffer, 0, SEDSLEEP_SCSI_BUFFER_SIZE);
 
-    KeInitializeEvent(&event, SynchronizationEvent, FALSE);
-    PIRP irp = IoBuildDeviceIoControlRequest(
-        IOCTL_SCSI_PASS_THROUGH_DIRECT,
-        driveDevice,
-        &sptdS,
-        sizeof(sptdS),
-        &sptdS,
-        sizeof(sptdS),
-        FALSE,
-        &event,
-        &ioStatus
-    );
-    if (!irp) 
-    {
-        DebugPrint((0, "SEDSleepSendSCSICommand: Fail to build irp\n"));
-        return;
-    }
-    status = IoCallDriver(driveDevice, irp);
-    if (status == STATUS_PENDING) 
-    {
-        DebugPrint((0, "SEDSleepSendSCSICommand: Pending so we waiting\n"));
-        KeWaitForSingleObject(&event, Executive, KernelMode, FALSE, NULL);
-        DebugPrint((0, "SEDSleepSendSCSICommand: Finished waiting\n"));
-        status = ioStatus.Status;
-    }
-    if (sptdS.Sptd.ScsiStatus != 0 || !NT_SUCCESS(status))
+    for (attempt = 1; ; attempt++)
     {
+        if (attempt > 1)
+        {
+            //
+            // The pass-through writes back status and sense, and a data in
+            // buffer may have been partly filled
+            //
+            sptdS.Sptd.ScsiStatus = 0;
+            sptdS.Sptd.SenseInfoLength = sizeof(sptdS.sense);
+            sptdS.Sptd.DataTransferLength = (ULONG)len;
+            memset(sptdS.sense, 0, sizeof(sptdS.sense));
+            memcpy(dataBuffer, deviceExtension->Unlock->ScsiSendBuffer, len);
+        }
+
+        //
+        // The ATA transport sends the same command as TRUSTED SEND or
+        // RECEIVE. sptdS still describes it for the trace, the capture and
+        // the classification, with the status register folded into the
+        // SCSI status.
+        //
+        if (ata)
+        {
+            RtlZeroMemory(&aptd, sizeof(aptd));
+            aptd.Length = sizeof(ATA_PASS_THROUGH_DIRECT);
+            aptd.AtaFlags = ATA_FLAGS_DRDY_REQUIRED |
+                ((cmd == IF_RECV) ? ATA_FLAGS_DATA_IN : ATA_FLAGS_DATA_OUT);
+            aptd.DataTransferLength = (ULONG)len;
+            aptd.TimeOutValue = timeout;
+            aptd.DataBuffer = dataBuffer;
+            aptd.CurrentTaskFile[0] = protocol;                      /* Features - Security Protocol */
+            aptd.CurrentTaskFile[1] = (UCHAR)((len / 512) & 0xFF);   /* Count - Transfer Length LSB */
+            aptd.CurrentTaskFile[2] = (UCHAR)((len / 512) >> 8);     /* LBA Low - Transfer Length MSB */
+            aptd.CurrentTaskFile[3] = comID & 0xFF;                  /* LBA Mid - Security Protocol Specific LSB */
+            aptd.CurrentTaskFile[4] = comID >> 8;                    /* LBA High - Security Protocol Specific MSB */
+            aptd.CurrentTaskFile[6] = (UCHAR)cmd;                    /* Command */
+        }
+
+        KeInitializeEvent(&event, SynchronizationEvent, FALSE);
+        PIRP irp = ata ?
+            IoBuildDeviceIoControlRequest(
+                IOCTL_ATA_PASS_THROUGH_DIRECT,
+                driveDevice,
+                &aptd,
+                sizeof(aptd),
+                &aptd,
+                sizeof(aptd),
+                FALSE,
+                &event,
+                &ioStatus) :
+            IoBuildDeviceIoControlRequest(
+                IOCTL_SCSI_PASS_THROUGH_DIRECT,
+                driveDevice,
+                &sptdS,
+                sizeof(sptdS),
+                &sptdS,
+                sizeof(sptdS),
+                FALSE,
+                &event,
+                &ioStatus
+            );
+        if (!irp) 
+        {
+            DebugPrint((0, "SEDSleepSendSCSICommand: Fail to build irp\n"));
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+        LONGLONG start = KeQueryPerformanceCounter(NULL).QuadPart;
+        deviceExtension->Unlock->Result.RoundTrips++;
+        status = IoCallDriver(driveDevice, irp);
+        if (status == STATUS_PENDING) 
+        {
+            DebugPrint((0, "SEDSleepSendSCSICommand: Pending so we waiting\n"));
+            KeWaitForSingleObject(&event, Executive, KernelMode, FALSE, NULL);
+            DebugPrint((0, "SEDSleepSendSCSICommand: Finished waiting\n"));
+            status = ioStatus.Status;
+        }
+        if (ata)
+        {
+            sptdS.Sptd.SenseInfoLength = 0;
+            sptdS.Sptd.ScsiStatus =
+                (aptd.CurrentTaskFile[6] & SEDSLEEP_ATA_STATUS_BUSY) ? SEDSLEEP_SCSISTAT_BUSY :
+                (aptd.CurrentTaskFile[6] & SEDSLEEP_ATA_STATUS_ERROR) ? SEDSLEEP_SCSISTAT_CHECK_CONDITION : 0;
+        }
+        DiskPerfTraceEvent(deviceExtension,
+            (cmd == IF_SEND) ? SedTraceEventCommandSend : SedTraceEventCommandRecv,
+            sptdS.Sptd.ScsiStatus, (ULONG)status);
+        DiskPerfCaptureCommand(deviceExtension, &sptdS.Sptd, sptdS.sense, dataBuffer,
+            status, start, KeQueryPerformanceCounter(NULL).QuadPart);
+
+        result = SEDSleepClassifyCommand(status, sptdS.Sptd.ScsiStatus,
+            sptdS.sense, sptdS.Sptd.SenseInfoLength);
+        if (result == SedSleepCommandOk)
+        {
+            break;
+        }
+
+        if (result == SedSleepCommandRetry &&
+            attempt < SEDSLEEP_COMMAND_ATTEMPTS &&
+            (!deviceExtension->Unlock->UnlockQueued ||
+             KeQueryPerformanceCounter(NULL).QuadPart + (backoff * DiskPerfFrequency.QuadPart) / 1000000 <
+                deviceExtension->Unlock->UnlockDeadline))
+        {
+            DebugPrint((1, "SEDSleepSendSCSICommand: ScsiStatus %x status %x, retrying in %dus\n",
+                sptdS.Sptd.ScsiStatus, status, backoff));
+            SEDSleepBackoff(backoff);
+            backoff = min(backoff * 2, SEDSLEEP_BACKOFF_MAX_US);
+            continue;
+        }
+
         DbgPrint("SEDSleepSendSCSICommand: ScsiStatus was %x, status was %x", sptdS.Sptd.ScsiStatus, status);
         DbgPrint("SEDSleepSendSCSICommand: CDB:");
         HexDump(sptdS.Sptd.Cdb, sizeof(sptdS.Sptd.Cdb));
@@ -1977,95 +7359,131 @@ VOID SEDSleepSendSCSICommand(
         HexDump(sptdS.sense, sizeof(sptdS.sense));
         DbgPrint("SEDSleepSendSCSICommand: Hurr:");
         HexDump((UCHAR*)(&sptdS), sizeof(sptdS));
-        return;
+        if (!NT_SUCCESS(status))
+            return status;
+        return (result == SedSleepCommandRetry) ? STATUS_DEVICE_BUSY : STATUS_IO_DEVICE_ERROR;
     }
-    memcpy(deviceExtension->ScsiRecvBuffer, dataBuffer, len);
-
-    ExFreePool(dataBuffer);
+    memcpy(deviceExtension->Unlock->ScsiRecvBuffer, dataBuffer, len);
 
     DebugPrint((0, "SEDSleepSendSCSICommand: It worked I think\n"));
+    return STATUS_SUCCESS;
 }
 
+SEDSLEEP_COMMAND_RESULT SEDSleepClassifyCommand(
+    NTSTATUS status,
+    UCHAR scsiStatus,
+    const UCHAR* sense,
+    ULONG senseLength
+)
+
+/*++
+
+Routine Description:
+
+    Decide whether a pass-through command worked, is worth retrying or
+    failed for good. Busy, queue full, not ready (becoming ready or in
+    progress), unit attention and aborted command are transient. An empty
+    ComPacket from IF-RECV is not retried here: the TPer has not finished
+    the method yet, and the unlock session polls for it under its own
+    poll budget and deadline (SEDSleepOpalWait).
+
+Arguments:
+
+    status      - Pass-through IRP status.
+    scsiStatus  - SCSI status byte.
+    sense       - Sense data, fixed or descriptor format.
+    senseLength - Valid sense bytes.
+
+Return Value:
+
+    SEDSLEEP_COMMAND_RESULT
 
+--*/
 
-_Success_(return != NULL)
-_Post_maybenull_
-_Must_inspect_result_
-__drv_allocatesMem(Mem)
-_Post_writable_byte_size_(*BytesAllocated)
-_When_(((PoolType & 0x1)) != 0, _IRQL_requires_max_(APC_LEVEL))
-_When_(((PoolType & 0x1)) == 0, _IRQL_requires_max_(DISPATCH_LEVEL))
-_When_((PoolType& NonPagedPoolMustSucceed) != 0,
-    __drv_reportError("Must succeed pool allocations are forbidden. "
-        "Allocation failures cause a system crash"))
-    PVOID
-#pragma warning(suppress:28195) // Allocation is not guaranteed, caller needs to check return value
-    DsmpAllocateAlignedPool(
-        _In_ IN POOL_TYPE PoolType,
-        _In_ IN SIZE_T NumberOfBytes,
-        _In_ IN ULONG AlignmentMask,
-        _Out_ OUT SIZE_T* BytesAllocated
-    )
-    /*+++
-    Routine Description :
-        Allocates memory from the specified pool using the given tag and alignment requirement.
-        If the allocation is successful, the entire buffer will be zeroed.
-    Arguements:
-        PoolType - Pool to allocate from (NonPaged, Paged, etc)
-        NumberOfBytes - Size of the buffer to allocate
-        AlignmentMask - Alignment requirement specified by the device
-        Tag - Tag (DSM_TAG_XXX) to be used for this allocation.
-              These tags are defined in msdsm.h
-        BytesAllocated - Returns the number of bytes allocated, if the routine was successful
-    Return Value:
-        Pointer to the buffer if allocation is successful
-        NULL otherwise
-    --*/
-{
-    PVOID Block = NULL;
-    UINT_PTR align64 = (UINT_PTR)AlignmentMask;
-    ULONG totalSize = (ULONG)NumberOfBytes;
-    NTSTATUS status = STATUS_SUCCESS;
-
-    if (BytesAllocated == NULL) {
-
-        status = STATUS_INVALID_PARAMETER;
-        goto __Exit;
-    }
-
-    *BytesAllocated = 0;
-
-    if (AlignmentMask) {
-
-        status = RtlULongAdd((ULONG)NumberOfBytes, AlignmentMask, &totalSize);
+{
+    UCHAR senseKey;
+    UCHAR asc;
+    UCHAR ascq;
+
+    if (status == STATUS_DEVICE_NOT_READY ||
+        status == STATUS_DEVICE_BUSY ||
+        status == STATUS_INSUFFICIENT_RESOURCES) {
+        return SedSleepCommandRetry;
     }
 
-    if (NT_SUCCESS(status)) {
+    if (!NT_SUCCESS(status)) {
+        return SedSleepCommandFatal;
+    }
 
-#pragma warning(suppress: 6014 28118) // Block isn't leaked, this function is marked as an allocator; PoolType is simply passed through
-        Block = ExAllocatePool(PoolType, totalSize);
+    if (scsiStatus == SEDSLEEP_SCSISTAT_BUSY ||
+        scsiStatus == SEDSLEEP_SCSISTAT_QUEUE_FULL) {
+        return SedSleepCommandRetry;
+    }
 
-        if (Block != NULL) {
+    if (scsiStatus == SEDSLEEP_SCSISTAT_CHECK_CONDITION) {
 
-            if (AlignmentMask) {
+        //
+        // Response code 0x70/0x71 is fixed format, 0x72/0x73 descriptor
+        //
 
-                Block = (PVOID)(((UINT_PTR)Block + align64) & ~align64);
-            }
+        if (senseLength >= 14 && (sense[0] & 0x7e) == 0x70) {
+            senseKey = sense[2] & 0x0f;
+            asc = sense[12];
+            ascq = sense[13];
+        }
+        else if (senseLength >= 4 && (sense[0] & 0x7e) == 0x72) {
+            senseKey = sense[1] & 0x0f;
+            asc = sense[2];
+            ascq = sense[3];
         }
         else {
+            return SedSleepCommandFatal;
+        }
 
-            status = STATUS_INSUFFICIENT_RESOURCES;
+        if (senseKey == SEDSLEEP_SENSE_UNIT_ATTENTION ||
+            senseKey == SEDSLEEP_SENSE_ABORTED_COMMAND) {
+            return SedSleepCommandRetry;
         }
-    }
 
-__Exit:
+        if (senseKey == SEDSLEEP_SENSE_NOT_READY &&
+            asc == SEDSLEEP_ASC_LUN_NOT_READY &&
+            (ascq == SEDSLEEP_ASCQ_CAUSE_NOT_REPORTABLE ||
+             ascq == SEDSLEEP_ASCQ_BECOMING_READY ||
+             ascq == SEDSLEEP_ASCQ_OPERATION_IN_PROGRESS)) {
+            return SedSleepCommandRetry;
+        }
 
-    if (NT_SUCCESS(status)) {
+        return SedSleepCommandFatal;
+    }
 
-        RtlZeroMemory(Block, totalSize);
-        *BytesAllocated = totalSize;
+    if (scsiStatus != 0) {
+        return SedSleepCommandFatal;
     }
-    
-    return Block;
+
+    return SedSleepCommandOk;
 }
 
+VOID SEDSleepBackoff(
+    ULONG microseconds
+)
+
+/*++
+
+Routine Description:
+
+    Wait between attempts. Waits below a timer tick are spun, anything
+    longer sleeps.
+
+--*/
+
+{
+    LARGE_INTEGER interval;
+
+    if (microseconds < 1000) {
+        KeStallExecutionProcessor(microseconds);
+        return;
+    }
+
+    interval.QuadPart = -10LL * microseconds;
+    KeDelayExecutionThread(KernelMode, FALSE, &interval);
+}
@@ -0,0 +1,388 @@
+/*++
+
+Module Name:
+
+    sedsleepioctl.h
+
+Abstract:
+
+    Device control codes and structures shared between the SEDSleep filter
+    and user mode tools. The filter sits on every disk stack it attaches to,
+    so these are sent to the disk itself (e.g. \\.\PhysicalDrive0).
+
+Environment:
+
+    kernel and user mode
+
+Notes:
+
+--*/
+
+#ifndef _SEDSLEEPIOCTL_H_
+#define _SEDSLEEPIOCTL_H_
+
+//
+// Unlock the drive now, using the provisioned or compiled in unlock
+// commands. The request is pended and completed by the unlock worker once
+// the unlock is done; if one is already running, e.g. after resume, it
+// waits for that one. With an output buffer of at least
+// sizeof(SEDSLEEP_UNLOCK_RESULT) it completes with STATUS_SUCCESS and the
+// result, otherwise with the status of the unlock.
+//
+
+#define IOCTL_HURR_DURR_IM_A_GOAT      CTL_CODE(FILE_DEVICE_DISK, 0x4628, METHOD_BUFFERED, FILE_READ_DATA)
+
+//
+// Return the per-disk IO latency histograms as a SEDSLEEP_LATENCY_HISTOGRAMS
+//
+
+#define IOCTL_SEDSLEEP_QUERY_LATENCY   CTL_CODE(FILE_DEVICE_DISK, 0x4629, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+//
+// Enable, disable or reset latency collection, input is a
+// SEDSLEEP_LATENCY_CONTROL
+//
+
+#define IOCTL_SEDSLEEP_SET_LATENCY     CTL_CODE(FILE_DEVICE_DISK, 0x462A, METHOD_BUFFERED, FILE_WRITE_DATA)
+
+//
+// Return a trace chunk for this disk in the format described in
+// common/sedtrace.h. Input is an optional SEDSLEEP_TRACE_QUERY, the output
+// buffer should be at least SEDSLEEP_TRACE_CHUNK_SIZE bytes.
+//
+
+#define IOCTL_SEDSLEEP_QUERY_TRACE     CTL_CODE(FILE_DEVICE_DISK, 0x462B, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define SEDSLEEP_TRACE_CHUNK_SIZE      16384
+
+typedef struct _SEDSLEEP_TRACE_QUERY {
+
+    //
+    // Only return timing events with at least this sequence number, so a
+    // caller polling after every resume does not get the same events twice.
+    //
+
+    ULONG FirstSequence;
+
+} SEDSLEEP_TRACE_QUERY, * PSEDSLEEP_TRACE_QUERY;
+
+//
+// Start or stop capturing the pass-through commands sent to this disk,
+// input is a SEDSLEEP_CAPTURE_CONTROL. Stopping throws away anything not
+// yet read.
+//
+
+#define IOCTL_SEDSLEEP_SET_CAPTURE     CTL_CODE(FILE_DEVICE_DISK, 0x462C, METHOD_BUFFERED, FILE_WRITE_DATA)
+
+//
+// Return the captured commands as a trace chunk: a SEDTRACE_DEVICE record
+// followed by as many SEDTRACE_COMMAND records as fit. Returned commands
+// are removed from the capture buffer, so call until no commands come back.
+// Captures hold credentials, hence the access required.
+//
+
+#define IOCTL_SEDSLEEP_QUERY_CAPTURE   CTL_CODE(FILE_DEVICE_DISK, 0x462D, METHOD_BUFFERED, FILE_READ_DATA | FILE_WRITE_DATA)
+
+#define SEDSLEEP_CAPTURE_ENABLE        0x00000001
+
+#define SEDSLEEP_CAPTURE_DEFAULT_SIZE  (64 * 1024)
+#define SEDSLEEP_CAPTURE_MAX_SIZE      (1024 * 1024)
+
+typedef struct _SEDSLEEP_CAPTURE_CONTROL {
+
+    //
+    // SEDSLEEP_CAPTURE_xxx flags. Capture is stopped if ENABLE is clear.
+    //
+
+    ULONG Flags;
+
+    //
+    // Capture buffer size in bytes, zero for SEDSLEEP_CAPTURE_DEFAULT_SIZE.
+    // Commands that do not fit are dropped and counted.
+    //
+
+    ULONG BufferSize;
+
+} SEDSLEEP_CAPTURE_CONTROL, * PSEDSLEEP_CAPTURE_CONTROL;
+
+//
+// Set the unlock deadline, retry budget and policy, input is a
+// SEDSLEEP_UNLOCK_CONTROL. Applies from the next resume.
+//
+
+#define IOCTL_SEDSLEEP_SET_UNLOCK      CTL_CODE(FILE_DEVICE_DISK, 0x462E, METHOD_BUFFERED, FILE_WRITE_DATA)
+
+#define SEDSLEEP_UNLOCK_MAX_RETRIES          16
+#define SEDSLEEP_UNLOCK_MAX_COMMAND_TIMEOUT  60
+
+//
+// Leave the drive locked on resume and only unlock it once read/write IO
+// arrives for it. Resume does not wait on drives nobody is using; the
+// first IO waits for the whole unlock instead.
+//
+
+#define SEDSLEEP_UNLOCK_LAZY                 0x00000001
+
+//
+// Wait for each reply before sending the next command, even if the drive
+// says it takes queued ComPackets.
+//
+
+#define SEDSLEEP_UNLOCK_NO_PIPELINE          0x00000002
+
+//
+// Which power transitions the drive is expected to lose power in, and so
+// be locked after. S3, hybrid sleep, hibernation and fast startup are by
+// default; S1 and S2 only with STANDBY, for platforms that cut drive power
+// there too.
+//
+// Across hibernation and fast startup the drive is unlocked again by
+// pre-boot authentication before the boot loader can read the hiberfile,
+// so the unlock on resume only confirms it. SKIP_HIBERNATE leaves the gate
+// open for them instead. Hybrid sleep is always treated as S3, since it
+// may come back without going through pre-boot authentication.
+//
+
+#define SEDSLEEP_UNLOCK_STANDBY              0x00000004
+#define SEDSLEEP_UNLOCK_SKIP_HIBERNATE       0x00000008
+
+typedef struct _SEDSLEEP_UNLOCK_CONTROL {
+
+    //
+    // How long after the disk is powered up read/write IO may be held
+    // waiting for the unlock. Once it passes, held IO is failed with
+    // STATUS_IO_TIMEOUT and new IO fails until the unlock completes.
+    // Zero waits for as long as the unlock takes.
+    //
+
+    ULONG DeadlineMs;
+
+    //
+    // How many times a failed unlock is tried again within the deadline.
+    // IO is failed with STATUS_IO_DEVICE_ERROR if none of them works.
+    //
+
+    ULONG Retries;
+
+    //
+    // Pass-through timeout for each command in seconds, zero keeps the
+    // current setting. Commands are also cut short at the deadline.
+    //
+
+    ULONG CommandTimeout;
+
+    //
+    // SEDSLEEP_UNLOCK_* policy flags, zero unlocks as soon as the disk is
+    // powered up after S3, hybrid sleep, hibernation or fast startup. With
+    // SEDSLEEP_UNLOCK_LAZY the deadline runs from the first IO rather than
+    // from power up.
+    //
+
+    ULONG Flags;
+
+} SEDSLEEP_UNLOCK_CONTROL, * PSEDSLEEP_UNLOCK_CONTROL;
+
+//
+// Hand the filter the unlock credential and locking ranges of a drive,
+// input is a SEDSLEEP_PROVISION. Can be sent to any disk, the drive is
+// picked by serial number. Replaces the compiled in unlock commands for
+// that drive from the next unlock on. Only held in memory, so it has to be
+// sent again every boot.
+//
+
+#define IOCTL_SEDSLEEP_PROVISION       CTL_CODE(FILE_DEVICE_DISK, 0x462F, METHOD_BUFFERED, FILE_READ_DATA | FILE_WRITE_DATA)
+
+#define SEDSLEEP_PROVISION_VERSION          2
+#define SEDSLEEP_PROVISION_SERIAL_LENGTH    32
+#define SEDSLEEP_PROVISION_MAX_CREDENTIAL   32
+#define SEDSLEEP_PROVISION_MAX_RANGES       8
+#define SEDSLEEP_PROVISION_SALT_LENGTH      20
+
+#define SEDSLEEP_PROVISION_MBR_DONE         0x00000001  // also set MBRDone
+#define SEDSLEEP_PROVISION_CLEAR            0x00000002  // back to the compiled in commands
+#define SEDSLEEP_PROVISION_DERIVE           0x00000004  // Credential is a password, version 2 only
+
+#define SEDSLEEP_PROVISION_HASH_SHA1        0           // sedutil
+#define SEDSLEEP_PROVISION_HASH_SHA256      1
+#define SEDSLEEP_PROVISION_HASH_SHA512      2
+
+typedef struct _SEDSLEEP_PROVISION {
+
+    ULONG Version;                  // SEDSLEEP_PROVISION_VERSION
+    ULONG Flags;                    // SEDSLEEP_PROVISION_xxx
+
+    //
+    // Serial number as the disk reports it, without padding. Empty means
+    // the disk this is sent to.
+    //
+
+    CHAR SerialNumber[SEDSLEEP_PROVISION_SERIAL_LENGTH];
+
+    //
+    // Authority to authenticate as in the Locking SP, e.g. Admin1 is
+    // 00 00 00 09 00 01 00 01. All zero means Admin1.
+    //
+
+    UCHAR Authority[8];
+
+    //
+    // The PIN exactly as the drive checks it, i.e. after any hashing the
+    // tool that set it applied
+    //
+
+    ULONG CredentialLength;
+    UCHAR Credential[SEDSLEEP_PROVISION_MAX_CREDENTIAL];
+
+    //
+    // Locking ranges to unlock for read and write, 0 is the global range
+    //
+
+    ULONG RangeCount;
+    UCHAR Range[SEDSLEEP_PROVISION_MAX_RANGES];
+
+    //
+    // Version 2. With SEDSLEEP_PROVISION_DERIVE the filter hashes the
+    // password in Credential the way sedutil does, PBKDF2 into a 32 byte
+    // PIN. Iterations 0 is sedutil's 75000. A salt of all zeroes is the
+    // serial number as the drive reports it, untrimmed and padded with
+    // spaces to 20 bytes. When SerialNumber names another drive only the
+    // trimmed serial is known, so if that drive pads its serial at the
+    // front the salt has to be spelled out.
+    //
+
+    ULONG Hash;                     // SEDSLEEP_PROVISION_HASH_xxx
+    ULONG Iterations;
+    UCHAR Salt[SEDSLEEP_PROVISION_SALT_LENGTH];
+
+} SEDSLEEP_PROVISION, * PSEDSLEEP_PROVISION;
+
+#define SEDSLEEP_PROVISION_V1_SIZE          FIELD_OFFSET(SEDSLEEP_PROVISION, Hash)
+
+//
+// Stop the unlock that is running after the command in flight, and
+// complete every pending IOCTL_HURR_DURR_IM_A_GOAT with STATUS_CANCELLED.
+// An unlock started by resume is only stopped if its gate is already
+// open, IO waiting on the drive is never left stranded.
+//
+
+#define IOCTL_SEDSLEEP_CANCEL_UNLOCK   CTL_CODE(FILE_DEVICE_DISK, 0x4630, METHOD_BUFFERED, FILE_READ_DATA)
+
+//
+// Return the progress of the unlock running now, or the result of the last
+// one, as a SEDSLEEP_UNLOCK_RESULT. Does not wait.
+//
+
+#define IOCTL_SEDSLEEP_QUERY_UNLOCK    CTL_CODE(FILE_DEVICE_DISK, 0x4631, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define SEDSLEEP_UNLOCK_RESULT_VERSION      1
+
+//
+// One unlock command per locking range, plus MBRDone
+//
+
+#define SEDSLEEP_UNLOCK_MAX_COMMANDS        (SEDSLEEP_PROVISION_MAX_RANGES + 1)
+
+#define SEDSLEEP_UNLOCK_RESULT_RUNNING      0x00000001  // not finished yet
+#define SEDSLEEP_UNLOCK_RESULT_CANCELLED    0x00000002  // stopped by IOCTL_SEDSLEEP_CANCEL_UNLOCK
+
+typedef struct _SEDSLEEP_UNLOCK_RESULT {
+
+    ULONG Version;                  // SEDSLEEP_UNLOCK_RESULT_VERSION
+    ULONG Flags;                    // SEDSLEEP_UNLOCK_RESULT_xxx
+
+    //
+    // Counts the unlocks of this disk, so a caller can tell a new result
+    // from the one it saw last
+    //
+
+    ULONG Sequence;
+
+    //
+    // NTSTATUS of the unlock, STATUS_PENDING while it runs
+    //
+
+    LONG Status;
+
+    //
+    // Times the whole unlock was tried, and pass-through commands sent for
+    // it including retries of single commands
+    //
+
+    ULONG Attempts;
+    ULONG RoundTrips;
+
+    //
+    // Unlock commands run by the last attempt so far and the NTSTATUS of
+    // each, in the order they were sent: the locking ranges, then MBRDone
+    //
+
+    ULONG CommandCount;
+    LONG CommandStatus[SEDSLEEP_UNLOCK_MAX_COMMANDS];
+
+    //
+    // From queueing the unlock until it finished, or until now while it
+    // runs
+    //
+
+    ULONG64 DurationMicroseconds;
+
+} SEDSLEEP_UNLOCK_RESULT, * PSEDSLEEP_UNLOCK_RESULT;
+
+//
+// Latency histograms are log-linear in microseconds: every power of two is
+// split into SEDSLEEP_LATENCY_SUB_BUCKETS linear steps. Buckets 0-3 hold
+// exactly 0-3us, after that bucket b starts at SEDSLEEP_LATENCY_BUCKET_FLOOR(b).
+// The last bucket also collects everything longer than it.
+//
+
+#define SEDSLEEP_LATENCY_BUCKETS       128
+#define SEDSLEEP_LATENCY_SUB_BUCKETS   4
+
+#define SEDSLEEP_LATENCY_BUCKET_FLOOR(b)                                      \
+    ((b) < SEDSLEEP_LATENCY_SUB_BUCKETS ? (ULONG64)(b) :                        \
+     (ULONG64)(SEDSLEEP_LATENCY_SUB_BUCKETS + ((b) & 3)) << (((b) >> 2) - 1))
+
+typedef enum _SEDSLEEP_LATENCY_CLASS {
+    SedSleepLatencySteady = 0,      // normal operation
+    SedSleepLatencyResume,          // first ResumeWindowMs after resume
+    SedSleepLatencyClassCount
+} SEDSLEEP_LATENCY_CLASS;
+
+#define SEDSLEEP_LATENCY_ENABLE        0x00000001
+#define SEDSLEEP_LATENCY_RESET         0x00000002
+
+typedef struct _SEDSLEEP_LATENCY_CONTROL {
+
+    //
+    // SEDSLEEP_LATENCY_xxx flags. Collection is disabled if ENABLE is clear.
+    //
+
+    ULONG Flags;
+
+    //
+    // How long after resume IO is counted in the resume histogram,
+    // zero keeps the current setting
+    //
+
+    ULONG ResumeWindowMs;
+
+} SEDSLEEP_LATENCY_CONTROL, * PSEDSLEEP_LATENCY_CONTROL;
+
+typedef struct _SEDSLEEP_LATENCY_HISTOGRAM {
+    ULONG64 Count;
+    ULONG64 TotalMicroseconds;
+    ULONG64 MaxMicroseconds;
+    ULONG64 Buckets[SEDSLEEP_LATENCY_BUCKETS];
+} SEDSLEEP_LATENCY_HISTOGRAM, * PSEDSLEEP_LATENCY_HISTOGRAM;
+
+#define SEDSLEEP_LATENCY_VERSION       1
+
+typedef struct _SEDSLEEP_LATENCY_HISTOGRAMS {
+    ULONG Version;
+    ULONG Flags;                    // SEDSLEEP_LATENCY_ENABLE if collecting
+    ULONG ResumeWindowMs;
+    ULONG DiskNumber;
+    SEDSLEEP_LATENCY_HISTOGRAM Class[SedSleepLatencyClassCount];
+} SEDSLEEP_LATENCY_HISTOGRAMS, * PSEDSLEEP_LATENCY_HISTOGRAMS;
+
+#endif // _SEDSLEEPIOCTL_H_
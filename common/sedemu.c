@@ -0,0 +1,774 @@
+/*++
+
+Module Name:
+
+    sedemu.c
+
+Abstract:
+
+    The emulated TPer, see sedemu.h.
+
+Environment:
+
+    User mode, POSIX
+
+--*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "sedemu.h"
+#include "sedopal.h"
+#include "sedunlock.h"
+
+#define SED_EMU_COMID           4100
+#define SED_EMU_BUFFER          2048
+#define SED_EMU_QUEUE           16
+#define SED_EMU_MAX_TOKENS      256
+#define SED_EMU_MAX_PIN         64
+#define SED_EMU_FIRST_TSN       0x1000
+
+//
+// Level 0 Discovery features reported
+//
+
+#define SED_EMU_FEATURE_TPER        0x0001
+#define SED_EMU_FEATURE_OPAL2       0x0203
+#define SED_EMU_TPER_SYNC           0x01
+#define SED_EMU_TPER_ASYNC          0x02
+#define SED_EMU_LOCKING_MBR_ENABLED 0x10
+#define SED_EMU_LOCKING_MBR_DONE    0x20
+
+#define SED_EMU_COLUMN_MBR_ENABLE   1
+
+typedef struct _SED_EMU_REPLY {
+    uint64_t Ready;                 // monotonic ns
+    uint32_t Length;
+    uint8_t Data[SED_EMU_BUFFER];
+} SED_EMU_REPLY;
+
+typedef struct _SED_EMU {
+    SED_TRANSPORT Transport;
+    char* StateFile;
+    char Serial[21];
+    uint8_t Pin[SED_EMU_MAX_PIN];
+    uint32_t PinLength;
+    uint32_t ReadLocked;            // bit per locking range
+    uint32_t WriteLocked;
+    int MbrDone;
+    int Asynchronous;
+    uint32_t LatencyUs;
+
+    uint32_t Tsn;                   // open session, 0 if none
+    uint32_t Hsn;
+    uint32_t NextTsn;
+
+    uint64_t Busy;                  // when the last queued reply is ready
+    uint32_t Head;
+    uint32_t Count;
+    SED_EMU_REPLY Queue[SED_EMU_QUEUE];
+
+    SED_OPAL_TOKEN Tokens[SED_EMU_MAX_TOKENS];  // of the ComPacket being taken
+} SED_EMU;
+
+static uint64_t
+EmuNowNs(
+    void
+)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+static int
+IsControl(
+    const SED_OPAL_TOKEN* Token,
+    uint8_t Control
+)
+{
+    return Token->Kind == SedOpalTokenControl && Token->Control == Control;
+}
+
+static int
+IsUid(
+    const SED_OPAL_TOKEN* Token,
+    const uint8_t* Uid
+)
+{
+    return Token->Kind == SedOpalTokenBytes && Token->Length == 8 && memcmp(Token->Bytes, Uid, 8) == 0;
+}
+
+static const SED_OPAL_TOKEN*
+FindNamed(
+    const SED_OPAL_TOKEN* Tokens,
+    uint32_t First,
+    uint32_t Last,
+    uint64_t Name
+)
+
+/*++
+
+Routine Description:
+
+    The value of the first name = value pair with an atom value and a
+    uinteger name between First and Last, at any depth
+
+--*/
+
+{
+    uint32_t i;
+
+    for (i = First; i + 3 < Last; i++) {
+        if (IsControl(&Tokens[i], SED_OPAL_START_NAME) &&
+            Tokens[i + 1].Kind == SedOpalTokenUint && Tokens[i + 1].Value == Name &&
+            Tokens[i + 2].Kind != SedOpalTokenControl &&
+            IsControl(&Tokens[i + 3], SED_OPAL_END_NAME)) {
+            return &Tokens[i + 2];
+        }
+    }
+
+    return NULL;
+}
+
+static void
+EmuProperties(
+    SED_EMU* Emu,
+    SED_OPAL_ENCODER* Encoder,
+    const SED_OPAL_TOKEN* Tokens,
+    uint32_t First,
+    uint32_t Last
+)
+
+/*++
+
+Routine Description:
+
+    The host offers Asynchronous = 1 among its properties; it is accepted
+    if this TPer takes queued ComPackets
+
+--*/
+
+{
+    int      hostAsync = 0;
+    uint32_t i;
+
+    for (i = First; i + 3 < Last; i++) {
+        if (IsControl(&Tokens[i], SED_OPAL_START_NAME) &&
+            Tokens[i + 1].Kind == SedOpalTokenBytes && Tokens[i + 1].Length == 12 &&
+            memcmp(Tokens[i + 1].Bytes, "Asynchronous", 12) == 0 &&
+            Tokens[i + 2].Kind == SedOpalTokenUint && Tokens[i + 2].Value != 0) {
+            hostAsync = 1;
+        }
+    }
+
+    SedOpalPutControl(Encoder, SED_OPAL_CALL);
+    SedOpalPutBytes(Encoder, SedOpalSessionManager, 8);
+    SedOpalPutBytes(Encoder, SedOpalMethodProperties, 8);
+    SedOpalPutControl(Encoder, SED_OPAL_START_LIST);
+    SedOpalPutControl(Encoder, SED_OPAL_START_LIST);
+    SedOpalPutName(Encoder, "MaxComPacketSize", SED_EMU_BUFFER);
+    SedOpalPutName(Encoder, "MaxResponseComPacketSize", SED_EMU_BUFFER);
+    SedOpalPutName(Encoder, "MaxPackets", 1);
+    SedOpalPutName(Encoder, "MaxSubpackets", 1);
+    SedOpalPutName(Encoder, "Asynchronous", Emu->Asynchronous);
+    SedOpalPutControl(Encoder, SED_OPAL_END_LIST);
+    SedOpalPutControl(Encoder, SED_OPAL_START_NAME);
+    SedOpalPutUint(Encoder, 0);
+    SedOpalPutControl(Encoder, SED_OPAL_START_LIST);
+    SedOpalPutName(Encoder, "Asynchronous", Emu->Asynchronous && hostAsync);
+    SedOpalPutControl(Encoder, SED_OPAL_END_LIST);
+    SedOpalPutControl(Encoder, SED_OPAL_END_NAME);
+    SedOpalPutControl(Encoder, SED_OPAL_END_LIST);
+    SedOpalPutStatus(Encoder, SED_OPAL_STATUS_SUCCESS);
+}
+
+static void
+EmuStartSession(
+    SED_EMU* Emu,
+    SED_OPAL_ENCODER* Encoder,
+    const SED_OPAL_TOKEN* Tokens,
+    uint32_t First,
+    uint32_t Last
+)
+
+/*++
+
+Routine Description:
+
+    [ HSN SP Write HostChallenge = PIN HostSigningAuthority = authority ].
+    Any authority is taken if the PIN is right. A second session is
+    refused while one is open.
+
+--*/
+
+{
+    const SED_OPAL_TOKEN* challenge = FindNamed(Tokens, First, Last, SED_OPAL_HOST_CHALLENGE);
+    const SED_OPAL_TOKEN* authority = FindNamed(Tokens, First, Last, SED_OPAL_HOST_SIGNING_AUTHORITY);
+    uint8_t  status = SED_OPAL_STATUS_SUCCESS;
+    uint32_t hsn = 0;
+    uint32_t tsn = 0;
+
+    if (Last - First < 4 ||
+        Tokens[First + 1].Kind != SedOpalTokenUint || Tokens[First + 1].Value > 0xFFFFFFFF) {
+        status = SED_OPAL_STATUS_FAIL;
+    }
+    else if (Emu->Tsn != 0) {
+        status = SED_OPAL_STATUS_SP_BUSY;
+    }
+    else if (!IsUid(&Tokens[First + 2], SedUnlockLockingSp) ||
+        challenge == NULL || challenge->Kind != SedOpalTokenBytes ||
+        challenge->Length != Emu->PinLength || memcmp(challenge->Bytes, Emu->Pin, Emu->PinLength) != 0 ||
+        authority == NULL || authority->Kind != SedOpalTokenBytes || authority->Length != 8) {
+        status = SED_OPAL_STATUS_NOT_AUTHORIZED;
+    }
+
+    if (Last - First >= 2 && Tokens[First + 1].Kind == SedOpalTokenUint) {
+        hsn = (uint32_t)Tokens[First + 1].Value;
+    }
+
+    if (status == SED_OPAL_STATUS_SUCCESS) {
+        tsn = Emu->NextTsn++;
+        Emu->Tsn = tsn;
+        Emu->Hsn = hsn;
+    }
+
+    SedOpalPutControl(Encoder, SED_OPAL_CALL);
+    SedOpalPutBytes(Encoder, SedOpalSessionManager, 8);
+    SedOpalPutBytes(Encoder, SedOpalMethodSyncSession, 8);
+    SedOpalPutControl(Encoder, SED_OPAL_START_LIST);
+    SedOpalPutUint(Encoder, hsn);
+    SedOpalPutUint(Encoder, tsn);
+    SedOpalPutControl(Encoder, SED_OPAL_END_LIST);
+    SedOpalPutStatus(Encoder, status);
+}
+
+static int
+EmuObject(
+    const SED_OPAL_TOKEN* Token
+)
+
+/*++
+
+Routine Description:
+
+    Locking range number of a Locking table object, SED_EMU_MAX_RANGES
+    for MBRControl, -1 for anything else
+
+--*/
+
+{
+    if (IsUid(Token, SedUnlockGlobalRange)) {
+        return 0;
+    }
+    if (IsUid(Token, SedUnlockMbrControl)) {
+        return SED_EMU_MAX_RANGES;
+    }
+    if (Token->Kind == SedOpalTokenBytes && Token->Length == 8 &&
+        memcmp(Token->Bytes, SedUnlockLockingRange, 7) == 0 &&
+        Token->Bytes[7] != 0 && Token->Bytes[7] < SED_EMU_MAX_RANGES) {
+        return Token->Bytes[7];
+    }
+    return -1;
+}
+
+static int
+EmuColumn(
+    SED_EMU* Emu,
+    int Object,
+    uint32_t Column,
+    uint64_t* Value
+)
+{
+    if (Object == SED_EMU_MAX_RANGES) {
+        if (Column == SED_EMU_COLUMN_MBR_ENABLE) {
+            *Value = 1;
+            return 1;
+        }
+        if (Column == SED_OPAL_COLUMN_DONE) {
+            *Value = Emu->MbrDone;
+            return 1;
+        }
+        return 0;
+    }
+
+    if (Column == SED_OPAL_COLUMN_READ_LOCKED) {
+        *Value = (Emu->ReadLocked >> Object) & 1;
+        return 1;
+    }
+    if (Column == SED_OPAL_COLUMN_WRITE_LOCKED) {
+        *Value = (Emu->WriteLocked >> Object) & 1;
+        return 1;
+    }
+    return 0;
+}
+
+static void
+EmuSessionMethod(
+    SED_EMU* Emu,
+    SED_OPAL_ENCODER* Encoder,
+    const SED_OPAL_TOKEN* Tokens,
+    uint32_t Call,
+    uint32_t First,
+    uint32_t Last
+)
+
+/*++
+
+Routine Description:
+
+    Set [ Values = [ column = value ... ] ] or Get [ [ startColumn = a
+    endColumn = b ] ] on a locking range or MBRControl
+
+--*/
+
+{
+    int      object = EmuObject(&Tokens[Call + 1]);
+    uint64_t value;
+    uint32_t column;
+    uint32_t i;
+
+    if (object >= 0 && IsUid(&Tokens[Call + 2], SedOpalMethodSet)) {
+        for (i = First; i + 3 < Last; i++) {
+            if (!IsControl(&Tokens[i], SED_OPAL_START_NAME) ||
+                Tokens[i + 1].Kind != SedOpalTokenUint || Tokens[i + 2].Kind != SedOpalTokenUint) {
+                continue;
+            }
+
+            column = (uint32_t)Tokens[i + 1].Value;
+            value = Tokens[i + 2].Value;
+
+            if (object == SED_EMU_MAX_RANGES) {
+                if (column == SED_OPAL_COLUMN_DONE) {
+                    Emu->MbrDone = value != 0;
+                }
+            }
+            else if (column == SED_OPAL_COLUMN_READ_LOCKED) {
+                Emu->ReadLocked = value ? (Emu->ReadLocked | (1u << object)) : (Emu->ReadLocked & ~(1u << object));
+            }
+            else if (column == SED_OPAL_COLUMN_WRITE_LOCKED) {
+                Emu->WriteLocked = value ? (Emu->WriteLocked | (1u << object)) : (Emu->WriteLocked & ~(1u << object));
+            }
+        }
+
+        SedOpalPutControl(Encoder, SED_OPAL_START_LIST);
+        SedOpalPutControl(Encoder, SED_OPAL_END_LIST);
+        SedOpalPutStatus(Encoder, SED_OPAL_STATUS_SUCCESS);
+        return;
+    }
+
+    if (object >= 0 && IsUid(&Tokens[Call + 2], SedOpalMethodGet)) {
+        const SED_OPAL_TOKEN* start = FindNamed(Tokens, First, Last, 3);
+        const SED_OPAL_TOKEN* end = FindNamed(Tokens, First, Last, 4);
+        uint32_t from = (start != NULL && start->Kind == SedOpalTokenUint) ? (uint32_t)start->Value : 0;
+        uint32_t to = (end != NULL && end->Kind == SedOpalTokenUint) ? (uint32_t)end->Value : 31;
+
+        SedOpalPutControl(Encoder, SED_OPAL_START_LIST);
+        SedOpalPutControl(Encoder, SED_OPAL_START_LIST);
+        for (column = from; column <= to && column < 32; column++) {
+            if (EmuColumn(Emu, object, column, &value)) {
+                SedOpalPutColumn(Encoder, column, value);
+            }
+        }
+        SedOpalPutControl(Encoder, SED_OPAL_END_LIST);
+        SedOpalPutControl(Encoder, SED_OPAL_END_LIST);
+        SedOpalPutStatus(Encoder, SED_OPAL_STATUS_SUCCESS);
+        return;
+    }
+
+    SedOpalPutControl(Encoder, SED_OPAL_START_LIST);
+    SedOpalPutControl(Encoder, SED_OPAL_END_LIST);
+    SedOpalPutStatus(Encoder, SED_OPAL_STATUS_FAIL);
+}
+
+static int
+EmuIfSend(
+    SED_TRANSPORT* Transport,
+    uint8_t Protocol,
+    uint16_t ComId,
+    const void* Data,
+    uint32_t Length
+)
+
+/*++
+
+Routine Description:
+
+    Take one ComPacket and queue the reply to every call in it: method
+    calls, each up to its end of data and status list, and EndSession.
+    Calls inside a session that is not the open one are dropped.
+
+--*/
+
+{
+    SED_EMU*         emu = (SED_EMU*)Transport;
+    SED_OPAL_TOKEN*  tokens = emu->Tokens;
+    const uint8_t*   packet = Data;
+    SED_EMU_REPLY*   reply;
+    SED_OPAL_ENCODER encoder;
+    uint32_t         payload;
+    uint32_t         payloadLength;
+    uint32_t         offset;
+    uint32_t         count = 0;
+    uint32_t         tsn;
+    uint32_t         hsn;
+    uint32_t         i;
+    uint32_t         end;
+    uint32_t         depth;
+    uint64_t         now;
+    int              status;
+
+    if (Protocol != 1 || ComId != SED_EMU_COMID ||
+        SedOpalPayload(packet, Length, &payload, &payloadLength) != SED_OPAL_OK) {
+        return SED_ERROR_DEVICE;
+    }
+
+    if (emu->Count == SED_EMU_QUEUE || (!emu->Asynchronous && emu->Count != 0)) {
+        return SED_ERROR_DEVICE;
+    }
+
+    offset = payload;
+    for (;;) {
+        if (count == SED_EMU_MAX_TOKENS) {
+            return SED_ERROR_DEVICE;
+        }
+        status = SedOpalNextToken(packet, payload + payloadLength, &offset, &tokens[count]);
+        if (status == SED_OPAL_END) {
+            break;
+        }
+        if (status != SED_OPAL_OK) {
+            return SED_ERROR_DEVICE;
+        }
+        count++;
+    }
+
+    tsn = SedOpalGet32(packet + SED_OPAL_PACKET_TSN);
+    hsn = SedOpalGet32(packet + SED_OPAL_PACKET_HSN);
+
+    reply = &emu->Queue[(emu->Head + emu->Count) % SED_EMU_QUEUE];
+    SedOpalBeginPacket(&encoder, reply->Data, sizeof(reply->Data), ComId, tsn, hsn);
+
+    for (i = 0; i < count; ) {
+        int inSession = (tsn != 0 && tsn == emu->Tsn && hsn == emu->Hsn);
+
+        if (IsControl(&tokens[i], SED_OPAL_END_OF_SESSION)) {
+            if (inSession) {
+                emu->Tsn = 0;
+                SedOpalPutControl(&encoder, SED_OPAL_END_OF_SESSION);
+            }
+            i++;
+            continue;
+        }
+
+        if (!IsControl(&tokens[i], SED_OPAL_CALL) || i + 3 >= count ||
+            !IsControl(&tokens[i + 3], SED_OPAL_START_LIST)) {
+            break;
+        }
+
+        //
+        // Arguments run to the matching end of list, then EOD and the
+        // five tokens of the status list
+        //
+
+        for (end = i + 3, depth = 0; end < count; end++) {
+            if (IsControl(&tokens[end], SED_OPAL_START_LIST)) {
+                depth++;
+            }
+            else if (IsControl(&tokens[end], SED_OPAL_END_LIST) && --depth == 0) {
+                break;
+            }
+        }
+        if (end + 6 >= count || !IsControl(&tokens[end + 1], SED_OPAL_END_OF_DATA)) {
+            break;
+        }
+
+        if (IsUid(&tokens[i + 1], SedOpalSessionManager) && tsn == 0) {
+            if (IsUid(&tokens[i + 2], SedOpalMethodProperties)) {
+                EmuProperties(emu, &encoder, tokens, i + 3, end + 1);
+            }
+            else if (IsUid(&tokens[i + 2], SedOpalMethodStartSession)) {
+                EmuStartSession(emu, &encoder, tokens, i + 3, end + 1);
+            }
+        }
+        else if (inSession) {
+            EmuSessionMethod(emu, &encoder, tokens, i, i + 3, end + 1);
+        }
+
+        i = end + 7;
+    }
+
+    if (encoder.Length == SED_OPAL_PAYLOAD_OFFSET ||
+        SedOpalEndPacket(&encoder, &reply->Length) != SED_OPAL_OK) {
+        return SED_OK;
+    }
+
+    now = EmuNowNs();
+    reply->Ready = ((emu->Busy > now) ? emu->Busy : now) + (uint64_t)emu->LatencyUs * 1000;
+    emu->Busy = reply->Ready;
+    emu->Count++;
+    return SED_OK;
+}
+
+static void
+EmuDiscovery(
+    SED_EMU* Emu,
+    uint8_t* Data,
+    uint32_t Length
+)
+{
+    uint8_t  discovery[SED_OPAL_DISCOVERY_HEADER + 3 * 16 + 4];
+    uint8_t* feature = discovery + SED_OPAL_DISCOVERY_HEADER;
+
+    memset(discovery, 0, sizeof(discovery));
+
+    feature[1] = SED_EMU_FEATURE_TPER;
+    feature[2] = 0x10;
+    feature[3] = 12;
+    feature[4] = SED_EMU_TPER_SYNC | (Emu->Asynchronous ? SED_EMU_TPER_ASYNC : 0);
+    feature += 16;
+
+    feature[1] = SED_OPAL_FEATURE_LOCKING;
+    feature[2] = 0x10;
+    feature[3] = 12;
+    feature[4] = SED_OPAL_LOCKING_SUPPORTED | SED_OPAL_LOCKING_ENABLED | SED_EMU_LOCKING_MBR_ENABLED |
+        ((Emu->ReadLocked | Emu->WriteLocked) ? SED_OPAL_LOCKING_LOCKED : 0) |
+        (Emu->MbrDone ? SED_EMU_LOCKING_MBR_DONE : 0);
+    feature += 16;
+
+    feature[0] = (uint8_t)(SED_EMU_FEATURE_OPAL2 >> 8);
+    feature[1] = (uint8_t)SED_EMU_FEATURE_OPAL2;
+    feature[2] = 0x10;
+    feature[3] = 16;
+    feature[4] = (uint8_t)(SED_EMU_COMID >> 8);
+    feature[5] = (uint8_t)SED_EMU_COMID;
+    feature[7] = 1;
+    feature += 20;
+
+    SedOpalPut32(discovery, (uint32_t)(feature - discovery) - 4);
+    discovery[7] = 1;
+
+    memcpy(Data, discovery, Length < sizeof(discovery) ? Length : sizeof(discovery));
+}
+
+static int
+EmuIfRecv(
+    SED_TRANSPORT* Transport,
+    uint8_t Protocol,
+    uint16_t ComId,
+    void* Data,
+    uint32_t Length
+)
+
+/*++
+
+Routine Description:
+
+    Hand back the oldest reply once it is ready. Until then the ComPacket
+    is empty, with OutstandingData saying there is more to come.
+
+--*/
+
+{
+    SED_EMU*       emu = (SED_EMU*)Transport;
+    uint8_t*       data = Data;
+    SED_EMU_REPLY* reply;
+
+    memset(data, 0, Length);
+
+    if (Protocol == 1 && ComId == SED_OPAL_DISCOVERY_COMID) {
+        EmuDiscovery(emu, data, Length);
+        return SED_OK;
+    }
+
+    if (Protocol != 1 || ComId != SED_EMU_COMID || Length < SED_OPAL_COMPACKET_HEADER) {
+        return SED_ERROR_DEVICE;
+    }
+
+    reply = &emu->Queue[emu->Head];
+
+    if (emu->Count == 0 || EmuNowNs() < reply->Ready) {
+        data[SED_OPAL_COMPACKET_COMID] = (uint8_t)(ComId >> 8);
+        data[SED_OPAL_COMPACKET_COMID + 1] = (uint8_t)ComId;
+        SedOpalPut32(data + SED_OPAL_COMPACKET_OUTSTANDING, emu->Count != 0);
+        return SED_OK;
+    }
+
+    if (reply->Length > Length) {
+        return SED_ERROR_DEVICE;
+    }
+
+    memcpy(data, reply->Data, reply->Length);
+    emu->Head = (emu->Head + 1) % SED_EMU_QUEUE;
+    emu->Count--;
+    return SED_OK;
+}
+
+static void
+EmuSave(
+    SED_EMU* Emu
+)
+{
+    FILE*    file = fopen(Emu->StateFile, "w");
+    uint32_t i;
+
+    if (file == NULL) {
+        return;
+    }
+
+    fprintf(file, "serial=%s\npin=", Emu->Serial);
+    for (i = 0; i < Emu->PinLength; i++) {
+        fprintf(file, "%02x", Emu->Pin[i]);
+    }
+    fprintf(file, "\nlocked=%x\nmbrdone=%d\nasync=%d\nlatency=%u\n",
+        Emu->ReadLocked | Emu->WriteLocked, Emu->MbrDone, Emu->Asynchronous, Emu->LatencyUs);
+    fclose(file);
+}
+
+static void
+EmuClose(
+    SED_TRANSPORT* Transport
+)
+{
+    SED_EMU* emu = (SED_EMU*)Transport;
+
+    if (emu->StateFile != NULL) {
+        EmuSave(emu);
+    }
+    free(emu->StateFile);
+    free(emu);
+}
+
+static const SED_TRANSPORT_OPS EmuOps = {
+    EmuIfSend,
+    EmuIfRecv,
+    EmuClose
+};
+
+static int
+EmuLoad(
+    SED_EMU* Emu,
+    FILE* File
+)
+{
+    char     line[256];
+    char*    value;
+    uint32_t i;
+
+    while (fgets(line, sizeof(line), File) != NULL) {
+        line[strcspn(line, "\r\n")] = 0;
+        value = strchr(line, '=');
+        if (line[0] == '#' || value == NULL) {
+            continue;
+        }
+        *value++ = 0;
+
+        if (strcmp(line, "serial") == 0) {
+            snprintf(Emu->Serial, sizeof(Emu->Serial), "%s", value);
+        }
+        else if (strcmp(line, "pin") == 0) {
+            for (i = 0; value[2 * i] != 0 && value[2 * i + 1] != 0 && i < SED_EMU_MAX_PIN; i++) {
+                unsigned int byte;
+
+                if (sscanf(value + 2 * i, "%2x", &byte) != 1) {
+                    return 0;
+                }
+                Emu->Pin[i] = (uint8_t)byte;
+            }
+            Emu->PinLength = i;
+        }
+        else if (strcmp(line, "locked") == 0) {
+            Emu->ReadLocked = Emu->WriteLocked = (uint32_t)strtoul(value, NULL, 16) & ((1u << SED_EMU_MAX_RANGES) - 1);
+        }
+        else if (strcmp(line, "mbrdone") == 0) {
+            Emu->MbrDone = atoi(value) != 0;
+        }
+        else if (strcmp(line, "async") == 0) {
+            Emu->Asynchronous = atoi(value) != 0;
+        }
+        else if (strcmp(line, "latency") == 0) {
+            Emu->LatencyUs = (uint32_t)strtoul(value, NULL, 10);
+        }
+    }
+
+    return 1;
+}
+
+static void
+EmuInitialize(
+    SED_EMU* Emu
+)
+{
+    Emu->Transport.Ops = &EmuOps;
+    Emu->Transport.Name = "emulated";
+    Emu->Transport.SerialNumber = Emu->Serial;
+    Emu->NextTsn = SED_EMU_FIRST_TSN;
+}
+
+SED_TRANSPORT*
+SedEmuOpen(
+    const char* StateFile
+)
+{
+    SED_EMU* emu = calloc(1, sizeof(*emu));
+    FILE*    file;
+    int      loaded;
+
+    if (emu == NULL) {
+        return NULL;
+    }
+
+    file = fopen(StateFile, "r");
+    if (file == NULL) {
+        free(emu);
+        return NULL;
+    }
+
+    loaded = EmuLoad(emu, file);
+    fclose(file);
+
+    emu->StateFile = strdup(StateFile);
+    if (!loaded || emu->StateFile == NULL) {
+        free(emu->StateFile);
+        free(emu);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    EmuInitialize(emu);
+    return &emu->Transport;
+}
+
+SED_TRANSPORT*
+SedEmuCreate(
+    const SED_EMU_CONFIG* Config
+)
+{
+    SED_EMU* emu;
+
+    if (Config->PinLength > SED_EMU_MAX_PIN) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    emu = calloc(1, sizeof(*emu));
+    if (emu == NULL) {
+        return NULL;
+    }
+
+    snprintf(emu->Serial, sizeof(emu->Serial), "%s", Config->Serial != NULL ? Config->Serial : "");
+    memcpy(emu->Pin, Config->Pin, Config->PinLength);
+    emu->PinLength = Config->PinLength;
+    emu->ReadLocked = emu->WriteLocked = Config->Locked & ((1u << SED_EMU_MAX_RANGES) - 1);
+    emu->MbrDone = Config->MbrDone != 0;
+    emu->Asynchronous = Config->Asynchronous != 0;
+    emu->LatencyUs = Config->LatencyUs;
+
+    EmuInitialize(emu);
+    return &emu->Transport;
+}
@@ -0,0 +1,78 @@
+/*++
+
+Module Name:
+
+    sedemu.h
+
+Abstract:
+
+    An emulated Opal TPer as a SED_TRANSPORT, so the unlock path can be
+    run end to end without a drive. It answers Level 0 Discovery, the
+    session manager Properties and StartSession methods, Set and Get on
+    the Locking and MBRControl tables of the Locking SP, and EndSession.
+    Anything else gets a FAIL status.
+
+    Its state lives in a small text file, one name=value per line, read
+    when the transport is opened and written back when it is closed:
+
+        serial=EMU0000000000001     serial number
+        pin=70617373776f7264        hex, the PIN every authority accepts
+        locked=1ff                  hex mask, bit n for locking range n
+                                    (0 is the global range), both read
+                                    and write locked
+        mbrdone=0
+        async=1                     take queued ComPackets
+        latency=200                 microseconds each reply takes to be
+                                    ready; until then IF-RECV returns an
+                                    empty ComPacket
+
+    A synchronous TPer fails an IF-SEND while a reply is still unread, as
+    a drive would reject the out of sequence command.
+
+    SedEmuCreate makes one from the same settings without a file, for
+    benchmarks that want many of them; its state is dropped on close.
+
+Environment:
+
+    User mode, POSIX
+
+--*/
+
+#ifndef _SEDEMU_H_
+#define _SEDEMU_H_
+
+#include "sedtransport.h"
+
+#define SED_EMU_MAX_RANGES      9
+
+typedef struct _SED_EMU_CONFIG {
+    const char* Serial;
+    const uint8_t* Pin;
+    uint32_t PinLength;
+    uint32_t Locked;                // bit per locking range
+    int MbrDone;
+    int Asynchronous;
+    uint32_t LatencyUs;
+} SED_EMU_CONFIG;
+
+//
+// Open the emulated TPer described by StateFile. Returns NULL with errno
+// set if the file cannot be read.
+//
+
+SED_TRANSPORT*
+SedEmuOpen(
+    const char* StateFile
+);
+
+//
+// Create an emulated TPer that lives only in memory. Returns NULL if it
+// cannot be allocated or Config is out of range.
+//
+
+SED_TRANSPORT*
+SedEmuCreate(
+    const SED_EMU_CONFIG* Config
+);
+
+#endif // _SEDEMU_H_
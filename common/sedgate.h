@@ -0,0 +1,273 @@
+/*++
+
+Module Name:
+
+    sedgate.h
+
+Abstract:
+
+    Lock-free resume gate. Read/write IO has to be held back from the time
+    a drive goes to sleep (and locks itself) until it has been unlocked
+    again after resume. The gate is a single pointer sized word:
+
+        SED_GATE_OPEN       IO passes straight through
+        NULL                closed, nothing parked
+        entry pointer       closed, the most recently parked entry, which
+                            links to the one before it (a LIFO list)
+        SED_GATE_FAILED     the unlock failed, IO is failed
+        SED_GATE_REMOVED    the device is going away, IO is failed for good
+
+    Entering an open gate is one load. Parking is a compare-exchange push
+    onto the list, and opening (or failing) the gate swaps the whole list
+    out with one compare-exchange, so an entry is either seen by the
+    opener or sees the gate open; it can never be left behind. Entries
+    come back newest first, SedGateReverse puts them in arrival order.
+
+    The atomics default to the Interlocked/ReadPointerAcquire intrinsics on
+    Windows and the __atomic builtins elsewhere. Define SED_GATE_LOAD and
+    SED_GATE_CAS before including this file to supply your own, e.g.
+    tools/gatecheck.c turns each of them into a scheduling point to
+    explore interleavings deterministically.
+
+Environment:
+
+    kernel and user mode, Windows and Linux
+
+--*/
+
+#ifndef _SEDGATE_H_
+#define _SEDGATE_H_
+
+#include <stdint.h>
+
+typedef struct _SED_GATE_ENTRY {
+    struct _SED_GATE_ENTRY* Next;
+} SED_GATE_ENTRY, * PSED_GATE_ENTRY;
+
+typedef struct _SED_GATE {
+    void* volatile State;
+} SED_GATE, * PSED_GATE;
+
+//
+// Entries are pointer aligned, so the states that are not a list can
+// never be mistaken for one
+//
+
+#define SED_GATE_OPEN               ((void*)(uintptr_t)1)
+#define SED_GATE_FAILED             ((void*)(uintptr_t)3)
+#define SED_GATE_REMOVED            ((void*)(uintptr_t)5)
+
+#define SED_GATE_IS_CLOSED(s)       (((uintptr_t)(s) & 1) == 0)
+
+typedef enum _SED_GATE_RESULT {
+    SedGateResultPass,              // go ahead with the IO
+    SedGateResultParked,            // entry now belongs to the gate
+    SedGateResultFail               // complete the IO with an error
+} SED_GATE_RESULT;
+
+#ifndef SED_GATE_LOAD
+#if defined(_MSC_VER)
+#define SED_GATE_LOAD(p)            ReadPointerAcquire((PVOID volatile*)(p))
+#define SED_GATE_CAS(p, n, o)       InterlockedCompareExchangePointer((PVOID volatile*)(p), (n), (o))
+#else
+#define SED_GATE_LOAD(p)            __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define SED_GATE_CAS(p, n, o)       SedGateCasBuiltin((p), (n), (o))
+
+static __inline void*
+SedGateCasBuiltin(
+    void* volatile* Target,
+    void* New,
+    void* Old
+)
+{
+    __atomic_compare_exchange_n(Target, &Old, New, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+    return Old;
+}
+#endif
+#endif
+
+static __inline void
+SedGateInitialize(
+    PSED_GATE Gate,
+    int Open
+)
+{
+    Gate->State = Open ? SED_GATE_OPEN : (void*)0;
+}
+
+static __inline int
+SedGateIsOpen(
+    PSED_GATE Gate
+)
+{
+    return SED_GATE_LOAD(&Gate->State) == SED_GATE_OPEN;
+}
+
+//
+// Closed, i.e. waiting to be opened or failed (not failed or removed)
+//
+
+static __inline int
+SedGateIsClosed(
+    PSED_GATE Gate
+)
+{
+    return SED_GATE_IS_CLOSED(SED_GATE_LOAD(&Gate->State));
+}
+
+//
+// Close the gate before the drive goes to sleep. A failed gate closes too,
+// so the next resume gets another go at unlocking; a removed one stays
+// removed. Returns nonzero if this call closed it.
+//
+
+static __inline int
+SedGateClose(
+    PSED_GATE Gate
+)
+{
+    void* state = SED_GATE_LOAD(&Gate->State);
+
+    while (state == SED_GATE_OPEN || state == SED_GATE_FAILED) {
+        void* seen = SED_GATE_CAS(&Gate->State, (void*)0, state);
+
+        if (seen == state) {
+            return 1;
+        }
+        state = seen;
+    }
+
+    return 0;
+}
+
+//
+// Try to pass the gate. If it is closed the entry is parked and will be
+// handed back by SedGateOpen or SedGateFail; *First is set if it is the
+// first entry parked since the gate closed.
+//
+
+static __inline SED_GATE_RESULT
+SedGateEnter(
+    PSED_GATE Gate,
+    PSED_GATE_ENTRY Entry,
+    int* First
+)
+{
+    void* state = SED_GATE_LOAD(&Gate->State);
+
+    for (;;) {
+        void* seen;
+
+        if (state == SED_GATE_OPEN) {
+            return SedGateResultPass;
+        }
+
+        if (!SED_GATE_IS_CLOSED(state)) {
+            return SedGateResultFail;
+        }
+
+        Entry->Next = (PSED_GATE_ENTRY)state;
+        seen = SED_GATE_CAS(&Gate->State, (void*)Entry, state);
+        if (seen == state) {
+            if (First != 0) {
+                *First = (state == (void*)0);
+            }
+            return SedGateResultParked;
+        }
+        state = seen;
+    }
+}
+
+//
+// Swap a closed gate to NewState and return what was parked, newest first.
+// Nothing is returned, and the state is left alone, if the gate was not
+// closed (already open, failed or removed), except that removing always
+// wins.
+//
+
+static __inline PSED_GATE_ENTRY
+SedGateRelease(
+    PSED_GATE Gate,
+    void* NewState
+)
+{
+    void* state = SED_GATE_LOAD(&Gate->State);
+
+    for (;;) {
+        void* seen;
+
+        if (!SED_GATE_IS_CLOSED(state) &&
+            (NewState != SED_GATE_REMOVED || state == SED_GATE_REMOVED)) {
+            return 0;
+        }
+
+        seen = SED_GATE_CAS(&Gate->State, NewState, state);
+        if (seen == state) {
+            return SED_GATE_IS_CLOSED(state) ? (PSED_GATE_ENTRY)state : 0;
+        }
+        state = seen;
+    }
+}
+
+//
+// The drive is unlocked, let IO through and return the parked entries to
+// be sent on
+//
+
+static __inline PSED_GATE_ENTRY
+SedGateOpen(
+    PSED_GATE Gate
+)
+{
+    return SedGateRelease(Gate, SED_GATE_OPEN);
+}
+
+//
+// The unlock failed, fail IO until the gate is closed again and return the
+// parked entries to be failed
+//
+
+static __inline PSED_GATE_ENTRY
+SedGateFail(
+    PSED_GATE Gate
+)
+{
+    return SedGateRelease(Gate, SED_GATE_FAILED);
+}
+
+//
+// The device is being removed, fail all IO from now on and return the
+// parked entries to be failed. Nothing can open the gate afterwards.
+//
+
+static __inline PSED_GATE_ENTRY
+SedGateRemove(
+    PSED_GATE Gate
+)
+{
+    return SedGateRelease(Gate, SED_GATE_REMOVED);
+}
+
+//
+// Reverse a released list into arrival order
+//
+
+static __inline PSED_GATE_ENTRY
+SedGateReverse(
+    PSED_GATE_ENTRY List
+)
+{
+    PSED_GATE_ENTRY reversed = 0;
+
+    while (List != 0) {
+        PSED_GATE_ENTRY next = List->Next;
+
+        List->Next = reversed;
+        reversed = List;
+        List = next;
+    }
+
+    return reversed;
+}
+
+#endif // _SEDGATE_H_
@@ -0,0 +1,340 @@
+/*++
+
+Module Name:
+
+    sedlinux.c
+
+Abstract:
+
+    SG_IO and NVMe admin passthrough transport, see sedlinux.h.
+
+Environment:
+
+    User mode, Linux
+
+--*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include <linux/nvme_ioctl.h>
+#include <scsi/sg.h>
+
+#include "sedlinux.h"
+
+#define SED_SCSI_SECURITY_PROTOCOL_IN   0xA2
+#define SED_SCSI_SECURITY_PROTOCOL_OUT  0xB5
+#define SED_SCSI_INQUIRY                0x12
+#define SED_SCSI_ATA_PASS_THROUGH_16    0x85
+#define SED_SCSI_INC_512                0x80
+#define SED_SCSI_VPD_SERIAL_NUMBER      0x80
+
+#define SED_ATA_TRUSTED_RECEIVE         0x5C
+#define SED_ATA_TRUSTED_SEND            0x5E
+#define SED_ATA_PIO_DATA_IN             4
+#define SED_ATA_PIO_DATA_OUT            5
+#define SED_ATA_T_DIR_IN                0x08    // T_DIR, in the ATA PASS-THROUGH flags byte
+#define SED_ATA_BYTE_BLOCK_SECTORS      0x06    // BYT_BLOK, T_LENGTH in the count field
+
+#define SED_NVME_SECURITY_SEND          0x81
+#define SED_NVME_SECURITY_RECEIVE       0x82
+#define SED_NVME_IDENTIFY               0x06
+#define SED_NVME_IDENTIFY_CONTROLLER    1
+#define SED_NVME_SERIAL_OFFSET          4
+
+#define SED_SERIAL_LENGTH               20
+#define SED_SENSE_LENGTH                32
+
+typedef struct _SED_LINUX {
+    SED_TRANSPORT Transport;
+    int Fd;
+    SED_LINUX_KIND Kind;
+    char Serial[SED_SERIAL_LENGTH + 1];
+} SED_LINUX;
+
+static int
+SgIo(
+    int Fd,
+    const uint8_t* Cdb,
+    uint8_t CdbLength,
+    int Direction,
+    void* Data,
+    uint32_t Length
+)
+{
+    uint8_t     sense[SED_SENSE_LENGTH];
+    sg_io_hdr_t io;
+
+    memset(&io, 0, sizeof(io));
+    io.interface_id = 'S';
+    io.dxfer_direction = Direction;
+    io.cmd_len = CdbLength;
+    io.cmdp = (unsigned char*)Cdb;
+    io.mx_sb_len = sizeof(sense);
+    io.sbp = sense;
+    io.dxfer_len = Length;
+    io.dxferp = Data;
+    io.timeout = SED_LINUX_TIMEOUT_MS;
+
+    if (ioctl(Fd, SG_IO, &io) < 0) {
+        return SED_ERROR_IO;
+    }
+
+    if ((io.info & SG_INFO_OK_MASK) != SG_INFO_OK) {
+        return (io.host_status != 0) ? SED_ERROR_IO : SED_ERROR_DEVICE;
+    }
+
+    return SED_OK;
+}
+
+static int
+NvmeAdmin(
+    int Fd,
+    uint8_t Opcode,
+    uint32_t Cdw10,
+    uint32_t Cdw11,
+    void* Data,
+    uint32_t Length
+)
+{
+    struct nvme_admin_cmd cmd;
+    int result;
+
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.opcode = Opcode;
+    cmd.addr = (uint64_t)(uintptr_t)Data;
+    cmd.data_len = Length;
+    cmd.cdw10 = Cdw10;
+    cmd.cdw11 = Cdw11;
+    cmd.timeout_ms = SED_LINUX_TIMEOUT_MS;
+
+    result = ioctl(Fd, NVME_IOCTL_ADMIN_CMD, &cmd);
+    if (result < 0) {
+        return SED_ERROR_IO;
+    }
+
+    return (result == 0) ? SED_OK : SED_ERROR_DEVICE;
+}
+
+static int
+LinuxSecurity(
+    SED_LINUX* Linux,
+    int In,
+    uint8_t Protocol,
+    uint16_t ComId,
+    void* Data,
+    uint32_t Length
+)
+
+/*++
+
+Routine Description:
+
+    One IF-SEND or IF-RECV. The SCSI and ATA forms count 512 byte blocks,
+    as the filter's do, so Length must be a whole number of them.
+
+--*/
+
+{
+    uint8_t  cdb[16];
+    uint32_t blocks = Length / 512;
+
+    memset(cdb, 0, sizeof(cdb));
+
+    switch (Linux->Kind) {
+
+    case SedLinuxNvme:
+        return NvmeAdmin(Linux->Fd, In ? SED_NVME_SECURITY_RECEIVE : SED_NVME_SECURITY_SEND,
+            ((uint32_t)Protocol << 24) | ((uint32_t)ComId << 8), Length, Data, Length);
+
+    case SedLinuxAta:
+        if (Length % 512 != 0 || blocks > 0xFFFF) {
+            return SED_ERROR_INVALID;
+        }
+
+        cdb[0] = SED_SCSI_ATA_PASS_THROUGH_16;
+        cdb[1] = (In ? SED_ATA_PIO_DATA_IN : SED_ATA_PIO_DATA_OUT) << 1;
+        cdb[2] = SED_ATA_BYTE_BLOCK_SECTORS | (In ? SED_ATA_T_DIR_IN : 0);
+        cdb[4] = Protocol;                          /* Features - Security Protocol */
+        cdb[6] = (uint8_t)blocks;                   /* Count - Transfer Length LSB */
+        cdb[8] = (uint8_t)(blocks >> 8);            /* LBA Low - Transfer Length MSB */
+        cdb[10] = (uint8_t)ComId;                   /* LBA Mid - Security Protocol Specific LSB */
+        cdb[12] = (uint8_t)(ComId >> 8);            /* LBA High - Security Protocol Specific MSB */
+        cdb[14] = In ? SED_ATA_TRUSTED_RECEIVE : SED_ATA_TRUSTED_SEND;
+        return SgIo(Linux->Fd, cdb, 16, In ? SG_DXFER_FROM_DEV : SG_DXFER_TO_DEV, Data, Length);
+
+    default:
+        if (Length % 512 != 0) {
+            return SED_ERROR_INVALID;
+        }
+
+        cdb[0] = In ? SED_SCSI_SECURITY_PROTOCOL_IN : SED_SCSI_SECURITY_PROTOCOL_OUT;
+        cdb[1] = Protocol;
+        cdb[2] = (uint8_t)(ComId >> 8);
+        cdb[3] = (uint8_t)ComId;
+        cdb[4] = SED_SCSI_INC_512;
+        cdb[6] = (uint8_t)(blocks >> 24);
+        cdb[7] = (uint8_t)(blocks >> 16);
+        cdb[8] = (uint8_t)(blocks >> 8);
+        cdb[9] = (uint8_t)blocks;
+        return SgIo(Linux->Fd, cdb, 12, In ? SG_DXFER_FROM_DEV : SG_DXFER_TO_DEV, Data, Length);
+    }
+}
+
+static int
+LinuxIfSend(
+    SED_TRANSPORT* Transport,
+    uint8_t Protocol,
+    uint16_t ComId,
+    const void* Data,
+    uint32_t Length
+)
+{
+    return LinuxSecurity((SED_LINUX*)Transport, 0, Protocol, ComId, (void*)Data, Length);
+}
+
+static int
+LinuxIfRecv(
+    SED_TRANSPORT* Transport,
+    uint8_t Protocol,
+    uint16_t ComId,
+    void* Data,
+    uint32_t Length
+)
+{
+    memset(Data, 0, Length);
+    return LinuxSecurity((SED_LINUX*)Transport, 1, Protocol, ComId, Data, Length);
+}
+
+static void
+LinuxClose(
+    SED_TRANSPORT* Transport
+)
+{
+    SED_LINUX* device = (SED_LINUX*)Transport;
+
+    close(device->Fd);
+    free(device);
+}
+
+static const SED_TRANSPORT_OPS LinuxOps = {
+    LinuxIfSend,
+    LinuxIfRecv,
+    LinuxClose
+};
+
+static void
+CopySerial(
+    SED_LINUX* Linux,
+    const uint8_t* Serial,
+    uint32_t Length
+)
+
+/*++
+
+Routine Description:
+
+    Keep the serial number as the drive reports it, padding and all.
+    sedutil salts the PIN with the first 20 bytes untrimmed, so a drive
+    that pads its serial at the front must keep those spaces.
+
+--*/
+
+{
+    uint32_t i;
+
+    if (Length > SED_SERIAL_LENGTH) {
+        Length = SED_SERIAL_LENGTH;
+    }
+    for (i = 0; i < Length && Serial[i] != 0; i++) {
+        Linux->Serial[i] = (char)Serial[i];
+    }
+
+    Linux->Serial[i] = 0;
+    Linux->Transport.SerialNumber = Linux->Serial;
+}
+
+static int
+NvmeIdentify(
+    SED_LINUX* Linux
+)
+{
+    uint8_t identify[4096];
+
+    if (NvmeAdmin(Linux->Fd, SED_NVME_IDENTIFY, SED_NVME_IDENTIFY_CONTROLLER, 0,
+        identify, sizeof(identify)) != SED_OK) {
+        return 0;
+    }
+
+    CopySerial(Linux, identify + SED_NVME_SERIAL_OFFSET, SED_SERIAL_LENGTH);
+    return 1;
+}
+
+static void
+ScsiInquirySerial(
+    SED_LINUX* Linux
+)
+{
+    uint8_t cdb[6] = { SED_SCSI_INQUIRY, 0x01, SED_SCSI_VPD_SERIAL_NUMBER, 0, 252, 0 };
+    uint8_t page[252];
+
+    memset(page, 0, sizeof(page));
+    if (SgIo(Linux->Fd, cdb, sizeof(cdb), SG_DXFER_FROM_DEV, page, sizeof(page)) == SED_OK &&
+        page[1] == SED_SCSI_VPD_SERIAL_NUMBER) {
+        CopySerial(Linux, page + 4, page[3] < sizeof(page) - 4 ? page[3] : sizeof(page) - 4);
+    }
+}
+
+SED_TRANSPORT*
+SedLinuxOpen(
+    const char* Path,
+    SED_LINUX_KIND Kind
+)
+{
+    SED_LINUX* device = calloc(1, sizeof(*device));
+
+    if (device == NULL) {
+        return NULL;
+    }
+
+    device->Transport.Ops = &LinuxOps;
+    device->Fd = open(Path, O_RDWR | O_NONBLOCK);
+    if (device->Fd < 0) {
+        free(device);
+        return NULL;
+    }
+
+    //
+    // Identify Controller both tells an NVMe device apart and gives its
+    // serial number
+    //
+
+    if (Kind == SedLinuxAuto || Kind == SedLinuxNvme) {
+        if (NvmeIdentify(device)) {
+            Kind = SedLinuxNvme;
+        }
+        else if (Kind == SedLinuxNvme) {
+            close(device->Fd);
+            free(device);
+            errno = ENOTTY;
+            return NULL;
+        }
+        else {
+            Kind = SedLinuxScsi;
+        }
+    }
+
+    if (Kind != SedLinuxNvme) {
+        ScsiInquirySerial(device);
+    }
+
+    device->Kind = Kind;
+    device->Transport.Name = (Kind == SedLinuxNvme) ? "nvme" : (Kind == SedLinuxAta) ? "ata" : "scsi";
+    return &device->Transport;
+}
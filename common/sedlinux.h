@@ -0,0 +1,56 @@
+/*++
+
+Module Name:
+
+    sedlinux.h
+
+Abstract:
+
+    SED_TRANSPORT over a Linux block or NVMe device:
+
+        scsi    SECURITY PROTOCOL IN/OUT through SG_IO. libata translates
+                these to TRUSTED RECEIVE/SEND for SATA drives, and USB
+                bridges that pass them on work too.
+        ata     ATA PASS-THROUGH(16) carrying TRUSTED RECEIVE/SEND, for
+                SCSI layers that do not translate the security commands.
+        nvme    Security Receive/Send admin commands through
+                NVME_IOCTL_ADMIN_CMD, on /dev/nvmeN or a namespace.
+
+    The serial number (INQUIRY unit serial number page, or Identify
+    Controller) is read when the transport is opened, as the salt for
+    sedutil style PINs.
+
+    Needs CAP_SYS_RAWIO, or read and write access to the device node.
+
+Environment:
+
+    User mode, Linux
+
+--*/
+
+#ifndef _SEDLINUX_H_
+#define _SEDLINUX_H_
+
+#include "sedtransport.h"
+
+typedef enum _SED_LINUX_KIND {
+    SedLinuxAuto,                   // nvme if the device answers Identify, else scsi
+    SedLinuxScsi,
+    SedLinuxAta,
+    SedLinuxNvme
+} SED_LINUX_KIND;
+
+#define SED_LINUX_TIMEOUT_MS    10000
+
+//
+// Open Path. Returns NULL with errno set if it cannot be opened, or if
+// Kind is SedLinuxNvme and it is not an NVMe device.
+//
+
+SED_TRANSPORT*
+SedLinuxOpen(
+    const char* Path,
+    SED_LINUX_KIND Kind
+);
+
+#endif // _SEDLINUX_H_
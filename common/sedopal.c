@@ -0,0 +1,1255 @@
+/*++
+
+Module Name:
+
+    sedopal.c
+
+Abstract:
+
+    TCG Storage token encoding and decoding, see sedopal.h.
+
+Environment:
+
+    kernel and user mode, Windows and Linux
+
+--*/
+
+#include <string.h>
+
+#include "sedopal.h"
+
+const uint8_t SedOpalMethodSet[8] = { 0x00, 0x00, 0x00, 0x06, 0x00, 0x00, 0x00, 0x17 };
+const uint8_t SedOpalMethodGet[8] = { 0x00, 0x00, 0x00, 0x06, 0x00, 0x00, 0x00, 0x16 };
+const uint8_t SedOpalSessionManager[8] = { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xFF };
+const uint8_t SedOpalMethodProperties[8] = { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xFF, 0x01 };
+const uint8_t SedOpalMethodStartSession[8] = { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xFF, 0x02 };
+const uint8_t SedOpalMethodSyncSession[8] = { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xFF, 0x03 };
+
+//
+// Get cell block names
+//
+
+#define SED_OPAL_START_COLUMN       3
+#define SED_OPAL_END_COLUMN         4
+
+int
+SedOpalPayload(
+    const uint8_t* ComPacket,
+    uint32_t Length,
+    uint32_t* PayloadOffset,
+    uint32_t* PayloadLength
+)
+{
+    uint32_t comPacketLength;
+    uint32_t packetLength;
+    uint32_t subPacketLength;
+
+    if (Length < SED_OPAL_PAYLOAD_OFFSET) {
+        return SED_OPAL_ERROR_INVALID;
+    }
+
+    comPacketLength = SedOpalGet32(ComPacket + SED_OPAL_COMPACKET_LENGTH);
+    packetLength = SedOpalGet32(ComPacket + SED_OPAL_PACKET_LENGTH);
+    subPacketLength = SedOpalGet32(ComPacket + SED_OPAL_SUBPACKET_LENGTH);
+
+    if (comPacketLength > Length - SED_OPAL_COMPACKET_HEADER ||
+        packetLength > comPacketLength - SED_OPAL_PACKET_HEADER ||
+        comPacketLength < SED_OPAL_PACKET_HEADER ||
+        packetLength < SED_OPAL_SUBPACKET_HEADER ||
+        subPacketLength > packetLength - SED_OPAL_SUBPACKET_HEADER) {
+        return SED_OPAL_ERROR_INVALID;
+    }
+
+    *PayloadOffset = SED_OPAL_PAYLOAD_OFFSET;
+    *PayloadLength = subPacketLength;
+    return SED_OPAL_OK;
+}
+
+int
+SedOpalNextToken(
+    const uint8_t* Data,
+    uint32_t Length,
+    uint32_t* Offset,
+    SED_OPAL_TOKEN* Token
+)
+
+/*++
+
+Routine Description:
+
+    Decode one token. Atoms are tiny (the value is in the token byte),
+    short (up to 15 bytes), medium (up to 2047) or long (24 bit length);
+    anything from 0xF0 up is a control token. Empty tokens are skipped.
+
+--*/
+
+{
+    uint32_t offset = *Offset;
+    uint32_t header;
+    uint32_t length;
+    uint8_t  b;
+    int      isBytes;
+    int      isSigned;
+    uint32_t i;
+
+    for (;;) {
+        if (offset >= Length) {
+            *Offset = offset;
+            return SED_OPAL_END;
+        }
+
+        b = Data[offset];
+        if (b != SED_OPAL_EMPTY) {
+            break;
+        }
+        offset++;
+    }
+
+    memset(Token, 0, sizeof(*Token));
+
+    if (b < 0x80) {
+        if (b & 0x40) {
+            Token->Kind = SedOpalTokenInt;
+            Token->Value = (uint64_t)(int64_t)((int8_t)(b << 2) >> 2);
+        }
+        else {
+            Token->Kind = SedOpalTokenUint;
+            Token->Value = b;
+        }
+        *Offset = offset + 1;
+        return SED_OPAL_OK;
+    }
+
+    if (b >= 0xF0) {
+        Token->Kind = SedOpalTokenControl;
+        Token->Control = b;
+        *Offset = offset + 1;
+        return SED_OPAL_OK;
+    }
+
+    if (b < 0xC0) {
+        header = 1;
+        length = b & 0x0F;
+        isBytes = (b & 0x20) != 0;
+        isSigned = (b & 0x10) != 0;
+    }
+    else if (b < 0xE0) {
+        if (Length - offset < 2) {
+            return SED_OPAL_ERROR_INVALID;
+        }
+        header = 2;
+        length = ((uint32_t)(b & 0x07) << 8) | Data[offset + 1];
+        isBytes = (b & 0x10) != 0;
+        isSigned = (b & 0x08) != 0;
+    }
+    else if (b < 0xE4) {
+        if (Length - offset < 4) {
+            return SED_OPAL_ERROR_INVALID;
+        }
+        header = 4;
+        length = ((uint32_t)Data[offset + 1] << 16) | ((uint32_t)Data[offset + 2] << 8) | Data[offset + 3];
+        isBytes = (b & 0x02) != 0;
+        isSigned = (b & 0x01) != 0;
+    }
+    else {
+        return SED_OPAL_ERROR_INVALID;
+    }
+
+    if (length > Length - offset - header) {
+        return SED_OPAL_ERROR_INVALID;
+    }
+
+    Token->Bytes = Data + offset + header;
+    Token->Length = length;
+
+    if (isBytes) {
+        Token->Kind = SedOpalTokenBytes;
+    }
+    else {
+        if (length > 8) {
+            return SED_OPAL_ERROR_INVALID;
+        }
+        Token->Kind = isSigned ? SedOpalTokenInt : SedOpalTokenUint;
+        for (i = 0; i < length; i++) {
+            Token->Value = (Token->Value << 8) | Token->Bytes[i];
+        }
+    }
+
+    *Offset = offset + header + length;
+    return SED_OPAL_OK;
+}
+
+static int
+SedOpalReaderSubPacket(
+    SED_OPAL_READER* Reader
+)
+
+/*++
+
+Routine Description:
+
+    Move to the payload of the next data SubPacket, in this Packet or a
+    later one. Payloads are padded to a multiple of four bytes, but the
+    padding after the last one may be left out. Credit control SubPackets
+    carry no tokens and are passed over.
+
+--*/
+
+{
+    const uint8_t* data = Reader->ComPacket;
+    uint32_t at;
+    uint32_t length;
+    uint32_t padded;
+
+    for (;;) {
+        if (Reader->PacketEnd - Reader->NextSubPacket >= SED_OPAL_SUBPACKET_HEADER) {
+            at = Reader->NextSubPacket;
+            length = SedOpalGet32(data + at + SED_OPAL_SUBPACKET_LENGTH_FIELD);
+            if (length > Reader->PacketEnd - at - SED_OPAL_SUBPACKET_HEADER) {
+                return SED_OPAL_ERROR_INVALID;
+            }
+
+            Reader->Offset = at + SED_OPAL_SUBPACKET_HEADER;
+            Reader->PayloadEnd = Reader->Offset + length;
+
+            padded = (length + 3) & ~3u;
+            Reader->NextSubPacket = (padded > Reader->PacketEnd - Reader->Offset) ?
+                Reader->PacketEnd : Reader->Offset + padded;
+
+            if (((data[at + SED_OPAL_SUBPACKET_KIND_FIELD] << 8) |
+                 data[at + SED_OPAL_SUBPACKET_KIND_FIELD + 1]) == SED_OPAL_SUBPACKET_DATA) {
+                return SED_OPAL_OK;
+            }
+            continue;
+        }
+
+        at = Reader->PacketEnd;
+        if (Reader->End - at < SED_OPAL_PACKET_HEADER) {
+            Reader->Offset = Reader->PayloadEnd;
+            return SED_OPAL_END;
+        }
+
+        length = SedOpalGet32(data + at + SED_OPAL_PACKET_LENGTH_FIELD);
+        if (length > Reader->End - at - SED_OPAL_PACKET_HEADER) {
+            return SED_OPAL_ERROR_INVALID;
+        }
+
+        Reader->NextSubPacket = at + SED_OPAL_PACKET_HEADER;
+        Reader->PacketEnd = Reader->NextSubPacket + length;
+    }
+}
+
+int
+SedOpalReaderInit(
+    SED_OPAL_READER* Reader,
+    const uint8_t* ComPacket,
+    uint32_t Length
+)
+{
+    uint32_t comPacketLength;
+    int      status;
+
+    if (Length < SED_OPAL_COMPACKET_HEADER + SED_OPAL_PACKET_HEADER) {
+        return SED_OPAL_ERROR_INVALID;
+    }
+
+    comPacketLength = SedOpalGet32(ComPacket + SED_OPAL_COMPACKET_LENGTH);
+    if (comPacketLength > Length - SED_OPAL_COMPACKET_HEADER ||
+        comPacketLength < SED_OPAL_PACKET_HEADER) {
+        return SED_OPAL_ERROR_INVALID;
+    }
+
+    Reader->ComPacket = ComPacket;
+    Reader->End = SED_OPAL_COMPACKET_HEADER + comPacketLength;
+    Reader->PacketEnd = SED_OPAL_COMPACKET_HEADER;
+    Reader->NextSubPacket = SED_OPAL_COMPACKET_HEADER;
+    Reader->Offset = SED_OPAL_COMPACKET_HEADER;
+    Reader->PayloadEnd = SED_OPAL_COMPACKET_HEADER;
+
+    status = SedOpalReaderSubPacket(Reader);
+    return (status == SED_OPAL_END) ? SED_OPAL_OK : status;
+}
+
+int
+SedOpalReaderNext(
+    SED_OPAL_READER* Reader,
+    SED_OPAL_TOKEN* Token
+)
+{
+    int status;
+
+    for (;;) {
+        status = SedOpalNextToken(Reader->ComPacket, Reader->PayloadEnd, &Reader->Offset, Token);
+        if (status != SED_OPAL_END) {
+            return status;
+        }
+
+        status = SedOpalReaderSubPacket(Reader);
+        if (status != SED_OPAL_OK) {
+            return status;
+        }
+    }
+}
+
+int
+SedOpalReaderSkip(
+    SED_OPAL_READER* Reader,
+    uint8_t* Control
+)
+
+/*++
+
+Routine Description:
+
+    The atom header gives the whole length of the atom, so stepping over
+    even a long byte string costs no more than a tiny atom.
+
+--*/
+
+{
+    const uint8_t* data = Reader->ComPacket;
+    uint32_t offset;
+    uint32_t left;
+    uint32_t length;
+    uint8_t  b;
+    int      status;
+
+    for (;;) {
+        offset = Reader->Offset;
+        if (offset >= Reader->PayloadEnd) {
+            status = SedOpalReaderSubPacket(Reader);
+            if (status != SED_OPAL_OK) {
+                return status;
+            }
+            continue;
+        }
+
+        b = data[offset];
+        if (b != SED_OPAL_EMPTY) {
+            break;
+        }
+        Reader->Offset = offset + 1;
+    }
+
+    left = Reader->PayloadEnd - offset;
+    *Control = 0;
+
+    if (b < 0x80) {
+        length = 1;
+    }
+    else if (b >= 0xF0) {
+        *Control = b;
+        length = 1;
+    }
+    else if (b < 0xC0) {
+        length = 1 + (b & 0x0F);
+    }
+    else if (b < 0xE0) {
+        if (left < 2) {
+            return SED_OPAL_ERROR_INVALID;
+        }
+        length = 2 + (((uint32_t)(b & 0x07) << 8) | data[offset + 1]);
+    }
+    else if (b < 0xE4) {
+        if (left < 4) {
+            return SED_OPAL_ERROR_INVALID;
+        }
+        length = 4 + (((uint32_t)data[offset + 1] << 16) | ((uint32_t)data[offset + 2] << 8) | data[offset + 3]);
+    }
+    else {
+        return SED_OPAL_ERROR_INVALID;
+    }
+
+    if (length > left) {
+        return SED_OPAL_ERROR_INVALID;
+    }
+
+    Reader->Offset = offset + length;
+    return SED_OPAL_OK;
+}
+
+void
+SedOpalEncoderInit(
+    SED_OPAL_ENCODER* Encoder,
+    uint8_t* Buffer,
+    uint32_t Size,
+    uint32_t Length
+)
+{
+    Encoder->Buffer = Buffer;
+    Encoder->Size = Size;
+    Encoder->Length = Length;
+    Encoder->Overflow = 0;
+}
+
+static void
+SedOpalPut(
+    SED_OPAL_ENCODER* Encoder,
+    const uint8_t* Data,
+    uint32_t Length
+)
+{
+    if (Encoder->Overflow || Length > Encoder->Size - Encoder->Length) {
+        Encoder->Overflow = 1;
+        return;
+    }
+
+    memcpy(Encoder->Buffer + Encoder->Length, Data, Length);
+    Encoder->Length += Length;
+}
+
+void
+SedOpalPutControl(
+    SED_OPAL_ENCODER* Encoder,
+    uint8_t Control
+)
+{
+    SedOpalPut(Encoder, &Control, 1);
+}
+
+void
+SedOpalPutUint(
+    SED_OPAL_ENCODER* Encoder,
+    uint64_t Value
+)
+{
+    uint8_t  atom[9];
+    uint32_t length = 0;
+    uint32_t i;
+
+    if (Value < 0x40) {
+        atom[0] = (uint8_t)Value;
+        SedOpalPut(Encoder, atom, 1);
+        return;
+    }
+
+    while (length < 8 && (Value >> (8 * length)) != 0) {
+        length++;
+    }
+
+    atom[0] = (uint8_t)(0x80 | length);
+    for (i = 0; i < length; i++) {
+        atom[1 + i] = (uint8_t)(Value >> (8 * (length - 1 - i)));
+    }
+
+    SedOpalPut(Encoder, atom, 1 + length);
+}
+
+void
+SedOpalPutBytes(
+    SED_OPAL_ENCODER* Encoder,
+    const uint8_t* Bytes,
+    uint32_t Length
+)
+{
+    uint8_t header[2];
+
+    if (Length < 16) {
+        header[0] = (uint8_t)(0xA0 | Length);
+        SedOpalPut(Encoder, header, 1);
+    }
+    else if (Length < 2048) {
+        header[0] = (uint8_t)(0xD0 | (Length >> 8));
+        header[1] = (uint8_t)Length;
+        SedOpalPut(Encoder, header, 2);
+    }
+    else {
+        Encoder->Overflow = 1;
+        return;
+    }
+
+    SedOpalPut(Encoder, Bytes, Length);
+}
+
+int
+SedOpalBeginPacket(
+    SED_OPAL_ENCODER* Encoder,
+    uint8_t* Buffer,
+    uint32_t Size,
+    uint16_t ComId,
+    uint32_t Tsn,
+    uint32_t Hsn
+)
+{
+    if (Size < SED_OPAL_PAYLOAD_OFFSET) {
+        return SED_OPAL_ERROR_SPACE;
+    }
+
+    memset(Buffer, 0, SED_OPAL_PAYLOAD_OFFSET);
+    Buffer[SED_OPAL_COMPACKET_COMID] = (uint8_t)(ComId >> 8);
+    Buffer[SED_OPAL_COMPACKET_COMID + 1] = (uint8_t)ComId;
+    SedOpalPut32(Buffer + SED_OPAL_PACKET_TSN, Tsn);
+    SedOpalPut32(Buffer + SED_OPAL_PACKET_HSN, Hsn);
+
+    SedOpalEncoderInit(Encoder, Buffer, Size, SED_OPAL_PAYLOAD_OFFSET);
+    return SED_OPAL_OK;
+}
+
+int
+SedOpalEndPacket(
+    SED_OPAL_ENCODER* Encoder,
+    uint32_t* Length
+)
+
+/*++
+
+Routine Description:
+
+    Pad the SubPacket to a multiple of four bytes and fill in the
+    SubPacket, Packet and ComPacket lengths. *Length is the ComPacket
+    length including headers.
+
+--*/
+
+{
+    uint8_t* buffer = Encoder->Buffer;
+    uint32_t payloadLength = Encoder->Length - SED_OPAL_PAYLOAD_OFFSET;
+    uint32_t padded = (payloadLength + 3) & ~3u;
+
+    if (Encoder->Overflow || padded > Encoder->Size - SED_OPAL_PAYLOAD_OFFSET) {
+        return SED_OPAL_ERROR_SPACE;
+    }
+
+    memset(buffer + Encoder->Length, 0, padded - payloadLength);
+
+    SedOpalPut32(buffer + SED_OPAL_SUBPACKET_LENGTH, payloadLength);
+    SedOpalPut32(buffer + SED_OPAL_PACKET_LENGTH, SED_OPAL_SUBPACKET_HEADER + padded);
+    SedOpalPut32(buffer + SED_OPAL_COMPACKET_LENGTH,
+        SED_OPAL_PACKET_HEADER + SED_OPAL_SUBPACKET_HEADER + padded);
+
+    *Length = SED_OPAL_PAYLOAD_OFFSET + padded;
+    return SED_OPAL_OK;
+}
+
+void
+SedOpalPutStatus(
+    SED_OPAL_ENCODER* Encoder,
+    uint8_t Status
+)
+{
+    SedOpalPutControl(Encoder, SED_OPAL_END_OF_DATA);
+    SedOpalPutControl(Encoder, SED_OPAL_START_LIST);
+    SedOpalPutUint(Encoder, Status);
+    SedOpalPutUint(Encoder, 0);
+    SedOpalPutUint(Encoder, 0);
+    SedOpalPutControl(Encoder, SED_OPAL_END_LIST);
+}
+
+void
+SedOpalPutColumn(
+    SED_OPAL_ENCODER* Encoder,
+    uint64_t Column,
+    uint64_t Value
+)
+{
+    SedOpalPutControl(Encoder, SED_OPAL_START_NAME);
+    SedOpalPutUint(Encoder, Column);
+    SedOpalPutUint(Encoder, Value);
+    SedOpalPutControl(Encoder, SED_OPAL_END_NAME);
+}
+
+void
+SedOpalPutName(
+    SED_OPAL_ENCODER* Encoder,
+    const char* Name,
+    uint64_t Value
+)
+{
+    SedOpalPutControl(Encoder, SED_OPAL_START_NAME);
+    SedOpalPutBytes(Encoder, (const uint8_t*)Name, (uint32_t)strlen(Name));
+    SedOpalPutUint(Encoder, Value);
+    SedOpalPutControl(Encoder, SED_OPAL_END_NAME);
+}
+
+int
+SedOpalParseSet(
+    const uint8_t* ComPacket,
+    uint32_t Length,
+    SED_OPAL_SET* Set
+)
+
+/*++
+
+Routine Description:
+
+    Expects CALL <object> <Set> and collects every name = value pair of
+    uintegers up to the end of data, which are the columns being set.
+    The Values list itself is a pair too, but its value is a list, so it
+    is not mistaken for a column.
+
+--*/
+
+{
+    SED_OPAL_TOKEN token[4];
+    uint32_t payload;
+    uint32_t payloadLength;
+    uint32_t offset;
+    uint32_t end;
+    int      status;
+
+    memset(Set, 0, sizeof(*Set));
+
+    status = SedOpalPayload(ComPacket, Length, &payload, &payloadLength);
+    if (status != SED_OPAL_OK) {
+        return status;
+    }
+
+    offset = payload;
+    end = payload + payloadLength;
+
+    if (SedOpalNextToken(ComPacket, end, &offset, &token[0]) != SED_OPAL_OK ||
+        token[0].Kind != SedOpalTokenControl || token[0].Control != SED_OPAL_CALL ||
+        SedOpalNextToken(ComPacket, end, &offset, &token[1]) != SED_OPAL_OK ||
+        token[1].Kind != SedOpalTokenBytes || token[1].Length != 8 ||
+        SedOpalNextToken(ComPacket, end, &offset, &token[2]) != SED_OPAL_OK ||
+        token[2].Kind != SedOpalTokenBytes || token[2].Length != 8 ||
+        memcmp(token[2].Bytes, SedOpalMethodSet, 8) != 0) {
+        return SED_OPAL_ERROR_INVALID;
+    }
+
+    memcpy(Set->Object, token[1].Bytes, 8);
+
+    memset(token, 0, sizeof(token));
+    for (;;) {
+        token[0] = token[1];
+        token[1] = token[2];
+        token[2] = token[3];
+
+        status = SedOpalNextToken(ComPacket, end, &offset, &token[3]);
+        if (status != SED_OPAL_OK) {
+            return SED_OPAL_ERROR_INVALID;
+        }
+
+        if (token[3].Kind == SedOpalTokenControl && token[3].Control == SED_OPAL_END_OF_DATA) {
+            break;
+        }
+
+        if (token[0].Kind == SedOpalTokenControl && token[0].Control == SED_OPAL_START_NAME &&
+            token[1].Kind == SedOpalTokenUint &&
+            token[2].Kind == SedOpalTokenUint &&
+            token[3].Kind == SedOpalTokenControl && token[3].Control == SED_OPAL_END_NAME) {
+
+            if (Set->Count == SED_OPAL_MAX_COLUMNS) {
+                return SED_OPAL_ERROR_SPACE;
+            }
+            Set->Column[Set->Count] = (uint32_t)token[1].Value;
+            Set->Value[Set->Count] = token[2].Value;
+            Set->Count++;
+        }
+    }
+
+    return SED_OPAL_OK;
+}
+
+int
+SedOpalAppendGet(
+    uint8_t* ComPacket,
+    uint32_t Size,
+    const SED_OPAL_SET* Set,
+    uint32_t* NewLength
+)
+
+/*++
+
+Routine Description:
+
+    Append CALL <object> <Get> [ [ startColumn = min, endColumn = max ] ]
+    to the payload, after the Set, and update the lengths.
+
+--*/
+
+{
+    SED_OPAL_ENCODER encoder;
+    uint32_t payload;
+    uint32_t payloadLength;
+    uint32_t first;
+    uint32_t last;
+    uint32_t i;
+    int      status;
+
+    if (Set->Count == 0) {
+        return SED_OPAL_ERROR_INVALID;
+    }
+
+    status = SedOpalPayload(ComPacket, Size, &payload, &payloadLength);
+    if (status != SED_OPAL_OK) {
+        return status;
+    }
+
+    first = last = Set->Column[0];
+    for (i = 1; i < Set->Count; i++) {
+        first = Set->Column[i] < first ? Set->Column[i] : first;
+        last = Set->Column[i] > last ? Set->Column[i] : last;
+    }
+
+    SedOpalEncoderInit(&encoder, ComPacket, Size, payload + payloadLength);
+
+    SedOpalPutControl(&encoder, SED_OPAL_CALL);
+    SedOpalPutBytes(&encoder, Set->Object, 8);
+    SedOpalPutBytes(&encoder, SedOpalMethodGet, 8);
+    SedOpalPutControl(&encoder, SED_OPAL_START_LIST);
+    SedOpalPutControl(&encoder, SED_OPAL_START_LIST);
+    SedOpalPutColumn(&encoder, SED_OPAL_START_COLUMN, first);
+    SedOpalPutColumn(&encoder, SED_OPAL_END_COLUMN, last);
+    SedOpalPutControl(&encoder, SED_OPAL_END_LIST);
+    SedOpalPutControl(&encoder, SED_OPAL_END_LIST);
+    SedOpalPutStatus(&encoder, SED_OPAL_STATUS_SUCCESS);
+
+    return SedOpalEndPacket(&encoder, NewLength);
+}
+
+int
+SedOpalMethodStatus(
+    const uint8_t* ComPacket,
+    uint32_t Length,
+    uint8_t* MethodStatus,
+    uint32_t* Results
+)
+
+/*++
+
+Routine Description:
+
+    The fast path for responses nobody reads the results of, which is
+    nearly all of them in an unlock: only the end of data tokens matter,
+    so everything else is stepped over undecoded, and only the status
+    list after each end of data is decoded.
+
+--*/
+
+{
+    SED_OPAL_READER reader;
+    SED_OPAL_TOKEN  list[5];
+    uint8_t  control;
+    uint32_t i;
+    int      status;
+
+    *MethodStatus = SED_OPAL_STATUS_SUCCESS;
+    *Results = 0;
+
+    status = SedOpalReaderInit(&reader, ComPacket, Length);
+    if (status != SED_OPAL_OK) {
+        return status;
+    }
+
+    for (;;) {
+        status = SedOpalReaderSkip(&reader, &control);
+        if (status == SED_OPAL_END) {
+            break;
+        }
+        if (status != SED_OPAL_OK) {
+            return status;
+        }
+
+        if (control != SED_OPAL_END_OF_DATA) {
+            continue;
+        }
+
+        for (i = 0; i < 5; i++) {
+            if (SedOpalReaderNext(&reader, &list[i]) != SED_OPAL_OK) {
+                return SED_OPAL_ERROR_INVALID;
+            }
+        }
+
+        if (list[0].Kind != SedOpalTokenControl || list[0].Control != SED_OPAL_START_LIST ||
+            list[1].Kind != SedOpalTokenUint ||
+            list[4].Kind != SedOpalTokenControl || list[4].Control != SED_OPAL_END_LIST) {
+            return SED_OPAL_ERROR_INVALID;
+        }
+
+        if (list[1].Value != SED_OPAL_STATUS_SUCCESS) {
+            *MethodStatus = (uint8_t)list[1].Value;
+            return SED_OPAL_ERROR_STATUS;
+        }
+
+        (*Results)++;
+    }
+
+    return (*Results == 0) ? SED_OPAL_ERROR_INVALID : SED_OPAL_OK;
+}
+
+int
+SedOpalCheckResponse(
+    const uint8_t* ComPacket,
+    uint32_t Length,
+    const SED_OPAL_SET* Expected,
+    uint8_t* MethodStatus
+)
+
+/*++
+
+Routine Description:
+
+    A response is a sequence of method results, each being whatever the
+    method returned (a list, or a call for session manager methods) up to
+    an end of data token, then the status list [ status 0 0 ]. Name/value
+    pairs of uintegers seen anywhere in the results are matched against
+    Expected. Without Expected only the status lists are looked at.
+
+--*/
+
+{
+    SED_OPAL_READER reader;
+    SED_OPAL_TOKEN  token[4];
+    uint32_t found = 0;
+    uint32_t results = 0;
+    uint32_t i;
+    int      status;
+
+    if (Expected == NULL) {
+        return SedOpalMethodStatus(ComPacket, Length, MethodStatus, &results);
+    }
+
+    *MethodStatus = SED_OPAL_STATUS_SUCCESS;
+
+    status = SedOpalReaderInit(&reader, ComPacket, Length);
+    if (status != SED_OPAL_OK) {
+        return status;
+    }
+
+    memset(token, 0, sizeof(token));
+
+    for (;;) {
+        token[0] = token[1];
+        token[1] = token[2];
+        token[2] = token[3];
+
+        status = SedOpalReaderNext(&reader, &token[3]);
+        if (status == SED_OPAL_END) {
+            break;
+        }
+        if (status != SED_OPAL_OK) {
+            return status;
+        }
+
+        if (token[3].Kind == SedOpalTokenControl && token[3].Control == SED_OPAL_END_OF_DATA) {
+            SED_OPAL_TOKEN list[5];
+
+            for (i = 0; i < 5; i++) {
+                if (SedOpalReaderNext(&reader, &list[i]) != SED_OPAL_OK) {
+                    return SED_OPAL_ERROR_INVALID;
+                }
+            }
+
+            if (list[0].Kind != SedOpalTokenControl || list[0].Control != SED_OPAL_START_LIST ||
+                list[1].Kind != SedOpalTokenUint ||
+                list[4].Kind != SedOpalTokenControl || list[4].Control != SED_OPAL_END_LIST) {
+                return SED_OPAL_ERROR_INVALID;
+            }
+
+            if (list[1].Value != SED_OPAL_STATUS_SUCCESS) {
+                *MethodStatus = (uint8_t)list[1].Value;
+                return SED_OPAL_ERROR_STATUS;
+            }
+
+            results++;
+            memset(token, 0, sizeof(token));
+            continue;
+        }
+
+        if (token[0].Kind == SedOpalTokenControl && token[0].Control == SED_OPAL_START_NAME &&
+            token[1].Kind == SedOpalTokenUint &&
+            token[2].Kind == SedOpalTokenUint &&
+            token[3].Kind == SedOpalTokenControl && token[3].Control == SED_OPAL_END_NAME) {
+
+            for (i = 0; i < Expected->Count; i++) {
+                if (Expected->Column[i] == token[1].Value) {
+                    if (Expected->Value[i] != token[2].Value) {
+                        return SED_OPAL_ERROR_MISMATCH;
+                    }
+                    found |= 1u << i;
+                }
+            }
+        }
+    }
+
+    if (results == 0) {
+        return SED_OPAL_ERROR_INVALID;
+    }
+
+    if (found != (1u << Expected->Count) - 1) {
+        return SED_OPAL_ERROR_MISMATCH;
+    }
+
+    return SED_OPAL_OK;
+}
+
+int
+SedOpalFindControl(
+    const uint8_t* ComPacket,
+    uint32_t Length,
+    uint8_t Control
+)
+{
+    SED_OPAL_READER reader;
+    uint8_t  control;
+    int      status;
+
+    status = SedOpalReaderInit(&reader, ComPacket, Length);
+    if (status != SED_OPAL_OK) {
+        return status;
+    }
+
+    for (;;) {
+        status = SedOpalReaderSkip(&reader, &control);
+        if (status != SED_OPAL_OK) {
+            return status;
+        }
+        if (control == Control) {
+            return SED_OPAL_OK;
+        }
+    }
+}
+
+int
+SedOpalBuildProperties(
+    uint8_t* Buffer,
+    uint32_t Size,
+    uint16_t ComId,
+    uint32_t* Length
+)
+
+/*++
+
+Routine Description:
+
+    CALL SMUID Properties [ HostProperties = [ Asynchronous = 1 ] ] EOD
+    [ 0 0 0 ], in a ComPacket with zero TSN and HSN. The TPer only talks
+    asynchronously if the host said it can, whatever it supports itself.
+
+--*/
+
+{
+    SED_OPAL_ENCODER encoder;
+    int      status;
+
+    status = SedOpalBeginPacket(&encoder, Buffer, Size, ComId, 0, 0);
+    if (status != SED_OPAL_OK) {
+        return status;
+    }
+
+    SedOpalPutControl(&encoder, SED_OPAL_CALL);
+    SedOpalPutBytes(&encoder, SedOpalSessionManager, 8);
+    SedOpalPutBytes(&encoder, SedOpalMethodProperties, 8);
+    SedOpalPutControl(&encoder, SED_OPAL_START_LIST);
+    SedOpalPutControl(&encoder, SED_OPAL_START_NAME);
+    SedOpalPutUint(&encoder, 0);
+    SedOpalPutControl(&encoder, SED_OPAL_START_LIST);
+    SedOpalPutName(&encoder, "Asynchronous", 1);
+    SedOpalPutControl(&encoder, SED_OPAL_END_LIST);
+    SedOpalPutControl(&encoder, SED_OPAL_END_NAME);
+    SedOpalPutControl(&encoder, SED_OPAL_END_LIST);
+    SedOpalPutStatus(&encoder, SED_OPAL_STATUS_SUCCESS);
+
+    return SedOpalEndPacket(&encoder, Length);
+}
+
+int
+SedOpalParseProperties(
+    const uint8_t* ComPacket,
+    uint32_t Length,
+    SED_OPAL_PROPERTIES* Properties
+)
+
+/*++
+
+Routine Description:
+
+    The reply is CALL SMUID Properties [ [ TPer properties ]
+    HostProperties = [ host properties ] ] EOD [ status 0 0 ], each
+    property a name = value pair with a byte string name. The TPer list
+    comes first, so the first value seen for a name is the TPer's.
+
+--*/
+
+{
+    SED_OPAL_READER reader;
+    SED_OPAL_TOKEN  token[4];
+    uint32_t results;
+    uint8_t  methodStatus;
+    int      asyncOn = 0;
+    int      asyncOff = 0;
+    int      status;
+
+    memset(Properties, 0, sizeof(*Properties));
+
+    status = SedOpalMethodStatus(ComPacket, Length, &methodStatus, &results);
+    if (status != SED_OPAL_OK) {
+        return status;
+    }
+
+    SedOpalReaderInit(&reader, ComPacket, Length);
+    memset(token, 0, sizeof(token));
+
+    for (;;) {
+        token[0] = token[1];
+        token[1] = token[2];
+        token[2] = token[3];
+
+        status = SedOpalReaderNext(&reader, &token[3]);
+        if (status == SED_OPAL_END) {
+            break;
+        }
+        if (status != SED_OPAL_OK) {
+            return status;
+        }
+
+        if (token[0].Kind == SedOpalTokenControl && token[0].Control == SED_OPAL_START_NAME &&
+            token[1].Kind == SedOpalTokenBytes &&
+            token[2].Kind == SedOpalTokenUint &&
+            token[3].Kind == SedOpalTokenControl && token[3].Control == SED_OPAL_END_NAME) {
+
+            uint32_t value = token[2].Value > 0xFFFFFFFF ? 0xFFFFFFFF : (uint32_t)token[2].Value;
+
+#define SED_OPAL_NAME_IS(t, n)  ((t).Length == sizeof(n) - 1 && memcmp((t).Bytes, (n), sizeof(n) - 1) == 0)
+
+            if (SED_OPAL_NAME_IS(token[1], "MaxComPacketSize")) {
+                if (Properties->MaxComPacketSize == 0) {
+                    Properties->MaxComPacketSize = value;
+                }
+            }
+            else if (SED_OPAL_NAME_IS(token[1], "MaxResponseComPacketSize")) {
+                if (Properties->MaxResponseComPacketSize == 0) {
+                    Properties->MaxResponseComPacketSize = value;
+                }
+            }
+            else if (SED_OPAL_NAME_IS(token[1], "MaxPackets")) {
+                if (Properties->MaxPackets == 0) {
+                    Properties->MaxPackets = value;
+                }
+            }
+            else if (SED_OPAL_NAME_IS(token[1], "Asynchronous")) {
+                if (value != 0) {
+                    asyncOn = 1;
+                }
+                else {
+                    asyncOff = 1;
+                }
+            }
+
+#undef SED_OPAL_NAME_IS
+        }
+    }
+
+    Properties->Asynchronous = asyncOn && !asyncOff;
+    return SED_OPAL_OK;
+}
+
+int
+SedOpalBuildStartSession(
+    uint8_t* Buffer,
+    uint32_t Size,
+    uint16_t ComId,
+    uint32_t Hsn,
+    const uint8_t* Sp,
+    const uint8_t* Authority,
+    const uint8_t* Challenge,
+    uint32_t ChallengeLength,
+    uint32_t* Length
+)
+
+/*++
+
+Routine Description:
+
+    CALL SMUID StartSession [ HSN SP Write=1 HostChallenge = challenge
+    HostSigningAuthority = authority ] EOD [ 0 0 0 ]
+
+--*/
+
+{
+    SED_OPAL_ENCODER encoder;
+    int      status;
+
+    status = SedOpalBeginPacket(&encoder, Buffer, Size, ComId, 0, 0);
+    if (status != SED_OPAL_OK) {
+        return status;
+    }
+
+    SedOpalPutControl(&encoder, SED_OPAL_CALL);
+    SedOpalPutBytes(&encoder, SedOpalSessionManager, 8);
+    SedOpalPutBytes(&encoder, SedOpalMethodStartSession, 8);
+    SedOpalPutControl(&encoder, SED_OPAL_START_LIST);
+    SedOpalPutUint(&encoder, Hsn);
+    SedOpalPutBytes(&encoder, Sp, 8);
+    SedOpalPutUint(&encoder, 1);
+    SedOpalPutControl(&encoder, SED_OPAL_START_NAME);
+    SedOpalPutUint(&encoder, SED_OPAL_HOST_CHALLENGE);
+    SedOpalPutBytes(&encoder, Challenge, ChallengeLength);
+    SedOpalPutControl(&encoder, SED_OPAL_END_NAME);
+    SedOpalPutControl(&encoder, SED_OPAL_START_NAME);
+    SedOpalPutUint(&encoder, SED_OPAL_HOST_SIGNING_AUTHORITY);
+    SedOpalPutBytes(&encoder, Authority, 8);
+    SedOpalPutControl(&encoder, SED_OPAL_END_NAME);
+    SedOpalPutControl(&encoder, SED_OPAL_END_LIST);
+    SedOpalPutStatus(&encoder, SED_OPAL_STATUS_SUCCESS);
+
+    return SedOpalEndPacket(&encoder, Length);
+}
+
+int
+SedOpalBuildSet(
+    uint8_t* Buffer,
+    uint32_t Size,
+    uint16_t ComId,
+    const SED_OPAL_SET* Set,
+    uint32_t* Length
+)
+
+/*++
+
+Routine Description:
+
+    CALL <object> Set [ Values = [ column = value ... ] ] EOD [ 0 0 0 ],
+    with TSN and HSN left zero for the caller to fill in once the
+    session is up.
+
+--*/
+
+{
+    SED_OPAL_ENCODER encoder;
+    uint32_t i;
+    int      status;
+
+    status = SedOpalBeginPacket(&encoder, Buffer, Size, ComId, 0, 0);
+    if (status != SED_OPAL_OK) {
+        return status;
+    }
+
+    SedOpalPutControl(&encoder, SED_OPAL_CALL);
+    SedOpalPutBytes(&encoder, Set->Object, 8);
+    SedOpalPutBytes(&encoder, SedOpalMethodSet, 8);
+    SedOpalPutControl(&encoder, SED_OPAL_START_LIST);
+    SedOpalPutControl(&encoder, SED_OPAL_START_NAME);
+    SedOpalPutUint(&encoder, SED_OPAL_SET_VALUES);
+    SedOpalPutControl(&encoder, SED_OPAL_START_LIST);
+    for (i = 0; i < Set->Count; i++) {
+        SedOpalPutColumn(&encoder, Set->Column[i], Set->Value[i]);
+    }
+    SedOpalPutControl(&encoder, SED_OPAL_END_LIST);
+    SedOpalPutControl(&encoder, SED_OPAL_END_NAME);
+    SedOpalPutControl(&encoder, SED_OPAL_END_LIST);
+    SedOpalPutStatus(&encoder, SED_OPAL_STATUS_SUCCESS);
+
+    return SedOpalEndPacket(&encoder, Length);
+}
+
+int
+SedOpalBuildEndSession(
+    uint8_t* Buffer,
+    uint32_t Size,
+    uint16_t ComId,
+    uint32_t* Length
+)
+{
+    SED_OPAL_ENCODER encoder;
+    int      status;
+
+    status = SedOpalBeginPacket(&encoder, Buffer, Size, ComId, 0, 0);
+    if (status != SED_OPAL_OK) {
+        return status;
+    }
+
+    SedOpalPutControl(&encoder, SED_OPAL_END_OF_SESSION);
+
+    return SedOpalEndPacket(&encoder, Length);
+}
+
+int
+SedOpalParseSyncSession(
+    const uint8_t* ComPacket,
+    uint32_t Length,
+    uint32_t* Hsn,
+    uint32_t* Tsn
+)
+
+/*++
+
+Routine Description:
+
+    The reply to StartSession is CALL SMUID SyncSession [ HSN TSN ... ].
+    The method status is checked separately.
+
+--*/
+
+{
+    SED_OPAL_READER reader;
+    SED_OPAL_TOKEN  token[6];
+    uint32_t i;
+    int      status;
+
+    status = SedOpalReaderInit(&reader, ComPacket, Length);
+    if (status != SED_OPAL_OK) {
+        return status;
+    }
+
+    for (i = 0; i < 6; i++) {
+        if (SedOpalReaderNext(&reader, &token[i]) != SED_OPAL_OK) {
+            return SED_OPAL_ERROR_INVALID;
+        }
+    }
+
+    if (token[0].Kind != SedOpalTokenControl || token[0].Control != SED_OPAL_CALL ||
+        token[1].Kind != SedOpalTokenBytes || token[1].Length != 8 ||
+        memcmp(token[1].Bytes, SedOpalSessionManager, 8) != 0 ||
+        token[2].Kind != SedOpalTokenBytes || token[2].Length != 8 ||
+        memcmp(token[2].Bytes, SedOpalMethodSyncSession, 8) != 0 ||
+        token[3].Kind != SedOpalTokenControl || token[3].Control != SED_OPAL_START_LIST ||
+        token[4].Kind != SedOpalTokenUint || token[4].Value > 0xFFFFFFFF ||
+        token[5].Kind != SedOpalTokenUint || token[5].Value > 0xFFFFFFFF) {
+        return SED_OPAL_ERROR_INVALID;
+    }
+
+    *Hsn = (uint32_t)token[4].Value;
+    *Tsn = (uint32_t)token[5].Value;
+    return SED_OPAL_OK;
+}
+
+int
+SedOpalFindFeature(
+    const uint8_t* Discovery,
+    uint32_t Length,
+    uint16_t Code,
+    const uint8_t** Data,
+    uint32_t* DataLength
+)
+
+/*++
+
+Routine Description:
+
+    Level 0 Discovery is a 48 byte header, whose first field is the length
+    of what follows it, then feature descriptors of a 16 bit code, a
+    version byte and a length byte ahead of the feature data.
+
+--*/
+
+{
+    uint32_t end;
+    uint32_t offset;
+    uint32_t featureLength;
+
+    if (Length < SED_OPAL_DISCOVERY_HEADER) {
+        return SED_OPAL_ERROR_INVALID;
+    }
+
+    end = SedOpalGet32(Discovery);
+    if (end > Length - 4) {
+        return SED_OPAL_ERROR_INVALID;
+    }
+    end += 4;
+
+    for (offset = SED_OPAL_DISCOVERY_HEADER; offset + 4 <= end; offset += 4 + featureLength) {
+        featureLength = Discovery[offset + 3];
+        if (offset + 4 + featureLength > end) {
+            return SED_OPAL_ERROR_INVALID;
+        }
+        if ((uint16_t)((Discovery[offset] << 8) | Discovery[offset + 1]) == Code) {
+            *Data = Discovery + offset + 4;
+            *DataLength = featureLength;
+            return SED_OPAL_OK;
+        }
+    }
+
+    return SED_OPAL_END;
+}
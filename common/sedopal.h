@@ -0,0 +1,511 @@
+/*++
+
+Module Name:
+
+    sedopal.h
+
+Abstract:
+
+    Just enough of the TCG Storage token stream to check what the drive
+    answered, to add to a prebuilt command and to ask the TPer for its
+    properties: locating the payload of a ComPacket, encoding and decoding
+    tokens, and verifying method status. Also the one Level 0 Discovery
+    lookup needed to tell whether a drive can lock at all.
+
+    A ComPacket is a 20 byte header, one Packet (24 bytes) and one
+    SubPacket (12 bytes) followed by the token payload, all big-endian.
+    That is all the commands built here ever are, but a response may hold
+    several Packets and SubPackets, so responses are read with a reader
+    that walks every data SubPacket as one token stream, in place.
+    Nothing here allocates or copies, so the same code runs in the filter
+    and in the host tools.
+
+Environment:
+
+    kernel and user mode, Windows and Linux
+
+--*/
+
+#ifndef _SEDOPAL_H_
+#define _SEDOPAL_H_
+
+#include <stdint.h>
+
+#define SED_OPAL_COMPACKET_HEADER   20
+#define SED_OPAL_PACKET_HEADER      24
+#define SED_OPAL_SUBPACKET_HEADER   12
+#define SED_OPAL_PAYLOAD_OFFSET     (SED_OPAL_COMPACKET_HEADER + SED_OPAL_PACKET_HEADER + SED_OPAL_SUBPACKET_HEADER)
+
+//
+// Field offsets from the start of the ComPacket
+//
+
+#define SED_OPAL_COMPACKET_COMID        4
+#define SED_OPAL_COMPACKET_OUTSTANDING  8
+#define SED_OPAL_COMPACKET_LENGTH       16
+#define SED_OPAL_PACKET_TSN             20
+#define SED_OPAL_PACKET_HSN             24
+#define SED_OPAL_PACKET_LENGTH          40
+#define SED_OPAL_SUBPACKET_LENGTH       52
+
+//
+// Field offsets from the start of a Packet or SubPacket
+//
+
+#define SED_OPAL_PACKET_LENGTH_FIELD    20
+#define SED_OPAL_SUBPACKET_KIND_FIELD   6
+#define SED_OPAL_SUBPACKET_LENGTH_FIELD 8
+#define SED_OPAL_SUBPACKET_DATA         0       // kind; anything else is credit control
+
+//
+// Control tokens
+//
+
+#define SED_OPAL_START_LIST         0xF0
+#define SED_OPAL_END_LIST           0xF1
+#define SED_OPAL_START_NAME         0xF2
+#define SED_OPAL_END_NAME           0xF3
+#define SED_OPAL_CALL               0xF8
+#define SED_OPAL_END_OF_DATA        0xF9
+#define SED_OPAL_END_OF_SESSION     0xFA
+#define SED_OPAL_EMPTY              0xFF
+
+//
+// Method parameter and column numbers
+//
+
+#define SED_OPAL_HOST_CHALLENGE             0       // StartSession
+#define SED_OPAL_HOST_SIGNING_AUTHORITY     3       // StartSession
+#define SED_OPAL_SET_VALUES                 1       // Set
+#define SED_OPAL_COLUMN_READ_LOCKED         7       // Locking table
+#define SED_OPAL_COLUMN_WRITE_LOCKED        8       // Locking table
+#define SED_OPAL_COLUMN_DONE                2       // MBRControl table
+
+//
+// Method and session manager UIDs
+//
+
+extern const uint8_t SedOpalSessionManager[8];
+extern const uint8_t SedOpalMethodProperties[8];
+extern const uint8_t SedOpalMethodStartSession[8];
+extern const uint8_t SedOpalMethodSyncSession[8];
+extern const uint8_t SedOpalMethodSet[8];
+extern const uint8_t SedOpalMethodGet[8];
+
+//
+// Method status codes
+//
+
+#define SED_OPAL_STATUS_SUCCESS         0x00
+#define SED_OPAL_STATUS_NOT_AUTHORIZED  0x01
+#define SED_OPAL_STATUS_SP_BUSY         0x03
+#define SED_OPAL_STATUS_FAIL            0x3F
+
+//
+// Level 0 Discovery, security protocol 1 ComId 1
+//
+
+#define SED_OPAL_DISCOVERY_COMID        1
+#define SED_OPAL_DISCOVERY_HEADER       48
+#define SED_OPAL_FEATURE_LOCKING        0x0002
+#define SED_OPAL_LOCKING_SUPPORTED      0x01    // first byte of the Locking feature
+#define SED_OPAL_LOCKING_ENABLED        0x02
+#define SED_OPAL_LOCKING_LOCKED         0x04
+
+//
+// Results. Zero is success.
+//
+
+#define SED_OPAL_OK                 0
+#define SED_OPAL_END                1       // no more tokens
+#define SED_OPAL_ERROR_INVALID      (-1)    // malformed packet or token
+#define SED_OPAL_ERROR_SPACE        (-2)    // does not fit in the buffer
+#define SED_OPAL_ERROR_STATUS       (-3)    // a method returned a failure status
+#define SED_OPAL_ERROR_MISMATCH     (-4)    // values read back are not the ones set
+
+typedef enum _SED_OPAL_TOKEN_KIND {
+    SedOpalTokenControl,
+    SedOpalTokenUint,
+    SedOpalTokenInt,
+    SedOpalTokenBytes
+} SED_OPAL_TOKEN_KIND;
+
+typedef struct _SED_OPAL_TOKEN {
+    SED_OPAL_TOKEN_KIND Kind;
+    uint8_t Control;                // SedOpalTokenControl
+    uint64_t Value;                 // SedOpalTokenUint/Int, up to 8 bytes
+    const uint8_t* Bytes;           // atom data
+    uint32_t Length;                // atom data length
+} SED_OPAL_TOKEN;
+
+//
+// Position in the token stream of a response. Tokens read through it
+// point into the ComPacket.
+//
+
+typedef struct _SED_OPAL_READER {
+    const uint8_t* ComPacket;
+    uint32_t End;                   // of the last Packet
+    uint32_t PacketEnd;             // of the current Packet
+    uint32_t NextSubPacket;         // in the current Packet
+    uint32_t Offset;                // of the next token
+    uint32_t PayloadEnd;            // of the current SubPacket payload
+} SED_OPAL_READER;
+
+typedef struct _SED_OPAL_ENCODER {
+    uint8_t* Buffer;
+    uint32_t Size;
+    uint32_t Length;
+    int Overflow;
+} SED_OPAL_ENCODER;
+
+//
+// A Set of uinteger columns on one object, as found in a prebuilt command
+//
+
+#define SED_OPAL_MAX_COLUMNS        8
+
+typedef struct _SED_OPAL_SET {
+    uint8_t Object[8];
+    uint32_t Count;
+    uint32_t Column[SED_OPAL_MAX_COLUMNS];
+    uint64_t Value[SED_OPAL_MAX_COLUMNS];
+} SED_OPAL_SET;
+
+//
+// Communication properties of the TPer, from the session manager
+// Properties method. Zero means not reported.
+//
+
+typedef struct _SED_OPAL_PROPERTIES {
+    uint32_t MaxComPacketSize;
+    uint32_t MaxResponseComPacketSize;
+    uint32_t MaxPackets;
+    int Asynchronous;               // queued ComPackets are accepted
+} SED_OPAL_PROPERTIES;
+
+static __inline uint32_t
+SedOpalGet32(
+    const uint8_t* p
+)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static __inline void
+SedOpalPut32(
+    uint8_t* p,
+    uint32_t v
+)
+{
+    p[0] = (uint8_t)(v >> 24);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);
+    p[3] = (uint8_t)v;
+}
+
+//
+// Find the token payload of the first SubPacket, checking that the
+// lengths nest and fit within Length
+//
+
+int
+SedOpalPayload(
+    const uint8_t* ComPacket,
+    uint32_t Length,
+    uint32_t* PayloadOffset,
+    uint32_t* PayloadLength
+);
+
+//
+// Decode the token at *Offset and advance past it. Returns SED_OPAL_END
+// once Length is reached.
+//
+
+int
+SedOpalNextToken(
+    const uint8_t* Data,
+    uint32_t Length,
+    uint32_t* Offset,
+    SED_OPAL_TOKEN* Token
+);
+
+//
+// Check the ComPacket header and stand the reader at the first token.
+// A ComPacket without any data SubPacket reads as no tokens.
+//
+
+int
+SedOpalReaderInit(
+    SED_OPAL_READER* Reader,
+    const uint8_t* ComPacket,
+    uint32_t Length
+);
+
+//
+// Decode the next token, moving on to the next data SubPacket (and
+// Packet) when one runs out. Returns SED_OPAL_END after the last.
+//
+
+int
+SedOpalReaderNext(
+    SED_OPAL_READER* Reader,
+    SED_OPAL_TOKEN* Token
+);
+
+//
+// Step over the next token by its header alone. *Control is the control
+// token, or 0 for an atom, whose value is not looked at.
+//
+
+int
+SedOpalReaderSkip(
+    SED_OPAL_READER* Reader,
+    uint8_t* Control
+);
+
+void
+SedOpalEncoderInit(
+    SED_OPAL_ENCODER* Encoder,
+    uint8_t* Buffer,
+    uint32_t Size,
+    uint32_t Length
+);
+
+void
+SedOpalPutControl(
+    SED_OPAL_ENCODER* Encoder,
+    uint8_t Control
+);
+
+void
+SedOpalPutUint(
+    SED_OPAL_ENCODER* Encoder,
+    uint64_t Value
+);
+
+void
+SedOpalPutBytes(
+    SED_OPAL_ENCODER* Encoder,
+    const uint8_t* Bytes,
+    uint32_t Length
+);
+
+//
+// Start a ComPacket on ComId with the given session numbers, to be filled
+// with the encoder. SedOpalEndPacket pads the SubPacket and fills in the
+// lengths; *Length is the ComPacket length including headers.
+//
+
+int
+SedOpalBeginPacket(
+    SED_OPAL_ENCODER* Encoder,
+    uint8_t* Buffer,
+    uint32_t Size,
+    uint16_t ComId,
+    uint32_t Tsn,
+    uint32_t Hsn
+);
+
+int
+SedOpalEndPacket(
+    SED_OPAL_ENCODER* Encoder,
+    uint32_t* Length
+);
+
+//
+// End of data and the status list [ Status 0 0 ] closing a method call
+// or result
+//
+
+void
+SedOpalPutStatus(
+    SED_OPAL_ENCODER* Encoder,
+    uint8_t Status
+);
+
+//
+// A name = value pair with a uinteger name, as the columns of a Set or
+// Get, or with a string name, as the Properties of the session manager
+//
+
+void
+SedOpalPutColumn(
+    SED_OPAL_ENCODER* Encoder,
+    uint64_t Column,
+    uint64_t Value
+);
+
+void
+SedOpalPutName(
+    SED_OPAL_ENCODER* Encoder,
+    const char* Name,
+    uint64_t Value
+);
+
+//
+// Pick the object and uinteger column values out of a Set method call
+//
+
+int
+SedOpalParseSet(
+    const uint8_t* ComPacket,
+    uint32_t Length,
+    SED_OPAL_SET* Set
+);
+
+//
+// Append a Get of the columns Set changed, on the same object, to the
+// ComPacket's payload and fix up the lengths. *NewLength is the ComPacket
+// length including headers.
+//
+
+int
+SedOpalAppendGet(
+    uint8_t* ComPacket,
+    uint32_t Size,
+    const SED_OPAL_SET* Set,
+    uint32_t* NewLength
+);
+
+//
+// Check the status of every method result in a response ComPacket and,
+// if Expected is given, that the columns read back hold the values that
+// were set. *MethodStatus gets the first failing status.
+//
+
+int
+SedOpalCheckResponse(
+    const uint8_t* ComPacket,
+    uint32_t Length,
+    const SED_OPAL_SET* Expected,
+    uint8_t* MethodStatus
+);
+
+//
+// The status of every method result in a response, without decoding the
+// results themselves. *Results is the number of results; *MethodStatus
+// gets the first failing status.
+//
+
+int
+SedOpalMethodStatus(
+    const uint8_t* ComPacket,
+    uint32_t Length,
+    uint8_t* MethodStatus,
+    uint32_t* Results
+);
+
+//
+// Look for a control token anywhere in the payload. Returns SED_OPAL_END
+// if it is not there.
+//
+
+int
+SedOpalFindControl(
+    const uint8_t* ComPacket,
+    uint32_t Length,
+    uint8_t Control
+);
+
+//
+// Build a session manager Properties call on ComId, outside any session,
+// offering asynchronous communication in the host properties. *Length is
+// the ComPacket length including headers.
+//
+
+int
+SedOpalBuildProperties(
+    uint8_t* Buffer,
+    uint32_t Size,
+    uint16_t ComId,
+    uint32_t* Length
+);
+
+//
+// Pick the TPer properties out of the response to a Properties call.
+// Asynchronous is only set if both the TPer and the properties it
+// accepted from the host allow it.
+//
+
+int
+SedOpalParseProperties(
+    const uint8_t* ComPacket,
+    uint32_t Length,
+    SED_OPAL_PROPERTIES* Properties
+);
+
+//
+// Build the packets of an unlock session. Only StartSession is complete;
+// the others go inside the session, so their TSN and HSN are left zero
+// for SedOpalSetSession.
+//
+
+int
+SedOpalBuildStartSession(
+    uint8_t* Buffer,
+    uint32_t Size,
+    uint16_t ComId,
+    uint32_t Hsn,
+    const uint8_t* Sp,
+    const uint8_t* Authority,
+    const uint8_t* Challenge,
+    uint32_t ChallengeLength,
+    uint32_t* Length
+);
+
+int
+SedOpalBuildSet(
+    uint8_t* Buffer,
+    uint32_t Size,
+    uint16_t ComId,
+    const SED_OPAL_SET* Set,
+    uint32_t* Length
+);
+
+int
+SedOpalBuildEndSession(
+    uint8_t* Buffer,
+    uint32_t Size,
+    uint16_t ComId,
+    uint32_t* Length
+);
+
+//
+// Pick the session numbers out of the SyncSession reply to StartSession
+//
+
+int
+SedOpalParseSyncSession(
+    const uint8_t* ComPacket,
+    uint32_t Length,
+    uint32_t* Hsn,
+    uint32_t* Tsn
+);
+
+static __inline void
+SedOpalSetSession(
+    uint8_t* ComPacket,
+    uint32_t Hsn,
+    uint32_t Tsn
+)
+{
+    SedOpalPut32(ComPacket + SED_OPAL_PACKET_TSN, Tsn);
+    SedOpalPut32(ComPacket + SED_OPAL_PACKET_HSN, Hsn);
+}
+
+//
+// Find a feature descriptor in a Level 0 Discovery response. Returns
+// SED_OPAL_END if the drive does not report it.
+//
+
+int
+SedOpalFindFeature(
+    const uint8_t* Discovery,
+    uint32_t Length,
+    uint16_t Code,
+    const uint8_t** Data,
+    uint32_t* DataLength
+);
+
+#endif // _SEDOPAL_H_
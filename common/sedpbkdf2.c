@@ -0,0 +1,1545 @@
+/*++
+
+Module Name:
+
+    sedpbkdf2.c
+
+Abstract:
+
+    PBKDF2 over HMAC-SHA-1/256/512 with scalar, SHA-NI and AVX2 kernels,
+    see sedpbkdf2.h.
+
+    Every iteration after the first hashes the previous U, which is shorter
+    than a block, under the HMAC keys. The inner and outer key blocks are
+    hashed once per lane, so an iteration is two compressions of a block
+    that is U followed by constant padding. The kernels keep U as words from
+    the first iteration to the last and only go back to bytes for the key.
+
+Environment:
+
+    kernel and user mode, Windows and Linux
+
+--*/
+
+#include <string.h>
+
+#include "sedpbkdf2.h"
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define SED_PBKDF2_X86
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define SED_TARGET(t)
+#else
+#include <cpuid.h>
+#define SED_TARGET(t)               __attribute__((target(t)))
+#endif
+#endif
+
+//
+// Output blocks of the jobs of one batch, [word][lane] so the AVX2 kernels
+// can load a word of every lane at once
+//
+
+typedef struct _SED_PBKDF2_BATCH {
+    uint32_t Count;
+    const SED_PBKDF2_JOB* Job[SED_PBKDF2_LANES];
+    uint32_t Block[SED_PBKDF2_LANES];       // 1 based, as in the salt
+    uint32_t Inner[8][SED_PBKDF2_LANES];    // state after the ipad block
+    uint32_t Outer[8][SED_PBKDF2_LANES];    // state after the opad block
+    uint32_t U[8][SED_PBKDF2_LANES];
+    uint32_t T[8][SED_PBKDF2_LANES];
+} SED_PBKDF2_BATCH;
+
+//
+// Incremental hash, only used to set up a lane
+//
+
+typedef struct _SED_SHA {
+    SED_HASH Hash;
+    uint32_t BlockLength;
+    uint32_t Fill;
+    uint64_t Length;
+    uint32_t State32[8];
+    uint64_t State64[8];
+    uint8_t Block[128];
+} SED_SHA;
+
+typedef void SED_SHA_COMPRESS(uint32_t* State, const uint32_t* W);
+
+static const uint32_t SedSha1Iv[5] = {
+    0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0
+};
+
+static const uint32_t SedSha256Iv[8] = {
+    0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A, 0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19
+};
+
+static const uint64_t SedSha512Iv[8] = {
+    0x6A09E667F3BCC908ULL, 0xBB67AE8584CAA73BULL, 0x3C6EF372FE94F82BULL, 0xA54FF53A5F1D36F1ULL,
+    0x510E527FADE682D1ULL, 0x9B05688C2B3E6C1FULL, 0x1F83D9ABFB41BD6BULL, 0x5BE0CD19137E2179ULL
+};
+
+static const uint32_t SedSha256K[64] = {
+    0x428A2F98, 0x71374491, 0xB5C0FBCF, 0xE9B5DBA5, 0x3956C25B, 0x59F111F1, 0x923F82A4, 0xAB1C5ED5,
+    0xD807AA98, 0x12835B01, 0x243185BE, 0x550C7DC3, 0x72BE5D74, 0x80DEB1FE, 0x9BDC06A7, 0xC19BF174,
+    0xE49B69C1, 0xEFBE4786, 0x0FC19DC6, 0x240CA1CC, 0x2DE92C6F, 0x4A7484AA, 0x5CB0A9DC, 0x76F988DA,
+    0x983E5152, 0xA831C66D, 0xB00327C8, 0xBF597FC7, 0xC6E00BF3, 0xD5A79147, 0x06CA6351, 0x14292967,
+    0x27B70A85, 0x2E1B2138, 0x4D2C6DFC, 0x53380D13, 0x650A7354, 0x766A0ABB, 0x81C2C92E, 0x92722C85,
+    0xA2BFE8A1, 0xA81A664B, 0xC24B8B70, 0xC76C51A3, 0xD192E819, 0xD6990624, 0xF40E3585, 0x106AA070,
+    0x19A4C116, 0x1E376C08, 0x2748774C, 0x34B0BCB5, 0x391C0CB3, 0x4ED8AA4A, 0x5B9CCA4F, 0x682E6FF3,
+    0x748F82EE, 0x78A5636F, 0x84C87814, 0x8CC70208, 0x90BEFFFA, 0xA4506CEB, 0xBEF9A3F7, 0xC67178F2
+};
+
+static const uint64_t SedSha512K[80] = {
+    0x428A2F98D728AE22ULL, 0x7137449123EF65CDULL, 0xB5C0FBCFEC4D3B2FULL, 0xE9B5DBA58189DBBCULL,
+    0x3956C25BF348B538ULL, 0x59F111F1B605D019ULL, 0x923F82A4AF194F9BULL, 0xAB1C5ED5DA6D8118ULL,
+    0xD807AA98A3030242ULL, 0x12835B0145706FBEULL, 0x243185BE4EE4B28CULL, 0x550C7DC3D5FFB4E2ULL,
+    0x72BE5D74F27B896FULL, 0x80DEB1FE3B1696B1ULL, 0x9BDC06A725C71235ULL, 0xC19BF174CF692694ULL,
+    0xE49B69C19EF14AD2ULL, 0xEFBE4786384F25E3ULL, 0x0FC19DC68B8CD5B5ULL, 0x240CA1CC77AC9C65ULL,
+    0x2DE92C6F592B0275ULL, 0x4A7484AA6EA6E483ULL, 0x5CB0A9DCBD41FBD4ULL, 0x76F988DA831153B5ULL,
+    0x983E5152EE66DFABULL, 0xA831C66D2DB43210ULL, 0xB00327C898FB213FULL, 0xBF597FC7BEEF0EE4ULL,
+    0xC6E00BF33DA88FC2ULL, 0xD5A79147930AA725ULL, 0x06CA6351E003826FULL, 0x142929670A0E6E70ULL,
+    0x27B70A8546D22FFCULL, 0x2E1B21385C26C926ULL, 0x4D2C6DFC5AC42AEDULL, 0x53380D139D95B3DFULL,
+    0x650A73548BAF63DEULL, 0x766A0ABB3C77B2A8ULL, 0x81C2C92E47EDAEE6ULL, 0x92722C851482353BULL,
+    0xA2BFE8A14CF10364ULL, 0xA81A664BBC423001ULL, 0xC24B8B70D0F89791ULL, 0xC76C51A30654BE30ULL,
+    0xD192E819D6EF5218ULL, 0xD69906245565A910ULL, 0xF40E35855771202AULL, 0x106AA07032BBD1B8ULL,
+    0x19A4C116B8D2D0C8ULL, 0x1E376C085141AB53ULL, 0x2748774CDF8EEB99ULL, 0x34B0BCB5E19B48A8ULL,
+    0x391C0CB3C5C95A63ULL, 0x4ED8AA4AE3418ACBULL, 0x5B9CCA4F7763E373ULL, 0x682E6FF3D6B2B8A3ULL,
+    0x748F82EE5DEFB2FCULL, 0x78A5636F43172F60ULL, 0x84C87814A1F0AB72ULL, 0x8CC702081A6439ECULL,
+    0x90BEFFFA23631E28ULL, 0xA4506CEBDE82BDE9ULL, 0xBEF9A3F7B2C67915ULL, 0xC67178F2E372532BULL,
+    0xCA273ECEEA26619CULL, 0xD186B8C721C0C207ULL, 0xEADA7DD6CDE0EB1EULL, 0xF57D4F7FEE6ED178ULL,
+    0x06F067AA72176FBAULL, 0x0A637DC5A2C898A6ULL, 0x113F9804BEF90DAEULL, 0x1B710B35131C471BULL,
+    0x28DB77F523047D84ULL, 0x32CAAB7B40C72493ULL, 0x3C9EBE0A15C9BEBCULL, 0x431D67C49C100D4CULL,
+    0x4CC5D4BECB3E42B6ULL, 0x597F299CFC657E2AULL, 0x5FCB6FAB3AD6FAECULL, 0x6C44198C4A475817ULL
+};
+
+#define SED_ROL32(x, n)             (((x) << (n)) | ((x) >> (32 - (n))))
+#define SED_ROR32(x, n)             (((x) >> (n)) | ((x) << (32 - (n))))
+#define SED_ROR64(x, n)             (((x) >> (n)) | ((x) << (64 - (n))))
+
+static void
+SedPbkdf2Wipe(
+    void* Buffer,
+    uint32_t Length
+)
+{
+    volatile uint8_t* p = (volatile uint8_t*)Buffer;
+
+    while (Length-- != 0) {
+        *p++ = 0;
+    }
+}
+
+static __inline uint32_t
+SedLoad32(
+    const uint8_t* p
+)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static __inline uint64_t
+SedLoad64(
+    const uint8_t* p
+)
+{
+    return ((uint64_t)SedLoad32(p) << 32) | SedLoad32(p + 4);
+}
+
+static __inline void
+SedStore32(
+    uint8_t* p,
+    uint32_t v
+)
+{
+    p[0] = (uint8_t)(v >> 24);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);
+    p[3] = (uint8_t)v;
+}
+
+static __inline void
+SedStore64(
+    uint8_t* p,
+    uint64_t v
+)
+{
+    SedStore32(p, (uint32_t)(v >> 32));
+    SedStore32(p + 4, (uint32_t)v);
+}
+
+//
+// Scalar compression functions, on message words
+//
+
+static void
+SedSha1Compress(
+    uint32_t* State,
+    const uint32_t* W
+)
+{
+    uint32_t w[16];
+    uint32_t a = State[0], b = State[1], c = State[2], d = State[3], e = State[4];
+    uint32_t f, k, t;
+    int i;
+
+    memcpy(w, W, sizeof(w));
+
+    for (i = 0; i < 80; i++) {
+        if (i >= 16) {
+            t = w[(i - 3) & 15] ^ w[(i - 8) & 15] ^ w[(i - 14) & 15] ^ w[i & 15];
+            w[i & 15] = SED_ROL32(t, 1);
+        }
+
+        if (i < 20) {
+            f = d ^ (b & (c ^ d));
+            k = 0x5A827999;
+        }
+        else if (i < 40) {
+            f = b ^ c ^ d;
+            k = 0x6ED9EBA1;
+        }
+        else if (i < 60) {
+            f = (b & c) | (d & (b | c));
+            k = 0x8F1BBCDC;
+        }
+        else {
+            f = b ^ c ^ d;
+            k = 0xCA62C1D6;
+        }
+
+        t = SED_ROL32(a, 5) + f + e + k + w[i & 15];
+        e = d;
+        d = c;
+        c = SED_ROL32(b, 30);
+        b = a;
+        a = t;
+    }
+
+    State[0] += a;
+    State[1] += b;
+    State[2] += c;
+    State[3] += d;
+    State[4] += e;
+}
+
+static void
+SedSha256Compress(
+    uint32_t* State,
+    const uint32_t* W
+)
+{
+    uint32_t w[16];
+    uint32_t a = State[0], b = State[1], c = State[2], d = State[3];
+    uint32_t e = State[4], f = State[5], g = State[6], h = State[7];
+    uint32_t t1, t2;
+    int i;
+
+    memcpy(w, W, sizeof(w));
+
+    for (i = 0; i < 64; i++) {
+        if (i >= 16) {
+            uint32_t w15 = w[(i - 15) & 15];
+            uint32_t w2 = w[(i - 2) & 15];
+
+            w[i & 15] += (SED_ROR32(w2, 17) ^ SED_ROR32(w2, 19) ^ (w2 >> 10)) + w[(i - 7) & 15] +
+                (SED_ROR32(w15, 7) ^ SED_ROR32(w15, 18) ^ (w15 >> 3));
+        }
+
+        t1 = h + (SED_ROR32(e, 6) ^ SED_ROR32(e, 11) ^ SED_ROR32(e, 25)) + (g ^ (e & (f ^ g))) +
+            SedSha256K[i] + w[i & 15];
+        t2 = (SED_ROR32(a, 2) ^ SED_ROR32(a, 13) ^ SED_ROR32(a, 22)) + ((a & b) | (c & (a | b)));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+
+    State[0] += a;
+    State[1] += b;
+    State[2] += c;
+    State[3] += d;
+    State[4] += e;
+    State[5] += f;
+    State[6] += g;
+    State[7] += h;
+}
+
+static void
+SedSha512Compress(
+    uint64_t* State,
+    const uint64_t* W
+)
+{
+    uint64_t w[16];
+    uint64_t a = State[0], b = State[1], c = State[2], d = State[3];
+    uint64_t e = State[4], f = State[5], g = State[6], h = State[7];
+    uint64_t t1, t2;
+    int i;
+
+    memcpy(w, W, sizeof(w));
+
+    for (i = 0; i < 80; i++) {
+        if (i >= 16) {
+            uint64_t w15 = w[(i - 15) & 15];
+            uint64_t w2 = w[(i - 2) & 15];
+
+            w[i & 15] += (SED_ROR64(w2, 19) ^ SED_ROR64(w2, 61) ^ (w2 >> 6)) + w[(i - 7) & 15] +
+                (SED_ROR64(w15, 1) ^ SED_ROR64(w15, 8) ^ (w15 >> 7));
+        }
+
+        t1 = h + (SED_ROR64(e, 14) ^ SED_ROR64(e, 18) ^ SED_ROR64(e, 41)) + (g ^ (e & (f ^ g))) +
+            SedSha512K[i] + w[i & 15];
+        t2 = (SED_ROR64(a, 28) ^ SED_ROR64(a, 34) ^ SED_ROR64(a, 39)) + ((a & b) | (c & (a | b)));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+
+    State[0] += a;
+    State[1] += b;
+    State[2] += c;
+    State[3] += d;
+    State[4] += e;
+    State[5] += f;
+    State[6] += g;
+    State[7] += h;
+}
+
+#if defined(SED_PBKDF2_X86)
+
+//
+// SHA-NI. The message words are already in host order, so where the usual
+// byte loads shuffle the bytes of each word only the word order is left
+// to fix.
+//
+
+SED_TARGET("sha,sse4.1")
+static void
+SedSha1CompressShaNi(
+    uint32_t* State,
+    const uint32_t* W
+)
+{
+    __m128i abcd, abcdSave, e0Save;
+    __m128i e0, e1;
+    __m128i msg0, msg1, msg2, msg3;
+
+    abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)State), 0x1B);
+    e0 = _mm_set_epi32((int)State[4], 0, 0, 0);
+    abcdSave = abcd;
+    e0Save = e0;
+
+    //
+    // The message schedule of the next groups is advanced alongside the
+    // rounds of this one
+    //
+
+    /* Rounds 0-3 */
+    msg0 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)(W + 0)), 0x1B);
+    e0 = _mm_add_epi32(e0, msg0);
+    e1 = abcd;
+    abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+
+    /* Rounds 4-7 */
+    msg1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)(W + 4)), 0x1B);
+    e1 = _mm_sha1nexte_epu32(e1, msg1);
+    e0 = abcd;
+    abcd = _mm_sha1rnds4_epu32(abcd, e1, 0);
+    msg0 = _mm_sha1msg1_epu32(msg0, msg1);
+
+    /* Rounds 8-11 */
+    msg2 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)(W + 8)), 0x1B);
+    e0 = _mm_sha1nexte_epu32(e0, msg2);
+    e1 = abcd;
+    abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+    msg1 = _mm_sha1msg1_epu32(msg1, msg2);
+    msg0 = _mm_xor_si128(msg0, msg2);
+
+    /* Rounds 12-15 */
+    msg3 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)(W + 12)), 0x1B);
+    e1 = _mm_sha1nexte_epu32(e1, msg3);
+    e0 = abcd;
+    msg0 = _mm_sha1msg2_epu32(msg0, msg3);
+    abcd = _mm_sha1rnds4_epu32(abcd, e1, 0);
+    msg2 = _mm_sha1msg1_epu32(msg2, msg3);
+    msg1 = _mm_xor_si128(msg1, msg3);
+
+    /* Rounds 16-19 */
+    e0 = _mm_sha1nexte_epu32(e0, msg0);
+    e1 = abcd;
+    msg1 = _mm_sha1msg2_epu32(msg1, msg0);
+    abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+    msg3 = _mm_sha1msg1_epu32(msg3, msg0);
+    msg2 = _mm_xor_si128(msg2, msg0);
+
+    /* Rounds 20-23 */
+    e1 = _mm_sha1nexte_epu32(e1, msg1);
+    e0 = abcd;
+    msg2 = _mm_sha1msg2_epu32(msg2, msg1);
+    abcd = _mm_sha1rnds4_epu32(abcd, e1, 1);
+    msg0 = _mm_sha1msg1_epu32(msg0, msg1);
+    msg3 = _mm_xor_si128(msg3, msg1);
+
+    /* Rounds 24-27 */
+    e0 = _mm_sha1nexte_epu32(e0, msg2);
+    e1 = abcd;
+    msg3 = _mm_sha1msg2_epu32(msg3, msg2);
+    abcd = _mm_sha1rnds4_epu32(abcd, e0, 1);
+    msg1 = _mm_sha1msg1_epu32(msg1, msg2);
+    msg0 = _mm_xor_si128(msg0, msg2);
+
+    /* Rounds 28-31 */
+    e1 = _mm_sha1nexte_epu32(e1, msg3);
+    e0 = abcd;
+    msg0 = _mm_sha1msg2_epu32(msg0, msg3);
+    abcd = _mm_sha1rnds4_epu32(abcd, e1, 1);
+    msg2 = _mm_sha1msg1_epu32(msg2, msg3);
+    msg1 = _mm_xor_si128(msg1, msg3);
+
+    /* Rounds 32-35 */
+    e0 = _mm_sha1nexte_epu32(e0, msg0);
+    e1 = abcd;
+    msg1 = _mm_sha1msg2_epu32(msg1, msg0);
+    abcd = _mm_sha1rnds4_epu32(abcd, e0, 1);
+    msg3 = _mm_sha1msg1_epu32(msg3, msg0);
+    msg2 = _mm_xor_si128(msg2, msg0);
+
+    /* Rounds 36-39 */
+    e1 = _mm_sha1nexte_epu32(e1, msg1);
+    e0 = abcd;
+    msg2 = _mm_sha1msg2_epu32(msg2, msg1);
+    abcd = _mm_sha1rnds4_epu32(abcd, e1, 1);
+    msg0 = _mm_sha1msg1_epu32(msg0, msg1);
+    msg3 = _mm_xor_si128(msg3, msg1);
+
+    /* Rounds 40-43 */
+    e0 = _mm_sha1nexte_epu32(e0, msg2);
+    e1 = abcd;
+    msg3 = _mm_sha1msg2_epu32(msg3, msg2);
+    abcd = _mm_sha1rnds4_epu32(abcd, e0, 2);
+    msg1 = _mm_sha1msg1_epu32(msg1, msg2);
+    msg0 = _mm_xor_si128(msg0, msg2);
+
+    /* Rounds 44-47 */
+    e1 = _mm_sha1nexte_epu32(e1, msg3);
+    e0 = abcd;
+    msg0 = _mm_sha1msg2_epu32(msg0, msg3);
+    abcd = _mm_sha1rnds4_epu32(abcd, e1, 2);
+    msg2 = _mm_sha1msg1_epu32(msg2, msg3);
+    msg1 = _mm_xor_si128(msg1, msg3);
+
+    /* Rounds 48-51 */
+    e0 = _mm_sha1nexte_epu32(e0, msg0);
+    e1 = abcd;
+    msg1 = _mm_sha1msg2_epu32(msg1, msg0);
+    abcd = _mm_sha1rnds4_epu32(abcd, e0, 2);
+    msg3 = _mm_sha1msg1_epu32(msg3, msg0);
+    msg2 = _mm_xor_si128(msg2, msg0);
+
+    /* Rounds 52-55 */
+    e1 = _mm_sha1nexte_epu32(e1, msg1);
+    e0 = abcd;
+    msg2 = _mm_sha1msg2_epu32(msg2, msg1);
+    abcd = _mm_sha1rnds4_epu32(abcd, e1, 2);
+    msg0 = _mm_sha1msg1_epu32(msg0, msg1);
+    msg3 = _mm_xor_si128(msg3, msg1);
+
+    /* Rounds 56-59 */
+    e0 = _mm_sha1nexte_epu32(e0, msg2);
+    e1 = abcd;
+    msg3 = _mm_sha1msg2_epu32(msg3, msg2);
+    abcd = _mm_sha1rnds4_epu32(abcd, e0, 2);
+    msg1 = _mm_sha1msg1_epu32(msg1, msg2);
+    msg0 = _mm_xor_si128(msg0, msg2);
+
+    /* Rounds 60-63 */
+    e1 = _mm_sha1nexte_epu32(e1, msg3);
+    e0 = abcd;
+    msg0 = _mm_sha1msg2_epu32(msg0, msg3);
+    abcd = _mm_sha1rnds4_epu32(abcd, e1, 3);
+    msg2 = _mm_sha1msg1_epu32(msg2, msg3);
+    msg1 = _mm_xor_si128(msg1, msg3);
+
+    /* Rounds 64-67 */
+    e0 = _mm_sha1nexte_epu32(e0, msg0);
+    e1 = abcd;
+    msg1 = _mm_sha1msg2_epu32(msg1, msg0);
+    abcd = _mm_sha1rnds4_epu32(abcd, e0, 3);
+    msg3 = _mm_sha1msg1_epu32(msg3, msg0);
+    msg2 = _mm_xor_si128(msg2, msg0);
+
+    /* Rounds 68-71 */
+    e1 = _mm_sha1nexte_epu32(e1, msg1);
+    e0 = abcd;
+    msg2 = _mm_sha1msg2_epu32(msg2, msg1);
+    abcd = _mm_sha1rnds4_epu32(abcd, e1, 3);
+    msg3 = _mm_xor_si128(msg3, msg1);
+
+    /* Rounds 72-75 */
+    e0 = _mm_sha1nexte_epu32(e0, msg2);
+    e1 = abcd;
+    msg3 = _mm_sha1msg2_epu32(msg3, msg2);
+    abcd = _mm_sha1rnds4_epu32(abcd, e0, 3);
+
+    /* Rounds 76-79 */
+    e1 = _mm_sha1nexte_epu32(e1, msg3);
+    e0 = abcd;
+    abcd = _mm_sha1rnds4_epu32(abcd, e1, 3);
+    e0 = _mm_sha1nexte_epu32(e0, e0Save);
+    abcd = _mm_add_epi32(abcd, abcdSave);
+
+    _mm_storeu_si128((__m128i*)State, _mm_shuffle_epi32(abcd, 0x1B));
+    State[4] = (uint32_t)_mm_extract_epi32(e0, 3);
+}
+
+SED_TARGET("sha,sse4.1")
+static void
+SedSha256CompressShaNi(
+    uint32_t* State,
+    const uint32_t* W
+)
+{
+    __m128i state0, state1, save0, save1, m, t;
+    __m128i msg0, msg1, msg2, msg3;
+
+    //
+    // The round instructions want ABEF and CDGH
+    //
+
+    t = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&State[0]), 0xB1);
+    state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&State[4]), 0x1B);
+    state0 = _mm_alignr_epi8(t, state1, 8);
+    state1 = _mm_blend_epi16(state1, t, 0xF0);
+    save0 = state0;
+    save1 = state1;
+
+    /* Rounds 0-3 */
+    msg0 = _mm_loadu_si128((const __m128i*)(W + 0));
+    m = _mm_add_epi32(msg0, _mm_loadu_si128((const __m128i*)&SedSha256K[0]));
+    state1 = _mm_sha256rnds2_epu32(state1, state0, m);
+    m = _mm_shuffle_epi32(m, 0x0E);
+    state0 = _mm_sha256rnds2_epu32(state0, state1, m);
+
+    /* Rounds 4-7 */
+    msg1 = _mm_loadu_si128((const __m128i*)(W + 4));
+    m = _mm_add_epi32(msg1, _mm_loadu_si128((const __m128i*)&SedSha256K[4]));
+    state1 = _mm_sha256rnds2_epu32(state1, state0, m);
+    m = _mm_shuffle_epi32(m, 0x0E);
+    state0 = _mm_sha256rnds2_epu32(state0, state1, m);
+    msg0 = _mm_sha256msg1_epu32(msg0, msg1);
+
+    /* Rounds 8-11 */
+    msg2 = _mm_loadu_si128((const __m128i*)(W + 8));
+    m = _mm_add_epi32(msg2, _mm_loadu_si128((const __m128i*)&SedSha256K[8]));
+    state1 = _mm_sha256rnds2_epu32(state1, state0, m);
+    m = _mm_shuffle_epi32(m, 0x0E);
+    state0 = _mm_sha256rnds2_epu32(state0, state1, m);
+    msg1 = _mm_sha256msg1_epu32(msg1, msg2);
+
+    /* Rounds 12-15 */
+    msg3 = _mm_loadu_si128((const __m128i*)(W + 12));
+    m = _mm_add_epi32(msg3, _mm_loadu_si128((const __m128i*)&SedSha256K[12]));
+    state1 = _mm_sha256rnds2_epu32(state1, state0, m);
+    t = _mm_alignr_epi8(msg3, msg2, 4);
+    msg0 = _mm_sha256msg2_epu32(_mm_add_epi32(msg0, t), msg3);
+    m = _mm_shuffle_epi32(m, 0x0E);
+    state0 = _mm_sha256rnds2_epu32(state0, state1, m);
+    msg2 = _mm_sha256msg1_epu32(msg2, msg3);
+
+    /* Rounds 16-19 */
+    m = _mm_add_epi32(msg0, _mm_loadu_si128((const __m128i*)&SedSha256K[16]));
+    state1 = _mm_sha256rnds2_epu32(state1, state0, m);
+    t = _mm_alignr_epi8(msg0, msg3, 4);
+    msg1 = _mm_sha256msg2_epu32(_mm_add_epi32(msg1, t), msg0);
+    m = _mm_shuffle_epi32(m, 0x0E);
+    state0 = _mm_sha256rnds2_epu32(state0, state1, m);
+    msg3 = _mm_sha256msg1_epu32(msg3, msg0);
+
+    /* Rounds 20-23 */
+    m = _mm_add_epi32(msg1, _mm_loadu_si128((const __m128i*)&SedSha256K[20]));
+    state1 = _mm_sha256rnds2_epu32(state1, state0, m);
+    t = _mm_alignr_epi8(msg1, msg0, 4);
+    msg2 = _mm_sha256msg2_epu32(_mm_add_epi32(msg2, t), msg1);
+    m = _mm_shuffle_epi32(m, 0x0E);
+    state0 = _mm_sha256rnds2_epu32(state0, state1, m);
+    msg0 = _mm_sha256msg1_epu32(msg0, msg1);
+
+    /* Rounds 24-27 */
+    m = _mm_add_epi32(msg2, _mm_loadu_si128((const __m128i*)&SedSha256K[24]));
+    state1 = _mm_sha256rnds2_epu32(state1, state0, m);
+    t = _mm_alignr_epi8(msg2, msg1, 4);
+    msg3 = _mm_sha256msg2_epu32(_mm_add_epi32(msg3, t), msg2);
+    m = _mm_shuffle_epi32(m, 0x0E);
+    state0 = _mm_sha256rnds2_epu32(state0, state1, m);
+    msg1 = _mm_sha256msg1_epu32(msg1, msg2);
+
+    /* Rounds 28-31 */
+    m = _mm_add_epi32(msg3, _mm_loadu_si128((const __m128i*)&SedSha256K[28]));
+    state1 = _mm_sha256rnds2_epu32(state1, state0, m);
+    t = _mm_alignr_epi8(msg3, msg2, 4);
+    msg0 = _mm_sha256msg2_epu32(_mm_add_epi32(msg0, t), msg3);
+    m = _mm_shuffle_epi32(m, 0x0E);
+    state0 = _mm_sha256rnds2_epu32(state0, state1, m);
+    msg2 = _mm_sha256msg1_epu32(msg2, msg3);
+
+    /* Rounds 32-35 */
+    m = _mm_add_epi32(msg0, _mm_loadu_si128((const __m128i*)&SedSha256K[32]));
+    state1 = _mm_sha256rnds2_epu32(state1, state0, m);
+    t = _mm_alignr_epi8(msg0, msg3, 4);
+    msg1 = _mm_sha256msg2_epu32(_mm_add_epi32(msg1, t), msg0);
+    m = _mm_shuffle_epi32(m, 0x0E);
+    state0 = _mm_sha256rnds2_epu32(state0, state1, m);
+    msg3 = _mm_sha256msg1_epu32(msg3, msg0);
+
+    /* Rounds 36-39 */
+    m = _mm_add_epi32(msg1, _mm_loadu_si128((const __m128i*)&SedSha256K[36]));
+    state1 = _mm_sha256rnds2_epu32(state1, state0, m);
+    t = _mm_alignr_epi8(msg1, msg0, 4);
+    msg2 = _mm_sha256msg2_epu32(_mm_add_epi32(msg2, t), msg1);
+    m = _mm_shuffle_epi32(m, 0x0E);
+    state0 = _mm_sha256rnds2_epu32(state0, state1, m);
+    msg0 = _mm_sha256msg1_epu32(msg0, msg1);
+
+    /* Rounds 40-43 */
+    m = _mm_add_epi32(msg2, _mm_loadu_si128((const __m128i*)&SedSha256K[40]));
+    state1 = _mm_sha256rnds2_epu32(state1, state0, m);
+    t = _mm_alignr_epi8(msg2, msg1, 4);
+    msg3 = _mm_sha256msg2_epu32(_mm_add_epi32(msg3, t), msg2);
+    m = _mm_shuffle_epi32(m, 0x0E);
+    state0 = _mm_sha256rnds2_epu32(state0, state1, m);
+    msg1 = _mm_sha256msg1_epu32(msg1, msg2);
+
+    /* Rounds 44-47 */
+    m = _mm_add_epi32(msg3, _mm_loadu_si128((const __m128i*)&SedSha256K[44]));
+    state1 = _mm_sha256rnds2_epu32(state1, state0, m);
+    t = _mm_alignr_epi8(msg3, msg2, 4);
+    msg0 = _mm_sha256msg2_epu32(_mm_add_epi32(msg0, t), msg3);
+    m = _mm_shuffle_epi32(m, 0x0E);
+    state0 = _mm_sha256rnds2_epu32(state0, state1, m);
+    msg2 = _mm_sha256msg1_epu32(msg2, msg3);
+
+    /* Rounds 48-51 */
+    m = _mm_add_epi32(msg0, _mm_loadu_si128((const __m128i*)&SedSha256K[48]));
+    state1 = _mm_sha256rnds2_epu32(state1, state0, m);
+    t = _mm_alignr_epi8(msg0, msg3, 4);
+    msg1 = _mm_sha256msg2_epu32(_mm_add_epi32(msg1, t), msg0);
+    m = _mm_shuffle_epi32(m, 0x0E);
+    state0 = _mm_sha256rnds2_epu32(state0, state1, m);
+    msg3 = _mm_sha256msg1_epu32(msg3, msg0);
+
+    /* Rounds 52-55 */
+    m = _mm_add_epi32(msg1, _mm_loadu_si128((const __m128i*)&SedSha256K[52]));
+    state1 = _mm_sha256rnds2_epu32(state1, state0, m);
+    t = _mm_alignr_epi8(msg1, msg0, 4);
+    msg2 = _mm_sha256msg2_epu32(_mm_add_epi32(msg2, t), msg1);
+    m = _mm_shuffle_epi32(m, 0x0E);
+    state0 = _mm_sha256rnds2_epu32(state0, state1, m);
+
+    /* Rounds 56-59 */
+    m = _mm_add_epi32(msg2, _mm_loadu_si128((const __m128i*)&SedSha256K[56]));
+    state1 = _mm_sha256rnds2_epu32(state1, state0, m);
+    t = _mm_alignr_epi8(msg2, msg1, 4);
+    msg3 = _mm_sha256msg2_epu32(_mm_add_epi32(msg3, t), msg2);
+    m = _mm_shuffle_epi32(m, 0x0E);
+    state0 = _mm_sha256rnds2_epu32(state0, state1, m);
+
+    /* Rounds 60-63 */
+    m = _mm_add_epi32(msg3, _mm_loadu_si128((const __m128i*)&SedSha256K[60]));
+    state1 = _mm_sha256rnds2_epu32(state1, state0, m);
+    m = _mm_shuffle_epi32(m, 0x0E);
+    state0 = _mm_sha256rnds2_epu32(state0, state1, m);
+    state0 = _mm_add_epi32(state0, save0);
+    state1 = _mm_add_epi32(state1, save1);
+
+    t = _mm_shuffle_epi32(state0, 0x1B);
+    state1 = _mm_shuffle_epi32(state1, 0xB1);
+    _mm_storeu_si128((__m128i*)&State[0], _mm_blend_epi16(t, state1, 0xF0));
+    _mm_storeu_si128((__m128i*)&State[4], _mm_alignr_epi8(state1, t, 8));
+}
+
+//
+// AVX2, eight lanes at a time
+//
+
+SED_TARGET("avx2")
+static __inline __m256i
+SedRol32x8(
+    __m256i x,
+    int n
+)
+{
+    return _mm256_or_si256(_mm256_slli_epi32(x, n), _mm256_srli_epi32(x, 32 - n));
+}
+
+SED_TARGET("avx2")
+static __inline __m256i
+SedRor32x8(
+    __m256i x,
+    int n
+)
+{
+    return _mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - n));
+}
+
+SED_TARGET("avx2")
+static __inline void
+SedSha1CompressX8(
+    __m256i* State,
+    __m256i* W
+)
+{
+    __m256i a = State[0], b = State[1], c = State[2], d = State[3], e = State[4];
+    __m256i f, k, t;
+    int i;
+
+    for (i = 0; i < 80; i++) {
+        if (i >= 16) {
+            t = _mm256_xor_si256(_mm256_xor_si256(W[(i - 3) & 15], W[(i - 8) & 15]),
+                _mm256_xor_si256(W[(i - 14) & 15], W[i & 15]));
+            W[i & 15] = SedRol32x8(t, 1);
+        }
+
+        if (i < 20) {
+            f = _mm256_xor_si256(d, _mm256_and_si256(b, _mm256_xor_si256(c, d)));
+            k = _mm256_set1_epi32(0x5A827999);
+        }
+        else if (i < 40) {
+            f = _mm256_xor_si256(_mm256_xor_si256(b, c), d);
+            k = _mm256_set1_epi32(0x6ED9EBA1);
+        }
+        else if (i < 60) {
+            f = _mm256_or_si256(_mm256_and_si256(b, c), _mm256_and_si256(d, _mm256_or_si256(b, c)));
+            k = _mm256_set1_epi32((int)0x8F1BBCDC);
+        }
+        else {
+            f = _mm256_xor_si256(_mm256_xor_si256(b, c), d);
+            k = _mm256_set1_epi32((int)0xCA62C1D6);
+        }
+
+        t = _mm256_add_epi32(_mm256_add_epi32(SedRol32x8(a, 5), f),
+            _mm256_add_epi32(_mm256_add_epi32(e, k), W[i & 15]));
+        e = d;
+        d = c;
+        c = SedRol32x8(b, 30);
+        b = a;
+        a = t;
+    }
+
+    State[0] = _mm256_add_epi32(State[0], a);
+    State[1] = _mm256_add_epi32(State[1], b);
+    State[2] = _mm256_add_epi32(State[2], c);
+    State[3] = _mm256_add_epi32(State[3], d);
+    State[4] = _mm256_add_epi32(State[4], e);
+}
+
+SED_TARGET("avx2")
+static __inline void
+SedSha256CompressX8(
+    __m256i* State,
+    __m256i* W
+)
+{
+    __m256i a = State[0], b = State[1], c = State[2], d = State[3];
+    __m256i e = State[4], f = State[5], g = State[6], h = State[7];
+    __m256i s0, s1, t1, t2;
+    int i;
+
+    for (i = 0; i < 64; i++) {
+        if (i >= 16) {
+            __m256i w15 = W[(i - 15) & 15];
+            __m256i w2 = W[(i - 2) & 15];
+
+            s0 = _mm256_xor_si256(_mm256_xor_si256(SedRor32x8(w15, 7), SedRor32x8(w15, 18)),
+                _mm256_srli_epi32(w15, 3));
+            s1 = _mm256_xor_si256(_mm256_xor_si256(SedRor32x8(w2, 17), SedRor32x8(w2, 19)),
+                _mm256_srli_epi32(w2, 10));
+            W[i & 15] = _mm256_add_epi32(_mm256_add_epi32(W[i & 15], s0),
+                _mm256_add_epi32(W[(i - 7) & 15], s1));
+        }
+
+        s1 = _mm256_xor_si256(_mm256_xor_si256(SedRor32x8(e, 6), SedRor32x8(e, 11)), SedRor32x8(e, 25));
+        t1 = _mm256_add_epi32(_mm256_add_epi32(h, s1),
+            _mm256_add_epi32(_mm256_xor_si256(g, _mm256_and_si256(e, _mm256_xor_si256(f, g))),
+                _mm256_add_epi32(_mm256_set1_epi32((int)SedSha256K[i]), W[i & 15])));
+        s0 = _mm256_xor_si256(_mm256_xor_si256(SedRor32x8(a, 2), SedRor32x8(a, 13)), SedRor32x8(a, 22));
+        t2 = _mm256_add_epi32(s0,
+            _mm256_or_si256(_mm256_and_si256(a, b), _mm256_and_si256(c, _mm256_or_si256(a, b))));
+        h = g;
+        g = f;
+        f = e;
+        e = _mm256_add_epi32(d, t1);
+        d = c;
+        c = b;
+        b = a;
+        a = _mm256_add_epi32(t1, t2);
+    }
+
+    State[0] = _mm256_add_epi32(State[0], a);
+    State[1] = _mm256_add_epi32(State[1], b);
+    State[2] = _mm256_add_epi32(State[2], c);
+    State[3] = _mm256_add_epi32(State[3], d);
+    State[4] = _mm256_add_epi32(State[4], e);
+    State[5] = _mm256_add_epi32(State[5], f);
+    State[6] = _mm256_add_epi32(State[6], g);
+    State[7] = _mm256_add_epi32(State[7], h);
+}
+
+SED_TARGET("avx2")
+static void
+SedPbkdf2IterateAvx2(
+    SED_PBKDF2_BATCH* Lanes,
+    SED_HASH Hash,
+    uint32_t Iterations
+)
+
+/*++
+
+Routine Description:
+
+    Run iterations 2..Iterations of all eight lanes together. Unused lanes
+    are zero and just go along for the ride.
+
+--*/
+
+{
+    __m256i inner[8], outer[8], u[8], t[8], state[8], w[16];
+    uint32_t words = (Hash == SedHashSha1) ? 5 : 8;
+    uint32_t i;
+    uint32_t n;
+
+    for (i = 0; i < words; i++) {
+        inner[i] = _mm256_loadu_si256((const __m256i*)Lanes->Inner[i]);
+        outer[i] = _mm256_loadu_si256((const __m256i*)Lanes->Outer[i]);
+        u[i] = _mm256_loadu_si256((const __m256i*)Lanes->U[i]);
+        t[i] = _mm256_loadu_si256((const __m256i*)Lanes->T[i]);
+    }
+
+    for (n = 1; n < Iterations; n++) {
+
+        //
+        // Inner hash of U, then outer hash of that
+        //
+
+        for (i = 0; i < words; i++) {
+            w[i] = u[i];
+            state[i] = inner[i];
+        }
+        w[words] = _mm256_set1_epi32((int)0x80000000);
+        for (i = words + 1; i < 15; i++) {
+            w[i] = _mm256_setzero_si256();
+        }
+        w[15] = _mm256_set1_epi32((int)((64 + words * 4) * 8));
+
+        if (Hash == SedHashSha1) {
+            SedSha1CompressX8(state, w);
+        }
+        else {
+            SedSha256CompressX8(state, w);
+        }
+
+        for (i = 0; i < words; i++) {
+            w[i] = state[i];
+            state[i] = outer[i];
+        }
+        w[words] = _mm256_set1_epi32((int)0x80000000);
+        for (i = words + 1; i < 15; i++) {
+            w[i] = _mm256_setzero_si256();
+        }
+        w[15] = _mm256_set1_epi32((int)((64 + words * 4) * 8));
+
+        if (Hash == SedHashSha1) {
+            SedSha1CompressX8(state, w);
+        }
+        else {
+            SedSha256CompressX8(state, w);
+        }
+
+        for (i = 0; i < words; i++) {
+            u[i] = state[i];
+            t[i] = _mm256_xor_si256(t[i], u[i]);
+        }
+    }
+
+    for (i = 0; i < words; i++) {
+        _mm256_storeu_si256((__m256i*)Lanes->T[i], t[i]);
+    }
+
+    //
+    // The compiler may well have spilled key state; the caller wipes the
+    // lanes, this wipes the registers
+    //
+
+    _mm256_zeroall();
+}
+
+#endif // SED_PBKDF2_X86
+
+static void
+SedPbkdf2Iterate32(
+    SED_PBKDF2_BATCH* Lanes,
+    uint32_t Words,
+    uint32_t Iterations,
+    SED_SHA_COMPRESS* Compress
+)
+
+/*++
+
+Routine Description:
+
+    Run iterations 2..Iterations of each lane in turn, with a one block
+    compression function.
+
+--*/
+
+{
+    uint32_t w[16];
+    uint32_t inner[8];
+    uint32_t outer[8];
+    uint32_t state[8];
+    uint32_t t[8];
+    uint32_t lane;
+    uint32_t i;
+    uint32_t n;
+
+    for (lane = 0; lane < Lanes->Count; lane++) {
+        memset(w, 0, sizeof(w));
+        for (i = 0; i < Words; i++) {
+            inner[i] = Lanes->Inner[i][lane];
+            outer[i] = Lanes->Outer[i][lane];
+            w[i] = Lanes->U[i][lane];
+            t[i] = Lanes->T[i][lane];
+        }
+        w[Words] = 0x80000000;
+        w[15] = (64 + Words * 4) * 8;
+
+        for (n = 1; n < Iterations; n++) {
+            memcpy(state, inner, Words * 4);
+            Compress(state, w);
+            memcpy(w, state, Words * 4);
+
+            memcpy(state, outer, Words * 4);
+            Compress(state, w);
+            memcpy(w, state, Words * 4);
+
+            for (i = 0; i < Words; i++) {
+                t[i] ^= w[i];
+            }
+        }
+
+        for (i = 0; i < Words; i++) {
+            Lanes->T[i][lane] = t[i];
+        }
+    }
+
+    SedPbkdf2Wipe(w, sizeof(w));
+    SedPbkdf2Wipe(inner, sizeof(inner));
+    SedPbkdf2Wipe(outer, sizeof(outer));
+    SedPbkdf2Wipe(state, sizeof(state));
+    SedPbkdf2Wipe(t, sizeof(t));
+}
+
+uint32_t
+SedHashDigestLength(
+    SED_HASH Hash
+)
+{
+    switch (Hash) {
+    case SedHashSha1:   return 20;
+    case SedHashSha256: return 32;
+    case SedHashSha512: return 64;
+    default:            return 0;
+    }
+}
+
+static void
+SedShaInit(
+    SED_SHA* Sha,
+    SED_HASH Hash
+)
+{
+    memset(Sha, 0, sizeof(*Sha));
+    Sha->Hash = Hash;
+    Sha->BlockLength = (Hash == SedHashSha512) ? 128 : 64;
+
+    if (Hash == SedHashSha1) {
+        memcpy(Sha->State32, SedSha1Iv, sizeof(SedSha1Iv));
+    }
+    else if (Hash == SedHashSha256) {
+        memcpy(Sha->State32, SedSha256Iv, sizeof(SedSha256Iv));
+    }
+    else {
+        memcpy(Sha->State64, SedSha512Iv, sizeof(SedSha512Iv));
+    }
+}
+
+static void
+SedShaBlock(
+    SED_SHA* Sha
+)
+{
+    uint32_t w32[16];
+    uint64_t w64[16];
+    uint32_t i;
+
+    if (Sha->Hash == SedHashSha512) {
+        for (i = 0; i < 16; i++) {
+            w64[i] = SedLoad64(Sha->Block + 8 * i);
+        }
+        SedSha512Compress(Sha->State64, w64);
+        SedPbkdf2Wipe(w64, sizeof(w64));
+    }
+    else {
+        for (i = 0; i < 16; i++) {
+            w32[i] = SedLoad32(Sha->Block + 4 * i);
+        }
+        if (Sha->Hash == SedHashSha1) {
+            SedSha1Compress(Sha->State32, w32);
+        }
+        else {
+            SedSha256Compress(Sha->State32, w32);
+        }
+        SedPbkdf2Wipe(w32, sizeof(w32));
+    }
+}
+
+static void
+SedShaUpdate(
+    SED_SHA* Sha,
+    const uint8_t* Data,
+    uint32_t Length
+)
+{
+    Sha->Length += Length;
+
+    while (Length != 0) {
+        uint32_t chunk = Sha->BlockLength - Sha->Fill;
+
+        if (chunk > Length) {
+            chunk = Length;
+        }
+
+        memcpy(Sha->Block + Sha->Fill, Data, chunk);
+        Sha->Fill += chunk;
+        Data += chunk;
+        Length -= chunk;
+
+        if (Sha->Fill == Sha->BlockLength) {
+            SedShaBlock(Sha);
+            Sha->Fill = 0;
+        }
+    }
+}
+
+static void
+SedShaFinal(
+    SED_SHA* Sha,
+    uint8_t* Digest
+)
+{
+    uint32_t lengthField = (Sha->Hash == SedHashSha512) ? 16 : 8;
+    uint64_t bits = Sha->Length * 8;
+    uint32_t i;
+
+    Sha->Block[Sha->Fill++] = 0x80;
+    if (Sha->Fill > Sha->BlockLength - lengthField) {
+        memset(Sha->Block + Sha->Fill, 0, Sha->BlockLength - Sha->Fill);
+        SedShaBlock(Sha);
+        Sha->Fill = 0;
+    }
+    memset(Sha->Block + Sha->Fill, 0, Sha->BlockLength - Sha->Fill);
+    SedStore64(Sha->Block + Sha->BlockLength - 8, bits);
+    SedShaBlock(Sha);
+
+    if (Sha->Hash == SedHashSha512) {
+        for (i = 0; i < 8; i++) {
+            SedStore64(Digest + 8 * i, Sha->State64[i]);
+        }
+    }
+    else {
+        for (i = 0; i < SedHashDigestLength(Sha->Hash) / 4; i++) {
+            SedStore32(Digest + 4 * i, Sha->State32[i]);
+        }
+    }
+}
+
+static void
+SedHmacKeys(
+    const SED_PBKDF2_JOB* Job,
+    SED_SHA* Inner,
+    SED_SHA* Outer
+)
+
+/*++
+
+Routine Description:
+
+    Hash the ipad and opad key blocks, a key longer than a block being
+    hashed first
+
+--*/
+
+{
+    uint8_t key[128];
+    uint8_t pad[128];
+    uint32_t i;
+
+    SedShaInit(Inner, Job->Hash);
+    memset(key, 0, sizeof(key));
+
+    if (Job->PasswordLength > Inner->BlockLength) {
+        SedShaUpdate(Inner, Job->Password, Job->PasswordLength);
+        SedShaFinal(Inner, key);
+        SedShaInit(Inner, Job->Hash);
+    }
+    else if (Job->PasswordLength != 0) {
+        memcpy(key, Job->Password, Job->PasswordLength);
+    }
+
+    *Outer = *Inner;
+
+    for (i = 0; i < Inner->BlockLength; i++) {
+        pad[i] = key[i] ^ 0x36;
+    }
+    SedShaUpdate(Inner, pad, Inner->BlockLength);
+
+    for (i = 0; i < Outer->BlockLength; i++) {
+        pad[i] = key[i] ^ 0x5C;
+    }
+    SedShaUpdate(Outer, pad, Outer->BlockLength);
+
+    SedPbkdf2Wipe(key, sizeof(key));
+    SedPbkdf2Wipe(pad, sizeof(pad));
+}
+
+static void
+SedPbkdf2First(
+    const SED_SHA* Inner,
+    const SED_SHA* Outer,
+    const SED_PBKDF2_JOB* Job,
+    uint32_t Block,
+    uint8_t* U
+)
+
+/*++
+
+Routine Description:
+
+    U1 = HMAC(Password, Salt || INT(Block))
+
+--*/
+
+{
+    SED_SHA sha;
+    uint8_t index[4];
+
+    SedStore32(index, Block);
+
+    sha = *Inner;
+    SedShaUpdate(&sha, Job->Salt, Job->SaltLength);
+    SedShaUpdate(&sha, index, sizeof(index));
+    SedShaFinal(&sha, U);
+
+    sha = *Outer;
+    SedShaUpdate(&sha, U, SedHashDigestLength(Job->Hash));
+    SedShaFinal(&sha, U);
+
+    SedPbkdf2Wipe(&sha, sizeof(sha));
+}
+
+static void
+SedPbkdf2Output(
+    const SED_PBKDF2_JOB* Job,
+    uint32_t Block,
+    const uint8_t* T
+)
+{
+    uint32_t digestLength = SedHashDigestLength(Job->Hash);
+    uint32_t offset = (Block - 1) * digestLength;
+    uint32_t length = Job->KeyLength - offset;
+
+    memcpy(Job->Key + offset, T, (length < digestLength) ? length : digestLength);
+}
+
+static void
+SedPbkdf2Sha512(
+    const SED_PBKDF2_JOB* Job,
+    uint32_t Block
+)
+
+/*++
+
+Routine Description:
+
+    One SHA-512 output block, start to finish
+
+--*/
+
+{
+    SED_SHA inner;
+    SED_SHA outer;
+    uint64_t w[16];
+    uint64_t state[8];
+    uint64_t t[8];
+    uint8_t u[64];
+    uint32_t i;
+    uint32_t n;
+
+    SedHmacKeys(Job, &inner, &outer);
+    SedPbkdf2First(&inner, &outer, Job, Block, u);
+
+    memset(w, 0, sizeof(w));
+    for (i = 0; i < 8; i++) {
+        w[i] = t[i] = SedLoad64(u + 8 * i);
+    }
+    w[8] = 0x8000000000000000ULL;
+    w[15] = (128 + 64) * 8;
+
+    for (n = 1; n < Job->Iterations; n++) {
+        memcpy(state, inner.State64, sizeof(state));
+        SedSha512Compress(state, w);
+        memcpy(w, state, sizeof(state));
+
+        memcpy(state, outer.State64, sizeof(state));
+        SedSha512Compress(state, w);
+        memcpy(w, state, sizeof(state));
+
+        for (i = 0; i < 8; i++) {
+            t[i] ^= w[i];
+        }
+    }
+
+    for (i = 0; i < 8; i++) {
+        SedStore64(u + 8 * i, t[i]);
+    }
+    SedPbkdf2Output(Job, Block, u);
+
+    SedPbkdf2Wipe(&inner, sizeof(inner));
+    SedPbkdf2Wipe(&outer, sizeof(outer));
+    SedPbkdf2Wipe(w, sizeof(w));
+    SedPbkdf2Wipe(state, sizeof(state));
+    SedPbkdf2Wipe(t, sizeof(t));
+    SedPbkdf2Wipe(u, sizeof(u));
+}
+
+static void
+SedPbkdf2Run(
+    SED_PBKDF2_BATCH* Lanes,
+    SED_HASH Hash,
+    uint32_t Iterations,
+    uint32_t Features
+)
+
+/*++
+
+Routine Description:
+
+    Derive the output blocks of a batch of SHA-1 or SHA-256 lanes, all with
+    the same iteration count
+
+--*/
+
+{
+    SED_SHA inner;
+    SED_SHA outer;
+    uint8_t u[32];
+    uint32_t words = SedHashDigestLength(Hash) / 4;
+    uint32_t lane;
+    uint32_t i;
+
+    for (lane = 0; lane < Lanes->Count; lane++) {
+        SedHmacKeys(Lanes->Job[lane], &inner, &outer);
+        SedPbkdf2First(&inner, &outer, Lanes->Job[lane], Lanes->Block[lane], u);
+
+        for (i = 0; i < words; i++) {
+            Lanes->Inner[i][lane] = inner.State32[i];
+            Lanes->Outer[i][lane] = outer.State32[i];
+            Lanes->U[i][lane] = Lanes->T[i][lane] = SedLoad32(u + 4 * i);
+        }
+    }
+
+    //
+    // One lane on the SHA extensions is about as fast as one of eight AVX2
+    // lanes and needs no ymm state, so they are used whenever they are
+    // there. AVX2 with a single lane is no faster than scalar.
+    //
+
+#if defined(SED_PBKDF2_X86)
+    if (Features & SED_PBKDF2_FEATURE_SHANI) {
+        SedPbkdf2Iterate32(Lanes, words, Iterations,
+            (Hash == SedHashSha1) ? SedSha1CompressShaNi : SedSha256CompressShaNi);
+    }
+    else if ((Features & SED_PBKDF2_FEATURE_AVX2) && Lanes->Count > 1) {
+        SedPbkdf2IterateAvx2(Lanes, Hash, Iterations);
+    }
+    else
+#endif
+    {
+        (void)Features;
+        SedPbkdf2Iterate32(Lanes, words, Iterations,
+            (Hash == SedHashSha1) ? SedSha1Compress : SedSha256Compress);
+    }
+
+    for (lane = 0; lane < Lanes->Count; lane++) {
+        for (i = 0; i < words; i++) {
+            SedStore32(u + 4 * i, Lanes->T[i][lane]);
+        }
+        SedPbkdf2Output(Lanes->Job[lane], Lanes->Block[lane], u);
+    }
+
+    SedPbkdf2Wipe(&inner, sizeof(inner));
+    SedPbkdf2Wipe(&outer, sizeof(outer));
+    SedPbkdf2Wipe(u, sizeof(u));
+}
+
+uint32_t
+SedPbkdf2Features(
+    void
+)
+{
+    uint32_t features = 0;
+
+#if defined(SED_PBKDF2_X86)
+    uint32_t leaf1[4] = { 0 };
+    uint32_t leaf7[4] = { 0 };
+    uint32_t maxLeaf;
+    uint64_t xcr0 = 0;
+
+#if defined(_MSC_VER)
+    int r[4];
+
+    __cpuid(r, 0);
+    maxLeaf = (uint32_t)r[0];
+    if (maxLeaf >= 7) {
+        __cpuid(r, 1);
+        memcpy(leaf1, r, sizeof(leaf1));
+        __cpuidex(r, 7, 0);
+        memcpy(leaf7, r, sizeof(leaf7));
+    }
+#else
+    maxLeaf = __get_cpuid_max(0, 0);
+    if (maxLeaf >= 7) {
+        __cpuid(1, leaf1[0], leaf1[1], leaf1[2], leaf1[3]);
+        __cpuid_count(7, 0, leaf7[0], leaf7[1], leaf7[2], leaf7[3]);
+    }
+#endif
+
+    //
+    // SHA (and the SSSE3/SSE4.1 shuffles around it)
+    //
+
+    if ((leaf7[1] & (1u << 29)) && (leaf1[2] & (1u << 9)) && (leaf1[2] & (1u << 19))) {
+        features |= SED_PBKDF2_FEATURE_SHANI;
+    }
+
+    //
+    // AVX2, if the OS saves the ymm registers
+    //
+
+    if ((leaf7[1] & (1u << 5)) && (leaf1[2] & (1u << 27)) && (leaf1[2] & (1u << 28))) {
+#if defined(_MSC_VER)
+        xcr0 = _xgetbv(0);
+#else
+        uint32_t lo, hi;
+
+        __asm__ __volatile__("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+        xcr0 = ((uint64_t)hi << 32) | lo;
+#endif
+        if ((xcr0 & 6) == 6) {
+            features |= SED_PBKDF2_FEATURE_AVX2;
+        }
+    }
+#endif
+
+    return features;
+}
+
+int
+SedPbkdf2(
+    const SED_PBKDF2_JOB* Jobs,
+    uint32_t Count,
+    uint32_t Features
+)
+
+/*++
+
+Routine Description:
+
+    Derive every job's key. The output blocks of all jobs sharing a hash
+    and iteration count are batched SED_PBKDF2_LANES at a time, taking the
+    jobs in order; a group is started by the first job of its kind.
+
+--*/
+
+{
+    SED_PBKDF2_BATCH lanes;
+    uint32_t first;
+    uint32_t j;
+    uint32_t k;
+    uint32_t block;
+    uint32_t blocks;
+
+    for (j = 0; j < Count; j++) {
+        if (SedHashDigestLength(Jobs[j].Hash) == 0 ||
+            Jobs[j].Iterations == 0 ||
+            Jobs[j].KeyLength == 0 ||
+            Jobs[j].Key == 0 ||
+            (Jobs[j].PasswordLength != 0 && Jobs[j].Password == 0) ||
+            (Jobs[j].SaltLength != 0 && Jobs[j].Salt == 0)) {
+            return SED_PBKDF2_ERROR_INVALID;
+        }
+    }
+
+    for (first = 0; first < Count; first++) {
+        for (k = 0; k < first; k++) {
+            if (Jobs[k].Hash == Jobs[first].Hash && Jobs[k].Iterations == Jobs[first].Iterations) {
+                break;
+            }
+        }
+        if (k != first) {
+            continue;
+        }
+
+        memset(&lanes, 0, sizeof(lanes));
+
+        for (j = first; j < Count; j++) {
+            if (Jobs[j].Hash != Jobs[first].Hash || Jobs[j].Iterations != Jobs[first].Iterations) {
+                continue;
+            }
+
+            blocks = (Jobs[j].KeyLength + SedHashDigestLength(Jobs[j].Hash) - 1) /
+                SedHashDigestLength(Jobs[j].Hash);
+
+            for (block = 1; block <= blocks; block++) {
+                if (Jobs[j].Hash == SedHashSha512) {
+                    SedPbkdf2Sha512(&Jobs[j], block);
+                    continue;
+                }
+
+                lanes.Job[lanes.Count] = &Jobs[j];
+                lanes.Block[lanes.Count] = block;
+                lanes.Count++;
+
+                if (lanes.Count == SED_PBKDF2_LANES) {
+                    SedPbkdf2Run(&lanes, Jobs[first].Hash, Jobs[first].Iterations, Features);
+                    memset(&lanes, 0, sizeof(lanes));
+                }
+            }
+        }
+
+        if (lanes.Count != 0) {
+            SedPbkdf2Run(&lanes, Jobs[first].Hash, Jobs[first].Iterations, Features);
+        }
+    }
+
+    SedPbkdf2Wipe(&lanes, sizeof(lanes));
+    return SED_PBKDF2_OK;
+}
+
+//
+// Self test vectors, RFC 6070 for SHA-1
+//
+
+typedef struct _SED_PBKDF2_VECTOR {
+    SED_HASH Hash;
+    const char* Password;
+    uint32_t PasswordLength;
+    const char* Salt;
+    uint32_t SaltLength;
+    uint32_t Iterations;
+    uint32_t KeyLength;
+    uint8_t Key[SED_PBKDF2_MAX_DIGEST];
+} SED_PBKDF2_VECTOR;
+
+static const SED_PBKDF2_VECTOR SedPbkdf2Vectors[] = {
+    { SedHashSha1, "password", 8, "salt", 4, 1, 20,
+        { 0x0c, 0x60, 0xc8, 0x0f, 0x96, 0x1f, 0x0e, 0x71, 0xf3, 0xa9, 0xb5, 0x24, 0xaf, 0x60, 0x12, 0x06,
+          0x2f, 0xe0, 0x37, 0xa6 } },
+    { SedHashSha1, "password", 8, "salt", 4, 2, 20,
+        { 0xea, 0x6c, 0x01, 0x4d, 0xc7, 0x2d, 0x6f, 0x8c, 0xcd, 0x1e, 0xd9, 0x2a, 0xce, 0x1d, 0x41, 0xf0,
+          0xd8, 0xde, 0x89, 0x57 } },
+    { SedHashSha1, "password", 8, "salt", 4, 4096, 20,
+        { 0x4b, 0x00, 0x79, 0x01, 0xb7, 0x65, 0x48, 0x9a, 0xbe, 0xad, 0x49, 0xd9, 0x26, 0xf7, 0x21, 0xd0,
+          0x65, 0xa4, 0x29, 0xc1 } },
+    { SedHashSha1, "passwordPASSWORDpassword", 24, "saltSALTsaltSALTsaltSALTsaltSALTsalt", 36, 4096, 25,
+        { 0x3d, 0x2e, 0xec, 0x4f, 0xe4, 0x1c, 0x84, 0x9b, 0x80, 0xc8, 0xd8, 0x36, 0x62, 0xc0, 0xe4, 0x4a,
+          0x8b, 0x29, 0x1a, 0x96, 0x4c, 0xf2, 0xf0, 0x70, 0x38 } },
+    { SedHashSha1, "pass\0word", 9, "sa\0lt", 5, 4096, 16,
+        { 0x56, 0xfa, 0x6a, 0xa7, 0x55, 0x48, 0x09, 0x9d, 0xcc, 0x37, 0xd7, 0xf0, 0x34, 0x25, 0xe0, 0xc3 } },
+    { SedHashSha256, "passwd", 6, "salt", 4, 1, 64,
+        { 0x55, 0xac, 0x04, 0x6e, 0x56, 0xe3, 0x08, 0x9f, 0xec, 0x16, 0x91, 0xc2, 0x25, 0x44, 0xb6, 0x05,
+          0xf9, 0x41, 0x85, 0x21, 0x6d, 0xde, 0x04, 0x65, 0xe6, 0x8b, 0x9d, 0x57, 0xc2, 0x0d, 0xac, 0xbc,
+          0x49, 0xca, 0x9c, 0xcc, 0xf1, 0x79, 0xb6, 0x45, 0x99, 0x16, 0x64, 0xb3, 0x9d, 0x77, 0xef, 0x31,
+          0x7c, 0x71, 0xb8, 0x45, 0xb1, 0xe3, 0x0b, 0xd5, 0x09, 0x11, 0x20, 0x41, 0xd3, 0xa1, 0x97, 0x83 } },
+    { SedHashSha256, "password", 8, "salt", 4, 4096, 32,
+        { 0xc5, 0xe4, 0x78, 0xd5, 0x92, 0x88, 0xc8, 0x41, 0xaa, 0x53, 0x0d, 0xb6, 0x84, 0x5c, 0x4c, 0x8d,
+          0x96, 0x28, 0x93, 0xa0, 0x01, 0xce, 0x4e, 0x11, 0xa4, 0x96, 0x38, 0x73, 0xaa, 0x98, 0x13, 0x4a } },
+    { SedHashSha256, "xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx", 100,
+        "salt", 4, 4096, 32,
+        { 0x82, 0xf6, 0x28, 0xb7, 0xf4, 0x20, 0xe7, 0xa4, 0x35, 0xa4, 0x1b, 0x05, 0x38, 0x39, 0x33, 0xde,
+          0xbb, 0x14, 0xe5, 0x10, 0x01, 0x26, 0xbc, 0x46, 0x0d, 0x33, 0x06, 0x2d, 0xdd, 0x80, 0x41, 0x24 } },
+    { SedHashSha512, "password", 8, "salt", 4, 4096, 64,
+        { 0xd1, 0x97, 0xb1, 0xb3, 0x3d, 0xb0, 0x14, 0x3e, 0x01, 0x8b, 0x12, 0xf3, 0xd1, 0xd1, 0x47, 0x9e,
+          0x6c, 0xde, 0xbd, 0xcc, 0x97, 0xc5, 0xc0, 0xf8, 0x7f, 0x69, 0x02, 0xe0, 0x72, 0xf4, 0x57, 0xb5,
+          0x14, 0x3f, 0x30, 0x60, 0x26, 0x41, 0xb3, 0xd5, 0x5c, 0xd3, 0x35, 0x98, 0x8c, 0xb3, 0x6b, 0x84,
+          0x37, 0x60, 0x60, 0xec, 0xd5, 0x32, 0xe0, 0x39, 0xb7, 0x42, 0xa2, 0x39, 0x43, 0x4a, 0xf2, 0xd5 } },
+};
+
+#define SED_PBKDF2_VECTOR_COUNT     (sizeof(SedPbkdf2Vectors) / sizeof(SedPbkdf2Vectors[0]))
+
+int
+SedPbkdf2SelfTest(
+    uint32_t Features
+)
+
+/*++
+
+Routine Description:
+
+    Derive all the test vectors in one call, so the 4096 iteration SHA-1
+    and SHA-256 ones share a batch and go through the multi lane kernel
+    when Features allows it.
+
+--*/
+
+{
+    SED_PBKDF2_JOB jobs[SED_PBKDF2_VECTOR_COUNT];
+    uint8_t keys[SED_PBKDF2_VECTOR_COUNT][SED_PBKDF2_MAX_DIGEST];
+    uint32_t i;
+    int status;
+
+    for (i = 0; i < SED_PBKDF2_VECTOR_COUNT; i++) {
+        jobs[i].Hash = SedPbkdf2Vectors[i].Hash;
+        jobs[i].Password = (const uint8_t*)SedPbkdf2Vectors[i].Password;
+        jobs[i].PasswordLength = SedPbkdf2Vectors[i].PasswordLength;
+        jobs[i].Salt = (const uint8_t*)SedPbkdf2Vectors[i].Salt;
+        jobs[i].SaltLength = SedPbkdf2Vectors[i].SaltLength;
+        jobs[i].Iterations = SedPbkdf2Vectors[i].Iterations;
+        jobs[i].Key = keys[i];
+        jobs[i].KeyLength = SedPbkdf2Vectors[i].KeyLength;
+    }
+
+    status = SedPbkdf2(jobs, SED_PBKDF2_VECTOR_COUNT, Features);
+    if (status != SED_PBKDF2_OK) {
+        return status;
+    }
+
+    for (i = 0; i < SED_PBKDF2_VECTOR_COUNT; i++) {
+        if (memcmp(keys[i], SedPbkdf2Vectors[i].Key, SedPbkdf2Vectors[i].KeyLength) != 0) {
+            return SED_PBKDF2_ERROR_MISMATCH;
+        }
+    }
+
+    return SED_PBKDF2_OK;
+}
@@ -0,0 +1,129 @@
+/*++
+
+Module Name:
+
+    sedpbkdf2.h
+
+Abstract:
+
+    PBKDF2 (RFC 8018) over HMAC-SHA-1, HMAC-SHA-256 and HMAC-SHA-512, for
+    turning a password into the PIN a drive was set up with. sedutil hashes
+    with SHA-1, the drive serial number as salt, 75000 iterations and a 32
+    byte key; newer forks use SHA-256 or SHA-512.
+
+    Nearly all of the time goes into the iterations, each of which is two
+    compressions of one fixed block per output block. Those are run on
+    words, never bytes, by one of:
+
+        scalar      portable C, always there
+        SHA-NI      the x86 SHA extensions, one lane at a time (SHA-1 and
+                    SHA-256)
+        AVX2        eight lanes side by side in the 32 bit elements of the
+                    ymm registers (SHA-1 and SHA-256)
+
+    A lane is one output block of one job, so a 32 byte SHA-1 key is two
+    lanes and several drives' keys can be derived together. SHA-512 is
+    always scalar.
+
+    Nothing here allocates. Kernel callers pick the features they have
+    saved the state for (the SHA extensions only need the xmm registers,
+    AVX2 needs the ymm ones).
+
+Environment:
+
+    kernel and user mode, Windows and Linux
+
+--*/
+
+#ifndef _SEDPBKDF2_H_
+#define _SEDPBKDF2_H_
+
+#include <stdint.h>
+
+typedef enum _SED_HASH {
+    SedHashSha1,
+    SedHashSha256,
+    SedHashSha512
+} SED_HASH;
+
+#define SED_PBKDF2_MAX_DIGEST           64
+
+//
+// Implementations to choose from, see SedPbkdf2Features
+//
+
+#define SED_PBKDF2_FEATURE_SHANI        0x1
+#define SED_PBKDF2_FEATURE_AVX2         0x2
+
+//
+// Lanes the AVX2 kernels run side by side
+//
+
+#define SED_PBKDF2_LANES                8
+
+//
+// sedutil's parameters
+//
+
+#define SED_PBKDF2_SEDUTIL_ITERATIONS   75000
+#define SED_PBKDF2_SEDUTIL_SALT         20
+#define SED_PBKDF2_SEDUTIL_KEY          32
+
+//
+// Results. Zero is success.
+//
+
+#define SED_PBKDF2_OK                   0
+#define SED_PBKDF2_ERROR_INVALID        (-1)    // bad hash, no iterations or no key
+#define SED_PBKDF2_ERROR_MISMATCH       (-2)    // self test gave the wrong key
+
+typedef struct _SED_PBKDF2_JOB {
+    SED_HASH Hash;
+    const uint8_t* Password;
+    uint32_t PasswordLength;
+    const uint8_t* Salt;
+    uint32_t SaltLength;
+    uint32_t Iterations;
+    uint8_t* Key;
+    uint32_t KeyLength;
+} SED_PBKDF2_JOB;
+
+uint32_t
+SedHashDigestLength(
+    SED_HASH Hash
+);
+
+//
+// The implementations this processor (and, for AVX2, the OS) supports
+//
+
+uint32_t
+SedPbkdf2Features(
+    void
+);
+
+//
+// Derive the key of every job. Output blocks of jobs with the same hash and
+// iteration count are run together; Features limits the implementations
+// used, 0 is scalar only.
+//
+
+int
+SedPbkdf2(
+    const SED_PBKDF2_JOB* Jobs,
+    uint32_t Count,
+    uint32_t Features
+);
+
+//
+// Check the RFC 6070 vectors, and SHA-256 and SHA-512 ones, with the
+// given implementations. A few thousand iterations, so cheap enough to run
+// once at load.
+//
+
+int
+SedPbkdf2SelfTest(
+    uint32_t Features
+);
+
+#endif // _SEDPBKDF2_H_
@@ -0,0 +1,455 @@
+/*++
+
+Module Name:
+
+    sedreplay.c
+
+Abstract:
+
+    Transcript loading and the replay transport, see sedreplay.h.
+
+Environment:
+
+    User mode, POSIX
+
+--*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "sedreplay.h"
+
+typedef struct _SED_REPLAY {
+    SED_TRANSPORT Transport;
+    const SED_TRANSCRIPT* Transcript;
+    SED_REPLAY_OPTIONS Options;
+    uint32_t Next;
+    SED_REPLAY_STATS Stats;
+} SED_REPLAY;
+
+//
+// Below this much time left it is more accurate to spin than to sleep
+//
+
+#define SED_SPIN_NS     200000
+
+uint64_t
+SedNowNs(
+    void
+)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+void
+SedWaitUntilNs(
+    uint64_t Deadline
+)
+{
+    for (;;) {
+        uint64_t now = SedNowNs();
+        struct timespec delay;
+
+        if (now >= Deadline) {
+            return;
+        }
+
+        if (Deadline - now > SED_SPIN_NS) {
+            uint64_t sleep = Deadline - now - SED_SPIN_NS / 2;
+
+            delay.tv_sec = (time_t)(sleep / 1000000000u);
+            delay.tv_nsec = (long)(sleep % 1000000000u);
+            nanosleep(&delay, NULL);
+        }
+    }
+}
+
+static uint64_t
+TicksToNs(
+    uint64_t Ticks,
+    uint64_t Frequency
+)
+{
+    if (Frequency == 0) {
+        return 0;
+    }
+
+    return (Ticks / Frequency) * 1000000000u +
+        ((Ticks % Frequency) * 1000000000u) / Frequency;
+}
+
+static int
+DeviceMatches(
+    const SEDTRACE_DEVICE* Device,
+    uint32_t Disk,
+    const char* Serial
+)
+{
+    if (Serial != NULL) {
+        return strncmp(Device->SerialNumber, Serial, sizeof(Device->SerialNumber)) == 0;
+    }
+
+    return Device->DiskNumber == Disk;
+}
+
+int
+SedTranscriptLoad(
+    const char* Path,
+    uint32_t Disk,
+    const char* Serial,
+    SED_TRANSCRIPT* Transcript
+)
+
+/*++
+
+Routine Description:
+
+    Read a capture file and index the commands of one disk. Pass 1 picks
+    the device and counts its commands, pass 2 fills in the index.
+
+Arguments:
+
+    Path       - Capture file, as written by seddump -c read.
+    Disk       - Disk number wanted, ~0 for the first one in the file.
+    Serial     - Serial number wanted instead of a disk number, or NULL.
+    Transcript - Receives the transcript, free with SedTranscriptFree.
+
+Return Value:
+
+    SED_OK, SED_ERROR_IO if the file cannot be read, SED_ERROR_INVALID if
+    it is not a trace file or has no commands for the disk.
+
+--*/
+
+{
+    FILE*                       f;
+    long                        size;
+    const SEDTRACE_FILE_HEADER* header;
+    const SEDTRACE_DEVICE*      current = NULL;
+    int                         pass;
+    int                         selected = 0;
+
+    memset(Transcript, 0, sizeof(*Transcript));
+
+    f = fopen(Path, "rb");
+    if (f == NULL) {
+        return SED_ERROR_IO;
+    }
+
+    if (fseek(f, 0, SEEK_END) != 0 || (size = ftell(f)) < 0 || fseek(f, 0, SEEK_SET) != 0) {
+        fclose(f);
+        return SED_ERROR_IO;
+    }
+
+    Transcript->File = malloc((size_t)size + 1);
+    if (Transcript->File == NULL) {
+        fclose(f);
+        return SED_ERROR_NO_MEMORY;
+    }
+
+    if (fread(Transcript->File, 1, (size_t)size, f) != (size_t)size) {
+        fclose(f);
+        SedTranscriptFree(Transcript);
+        return SED_ERROR_IO;
+    }
+    fclose(f);
+
+    header = (const SEDTRACE_FILE_HEADER*)Transcript->File;
+    if ((size_t)size < sizeof(*header) ||
+        header->Magic != SEDTRACE_MAGIC ||
+        header->Version != SEDTRACE_VERSION ||
+        header->HeaderSize < sizeof(*header) ||
+        header->HeaderSize > size) {
+        SedTranscriptFree(Transcript);
+        return SED_ERROR_INVALID;
+    }
+
+    for (pass = 0; pass < 2; pass++) {
+        uint32_t offset = SEDTRACE_ALIGN(header->HeaderSize);
+        uint32_t count = 0;
+
+        while (offset + sizeof(SEDTRACE_RECORD) <= (uint32_t)size) {
+            const SEDTRACE_RECORD* record = (const SEDTRACE_RECORD*)(Transcript->File + offset);
+
+            if (record->Length < sizeof(SEDTRACE_RECORD) ||
+                record->Length > (uint32_t)size - offset ||
+                (record->Length & 7) != 0) {
+                break;
+            }
+
+            if (record->Type == SedTraceRecordDevice &&
+                record->Length >= sizeof(SEDTRACE_DEVICE)) {
+
+                current = (const SEDTRACE_DEVICE*)record;
+                if (!selected) {
+                    if (Serial == NULL && Disk == ~0u) {
+                        Disk = current->DiskNumber;
+                    }
+                    if (DeviceMatches(current, Disk, Serial)) {
+                        Transcript->Device = *current;
+                        selected = 1;
+                    }
+                }
+            }
+            else if (record->Type == SedTraceRecordCommand &&
+                record->Length >= sizeof(SEDTRACE_COMMAND) &&
+                current != NULL &&
+                DeviceMatches(current, Disk, Serial)) {
+
+                const SEDTRACE_COMMAND* command = (const SEDTRACE_COMMAND*)record;
+
+                if (command->DataLength <= record->Length - sizeof(SEDTRACE_COMMAND)) {
+                    if (pass == 1) {
+                        SED_REPLAY_COMMAND* entry = &Transcript->Commands[count];
+
+                        entry->Record = command;
+                        entry->Data = (const uint8_t*)(command + 1);
+                        entry->ElapsedNs = TicksToNs(command->Elapsed, current->TimestampFrequency);
+                        entry->Protocol = command->Cdb[1];
+                        entry->ComId = (uint16_t)((command->Cdb[2] << 8) | command->Cdb[3]);
+                        entry->DataIn = command->DataIn;
+                        Transcript->Dropped += command->Dropped;
+                    }
+                    count++;
+                }
+            }
+
+            offset += record->Length;
+        }
+
+        if (pass == 0) {
+            if (count == 0) {
+                SedTranscriptFree(Transcript);
+                return SED_ERROR_INVALID;
+            }
+
+            Transcript->Commands = calloc(count, sizeof(SED_REPLAY_COMMAND));
+            if (Transcript->Commands == NULL) {
+                SedTranscriptFree(Transcript);
+                return SED_ERROR_NO_MEMORY;
+            }
+        }
+
+        Transcript->CommandCount = count;
+        current = NULL;
+    }
+
+    return SED_OK;
+}
+
+void
+SedTranscriptFree(
+    SED_TRANSCRIPT* Transcript
+)
+{
+    free(Transcript->Commands);
+    free(Transcript->File);
+    memset(Transcript, 0, sizeof(*Transcript));
+}
+
+static int
+ReplayMatch(
+    SED_REPLAY* Replay,
+    uint8_t DataIn,
+    uint8_t Protocol,
+    uint16_t ComId,
+    const SED_REPLAY_COMMAND** Command
+)
+
+/*++
+
+Routine Description:
+
+    Find the recorded command to answer this one with. Normally that is
+    simply the next one; outside strict mode recorded commands the caller
+    no longer sends (e.g. because it folded two round trips into one) are
+    skipped over.
+
+--*/
+
+{
+    const SED_TRANSCRIPT* transcript = Replay->Transcript;
+    uint32_t i;
+
+    for (i = 0; i < transcript->CommandCount; i++) {
+        uint32_t index = Replay->Next + i;
+        const SED_REPLAY_COMMAND* command;
+
+        if (index >= transcript->CommandCount) {
+            if (!(Replay->Options.Flags & SED_REPLAY_LOOP)) {
+                return SED_ERROR_END;
+            }
+            index -= transcript->CommandCount;
+        }
+
+        command = &transcript->Commands[index];
+        if (command->DataIn == DataIn &&
+            command->Protocol == Protocol &&
+            command->ComId == ComId) {
+
+            Replay->Stats.Skipped += i;
+            Replay->Next = index + 1;
+            *Command = command;
+            return SED_OK;
+        }
+
+        if (Replay->Options.Flags & SED_REPLAY_STRICT) {
+            return SED_ERROR_MISMATCH;
+        }
+    }
+
+    return transcript->CommandCount == 0 ? SED_ERROR_END : SED_ERROR_MISMATCH;
+}
+
+static int
+ReplayComplete(
+    SED_REPLAY* Replay,
+    const SED_REPLAY_COMMAND* Command,
+    uint64_t Start
+)
+{
+    uint64_t elapsed = Command->ElapsedNs;
+
+    if (Replay->Options.TimeScale > 0) {
+        elapsed = (uint64_t)((double)elapsed * Replay->Options.TimeScale);
+    }
+
+    if (!(Replay->Options.Flags & SED_REPLAY_NO_WAIT)) {
+        SedWaitUntilNs(Start + elapsed);
+    }
+
+    Replay->Stats.Commands++;
+    Replay->Stats.SimulatedNs += elapsed;
+
+    //
+    // NTSTATUS failures have the top bit set
+    //
+
+    if ((Command->Record->Status & 0x80000000u) != 0 || Command->Record->ScsiStatus != 0) {
+        Replay->Stats.Failed++;
+        return SED_ERROR_DEVICE;
+    }
+
+    return SED_OK;
+}
+
+static uint32_t
+TrimmedLength(
+    const uint8_t* Data,
+    uint32_t Length
+)
+{
+    while (Length != 0 && Data[Length - 1] == 0) {
+        Length--;
+    }
+
+    return Length;
+}
+
+static int
+ReplayIfSend(
+    SED_TRANSPORT* Transport,
+    uint8_t Protocol,
+    uint16_t ComId,
+    const void* Data,
+    uint32_t Length
+)
+{
+    SED_REPLAY* replay = (SED_REPLAY*)Transport;
+    const SED_REPLAY_COMMAND* command;
+    uint64_t start = SedNowNs();
+    uint32_t trimmed;
+    int status;
+
+    status = ReplayMatch(replay, 0, Protocol, ComId, &command);
+    if (status != SED_OK) {
+        return status;
+    }
+
+    trimmed = TrimmedLength(Data, Length);
+    if (trimmed != command->Record->DataLength ||
+        memcmp(Data, command->Data, trimmed) != 0) {
+        replay->Stats.PayloadMismatches++;
+    }
+
+    return ReplayComplete(replay, command, start);
+}
+
+static int
+ReplayIfRecv(
+    SED_TRANSPORT* Transport,
+    uint8_t Protocol,
+    uint16_t ComId,
+    void* Data,
+    uint32_t Length
+)
+{
+    SED_REPLAY* replay = (SED_REPLAY*)Transport;
+    const SED_REPLAY_COMMAND* command;
+    uint64_t start = SedNowNs();
+    uint32_t copy;
+    int status;
+
+    status = ReplayMatch(replay, 1, Protocol, ComId, &command);
+    if (status != SED_OK) {
+        return status;
+    }
+
+    copy = command->Record->DataLength < Length ? command->Record->DataLength : Length;
+    memcpy(Data, command->Data, copy);
+    memset((uint8_t*)Data + copy, 0, Length - copy);
+
+    return ReplayComplete(replay, command, start);
+}
+
+static void
+ReplayClose(
+    SED_TRANSPORT* Transport
+)
+{
+    free(Transport);
+}
+
+static const SED_TRANSPORT_OPS ReplayOps = {
+    ReplayIfSend,
+    ReplayIfRecv,
+    ReplayClose
+};
+
+SED_TRANSPORT*
+SedReplayOpen(
+    const SED_TRANSCRIPT* Transcript,
+    const SED_REPLAY_OPTIONS* Options
+)
+{
+    SED_REPLAY* replay = calloc(1, sizeof(*replay));
+
+    if (replay == NULL) {
+        return NULL;
+    }
+
+    replay->Transport.Ops = &ReplayOps;
+    replay->Transport.Name = "replay";
+    replay->Transcript = Transcript;
+    if (Options != NULL) {
+        replay->Options = *Options;
+    }
+
+    return &replay->Transport;
+}
+
+void
+SedReplayGetStats(
+    SED_TRANSPORT* Transport,
+    SED_REPLAY_STATS* Stats
+)
+{
+    *Stats = ((SED_REPLAY*)Transport)->Stats;
+}
@@ -0,0 +1,120 @@
+/*++
+
+Module Name:
+
+    sedreplay.h
+
+Abstract:
+
+    Replays pass-through commands captured by the filter (SEDTRACE_COMMAND
+    records, see sedtrace.h) as a SED_TRANSPORT. Each IF-SEND/IF-RECV is
+    matched against the next recorded command for the same protocol, ComID
+    and direction, takes as long as the recorded one did and returns the
+    recorded status and response.
+
+    A transcript is loaded once and is read only afterwards, so any number
+    of replay transports (e.g. one per benchmark thread) can share it.
+
+Environment:
+
+    User mode, POSIX
+
+--*/
+
+#ifndef _SEDREPLAY_H_
+#define _SEDREPLAY_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sedtrace.h"
+#include "sedtransport.h"
+
+#define SED_SCSI_SECURITY_PROTOCOL_IN   0xA2
+#define SED_SCSI_SECURITY_PROTOCOL_OUT  0xB5
+
+typedef struct _SED_REPLAY_COMMAND {
+    const SEDTRACE_COMMAND* Record;
+    const uint8_t* Data;            // Record->DataLength bytes
+    uint64_t ElapsedNs;
+    uint8_t  Protocol;
+    uint16_t ComId;
+    uint8_t  DataIn;
+} SED_REPLAY_COMMAND;
+
+typedef struct _SED_TRANSCRIPT {
+    uint8_t* File;                  // whole capture file
+    SEDTRACE_DEVICE Device;         // device the commands came from
+    SED_REPLAY_COMMAND* Commands;
+    uint32_t CommandCount;
+    uint32_t Dropped;               // commands the filter could not capture
+} SED_TRANSCRIPT;
+
+//
+// Replay options
+//
+
+#define SED_REPLAY_STRICT       0x1     // fail on the first out of order command
+#define SED_REPLAY_LOOP         0x2     // start again at the end of the transcript
+#define SED_REPLAY_NO_WAIT      0x4     // do not reproduce the recorded timing
+
+typedef struct _SED_REPLAY_OPTIONS {
+    uint32_t Flags;
+    double   TimeScale;             // multiplies recorded times, 0 means 1
+} SED_REPLAY_OPTIONS;
+
+typedef struct _SED_REPLAY_STATS {
+    uint64_t Commands;              // commands served
+    uint64_t Skipped;               // recorded commands passed over to find a match
+    uint64_t PayloadMismatches;     // IF-SENDs whose data differed from the recording
+    uint64_t Failed;                // commands that failed when recorded
+    uint64_t SimulatedNs;           // device time reproduced
+} SED_REPLAY_STATS;
+
+//
+// Load the commands for one disk from a capture file. With Serial set the
+// disk is picked by serial number, otherwise by Disk number; Disk ~0 takes
+// the first disk found.
+//
+
+int
+SedTranscriptLoad(
+    const char* Path,
+    uint32_t Disk,
+    const char* Serial,
+    SED_TRANSCRIPT* Transcript
+);
+
+void
+SedTranscriptFree(
+    SED_TRANSCRIPT* Transcript
+);
+
+SED_TRANSPORT*
+SedReplayOpen(
+    const SED_TRANSCRIPT* Transcript,
+    const SED_REPLAY_OPTIONS* Options
+);
+
+void
+SedReplayGetStats(
+    SED_TRANSPORT* Transport,
+    SED_REPLAY_STATS* Stats
+);
+
+//
+// Wait until a CLOCK_MONOTONIC deadline, sleeping for most of it and
+// spinning for the rest so short device times are reproduced accurately
+//
+
+uint64_t
+SedNowNs(
+    void
+);
+
+void
+SedWaitUntilNs(
+    uint64_t Deadline
+);
+
+#endif // _SEDREPLAY_H_
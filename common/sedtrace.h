@@ -0,0 +1,247 @@
+/*++
+
+Module Name:
+
+    sedtrace.h
+
+Abstract:
+
+    SEDSleep binary trace format. The filter produces trace chunks in this
+    format from IOCTL_SEDSLEEP_QUERY_TRACE, seddump appends them to a file
+    and sedanalyze reads them back on any platform.
+
+    A trace file is a SEDTRACE_FILE_HEADER followed by any number of
+    records. Every record starts with a SEDTRACE_RECORD giving its type and
+    total length, and lengths are always a multiple of 8, so a reader can
+    skip record types it does not know about and stream through a file
+    without ever holding more than one record in memory.
+
+    A chunk from the filter is a DEVICE record followed by the records
+    describing that device. Everything after a DEVICE record belongs to
+    that device until the next DEVICE record.
+
+    All fields are little endian and naturally aligned, so the structures
+    can be used directly on x86, x64 and ARM.
+
+Environment:
+
+    kernel and user mode, Windows and Linux
+
+Notes:
+
+    Bump SEDTRACE_VERSION when changing the layout of an existing record.
+    Adding a new record type does not need a version change.
+
+--*/
+
+#ifndef _SEDTRACE_H_
+#define _SEDTRACE_H_
+
+#include <stdint.h>
+
+#define SEDTRACE_MAGIC              0x54444553u     // "SEDT"
+#define SEDTRACE_VERSION            1
+
+#define SEDTRACE_ALIGN(x)           (((x) + 7u) & ~7u)
+
+typedef struct _SEDTRACE_FILE_HEADER {
+    uint32_t Magic;
+    uint16_t Version;
+    uint16_t HeaderSize;
+} SEDTRACE_FILE_HEADER, * PSEDTRACE_FILE_HEADER;
+
+typedef enum _SEDTRACE_RECORD_TYPE {
+    SedTraceRecordDevice = 1,       // SEDTRACE_DEVICE
+    SedTraceRecordCounters = 2,     // SEDTRACE_COUNTERS
+    SedTraceRecordLatency = 3,      // SEDTRACE_LATENCY + SEDTRACE_BUCKET[]
+    SedTraceRecordEvents = 4,       // SEDTRACE_EVENTS + SEDTRACE_EVENT[]
+    SedTraceRecordCommand = 5,      // SEDTRACE_COMMAND + data
+} SEDTRACE_RECORD_TYPE;
+
+typedef struct _SEDTRACE_RECORD {
+    uint16_t Type;                  // SEDTRACE_RECORD_TYPE
+    uint16_t Reserved;
+    uint32_t Length;                // including this header
+} SEDTRACE_RECORD, * PSEDTRACE_RECORD;
+
+//
+// Identifies the drive and driver build the following records came from
+//
+
+#define SEDTRACE_BUILD_LENGTH       32
+#define SEDTRACE_SERIAL_LENGTH      32
+#define SEDTRACE_MODEL_LENGTH       40
+
+typedef struct _SEDTRACE_DEVICE {
+    SEDTRACE_RECORD Header;
+    uint64_t CaptureTime;           // system time, 100ns units since 1601
+    uint64_t TimestampFrequency;    // ticks per second of event timestamps
+    uint32_t DiskNumber;
+    uint32_t Reserved;
+    char     DriverBuild[SEDTRACE_BUILD_LENGTH];
+    char     SerialNumber[SEDTRACE_SERIAL_LENGTH];
+    char     Model[SEDTRACE_MODEL_LENGTH];
+} SEDTRACE_DEVICE, * PSEDTRACE_DEVICE;
+
+//
+// Snapshot of the disk performance counters, times in 100ns units
+//
+
+typedef struct _SEDTRACE_COUNTERS {
+    SEDTRACE_RECORD Header;
+    uint64_t BytesRead;
+    uint64_t BytesWritten;
+    uint64_t ReadTime;
+    uint64_t WriteTime;
+    uint32_t ReadCount;
+    uint32_t WriteCount;
+    uint32_t QueueDepth;
+    uint32_t SplitCount;
+} SEDTRACE_COUNTERS, * PSEDTRACE_COUNTERS;
+
+//
+// One latency histogram. Only non-empty buckets are stored, using the
+// same log-linear microsecond buckets as SEDSLEEP_LATENCY_HISTOGRAM.
+//
+
+#define SEDTRACE_LATENCY_BUCKETS        128
+#define SEDTRACE_LATENCY_SUB_BUCKETS    4
+
+typedef struct _SEDTRACE_BUCKET {
+    uint32_t Bucket;
+    uint32_t Count;                 // saturates at 0xFFFFFFFF
+} SEDTRACE_BUCKET, * PSEDTRACE_BUCKET;
+
+typedef struct _SEDTRACE_LATENCY {
+    SEDTRACE_RECORD Header;
+    uint32_t LatencyClass;          // SEDSLEEP_LATENCY_CLASS
+    uint32_t ResumeWindowMs;
+    uint64_t Count;
+    uint64_t TotalMicroseconds;
+    uint64_t MaxMicroseconds;
+    uint32_t BucketCount;           // SEDTRACE_BUCKETs following
+    uint32_t Reserved;
+} SEDTRACE_LATENCY, * PSEDTRACE_LATENCY;
+
+//
+// Timing events from the filter's ring buffer, in sequence order. A resume
+// starts with a WAKE event; the events after it up to the next SLEEP or WAKE
+// are the phases of that resume.
+//
+
+typedef enum _SEDTRACE_EVENT_TYPE {
+    SedTraceEventSleep = 1,         // Sx IRP seen, Arg16 = SEDTRACE_TRANSITION, Arg32 = system state
+    SedTraceEventWake,              // first S0 or D0 IRP after the sleep arrived
+    SedTraceEventWakeDone,          // lower drivers finished the S0 IRP
+    SedTraceEventDeviceD0,          // lower drivers finished a D0 IRP
+    SedTraceEventUnlockStart,       // unlock sequence started
+    SedTraceEventCommandSend,       // Arg16 = SCSI status, Arg32 = NTSTATUS
+    SedTraceEventCommandRecv,       // Arg16 = SCSI status, Arg32 = NTSTATUS
+    SedTraceEventUnlockDone,        // Arg32 = NTSTATUS
+    SedTraceEventGateOpen,          // read/write allowed through again
+    SedTraceEventFirstIo,           // first read/write after the wake
+    SedTraceEventGateFail,          // unlock failed or timed out, Arg32 = NTSTATUS given to IO
+    SedTraceEventTypeCount
+} SEDTRACE_EVENT_TYPE;
+
+//
+// The kind of power transition a SLEEP event starts. Hybrid sleep writes
+// the hiberfile and then enters S3, so it comes back either as a sleep or,
+// if power was lost, as a hibernate. Fast startup is a hibernate of the
+// kernel session on the way to S5.
+//
+
+typedef enum _SEDTRACE_TRANSITION {
+    SedTraceTransitionUnknown = 0,  // older filters, which only traced S3
+    SedTraceTransitionSleep,        // S1 to S3
+    SedTraceTransitionHybridSleep,  // S3 with a hiberfile to fall back on
+    SedTraceTransitionHibernate,    // S4
+    SedTraceTransitionFastStartup,  // S4 instead of S5
+    SedTraceTransitionCount
+} SEDTRACE_TRANSITION;
+
+typedef struct _SEDTRACE_EVENT {
+    uint64_t Timestamp;             // SEDTRACE_DEVICE.TimestampFrequency ticks
+    uint32_t Sequence;              // never 0 for a valid event
+    uint16_t Event;                 // SEDTRACE_EVENT_TYPE
+    uint16_t Arg16;
+    uint32_t Arg32;
+    uint32_t Reserved;
+} SEDTRACE_EVENT, * PSEDTRACE_EVENT;
+
+typedef struct _SEDTRACE_EVENTS {
+    SEDTRACE_RECORD Header;
+    uint32_t EventCount;            // SEDTRACE_EVENTs following
+    uint32_t Reserved;
+} SEDTRACE_EVENTS, * PSEDTRACE_EVENTS;
+
+//
+// One pass-through command captured by the filter, for replay. The data is
+// what was sent for a data-out command, or what came back for a data-in
+// command, with trailing zero bytes dropped: DataLength bytes follow the
+// record and the remaining TransferLength - DataLength bytes were zero.
+//
+// Captures of the unlock sequence contain the drive credentials, treat
+// them like the password.
+//
+
+#define SEDTRACE_CDB_LENGTH         16
+#define SEDTRACE_SENSE_LENGTH       32
+
+typedef struct _SEDTRACE_COMMAND {
+    SEDTRACE_RECORD Header;
+    uint64_t Timestamp;             // when the command was issued
+    uint64_t Elapsed;               // ticks until it completed
+    uint32_t Sequence;              // capture order, starting at 1
+    uint32_t Status;                // NTSTATUS of the pass-through
+    uint8_t  Cdb[SEDTRACE_CDB_LENGTH];
+    uint8_t  CdbLength;
+    uint8_t  ScsiStatus;
+    uint8_t  DataIn;                // 1 if the drive returned data
+    uint8_t  SenseLength;
+    uint32_t TransferLength;
+    uint32_t DataLength;            // bytes of data following
+    uint32_t Dropped;               // commands lost before this one
+    uint8_t  Sense[SEDTRACE_SENSE_LENGTH];
+} SEDTRACE_COMMAND, * PSEDTRACE_COMMAND;
+
+//
+// Log-linear latency bucket helpers, see SEDSLEEP_LATENCY_BUCKET_FLOOR
+//
+
+static __inline uint32_t
+SedTraceLatencyBucket(
+    uint64_t Microseconds
+)
+{
+    uint32_t msb = 0;
+    uint64_t v = Microseconds;
+    uint32_t bucket;
+
+    if (Microseconds < SEDTRACE_LATENCY_SUB_BUCKETS) {
+        return (uint32_t)Microseconds;
+    }
+
+    while (v >>= 1) {
+        msb++;
+    }
+
+    bucket = (msb - 1) * SEDTRACE_LATENCY_SUB_BUCKETS +
+        (uint32_t)((Microseconds >> (msb - 2)) & (SEDTRACE_LATENCY_SUB_BUCKETS - 1));
+
+    return bucket < SEDTRACE_LATENCY_BUCKETS ? bucket : SEDTRACE_LATENCY_BUCKETS - 1;
+}
+
+static __inline uint64_t
+SedTraceLatencyBucketFloor(
+    uint32_t Bucket
+)
+{
+    if (Bucket < SEDTRACE_LATENCY_SUB_BUCKETS) {
+        return Bucket;
+    }
+
+    return (uint64_t)(SEDTRACE_LATENCY_SUB_BUCKETS + (Bucket & 3)) << ((Bucket >> 2) - 1);
+}
+
+#endif // _SEDTRACE_H_
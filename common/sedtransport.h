@@ -0,0 +1,121 @@
+/*++
+
+Module Name:
+
+    sedtransport.h
+
+Abstract:
+
+    Host side transport interface for talking to a TCG Opal TPer. Anything
+    that can carry IF-SEND and IF-RECV (SCSI SECURITY PROTOCOL OUT/IN, ATA
+    TRUSTED SEND/RECEIVE, NVMe Security Send/Receive, an emulated TPer or
+    a recording played back from a capture) implements SED_TRANSPORT_OPS,
+    so the code driving the unlock sequence (sedunlock.c) does not care
+    what is underneath. The filter wraps its own pass-through the same way.
+
+Environment:
+
+    kernel and user mode, any platform with a C99 compiler
+
+--*/
+
+#ifndef _SEDTRANSPORT_H_
+#define _SEDTRANSPORT_H_
+
+#include <stdint.h>
+
+//
+// Transport status codes. Zero is success, everything else is a failure.
+//
+
+#define SED_OK                      0
+#define SED_ERROR_IO                (-1)    // command did not reach the drive
+#define SED_ERROR_DEVICE            (-2)    // drive failed the command
+#define SED_ERROR_MISMATCH          (-3)    // replay: not what was recorded
+#define SED_ERROR_END               (-4)    // replay: recording exhausted
+#define SED_ERROR_NO_MEMORY         (-5)
+#define SED_ERROR_INVALID           (-6)
+#define SED_ERROR_NOT_AUTHORIZED    (-7)    // TPer refused the credentials
+#define SED_ERROR_PROTOCOL          (-8)    // bad or failed method response
+#define SED_ERROR_TIMEOUT           (-9)    // TPer did not answer in time
+
+typedef struct _SED_TRANSPORT SED_TRANSPORT;
+
+typedef struct _SED_TRANSPORT_OPS {
+
+    //
+    // Send Length bytes of security protocol data to ComId
+    //
+
+    int (*IfSend)(
+        SED_TRANSPORT* Transport,
+        uint8_t Protocol,
+        uint16_t ComId,
+        const void* Data,
+        uint32_t Length
+        );
+
+    //
+    // Receive up to Length bytes of security protocol data from ComId,
+    // anything the drive did not fill in is zeroed
+    //
+
+    int (*IfRecv)(
+        SED_TRANSPORT* Transport,
+        uint8_t Protocol,
+        uint16_t ComId,
+        void* Data,
+        uint32_t Length
+        );
+
+    void (*Close)(
+        SED_TRANSPORT* Transport
+        );
+
+} SED_TRANSPORT_OPS;
+
+//
+// Every transport starts with this, followed by its own state
+//
+
+struct _SED_TRANSPORT {
+    const SED_TRANSPORT_OPS* Ops;
+    const char* Name;
+    const char* SerialNumber;       // of the drive, NULL if not known
+};
+
+static __inline int
+SedIfSend(
+    SED_TRANSPORT* Transport,
+    uint8_t Protocol,
+    uint16_t ComId,
+    const void* Data,
+    uint32_t Length
+)
+{
+    return Transport->Ops->IfSend(Transport, Protocol, ComId, Data, Length);
+}
+
+static __inline int
+SedIfRecv(
+    SED_TRANSPORT* Transport,
+    uint8_t Protocol,
+    uint16_t ComId,
+    void* Data,
+    uint32_t Length
+)
+{
+    return Transport->Ops->IfRecv(Transport, Protocol, ComId, Data, Length);
+}
+
+static __inline void
+SedTransportClose(
+    SED_TRANSPORT* Transport
+)
+{
+    if (Transport != NULL) {
+        Transport->Ops->Close(Transport);
+    }
+}
+
+#endif // _SEDTRANSPORT_H_
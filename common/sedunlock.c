@@ -0,0 +1,551 @@
+/*++
+
+Module Name:
+
+    sedunlock.c
+
+Abstract:
+
+    The unlock session over a SED_TRANSPORT, see sedunlock.h.
+
+Environment:
+
+    kernel and user mode, Windows and Linux
+
+--*/
+
+#include <string.h>
+
+#include "sedunlock.h"
+
+const uint8_t SedUnlockLockingSp[8] = { 0x00, 0x00, 0x02, 0x05, 0x00, 0x00, 0x00, 0x02 };
+const uint8_t SedUnlockAdmin1[8] = { 0x00, 0x00, 0x00, 0x09, 0x00, 0x01, 0x00, 0x01 };
+
+const uint8_t SedUnlockGlobalRange[8] = { 0x00, 0x00, 0x08, 0x02, 0x00, 0x00, 0x00, 0x01 };
+const uint8_t SedUnlockLockingRange[8] = { 0x00, 0x00, 0x08, 0x02, 0x00, 0x03, 0x00, 0x00 };
+const uint8_t SedUnlockMbrControl[8] = { 0x00, 0x00, 0x08, 0x03, 0x00, 0x00, 0x00, 0x01 };
+
+void
+SedUnlockRangeSet(
+    SED_OPAL_SET* Set,
+    uint8_t Range
+)
+{
+    memset(Set, 0, sizeof(*Set));
+
+    if (Range == 0) {
+        memcpy(Set->Object, SedUnlockGlobalRange, 8);
+    }
+    else {
+        memcpy(Set->Object, SedUnlockLockingRange, 8);
+        Set->Object[7] = Range;
+    }
+
+    Set->Column[0] = SED_OPAL_COLUMN_READ_LOCKED;
+    Set->Column[1] = SED_OPAL_COLUMN_WRITE_LOCKED;
+    Set->Count = 2;
+}
+
+void
+SedUnlockMbrDoneSet(
+    SED_OPAL_SET* Set
+)
+{
+    memset(Set, 0, sizeof(*Set));
+
+    memcpy(Set->Object, SedUnlockMbrControl, 8);
+    Set->Column[0] = SED_OPAL_COLUMN_DONE;
+    Set->Value[0] = 1;
+    Set->Count = 1;
+}
+
+static int
+SedUnlockAddMethod(
+    SED_UNLOCK_PLAN* Plan,
+    uint16_t ComId,
+    int Verify
+)
+{
+    uint32_t index = Plan->MethodCount;
+    uint8_t* packet = Plan->Data[2 + index];
+    uint32_t length;
+
+    if (SedOpalBuildSet(packet, SED_UNLOCK_PACKET_SPACE, ComId, &Plan->Set[index], &length) != SED_OPAL_OK) {
+        return SED_ERROR_INVALID;
+    }
+
+    if (Verify) {
+        if (SedOpalAppendGet(packet, SED_UNLOCK_PACKET_SPACE, &Plan->Set[index], &length) != SED_OPAL_OK) {
+            return SED_ERROR_INVALID;
+        }
+        Plan->Method[index].Expected = &Plan->Set[index];
+    }
+
+    Plan->Method[index].Data = packet;
+    Plan->Method[index].Length = length;
+    Plan->MethodCount++;
+    return SED_OK;
+}
+
+int
+SedUnlockBuild(
+    SED_UNLOCK_PLAN* Plan,
+    uint16_t ComId,
+    const uint8_t* Authority,
+    const uint8_t* Pin,
+    uint32_t PinLength,
+    const uint8_t* Ranges,
+    uint32_t RangeCount,
+    int MbrDone,
+    int Verify
+)
+{
+    uint32_t length;
+    uint32_t i;
+    int      status;
+
+    memset(Plan, 0, sizeof(*Plan));
+
+    if (RangeCount > SED_UNLOCK_MAX_RANGES || (RangeCount == 0 && !MbrDone)) {
+        return SED_ERROR_INVALID;
+    }
+
+    if (SedOpalBuildStartSession(Plan->Data[0], SED_UNLOCK_PACKET_SPACE, ComId, SED_UNLOCK_HOST_SESSION,
+        SedUnlockLockingSp, Authority != NULL ? Authority : SedUnlockAdmin1, Pin, PinLength,
+        &length) != SED_OPAL_OK) {
+        return SED_ERROR_INVALID;
+    }
+    Plan->StartSession.Data = Plan->Data[0];
+    Plan->StartSession.Length = length;
+
+    if (SedOpalBuildEndSession(Plan->Data[1], SED_UNLOCK_PACKET_SPACE, ComId, &length) != SED_OPAL_OK) {
+        return SED_ERROR_INVALID;
+    }
+    Plan->EndSession.Data = Plan->Data[1];
+    Plan->EndSession.Length = length;
+
+    for (i = 0; i < RangeCount; i++) {
+        SedUnlockRangeSet(&Plan->Set[Plan->MethodCount], Ranges[i]);
+        status = SedUnlockAddMethod(Plan, ComId, Verify);
+        if (status != SED_OK) {
+            return status;
+        }
+    }
+
+    if (MbrDone) {
+        SedUnlockMbrDoneSet(&Plan->Set[Plan->MethodCount]);
+        return SedUnlockAddMethod(Plan, ComId, Verify);
+    }
+
+    return SED_OK;
+}
+
+static int
+SedUnlockSendCommand(
+    SED_UNLOCK* Unlock,
+    uint32_t Length
+)
+
+/*++
+
+Routine Description:
+
+    Send the Length bytes in the command buffer, zero padded to whole
+    blocks
+
+--*/
+
+{
+    uint32_t padded = (Length + SED_UNLOCK_BLOCK - 1) & ~(SED_UNLOCK_BLOCK - 1u);
+
+    if (padded > Unlock->BufferSize) {
+        return SED_ERROR_INVALID;
+    }
+
+    memset(Unlock->Command + Length, 0, padded - Length);
+    return SedIfSend(Unlock->Transport, SED_UNLOCK_PROTOCOL, Unlock->ComId, Unlock->Command, padded);
+}
+
+int
+SedUnlockSend(
+    SED_UNLOCK* Unlock,
+    const SED_UNLOCK_PACKET* Packet,
+    uint32_t Hsn,
+    uint32_t Tsn
+)
+{
+    if (Packet->Length < SED_OPAL_PAYLOAD_OFFSET || Packet->Length > Unlock->BufferSize) {
+        return SED_ERROR_INVALID;
+    }
+
+    //
+    // The packet itself is shared, so it is stamped in the command buffer
+    //
+
+    memcpy(Unlock->Command, Packet->Data, Packet->Length);
+    if (Tsn != 0) {
+        SedOpalSetSession(Unlock->Command, Hsn, Tsn);
+    }
+
+    return SedUnlockSendCommand(Unlock, Packet->Length);
+}
+
+int
+SedUnlockReceive(
+    SED_UNLOCK* Unlock,
+    int* Empty
+)
+{
+    int status;
+
+    status = SedIfRecv(Unlock->Transport, SED_UNLOCK_PROTOCOL, Unlock->ComId,
+        Unlock->Response, Unlock->BufferSize);
+    if (status != SED_OK) {
+        return status;
+    }
+
+    *Empty = SedOpalGet32(Unlock->Response + SED_OPAL_COMPACKET_LENGTH) == 0;
+    return SED_OK;
+}
+
+int
+SedUnlockCheck(
+    SED_UNLOCK* Unlock,
+    const SED_OPAL_SET* Expected
+)
+
+/*++
+
+Routine Description:
+
+    NOT_AUTHORIZED means the credentials are wrong, which no retry fixes,
+    so it is told apart from every other failure.
+
+--*/
+
+{
+    uint8_t methodStatus;
+    int     result;
+
+    result = SedOpalCheckResponse(Unlock->Response, Unlock->BufferSize, Expected, &methodStatus);
+    if (result == SED_OPAL_OK) {
+        return SED_OK;
+    }
+
+    Unlock->MethodStatus = methodStatus;
+
+    if (result == SED_OPAL_ERROR_STATUS && methodStatus == SED_OPAL_STATUS_NOT_AUTHORIZED) {
+        return SED_ERROR_NOT_AUTHORIZED;
+    }
+    return SED_ERROR_PROTOCOL;
+}
+
+static int
+SedUnlockBackOff(
+    SED_UNLOCK* Unlock,
+    uint32_t* Polls,
+    uint32_t* Backoff
+)
+
+/*++
+
+Routine Description:
+
+    The TPer has nothing for us yet. Wait a little longer each time, up to
+    SED_UNLOCK_BACKOFF_MAX_US, until MaxPolls empty replies have been
+    seen or the caller gives up.
+
+--*/
+
+{
+    uint32_t maxPolls = (Unlock->MaxPolls != 0) ? Unlock->MaxPolls : SED_UNLOCK_DEFAULT_POLLS;
+
+    Unlock->Polls++;
+
+    if (++*Polls >= maxPolls ||
+        (Unlock->Wait != NULL && Unlock->Wait(Unlock->Context, *Backoff) != 0)) {
+        return SED_ERROR_TIMEOUT;
+    }
+
+    *Backoff = (*Backoff * 2 < SED_UNLOCK_BACKOFF_MAX_US) ? *Backoff * 2 : SED_UNLOCK_BACKOFF_MAX_US;
+    return SED_OK;
+}
+
+static int
+SedUnlockReceiveReply(
+    SED_UNLOCK* Unlock
+)
+
+/*++
+
+Routine Description:
+
+    Receive the reply to the one command outstanding, waiting out empty
+    ComPackets
+
+--*/
+
+{
+    uint32_t polls = 0;
+    uint32_t backoff = SED_UNLOCK_BACKOFF_INITIAL_US;
+    int      empty;
+    int      status;
+
+    for (;;) {
+        status = SedUnlockReceive(Unlock, &empty);
+        if (status != SED_OK || !empty) {
+            return status;
+        }
+
+        status = SedUnlockBackOff(Unlock, &polls, &backoff);
+        if (status != SED_OK) {
+            return status;
+        }
+    }
+}
+
+int
+SedUnlockQueryProperties(
+    SED_UNLOCK* Unlock
+)
+{
+    uint32_t length;
+    int      status;
+
+    memset(&Unlock->Properties, 0, sizeof(Unlock->Properties));
+
+    if (SedOpalBuildProperties(Unlock->Command, Unlock->BufferSize, Unlock->ComId, &length) != SED_OPAL_OK) {
+        return SED_ERROR_INVALID;
+    }
+
+    status = SedUnlockSendCommand(Unlock, length);
+    if (status == SED_OK) {
+        status = SedUnlockReceiveReply(Unlock);
+    }
+    if (status != SED_OK) {
+        return status;
+    }
+
+    if (SedOpalParseProperties(Unlock->Response, Unlock->BufferSize, &Unlock->Properties) != SED_OPAL_OK) {
+        memset(&Unlock->Properties, 0, sizeof(Unlock->Properties));
+        return SED_ERROR_PROTOCOL;
+    }
+
+    return SED_OK;
+}
+
+int
+SedUnlockDiscover(
+    SED_UNLOCK* Unlock,
+    uint8_t* Locking
+)
+{
+    const uint8_t* feature;
+    uint32_t featureLength;
+    int      status;
+
+    *Locking = 0;
+
+    status = SedIfRecv(Unlock->Transport, SED_UNLOCK_PROTOCOL, SED_OPAL_DISCOVERY_COMID,
+        Unlock->Response, Unlock->BufferSize);
+    if (status != SED_OK) {
+        return status;
+    }
+
+    status = SedOpalFindFeature(Unlock->Response, Unlock->BufferSize, SED_OPAL_FEATURE_LOCKING,
+        &feature, &featureLength);
+    if (status == SED_OPAL_END) {
+        return SED_OK;
+    }
+    if (status != SED_OPAL_OK || featureLength == 0) {
+        return SED_ERROR_PROTOCOL;
+    }
+
+    *Locking = feature[0];
+    return SED_OK;
+}
+
+static int
+SedUnlockCollect(
+    SED_UNLOCK* Unlock,
+    const SED_UNLOCK_PACKET* Method,
+    uint32_t Sent,
+    int Closing,
+    int* Results,
+    uint32_t* Completed
+)
+
+/*++
+
+Routine Description:
+
+    Receive the replies to Sent queued method calls and, if Closing, to
+    the EndSession queued behind them, in one polling pass. Every reply is
+    drained even after a failure, so none is left for the next session to
+    read. A session the TPer ends early fails the calls it did not answer.
+
+--*/
+
+{
+    uint32_t polls = 0;
+    uint32_t backoff = SED_UNLOCK_BACKOFF_INITIAL_US;
+    uint32_t next = 0;
+    int      haveEnd = !Closing;
+    int      result = SED_OK;
+    int      empty;
+    int      ended;
+    int      status;
+
+    while (next < Sent || !haveEnd) {
+        status = SedUnlockReceive(Unlock, &empty);
+        if (status == SED_OK && empty) {
+            status = SedUnlockBackOff(Unlock, &polls, &backoff);
+            if (status == SED_OK) {
+                continue;
+            }
+        }
+        if (status != SED_OK) {
+            return (result != SED_OK) ? result : status;
+        }
+
+        ended = SedOpalFindControl(Unlock->Response, Unlock->BufferSize, SED_OPAL_END_OF_SESSION) == SED_OPAL_OK;
+
+        if (next < Sent) {
+            status = SedUnlockCheck(Unlock, Method[next].Expected);
+            Results[next++] = status;
+            if (status != SED_OK && result == SED_OK) {
+                result = status;
+            }
+
+            while (ended && next < Sent) {
+                Results[next++] = SED_ERROR_PROTOCOL;
+            }
+            *Completed = next;
+        }
+        else if (!ended) {
+
+            //
+            // Something other than the EndSession reply; count it against
+            // the polls so a confused TPer cannot keep us here
+            //
+
+            status = SedUnlockBackOff(Unlock, &polls, &backoff);
+            if (status != SED_OK) {
+                return (result != SED_OK) ? result : status;
+            }
+        }
+
+        if (ended) {
+            haveEnd = 1;
+        }
+    }
+
+    return result;
+}
+
+int
+SedUnlockRun(
+    SED_UNLOCK* Unlock,
+    const SED_UNLOCK_PACKET* StartSession,
+    const SED_UNLOCK_PACKET* Method,
+    uint32_t Count,
+    const SED_UNLOCK_PACKET* EndSession,
+    int* Results,
+    uint32_t* Completed
+)
+{
+    uint32_t hsn;
+    uint32_t tsn;
+    uint32_t sent;
+    uint32_t i;
+    int      pipeline;
+    int      closed = 0;
+    int      result;
+    int      status;
+
+    *Completed = 0;
+    Unlock->MethodStatus = SED_OPAL_STATUS_SUCCESS;
+    Unlock->Polls = 0;
+
+    //
+    // Nothing more can be done if the session does not open
+    //
+
+    status = SedUnlockSend(Unlock, StartSession, 0, 0);
+    if (status == SED_OK) {
+        status = SedUnlockReceiveReply(Unlock);
+    }
+    if (status == SED_OK) {
+        status = SedUnlockCheck(Unlock, NULL);
+    }
+    if (status != SED_OK) {
+        return status;
+    }
+    if (SedOpalParseSyncSession(Unlock->Response, Unlock->BufferSize, &hsn, &tsn) != SED_OPAL_OK || tsn == 0) {
+        return SED_ERROR_PROTOCOL;
+    }
+
+    //
+    // Now the session number is known, a TPer that takes queued ComPackets
+    // can have every call and the EndSession straight away, saving a round
+    // trip per call
+    //
+
+    pipeline = Unlock->Properties.Asynchronous && !Unlock->NoPipeline;
+    for (i = 0; i < Count && pipeline; i++) {
+        if (Unlock->Properties.MaxComPacketSize != 0 && Method[i].Length > Unlock->Properties.MaxComPacketSize) {
+            pipeline = 0;
+        }
+    }
+
+    if (pipeline) {
+        for (sent = 0; sent < Count; sent++) {
+            status = SedUnlockSend(Unlock, &Method[sent], hsn, tsn);
+            if (status != SED_OK) {
+                break;
+            }
+        }
+
+        if (sent == Count) {
+            closed = SedUnlockSend(Unlock, EndSession, hsn, tsn) == SED_OK;
+        }
+
+        result = SedUnlockCollect(Unlock, Method, sent, closed, Results, Completed);
+        if (status == SED_OK) {
+            status = result;
+        }
+    }
+    else {
+        for (i = 0; i < Count; i++) {
+            if (i != 0 && Unlock->Wait != NULL && Unlock->Wait(Unlock->Context, 0) != 0) {
+                status = SED_ERROR_TIMEOUT;
+                break;
+            }
+
+            status = SedUnlockSend(Unlock, &Method[i], hsn, tsn);
+            if (status == SED_OK) {
+                status = SedUnlockReceiveReply(Unlock);
+            }
+            if (status == SED_OK) {
+                status = SedUnlockCheck(Unlock, Method[i].Expected);
+            }
+
+            Results[i] = status;
+            *Completed = i + 1;
+
+            if (status != SED_OK) {
+                break;
+            }
+        }
+    }
+
+    //
+    // Close the session even if a call failed. Its reply is only drained.
+    //
+
+    if (!closed && SedUnlockSend(Unlock, EndSession, hsn, tsn) == SED_OK) {
+        (void)SedUnlockReceiveReply(Unlock);
+    }
+
+    return status;
+}
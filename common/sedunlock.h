@@ -0,0 +1,219 @@
+/*++
+
+Module Name:
+
+    sedunlock.h
+
+Abstract:
+
+    The unlock sequence itself, over any SED_TRANSPORT: one session on the
+    Locking SP in which every locking range is unlocked and MBRDone set,
+    then closed. The filter runs it over its pass-through on resume, the
+    sedunlock tool over SG_IO or NVMe admin passthrough on Linux, or over
+    the emulated TPer.
+
+    The commands are ComPackets built ahead of time with TSN and HSN zero;
+    the session numbers are stamped in as they are sent. A TPer that
+    accepts queued ComPackets gets every method call and the EndSession
+    back to back and the replies are collected afterwards, so the whole
+    unlock costs StartSession plus one round of replies. Otherwise each
+    call waits for its reply.
+
+    Nothing here allocates or sleeps. Waiting between polls is up to the
+    caller's Wait routine.
+
+Environment:
+
+    kernel and user mode, Windows and Linux
+
+--*/
+
+#ifndef _SEDUNLOCK_H_
+#define _SEDUNLOCK_H_
+
+#include <stdint.h>
+
+#include "sedopal.h"
+#include "sedtransport.h"
+
+#define SED_UNLOCK_PROTOCOL         1       // TCG security protocol
+#define SED_UNLOCK_COMID            4100    // base ComId of an Opal SSC drive
+#define SED_UNLOCK_BLOCK            512     // IF-SEND lengths are whole blocks
+
+//
+// Empty replies to wait out before giving up, and the back off between them
+//
+
+#define SED_UNLOCK_DEFAULT_POLLS        12
+#define SED_UNLOCK_BACKOFF_INITIAL_US   50
+#define SED_UNLOCK_BACKOFF_MAX_US       20000
+
+//
+// Host session number used for unlock sessions
+//
+
+#define SED_UNLOCK_HOST_SESSION     1
+
+typedef struct _SED_UNLOCK {
+    SED_TRANSPORT* Transport;
+    uint16_t ComId;
+    uint8_t* Command;               // BufferSize bytes, commands are stamped here
+    uint8_t* Response;              // BufferSize bytes, the last ComPacket received
+    uint32_t BufferSize;            // multiple of SED_UNLOCK_BLOCK
+    SED_OPAL_PROPERTIES Properties; // zero until SedUnlockQueryProperties
+    int NoPipeline;                 // wait for each reply even if the TPer queues
+    uint32_t MaxPolls;              // 0 for SED_UNLOCK_DEFAULT_POLLS
+
+    //
+    // Called to back off before polling again, and with 0 between method
+    // calls that wait for their replies. Nonzero gives up. NULL polls
+    // straight away.
+    //
+
+    int (*Wait)(void* Context, uint32_t Microseconds);
+    void* Context;
+
+    uint8_t MethodStatus;           // of the last method that failed
+    uint32_t Polls;                 // empty replies seen by the last run
+} SED_UNLOCK;
+
+typedef struct _SED_UNLOCK_PACKET {
+    const uint8_t* Data;            // ComPacket, TSN and HSN zero
+    uint32_t Length;                // including headers
+    const SED_OPAL_SET* Expected;   // values the call reads back, or NULL
+} SED_UNLOCK_PACKET;
+
+//
+// Commands for one unlock session, built by SedUnlockBuild
+//
+
+#define SED_UNLOCK_MAX_RANGES       8       // as SEDSLEEP_PROVISION_MAX_RANGES
+#define SED_UNLOCK_MAX_METHODS      (SED_UNLOCK_MAX_RANGES + 1)
+#define SED_UNLOCK_PACKET_SPACE     512
+
+typedef struct _SED_UNLOCK_PLAN {
+    SED_UNLOCK_PACKET StartSession;
+    SED_UNLOCK_PACKET EndSession;
+    SED_UNLOCK_PACKET Method[SED_UNLOCK_MAX_METHODS];
+    uint32_t MethodCount;
+    SED_OPAL_SET Set[SED_UNLOCK_MAX_METHODS];
+    uint8_t Data[SED_UNLOCK_MAX_METHODS + 2][SED_UNLOCK_PACKET_SPACE];
+} SED_UNLOCK_PLAN;
+
+extern const uint8_t SedUnlockLockingSp[8];
+extern const uint8_t SedUnlockAdmin1[8];
+extern const uint8_t SedUnlockGlobalRange[8];
+extern const uint8_t SedUnlockLockingRange[8];     // last byte is the range number
+extern const uint8_t SedUnlockMbrControl[8];
+
+//
+// A Set clearing ReadLocked and WriteLocked on a locking range, 0 being
+// the global range, and one setting MBRDone
+//
+
+void
+SedUnlockRangeSet(
+    SED_OPAL_SET* Set,
+    uint8_t Range
+);
+
+void
+SedUnlockMbrDoneSet(
+    SED_OPAL_SET* Set
+);
+
+//
+// Build the whole session: StartSession on the Locking SP as Authority
+// (Admin1 if NULL) with Pin, a Set for each of the locking ranges, then
+// MBRDone if asked. With Verify each Set reads its columns back in the
+// same call.
+//
+
+int
+SedUnlockBuild(
+    SED_UNLOCK_PLAN* Plan,
+    uint16_t ComId,
+    const uint8_t* Authority,
+    const uint8_t* Pin,
+    uint32_t PinLength,
+    const uint8_t* Ranges,
+    uint32_t RangeCount,
+    int MbrDone,
+    int Verify
+);
+
+//
+// Send a command, padded to whole blocks, with the session numbers
+// stamped in if Tsn is not zero
+//
+
+int
+SedUnlockSend(
+    SED_UNLOCK* Unlock,
+    const SED_UNLOCK_PACKET* Packet,
+    uint32_t Hsn,
+    uint32_t Tsn
+);
+
+//
+// Receive one ComPacket into Response. An empty one, the TPer having
+// nothing ready yet, sets *Empty.
+//
+
+int
+SedUnlockReceive(
+    SED_UNLOCK* Unlock,
+    int* Empty
+);
+
+//
+// Check the method status in Response and, if Expected is given, the
+// values read back
+//
+
+int
+SedUnlockCheck(
+    SED_UNLOCK* Unlock,
+    const SED_OPAL_SET* Expected
+);
+
+//
+// Ask the session manager for the TPer properties, leaving them zero
+// (synchronous) if it does not answer usefully
+//
+
+int
+SedUnlockQueryProperties(
+    SED_UNLOCK* Unlock
+);
+
+//
+// Level 0 Discovery; *Locking gets the first byte of the Locking feature,
+// zero if the drive does not report one
+//
+
+int
+SedUnlockDiscover(
+    SED_UNLOCK* Unlock,
+    uint8_t* Locking
+);
+
+//
+// Run StartSession, the Count method calls and EndSession as one session.
+// Results[i] gets the outcome of Method[i] for each of the first *Completed
+// calls; once a call fails without pipelining, the rest are not sent. The
+// session is always closed. Returns the first failure, if any.
+//
+
+int
+SedUnlockRun(
+    SED_UNLOCK* Unlock,
+    const SED_UNLOCK_PACKET* StartSession,
+    const SED_UNLOCK_PACKET* Method,
+    uint32_t Count,
+    const SED_UNLOCK_PACKET* EndSession,
+    int* Results,
+    uint32_t* Completed
+);
+
+#endif // _SEDUNLOCK_H_
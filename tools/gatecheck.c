@@ -0,0 +1,799 @@
+/*++
+
+Module Name:
+
+    gatecheck.c
+
+Abstract:
+
+    Deterministic concurrency checker for the resume gate (common/sedgate.h).
+
+    Every actor the filter has to cope with runs as a coroutine on one
+    thread: read/write callers, the power path closing the gate on sleep,
+    the unlock worker opening or failing it after resume, and remove-device
+    tearing it down. Every atomic operation on the gate is a scheduling
+    point, and a seeded scheduler picks who runs next, so each seed is one
+    exact interleaving that can be replayed at will.
+
+    gatecheck [-g gate] [-n runs] [-s seed] [-p depth] [-a actors]
+              [-i ios] [-c cycles] [-v]
+
+    -g      gate implementation: lockfree (default) or naive, a plain
+            load/store version kept to show what a broken design looks like
+    -n      number of runs, seeds seed .. seed+runs-1 (default 10000)
+    -s      first seed (default 1)
+    -p      PCT scheduling with this bug depth instead of uniform random
+    -a      read/write actors (default 3), -i IOs each (default 3)
+    -c      sleep/resume cycles (default 2)
+    -v      print the schedule of a failing run
+
+    After every run each IO must have completed exactly once, and no IO may
+    pass the gate while the model drive is locked or complete after the
+    device was deleted. The first failing seed is printed; run it again
+    with -s seed -n 1 -v to see the schedule.
+
+    Interleavings are explored under sequential consistency. Weak memory
+    reordering is not modelled, that is what the acquire/release atomics
+    in sedgate.h are for.
+
+Environment:
+
+    User mode, POSIX (ucontext)
+
+--*/
+
+#define _XOPEN_SOURCE 700
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ucontext.h>
+
+//
+// Gate atomics become scheduling points
+//
+
+static void Yield(const char* What);
+
+static void*
+CheckedLoad(
+    void* volatile* Target
+)
+{
+    Yield("load");
+    return *Target;
+}
+
+static void*
+CheckedCas(
+    void* volatile* Target,
+    void* New,
+    void* Old
+)
+{
+    void* seen;
+
+    Yield("cas");
+    seen = *Target;
+    if (seen == Old) {
+        *Target = New;
+    }
+    return seen;
+}
+
+static void
+CheckedStore(
+    void* volatile* Target,
+    void* Value
+)
+{
+    Yield("store");
+    *Target = Value;
+}
+
+#define SED_GATE_LOAD(p)            CheckedLoad((void* volatile*)(p))
+#define SED_GATE_CAS(p, n, o)       CheckedCas((void* volatile*)(p), (n), (o))
+
+#include "sedgate.h"
+
+//
+// Gate implementations under test
+//
+
+typedef struct _GATE_OPS {
+    const char* Name;
+    int (*Close)(PSED_GATE Gate);
+    SED_GATE_RESULT (*Enter)(PSED_GATE Gate, PSED_GATE_ENTRY Entry, int* First);
+    PSED_GATE_ENTRY (*Open)(PSED_GATE Gate);
+    PSED_GATE_ENTRY (*Fail)(PSED_GATE Gate);
+    PSED_GATE_ENTRY (*Remove)(PSED_GATE Gate);
+} GATE_OPS;
+
+//
+// Check-then-act version: parks with a plain store, so a push racing
+// another push or an open loses entries
+//
+
+static SED_GATE_RESULT
+NaiveEnter(
+    PSED_GATE Gate,
+    PSED_GATE_ENTRY Entry,
+    int* First
+)
+{
+    void* state = CheckedLoad(&Gate->State);
+
+    if (state == SED_GATE_OPEN) {
+        return SedGateResultPass;
+    }
+
+    if (!SED_GATE_IS_CLOSED(state)) {
+        return SedGateResultFail;
+    }
+
+    Entry->Next = (PSED_GATE_ENTRY)state;
+    CheckedStore(&Gate->State, Entry);
+    *First = (state == NULL);
+    return SedGateResultParked;
+}
+
+static const GATE_OPS Gates[] = {
+    { "lockfree", SedGateClose, SedGateEnter, SedGateOpen, SedGateFail, SedGateRemove },
+    { "naive", SedGateClose, NaiveEnter, SedGateOpen, SedGateFail, SedGateRemove },
+};
+
+//
+// Scheduler
+//
+
+#define MAX_ACTORS      16
+#define STACK_SIZE      (64 * 1024)
+#define MAX_STEPS       20000
+#define MAX_CYCLES      16
+
+typedef int (*WAIT_ROUTINE)(void);
+
+typedef struct _ACTOR {
+    const char*  Name;
+    int          Index;
+    void       (*Body)(int Index);
+    ucontext_t   Context;
+    int          Done;
+    WAIT_ROUTINE Wait;              // runnable only once this returns nonzero
+    uint32_t     Priority;          // PCT only
+    char*        Stack;
+} ACTOR;
+
+typedef struct _STEP {
+    uint16_t    Actor;
+    const char* What;
+} STEP;
+
+static ACTOR      Actors[MAX_ACTORS];
+static int        ActorCount;
+static ACTOR*     Current;
+static ucontext_t SchedulerContext;
+static uint64_t   Rng;
+static uint32_t   Steps;
+static STEP       Schedule[MAX_STEPS];
+static char       Failure[256];
+
+static int        PctDepth;
+static uint32_t   ChangePoints[8];
+
+static uint32_t
+Random(
+    uint32_t Bound
+)
+{
+    //
+    // xorshift64*
+    //
+
+    Rng ^= Rng >> 12;
+    Rng ^= Rng << 25;
+    Rng ^= Rng >> 27;
+    return (uint32_t)((Rng * 0x2545F4914F6CDD1DULL) >> 32) % Bound;
+}
+
+static void
+Fail(
+    const char* Format,
+    ...
+)
+{
+    va_list ap;
+
+    if (Failure[0] == 0) {
+        va_start(ap, Format);
+        vsnprintf(Failure, sizeof(Failure), Format, ap);
+        va_end(ap);
+    }
+
+    //
+    // Never resumed
+    //
+
+    swapcontext(&Current->Context, &SchedulerContext);
+}
+
+static void
+Yield(
+    const char* What
+)
+{
+    if (Steps < MAX_STEPS) {
+        Schedule[Steps].Actor = (uint16_t)Current->Index;
+        Schedule[Steps].What = What;
+    }
+    Steps++;
+
+    swapcontext(&Current->Context, &SchedulerContext);
+}
+
+static void
+WaitUntil(
+    WAIT_ROUTINE Routine,
+    const char* What
+)
+{
+    Current->Wait = Routine;
+    Yield(What);
+    Current->Wait = NULL;
+}
+
+static void
+ActorEntry(
+    int Index
+)
+{
+    Actors[Index].Body(Index);
+    Actors[Index].Done = 1;
+    swapcontext(&Actors[Index].Context, &SchedulerContext);
+}
+
+static void
+AddActor(
+    const char* Name,
+    void (*Body)(int Index)
+)
+{
+    ACTOR* actor = &Actors[ActorCount];
+
+    actor->Name = Name;
+    actor->Index = ActorCount;
+    actor->Body = Body;
+    actor->Done = 0;
+    actor->Wait = NULL;
+    if (actor->Stack == NULL) {
+        actor->Stack = malloc(STACK_SIZE);
+        if (actor->Stack == NULL) {
+            fprintf(stderr, "gatecheck: out of memory\n");
+            exit(1);
+        }
+    }
+
+    getcontext(&actor->Context);
+    actor->Context.uc_stack.ss_sp = actor->Stack;
+    actor->Context.uc_stack.ss_size = STACK_SIZE;
+    actor->Context.uc_link = NULL;
+    makecontext(&actor->Context, (void (*)(void))ActorEntry, 1, ActorCount);
+
+    ActorCount++;
+}
+
+static int
+Runnable(
+    ACTOR* Actor
+)
+{
+    return !Actor->Done && (Actor->Wait == NULL || Actor->Wait());
+}
+
+static ACTOR*
+PickNext(
+    void
+)
+{
+    ACTOR* runnable[MAX_ACTORS];
+    ACTOR* best = NULL;
+    int    count = 0;
+    int    i;
+
+    for (i = 0; i < ActorCount; i++) {
+        if (Runnable(&Actors[i])) {
+            runnable[count++] = &Actors[i];
+        }
+    }
+
+    if (count == 0) {
+        return NULL;
+    }
+
+    if (PctDepth == 0) {
+        return runnable[Random(count)];
+    }
+
+    //
+    // PCT: run the highest priority actor, demoting whoever is running at
+    // each change point below everybody else
+    //
+
+    for (i = 0; i < PctDepth - 1; i++) {
+        if (ChangePoints[i] == Steps && Current != NULL) {
+            Current->Priority = (uint32_t)i;
+        }
+    }
+
+    for (i = 0; i < count; i++) {
+        if (best == NULL || runnable[i]->Priority > best->Priority) {
+            best = runnable[i];
+        }
+    }
+
+    return best;
+}
+
+//
+// The model: the drive, the device and the IOs sent to it
+//
+
+#define MAX_IOS         256
+
+enum {
+    OutcomeNone,
+    OutcomePassed,                  // went straight through
+    OutcomeReleased,                // parked, sent on after unlock
+    OutcomeFailed,                  // failed by the gate
+    OutcomeRejected                 // remove lock refused it
+};
+
+typedef struct _IO {
+    SED_GATE_ENTRY Entry;           // first, so an entry is its IO
+    int Id;
+    int Outcome;
+    int Completions;
+} IO;
+
+static struct {
+    const GATE_OPS* Gate;
+    int  ReadWriteActors;
+    int  IosPerActor;
+    int  Cycles;
+    int  UnlockSucceeds[MAX_CYCLES];
+    int  RoundTrips;
+    int  RemoveAt;                  // step remove starts at, -1 for never
+} Config;
+
+static struct {
+    SED_GATE Gate;
+    IO   Ios[MAX_IOS];
+    int  DriveLocked;
+    int  Removing;
+    int  Deleted;
+    int  RemoveRefs;
+    int  UnlockPending;
+    int  Cycle;
+    int  PowerDone;
+    int  ReadWritesDone;
+} Model;
+
+static void
+Complete(
+    IO* Io,
+    int Outcome
+)
+{
+    if (Model.Deleted) {
+        Fail("io %d completed after the device was deleted", Io->Id);
+    }
+
+    if (++Io->Completions > 1) {
+        Fail("io %d completed twice", Io->Id);
+    }
+
+    Io->Outcome = Outcome;
+}
+
+static void
+ReleaseList(
+    PSED_GATE_ENTRY List,
+    int Outcome
+)
+{
+    List = SedGateReverse(List);
+
+    while (List != NULL) {
+        IO* io = (IO*)List;
+
+        List = List->Next;
+        Yield("release");
+        Complete(io, Outcome);
+        Model.RemoveRefs--;
+    }
+}
+
+static void
+ReadWriteActor(
+    int Index
+)
+{
+    int i;
+
+    for (i = 0; i < Config.IosPerActor; i++) {
+        IO* io = &Model.Ios[(Index - 3) * Config.IosPerActor + i];
+        int first = 0;
+
+        Yield("issue");
+
+        //
+        // IoAcquireRemoveLock, which fails the IO itself once removal has
+        // started (and there is no device to send it to once deleted)
+        //
+
+        if (Model.Removing) {
+            io->Outcome = OutcomeRejected;
+            io->Completions++;
+            continue;
+        }
+        Model.RemoveRefs++;
+
+        switch (Config.Gate->Enter(&Model.Gate, &io->Entry, &first)) {
+        case SedGateResultPass:
+            if (Model.DriveLocked) {
+                Fail("io %d passed the gate while the drive was locked", io->Id);
+            }
+            Complete(io, OutcomePassed);
+            Model.RemoveRefs--;
+            break;
+
+        case SedGateResultFail:
+            Complete(io, OutcomeFailed);
+            Model.RemoveRefs--;
+            break;
+
+        case SedGateResultParked:
+            break;
+        }
+    }
+
+    Model.ReadWritesDone++;
+}
+
+static int
+UnlockIdle(
+    void
+)
+{
+    return !Model.UnlockPending;
+}
+
+static void
+PowerActor(
+    int Index
+)
+{
+    int cycle;
+
+    (void)Index;
+
+    for (cycle = 0; cycle < Config.Cycles; cycle++) {
+
+        //
+        // The previous resume's unlock has to finish before the next sleep
+        //
+
+        WaitUntil(UnlockIdle, "sleep");
+        Config.Gate->Close(&Model.Gate);
+        Model.DriveLocked = 1;
+
+        Yield("resume");
+        Model.Cycle = cycle;
+        Model.UnlockPending = 1;
+    }
+
+    Model.PowerDone = 1;
+}
+
+static int
+UnlockWanted(
+    void
+)
+{
+    return Model.UnlockPending || Model.PowerDone;
+}
+
+static void
+UnlockActor(
+    int Index
+)
+{
+    (void)Index;
+
+    for (;;) {
+        int i;
+
+        WaitUntil(UnlockWanted, "unlock wait");
+        if (!Model.UnlockPending) {
+            return;
+        }
+
+        //
+        // The worker holds a remove lock reference while it unlocks
+        //
+
+        if (Model.Removing) {
+            Model.UnlockPending = 0;
+            continue;
+        }
+        Model.RemoveRefs++;
+
+        for (i = 0; i < Config.RoundTrips; i++) {
+            Yield("command");
+        }
+
+        if (Config.UnlockSucceeds[Model.Cycle]) {
+            Model.DriveLocked = 0;
+            ReleaseList(Config.Gate->Open(&Model.Gate), OutcomeReleased);
+        }
+        else {
+            ReleaseList(Config.Gate->Fail(&Model.Gate), OutcomeFailed);
+        }
+
+        Model.RemoveRefs--;
+        Model.UnlockPending = 0;
+    }
+}
+
+static int
+RemoveDue(
+    void
+)
+{
+    //
+    // Or right at the end, if everything else finished first
+    //
+
+    return Steps >= (uint32_t)Config.RemoveAt ||
+        (Model.PowerDone && !Model.UnlockPending &&
+         Model.ReadWritesDone == Config.ReadWriteActors);
+}
+
+static int
+RemoveDrained(
+    void
+)
+{
+    return Model.RemoveRefs == 0;
+}
+
+static void
+RemoveActor(
+    int Index
+)
+{
+    (void)Index;
+
+    WaitUntil(RemoveDue, "remove wait");
+    Model.Removing = 1;
+    ReleaseList(Config.Gate->Remove(&Model.Gate), OutcomeFailed);
+
+    //
+    // IoReleaseRemoveLockAndWait
+    //
+
+    WaitUntil(RemoveDrained, "remove drain");
+    Model.Deleted = 1;
+}
+
+//
+// One run
+//
+
+static int
+Run(
+    uint64_t Seed
+)
+{
+    int i;
+
+    Rng = Seed * 0x9E3779B97F4A7C15ULL + 1;
+    Steps = 0;
+    Failure[0] = 0;
+    Current = NULL;
+    memset(&Model, 0, sizeof(Model));
+    SedGateInitialize(&Model.Gate, 1);
+
+    //
+    // The scenario comes from the seed too
+    //
+
+    for (i = 0; i < Config.Cycles; i++) {
+        Config.UnlockSucceeds[i] = Random(4) != 0;
+    }
+    Config.RoundTrips = 1 + Random(3);
+    Config.RemoveAt = Random(3) == 0 ? (int)Random(200) : -1;
+
+    for (i = 0; i < Config.ReadWriteActors * Config.IosPerActor; i++) {
+        Model.Ios[i].Id = i;
+    }
+
+    ActorCount = 0;
+    AddActor("power", PowerActor);
+    AddActor("unlock", UnlockActor);
+    AddActor("remove", RemoveActor);
+    for (i = 0; i < Config.ReadWriteActors; i++) {
+        AddActor("readwrite", ReadWriteActor);
+    }
+
+    if (Config.RemoveAt < 0) {
+        Actors[2].Done = 1;
+    }
+
+    if (PctDepth != 0) {
+        for (i = 0; i < ActorCount; i++) {
+            Actors[i].Priority = (uint32_t)PctDepth + Random(1000);
+        }
+        for (i = 0; i < PctDepth - 1; i++) {
+            ChangePoints[i] = Random(400);
+        }
+    }
+
+    for (;;) {
+        ACTOR* next = PickNext();
+
+        if (Failure[0] != 0) {
+            return 0;
+        }
+
+        if (next == NULL) {
+            break;
+        }
+
+        if (Steps >= MAX_STEPS) {
+            snprintf(Failure, sizeof(Failure), "no progress after %u steps", Steps);
+            return 0;
+        }
+
+        Current = next;
+        swapcontext(&SchedulerContext, &next->Context);
+    }
+
+    if (Failure[0] != 0) {
+        return 0;
+    }
+
+    for (i = 0; i < ActorCount; i++) {
+        if (!Actors[i].Done) {
+            snprintf(Failure, sizeof(Failure), "deadlock, %s %d stuck", Actors[i].Name, i);
+            return 0;
+        }
+    }
+
+    for (i = 0; i < Config.ReadWriteActors * Config.IosPerActor; i++) {
+        if (Model.Ios[i].Completions == 0) {
+            snprintf(Failure, sizeof(Failure), "io %d never completed", i);
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static void
+PrintSchedule(
+    void
+)
+{
+    uint32_t i;
+
+    for (i = 0; i < Steps && i < MAX_STEPS; i++) {
+        printf("  %5u  %-9s %2u  %s\n", i,
+            Actors[Schedule[i].Actor].Name, Schedule[i].Actor, Schedule[i].What);
+    }
+}
+
+int
+main(
+    int argc,
+    char** argv
+)
+{
+    uint64_t seed = 1;
+    uint64_t runs = 10000;
+    uint64_t run;
+    uint64_t totalSteps = 0;
+    int      verbose = 0;
+    int      i;
+    size_t   g;
+
+    Config.Gate = &Gates[0];
+    Config.ReadWriteActors = 3;
+    Config.IosPerActor = 3;
+    Config.Cycles = 2;
+
+    for (i = 1; i < argc; i++) {
+        const char* value = (i + 1 < argc) ? argv[i + 1] : NULL;
+
+        if (strcmp(argv[i], "-v") == 0) {
+            verbose = 1;
+            continue;
+        }
+
+        if (value == NULL) {
+            break;
+        }
+
+        if (strcmp(argv[i], "-g") == 0) {
+            Config.Gate = NULL;
+            for (g = 0; g < sizeof(Gates) / sizeof(Gates[0]); g++) {
+                if (strcmp(value, Gates[g].Name) == 0) {
+                    Config.Gate = &Gates[g];
+                }
+            }
+            if (Config.Gate == NULL) {
+                break;
+            }
+        }
+        else if (strcmp(argv[i], "-n") == 0) {
+            runs = strtoull(value, NULL, 10);
+        }
+        else if (strcmp(argv[i], "-s") == 0) {
+            seed = strtoull(value, NULL, 10);
+        }
+        else if (strcmp(argv[i], "-p") == 0) {
+            PctDepth = atoi(value);
+        }
+        else if (strcmp(argv[i], "-a") == 0) {
+            Config.ReadWriteActors = atoi(value);
+        }
+        else if (strcmp(argv[i], "-i") == 0) {
+            Config.IosPerActor = atoi(value);
+        }
+        else if (strcmp(argv[i], "-c") == 0) {
+            Config.Cycles = atoi(value);
+        }
+        else {
+            break;
+        }
+        i++;
+    }
+
+    if (i != argc ||
+        Config.ReadWriteActors < 1 || Config.ReadWriteActors > MAX_ACTORS - 3 ||
+        Config.IosPerActor < 1 ||
+        Config.ReadWriteActors * Config.IosPerActor > MAX_IOS ||
+        Config.Cycles < 1 || Config.Cycles > MAX_CYCLES ||
+        PctDepth < 0 || PctDepth > 8) {
+        fprintf(stderr, "usage: gatecheck [-g lockfree|naive] [-n runs] [-s seed] [-p depth]\n"
+            "                 [-a actors] [-i ios] [-c cycles] [-v]\n");
+        return 2;
+    }
+
+    for (run = 0; run < runs; run++) {
+        if (!Run(seed + run)) {
+            printf("FAILED gate %s seed %llu: %s\n", Config.Gate->Name,
+                (unsigned long long)(seed + run), Failure);
+            if (verbose) {
+                PrintSchedule();
+            }
+            else {
+                printf("replay with: gatecheck -g %s -s %llu -n 1 -a %d -i %d -c %d -p %d -v\n",
+                    Config.Gate->Name, (unsigned long long)(seed + run),
+                    Config.ReadWriteActors, Config.IosPerActor, Config.Cycles, PctDepth);
+            }
+            return 1;
+        }
+        totalSteps += Steps;
+    }
+
+    printf("gate %s: %llu runs, %llu steps, no failures\n", Config.Gate->Name,
+        (unsigned long long)runs, (unsigned long long)totalSteps);
+    if (verbose && runs == 1) {
+        PrintSchedule();
+    }
+
+    return 0;
+}
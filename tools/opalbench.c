@@ -0,0 +1,441 @@
+/*++
+
+Module Name:
+
+    opalbench.c
+
+Abstract:
+
+    Times common/sedopal.c building each kind of command the filter
+    sends and parsing each kind of reply it reads, so that a change to
+    the encoder or the parsers can be weighed in packets per second.
+    Pair it with opalfuzz, which checks the same code for memory safety.
+
+    opalbench [-t milliseconds] [-r runs]
+
+    -t      how long each measurement runs, default 200
+    -r      take the best of this many, default 3
+
+Environment:
+
+    User mode, POSIX
+
+--*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "sedopal.h"
+#include "sedunlock.h"
+
+#define BUFFER_SIZE     2048
+#define COMID           4100
+
+static const uint8_t BenchPin[32] = { 0 };
+
+//
+// The packets the parsers are timed on, made once up front
+//
+
+static uint8_t  PropertiesReply[BUFFER_SIZE];
+static uint32_t PropertiesReplyLength;
+static uint8_t  SyncSessionReply[BUFFER_SIZE];
+static uint32_t SyncSessionReplyLength;
+static uint8_t  SetGetReply[BUFFER_SIZE];
+static uint32_t SetGetReplyLength;
+static uint8_t  EndSessionReply[BUFFER_SIZE];
+static uint32_t EndSessionReplyLength;
+static uint8_t  SetCommand[BUFFER_SIZE];
+static uint32_t SetCommandLength;
+static uint8_t  Discovery[BUFFER_SIZE];
+static uint32_t DiscoveryLength;
+
+static SED_OPAL_SET LockSet;
+static SED_OPAL_SET Expected;
+
+static volatile uint32_t Sink;
+
+typedef struct _BENCH_CASE {
+    const char* Name;
+    uint32_t (*Run)(void);          // returns the bytes built or parsed
+} BENCH_CASE;
+
+static uint64_t
+NowNs(
+    void
+)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static int
+MakePackets(
+    void
+)
+
+/*++
+
+Routine Description:
+
+    Replies shaped like a real TPer's: the Properties reply carries the
+    whole property list an Opal 2 drive reports, which is the largest
+    token stream the unlock reads.
+
+--*/
+
+{
+    static const char* tperProperties[] = {
+        "MaxMethods", "MaxSubpackets", "MaxPacketSize", "MaxPackets", "MaxComPacketSize",
+        "MaxResponseComPacketSize", "MaxSessions", "MaxReadSessions", "MaxIndTokenSize",
+        "MaxAggTokenSize", "MaxAuthentications", "MaxTransactionLimit", "DefSessionTimeout",
+        "MaxSessionTimeout", "MinSessionTimeout", "DefTransTimeout", "MaxTransTimeout",
+        "MinTransTimeout", "MaxComIDTime", "ContinuedTokens", "SequenceNumbers", "AckNak",
+        "Asynchronous"
+    };
+    SED_OPAL_ENCODER encoder;
+    uint32_t         i;
+    int              status = SED_OPAL_OK;
+
+    SedOpalBeginPacket(&encoder, PropertiesReply, BUFFER_SIZE, COMID, 0, 0);
+    SedOpalPutControl(&encoder, SED_OPAL_CALL);
+    SedOpalPutBytes(&encoder, SedOpalSessionManager, 8);
+    SedOpalPutBytes(&encoder, SedOpalMethodProperties, 8);
+    SedOpalPutControl(&encoder, SED_OPAL_START_LIST);
+    SedOpalPutControl(&encoder, SED_OPAL_START_LIST);
+    for (i = 0; i < sizeof(tperProperties) / sizeof(tperProperties[0]); i++) {
+        SedOpalPutName(&encoder, tperProperties[i], 65536 - i);
+    }
+    SedOpalPutControl(&encoder, SED_OPAL_END_LIST);
+    SedOpalPutControl(&encoder, SED_OPAL_START_NAME);
+    SedOpalPutUint(&encoder, 0);
+    SedOpalPutControl(&encoder, SED_OPAL_START_LIST);
+    SedOpalPutName(&encoder, "MaxComPacketSize", 2048);
+    SedOpalPutName(&encoder, "MaxPacketSize", 2028);
+    SedOpalPutName(&encoder, "MaxIndTokenSize", 1992);
+    SedOpalPutName(&encoder, "Asynchronous", 1);
+    SedOpalPutControl(&encoder, SED_OPAL_END_LIST);
+    SedOpalPutControl(&encoder, SED_OPAL_END_NAME);
+    SedOpalPutControl(&encoder, SED_OPAL_END_LIST);
+    SedOpalPutStatus(&encoder, SED_OPAL_STATUS_SUCCESS);
+    status |= SedOpalEndPacket(&encoder, &PropertiesReplyLength);
+
+    SedOpalBeginPacket(&encoder, SyncSessionReply, BUFFER_SIZE, COMID, 0, 0);
+    SedOpalPutControl(&encoder, SED_OPAL_CALL);
+    SedOpalPutBytes(&encoder, SedOpalSessionManager, 8);
+    SedOpalPutBytes(&encoder, SedOpalMethodSyncSession, 8);
+    SedOpalPutControl(&encoder, SED_OPAL_START_LIST);
+    SedOpalPutUint(&encoder, 1);
+    SedOpalPutUint(&encoder, 0x1000);
+    SedOpalPutControl(&encoder, SED_OPAL_END_LIST);
+    SedOpalPutStatus(&encoder, SED_OPAL_STATUS_SUCCESS);
+    status |= SedOpalEndPacket(&encoder, &SyncSessionReplyLength);
+
+    SedOpalBeginPacket(&encoder, SetGetReply, BUFFER_SIZE, COMID, 0x1000, 1);
+    SedOpalPutControl(&encoder, SED_OPAL_START_LIST);
+    SedOpalPutControl(&encoder, SED_OPAL_END_LIST);
+    SedOpalPutStatus(&encoder, SED_OPAL_STATUS_SUCCESS);
+    SedOpalPutControl(&encoder, SED_OPAL_START_LIST);
+    SedOpalPutControl(&encoder, SED_OPAL_START_LIST);
+    SedOpalPutColumn(&encoder, SED_OPAL_COLUMN_READ_LOCKED, 0);
+    SedOpalPutColumn(&encoder, SED_OPAL_COLUMN_WRITE_LOCKED, 0);
+    SedOpalPutControl(&encoder, SED_OPAL_END_LIST);
+    SedOpalPutControl(&encoder, SED_OPAL_END_LIST);
+    SedOpalPutStatus(&encoder, SED_OPAL_STATUS_SUCCESS);
+    status |= SedOpalEndPacket(&encoder, &SetGetReplyLength);
+
+    SedOpalBeginPacket(&encoder, EndSessionReply, BUFFER_SIZE, COMID, 0x1000, 1);
+    SedOpalPutControl(&encoder, SED_OPAL_END_OF_SESSION);
+    status |= SedOpalEndPacket(&encoder, &EndSessionReplyLength);
+
+    memset(&LockSet, 0, sizeof(LockSet));
+    memcpy(LockSet.Object, SedUnlockGlobalRange, 8);
+    LockSet.Count = 2;
+    LockSet.Column[0] = SED_OPAL_COLUMN_READ_LOCKED;
+    LockSet.Column[1] = SED_OPAL_COLUMN_WRITE_LOCKED;
+    Expected = LockSet;
+    status |= SedOpalBuildSet(SetCommand, BUFFER_SIZE, COMID, &LockSet, &SetCommandLength);
+
+    //
+    // Discovery with the features an Opal 2 drive lists, Locking last
+    //
+
+    memset(Discovery, 0, sizeof(Discovery));
+    DiscoveryLength = SED_OPAL_DISCOVERY_HEADER;
+    for (i = 0; i < 6; i++) {
+        static const uint16_t codes[] = { 0x0001, 0x0003, 0x0004, 0x0203, 0x0402, 0x0002 };
+
+        Discovery[DiscoveryLength] = (uint8_t)(codes[i] >> 8);
+        Discovery[DiscoveryLength + 1] = (uint8_t)codes[i];
+        Discovery[DiscoveryLength + 3] = 12;
+        if (codes[i] == SED_OPAL_FEATURE_LOCKING) {
+            Discovery[DiscoveryLength + 4] = SED_OPAL_LOCKING_SUPPORTED | SED_OPAL_LOCKING_ENABLED;
+        }
+        DiscoveryLength += 16;
+    }
+    SedOpalPut32(Discovery, DiscoveryLength - 4);
+
+    return status;
+}
+
+static uint32_t
+EncodeProperties(
+    void
+)
+{
+    static uint8_t buffer[BUFFER_SIZE];
+    uint32_t       length = 0;
+
+    SedOpalBuildProperties(buffer, BUFFER_SIZE, COMID, &length);
+    Sink += buffer[SED_OPAL_PAYLOAD_OFFSET];
+    return length;
+}
+
+static uint32_t
+EncodeStartSession(
+    void
+)
+{
+    static uint8_t buffer[BUFFER_SIZE];
+    uint32_t       length = 0;
+
+    SedOpalBuildStartSession(buffer, BUFFER_SIZE, COMID, 1, SedUnlockLockingSp, SedUnlockAdmin1,
+        BenchPin, sizeof(BenchPin), &length);
+    Sink += buffer[SED_OPAL_PAYLOAD_OFFSET];
+    return length;
+}
+
+static uint32_t
+EncodeSet(
+    void
+)
+{
+    static uint8_t buffer[BUFFER_SIZE];
+    uint32_t       length = 0;
+
+    SedOpalBuildSet(buffer, BUFFER_SIZE, COMID, &LockSet, &length);
+    Sink += buffer[SED_OPAL_PAYLOAD_OFFSET];
+    return length;
+}
+
+static uint32_t
+EncodeSetGet(
+    void
+)
+{
+    static uint8_t buffer[BUFFER_SIZE];
+    uint32_t       length = 0;
+
+    SedOpalBuildSet(buffer, BUFFER_SIZE, COMID, &LockSet, &length);
+    SedOpalAppendGet(buffer, BUFFER_SIZE, &LockSet, &length);
+    Sink += buffer[SED_OPAL_PAYLOAD_OFFSET];
+    return length;
+}
+
+static uint32_t
+EncodeEndSession(
+    void
+)
+{
+    static uint8_t buffer[BUFFER_SIZE];
+    uint32_t       length = 0;
+
+    SedOpalBuildEndSession(buffer, BUFFER_SIZE, COMID, &length);
+    Sink += buffer[SED_OPAL_PAYLOAD_OFFSET];
+    return length;
+}
+
+static uint32_t
+DecodeProperties(
+    void
+)
+{
+    SED_OPAL_PROPERTIES properties;
+
+    Sink += SedOpalParseProperties(PropertiesReply, BUFFER_SIZE, &properties);
+    Sink += properties.MaxComPacketSize;
+    return PropertiesReplyLength;
+}
+
+static uint32_t
+DecodePropertiesStatus(
+    void
+)
+{
+    uint8_t methodStatus;
+
+    Sink += SedOpalCheckResponse(PropertiesReply, BUFFER_SIZE, NULL, &methodStatus);
+    return PropertiesReplyLength;
+}
+
+static uint32_t
+DecodePropertiesTokens(
+    void
+)
+{
+    SED_OPAL_READER reader;
+    SED_OPAL_TOKEN  token;
+
+    SedOpalReaderInit(&reader, PropertiesReply, BUFFER_SIZE);
+    while (SedOpalReaderNext(&reader, &token) == SED_OPAL_OK) {
+        Sink += token.Length;
+    }
+    return PropertiesReplyLength;
+}
+
+static uint32_t
+DecodeSyncSession(
+    void
+)
+{
+    uint32_t hsn = 0;
+    uint32_t tsn = 0;
+    uint8_t  methodStatus;
+
+    Sink += SedOpalCheckResponse(SyncSessionReply, BUFFER_SIZE, NULL, &methodStatus);
+    Sink += SedOpalParseSyncSession(SyncSessionReply, BUFFER_SIZE, &hsn, &tsn);
+    Sink += tsn;
+    return SyncSessionReplyLength;
+}
+
+static uint32_t
+DecodeSetGet(
+    void
+)
+{
+    uint8_t methodStatus;
+
+    Sink += SedOpalCheckResponse(SetGetReply, BUFFER_SIZE, &Expected, &methodStatus);
+    return SetGetReplyLength;
+}
+
+static uint32_t
+DecodeEndSession(
+    void
+)
+{
+    Sink += SedOpalFindControl(EndSessionReply, BUFFER_SIZE, SED_OPAL_END_OF_SESSION);
+    return EndSessionReplyLength;
+}
+
+static uint32_t
+DecodeSetCommand(
+    void
+)
+{
+    SED_OPAL_SET set;
+
+    Sink += SedOpalParseSet(SetCommand, BUFFER_SIZE, &set);
+    Sink += set.Count;
+    return SetCommandLength;
+}
+
+static uint32_t
+DecodeDiscovery(
+    void
+)
+{
+    const uint8_t* data;
+    uint32_t       length;
+
+    Sink += SedOpalFindFeature(Discovery, BUFFER_SIZE, SED_OPAL_FEATURE_LOCKING, &data, &length);
+    return DiscoveryLength;
+}
+
+static const BENCH_CASE Cases[] = {
+    { "encode Properties", EncodeProperties },
+    { "encode StartSession", EncodeStartSession },
+    { "encode Set", EncodeSet },
+    { "encode Set + Get", EncodeSetGet },
+    { "encode EndSession", EncodeEndSession },
+    { "decode Properties", DecodeProperties },
+    { "  status only", DecodePropertiesStatus },
+    { "  every token", DecodePropertiesTokens },
+    { "decode SyncSession", DecodeSyncSession },
+    { "decode Set + Get", DecodeSetGet },
+    { "decode EndSession", DecodeEndSession },
+    { "decode Set command", DecodeSetCommand },
+    { "decode Discovery", DecodeDiscovery },
+};
+
+int
+main(
+    int argc,
+    char** argv
+)
+{
+    uint64_t duration = 200;
+    uint32_t runs = 3;
+    uint32_t c;
+    uint32_t r;
+    int      i;
+
+    for (i = 1; i < argc; i++) {
+        if (i + 1 < argc && strcmp(argv[i], "-t") == 0) {
+            duration = strtoul(argv[++i], NULL, 10);
+        }
+        else if (i + 1 < argc && strcmp(argv[i], "-r") == 0) {
+            runs = (uint32_t)strtoul(argv[++i], NULL, 10);
+        }
+        else {
+            fprintf(stderr, "usage: opalbench [-t milliseconds] [-r runs]\n");
+            return 2;
+        }
+    }
+
+    if (duration == 0 || runs == 0) {
+        fprintf(stderr, "usage: opalbench [-t milliseconds] [-r runs]\n");
+        return 2;
+    }
+
+    if (MakePackets() != SED_OPAL_OK) {
+        fprintf(stderr, "opalbench: cannot build the packets\n");
+        return 1;
+    }
+
+    printf("%-22s %8s %10s %12s %10s\n", "", "bytes", "ns/packet", "packets/s", "MB/s");
+
+    for (c = 0; c < sizeof(Cases) / sizeof(Cases[0]); c++) {
+        double   best = 0;
+        uint32_t bytes = 0;
+
+        for (r = 0; r < runs; r++) {
+            uint64_t start = NowNs();
+            uint64_t end = start + duration * 1000000;
+            uint64_t now;
+            uint64_t packets = 0;
+            uint32_t batch;
+            double   ns;
+
+            //
+            // Check the clock every so often only, so it does not weigh
+            // on the tiny cases
+            //
+
+            do {
+                for (batch = 0; batch < 256; batch++) {
+                    bytes = Cases[c].Run();
+                }
+                packets += batch;
+                now = NowNs();
+            } while (now < end);
+
+            ns = (double)(now - start) / (double)packets;
+            if (best == 0 || ns < best) {
+                best = ns;
+            }
+        }
+
+        printf("%-22s %8u %10.1f %12.0f %10.1f\n", Cases[c].Name, bytes, best, 1e9 / best,
+            bytes / best * 1e3);
+    }
+
+    return 0;
+}
@@ -0,0 +1,680 @@
+/*++
+
+Module Name:
+
+    opalfuzz.c
+
+Abstract:
+
+    Fuzz target for the response side of common/sedopal.c, which the
+    filter runs in kernel mode on whatever the drive sends back: the
+    ComPacket reader in both its decoding and its skipping form, the
+    method status and column checks, the Properties, SyncSession and Set
+    parsers, appending a Get, and the Level 0 Discovery feature walk.
+
+    Besides memory safety it checks that every token handed out lies in
+    the input, that skipping and decoding see the same number of tokens,
+    and that neither walk runs on past the data.
+
+    LLVMFuzzerTestOneInput is the libFuzzer entry point; built with
+    -DSED_OPAL_LIBFUZZER and clang -fsanitize=fuzzer it is a libFuzzer
+    target (make opalfuzz-libfuzzer CC=clang). Otherwise a small driver
+    of its own is linked in, so that it also runs under gcc with the
+    address and undefined behaviour sanitizers:
+
+    opalfuzz [-n iterations] [-s seed] [file...]
+
+    -n      inputs to try, default 1000000
+    -s      seed for the mutations, default 1
+
+    With files (a libFuzzer corpus or crash inputs), each is run once.
+    Otherwise valid requests, responses and Discovery data made with the
+    encoder are mutated. An input that fails is written to
+    opalfuzz-crash.bin.
+
+Environment:
+
+    User mode, any platform with a C99 compiler
+
+--*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sedopal.h"
+#include "sedunlock.h"
+
+#define FUZZ_MAX_INPUT      4096
+
+static void
+Fail(
+    const char* What
+);
+
+static void
+CheckView(
+    const uint8_t* Data,
+    uint32_t Length,
+    const uint8_t* View,
+    uint32_t ViewLength
+)
+{
+    //
+    // Tiny atoms have their value in the token byte and no view
+    //
+
+    if (View == NULL && ViewLength == 0) {
+        return;
+    }
+
+    if (View < Data || View > Data + Length || ViewLength > (uint32_t)(Data + Length - View)) {
+        Fail("view outside the input");
+    }
+}
+
+static void
+FuzzReader(
+    const uint8_t* Data,
+    uint32_t Length
+)
+
+/*++
+
+Routine Description:
+
+    Walk the token stream twice, decoding and skipping. Every token takes
+    at least a byte, so a walk that hands out more tokens than there are
+    bytes has gone round in circles.
+
+--*/
+
+{
+    SED_OPAL_READER reader;
+    SED_OPAL_TOKEN  token;
+    uint32_t decoded = 0;
+    uint32_t skipped = 0;
+    uint8_t  control;
+    int      decodeStatus;
+    int      skipStatus;
+
+    if (SedOpalReaderInit(&reader, Data, Length) != SED_OPAL_OK) {
+        return;
+    }
+
+    while ((decodeStatus = SedOpalReaderNext(&reader, &token)) == SED_OPAL_OK) {
+        if (token.Kind != SedOpalTokenControl) {
+            CheckView(Data, Length, token.Bytes, token.Length);
+        }
+        if (++decoded > Length) {
+            Fail("decoding does not end");
+        }
+    }
+
+    SedOpalReaderInit(&reader, Data, Length);
+
+    while ((skipStatus = SedOpalReaderSkip(&reader, &control)) == SED_OPAL_OK) {
+        if (++skipped > Length) {
+            Fail("skipping does not end");
+        }
+    }
+
+    //
+    // Skipping does not look at atom values, so it takes uintegers too
+    // long to decode; past those the two must agree
+    //
+
+    if (decodeStatus == SED_OPAL_END && (skipStatus != SED_OPAL_END || skipped != decoded)) {
+        Fail("skipping and decoding disagree");
+    }
+}
+
+static void
+FuzzParsers(
+    const uint8_t* Data,
+    uint32_t Length
+)
+{
+    SED_OPAL_PROPERTIES properties;
+    SED_OPAL_SET        set;
+    SED_OPAL_SET        expected;
+    const uint8_t*      feature;
+    uint32_t            featureLength;
+    uint32_t            results;
+    uint32_t            hsn;
+    uint32_t            tsn;
+    uint8_t             methodStatus;
+    uint8_t*            copy;
+    uint32_t            size;
+    uint32_t            newLength;
+
+    SedOpalMethodStatus(Data, Length, &methodStatus, &results);
+    SedOpalCheckResponse(Data, Length, NULL, &methodStatus);
+
+    memset(&expected, 0, sizeof(expected));
+    expected.Count = 3;
+    expected.Column[0] = SED_OPAL_COLUMN_READ_LOCKED;
+    expected.Column[1] = SED_OPAL_COLUMN_WRITE_LOCKED;
+    expected.Column[2] = SED_OPAL_COLUMN_DONE;
+    expected.Value[2] = 1;
+    SedOpalCheckResponse(Data, Length, &expected, &methodStatus);
+
+    SedOpalParseProperties(Data, Length, &properties);
+    SedOpalParseSyncSession(Data, Length, &hsn, &tsn);
+    SedOpalFindControl(Data, Length, SED_OPAL_END_OF_SESSION);
+
+    if (SedOpalFindFeature(Data, Length, SED_OPAL_FEATURE_LOCKING, &feature, &featureLength) == SED_OPAL_OK) {
+        CheckView(Data, Length, feature, featureLength);
+    }
+
+    //
+    // Appending a Get writes, so it works on a copy with a little room
+    // to grow, sized exactly so that overruns are caught
+    //
+
+    if (SedOpalParseSet(Data, Length, &set) == SED_OPAL_OK) {
+        size = Length + 64;
+        copy = malloc(size);
+        if (copy == NULL) {
+            return;
+        }
+        memcpy(copy, Data, Length);
+        if (SedOpalAppendGet(copy, size, &set, &newLength) == SED_OPAL_OK && newLength > size) {
+            Fail("appended Get overruns the buffer");
+        }
+        free(copy);
+    }
+}
+
+int
+LLVMFuzzerTestOneInput(
+    const uint8_t* Data,
+    size_t Size
+);
+
+int
+LLVMFuzzerTestOneInput(
+    const uint8_t* Data,
+    size_t Size
+)
+{
+    uint32_t length = (Size > FUZZ_MAX_INPUT) ? FUZZ_MAX_INPUT : (uint32_t)Size;
+
+    FuzzReader(Data, length);
+    FuzzParsers(Data, length);
+    return 0;
+}
+
+#ifdef SED_OPAL_LIBFUZZER
+
+static void
+Fail(
+    const char* What
+)
+{
+    fprintf(stderr, "opalfuzz: %s\n", What);
+    abort();
+}
+
+#else
+
+#if defined(__SANITIZE_ADDRESS__)
+#include <sanitizer/common_interface_defs.h>
+#define FUZZ_DEATH_CALLBACK     1
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#include <sanitizer/common_interface_defs.h>
+#define FUZZ_DEATH_CALLBACK     1
+#endif
+#endif
+
+#define FUZZ_MAX_SEEDS      16
+#define FUZZ_CRASH_FILE     "opalfuzz-crash.bin"
+
+typedef struct _FUZZ_SEED {
+    uint8_t Data[FUZZ_MAX_INPUT];
+    uint32_t Length;
+} FUZZ_SEED;
+
+
+static const uint8_t FuzzInteresting[] = {
+    0x00, 0x01, 0x3F, 0x40, 0x7F, 0x80, 0x8F, 0xA0, 0xAF, 0xBF, 0xC0, 0xD7, 0xDF,
+    0xE0, 0xE3, 0xE4, 0xF0, 0xF1, 0xF2, 0xF3, 0xF8, 0xF9, 0xFA, 0xFF
+};
+
+static const uint32_t FuzzFields[] = {
+    SED_OPAL_COMPACKET_LENGTH, SED_OPAL_PACKET_LENGTH, SED_OPAL_SUBPACKET_LENGTH, 0
+};
+
+static FUZZ_SEED Seeds[FUZZ_MAX_SEEDS];
+static uint32_t  SeedCount;
+static uint8_t*  Current;
+static uint32_t  CurrentLength;
+static uint64_t  State;
+
+static void
+SaveCurrent(
+    void
+)
+{
+    FILE* file = fopen(FUZZ_CRASH_FILE, "wb");
+
+    if (file != NULL) {
+        fwrite(Current, 1, CurrentLength, file);
+        fclose(file);
+        fprintf(stderr, "opalfuzz: input written to %s\n", FUZZ_CRASH_FILE);
+    }
+}
+
+static void
+Fail(
+    const char* What
+)
+{
+    fprintf(stderr, "opalfuzz: %s\n", What);
+    SaveCurrent();
+    abort();
+}
+
+static uint32_t
+Random(
+    uint32_t Below
+)
+{
+    State ^= State << 13;
+    State ^= State >> 7;
+    State ^= State << 17;
+    return (uint32_t)((State >> 11) % Below);
+}
+
+static FUZZ_SEED*
+AddSeed(
+    void
+)
+{
+    return (SeedCount < FUZZ_MAX_SEEDS) ? &Seeds[SeedCount++] : NULL;
+}
+
+static void
+EndSeed(
+    FUZZ_SEED* Seed,
+    SED_OPAL_ENCODER* Encoder
+)
+{
+    if (SedOpalEndPacket(Encoder, &Seed->Length) != SED_OPAL_OK) {
+        SeedCount--;
+    }
+}
+
+static void
+MakeSeeds(
+    void
+)
+
+/*++
+
+Routine Description:
+
+    One of everything the filter sends or gets back, so that mutations
+    start from inputs that get past the headers.
+
+--*/
+
+{
+    SED_OPAL_ENCODER encoder;
+    SED_OPAL_SET     set;
+    FUZZ_SEED*       seed;
+    uint32_t         at;
+
+    seed = AddSeed();
+    SedOpalBuildProperties(seed->Data, FUZZ_MAX_INPUT, 4100, &seed->Length);
+
+    seed = AddSeed();
+    SedOpalBeginPacket(&encoder, seed->Data, FUZZ_MAX_INPUT, 4100, 0, 0);
+    SedOpalPutControl(&encoder, SED_OPAL_CALL);
+    SedOpalPutBytes(&encoder, SedOpalSessionManager, 8);
+    SedOpalPutBytes(&encoder, SedOpalMethodProperties, 8);
+    SedOpalPutControl(&encoder, SED_OPAL_START_LIST);
+    SedOpalPutControl(&encoder, SED_OPAL_START_LIST);
+    SedOpalPutName(&encoder, "MaxComPacketSize", 65536);
+    SedOpalPutName(&encoder, "MaxResponseComPacketSize", 65536);
+    SedOpalPutName(&encoder, "MaxPacketSize", 65516);
+    SedOpalPutName(&encoder, "MaxIndTokenSize", 65480);
+    SedOpalPutName(&encoder, "MaxPackets", 1);
+    SedOpalPutName(&encoder, "MaxSubpackets", 1);
+    SedOpalPutName(&encoder, "MaxMethods", 1);
+    SedOpalPutName(&encoder, "Asynchronous", 1);
+    SedOpalPutControl(&encoder, SED_OPAL_END_LIST);
+    SedOpalPutControl(&encoder, SED_OPAL_START_NAME);
+    SedOpalPutUint(&encoder, 0);
+    SedOpalPutControl(&encoder, SED_OPAL_START_LIST);
+    SedOpalPutName(&encoder, "Asynchronous", 1);
+    SedOpalPutControl(&encoder, SED_OPAL_END_LIST);
+    SedOpalPutControl(&encoder, SED_OPAL_END_NAME);
+    SedOpalPutControl(&encoder, SED_OPAL_END_LIST);
+    SedOpalPutStatus(&encoder, SED_OPAL_STATUS_SUCCESS);
+    EndSeed(seed, &encoder);
+
+    seed = AddSeed();
+    SedOpalBuildStartSession(seed->Data, FUZZ_MAX_INPUT, 4100, 1, SedUnlockLockingSp, SedUnlockAdmin1,
+        (const uint8_t*)"password", 8, &seed->Length);
+
+    seed = AddSeed();
+    SedOpalBeginPacket(&encoder, seed->Data, FUZZ_MAX_INPUT, 4100, 0, 0);
+    SedOpalPutControl(&encoder, SED_OPAL_CALL);
+    SedOpalPutBytes(&encoder, SedOpalSessionManager, 8);
+    SedOpalPutBytes(&encoder, SedOpalMethodSyncSession, 8);
+    SedOpalPutControl(&encoder, SED_OPAL_START_LIST);
+    SedOpalPutUint(&encoder, 1);
+    SedOpalPutUint(&encoder, 0x1000);
+    SedOpalPutControl(&encoder, SED_OPAL_END_LIST);
+    SedOpalPutStatus(&encoder, SED_OPAL_STATUS_SUCCESS);
+    EndSeed(seed, &encoder);
+
+    memset(&set, 0, sizeof(set));
+    memcpy(set.Object, SedUnlockGlobalRange, 8);
+    set.Count = 2;
+    set.Column[0] = SED_OPAL_COLUMN_READ_LOCKED;
+    set.Column[1] = SED_OPAL_COLUMN_WRITE_LOCKED;
+
+    seed = AddSeed();
+    SedOpalBuildSet(seed->Data, FUZZ_MAX_INPUT, 4100, &set, &seed->Length);
+    if (SedOpalAppendGet(seed->Data, FUZZ_MAX_INPUT, &set, &seed->Length) != SED_OPAL_OK) {
+        SeedCount--;
+    }
+
+    //
+    // Replies to Set with a Get appended, to a refused Set, and to
+    // EndSession
+    //
+
+    seed = AddSeed();
+    SedOpalBeginPacket(&encoder, seed->Data, FUZZ_MAX_INPUT, 4100, 0x1000, 1);
+    SedOpalPutControl(&encoder, SED_OPAL_START_LIST);
+    SedOpalPutControl(&encoder, SED_OPAL_END_LIST);
+    SedOpalPutStatus(&encoder, SED_OPAL_STATUS_SUCCESS);
+    SedOpalPutControl(&encoder, SED_OPAL_START_LIST);
+    SedOpalPutControl(&encoder, SED_OPAL_START_LIST);
+    SedOpalPutColumn(&encoder, SED_OPAL_COLUMN_READ_LOCKED, 0);
+    SedOpalPutColumn(&encoder, SED_OPAL_COLUMN_WRITE_LOCKED, 0);
+    SedOpalPutControl(&encoder, SED_OPAL_END_LIST);
+    SedOpalPutControl(&encoder, SED_OPAL_END_LIST);
+    SedOpalPutStatus(&encoder, SED_OPAL_STATUS_SUCCESS);
+    EndSeed(seed, &encoder);
+
+    seed = AddSeed();
+    SedOpalBeginPacket(&encoder, seed->Data, FUZZ_MAX_INPUT, 4100, 0x1000, 1);
+    SedOpalPutControl(&encoder, SED_OPAL_START_LIST);
+    SedOpalPutControl(&encoder, SED_OPAL_END_LIST);
+    SedOpalPutStatus(&encoder, SED_OPAL_STATUS_NOT_AUTHORIZED);
+    EndSeed(seed, &encoder);
+
+    seed = AddSeed();
+    SedOpalBeginPacket(&encoder, seed->Data, FUZZ_MAX_INPUT, 4100, 0x1000, 1);
+    SedOpalPutControl(&encoder, SED_OPAL_END_OF_SESSION);
+    EndSeed(seed, &encoder);
+
+    //
+    // Two Packets, the first with a credit control SubPacket after its
+    // data
+    //
+
+    seed = AddSeed();
+    memset(seed->Data, 0, FUZZ_MAX_INPUT);
+    at = SED_OPAL_COMPACKET_HEADER + SED_OPAL_PACKET_HEADER;
+    seed->Data[at + 11] = 6;
+    memcpy(seed->Data + at + SED_OPAL_SUBPACKET_HEADER, "\xF9\xF0\x00\x00\x00\xF1", 6);
+    at += SED_OPAL_SUBPACKET_HEADER + 8;
+    seed->Data[at + 6] = 0x80;
+    seed->Data[at + 11] = 4;
+    at += SED_OPAL_SUBPACKET_HEADER + 4;
+    SedOpalPut32(seed->Data + SED_OPAL_PACKET_LENGTH, at - SED_OPAL_COMPACKET_HEADER - SED_OPAL_PACKET_HEADER);
+    SedOpalPut32(seed->Data + at + SED_OPAL_PACKET_LENGTH_FIELD, SED_OPAL_SUBPACKET_HEADER + 8);
+    at += SED_OPAL_PACKET_HEADER;
+    seed->Data[at + 11] = 6;
+    memcpy(seed->Data + at + SED_OPAL_SUBPACKET_HEADER, "\xF9\xF0\x00\x00\x00\xF1", 6);
+    at += SED_OPAL_SUBPACKET_HEADER + 8;
+    SedOpalPut32(seed->Data + SED_OPAL_COMPACKET_LENGTH, at - SED_OPAL_COMPACKET_HEADER);
+    seed->Length = at;
+
+    //
+    // Level 0 Discovery: the header, then the TPer and Locking features
+    //
+
+    seed = AddSeed();
+    memset(seed->Data, 0, FUZZ_MAX_INPUT);
+    at = SED_OPAL_DISCOVERY_HEADER;
+    seed->Data[at + 1] = 0x01;
+    seed->Data[at + 3] = 12;
+    seed->Data[at + 4] = 0x11;
+    at += 16;
+    seed->Data[at + 1] = 0x02;
+    seed->Data[at + 3] = 12;
+    seed->Data[at + 4] = SED_OPAL_LOCKING_SUPPORTED | SED_OPAL_LOCKING_ENABLED | SED_OPAL_LOCKING_LOCKED;
+    at += 16;
+    SedOpalPut32(seed->Data, at - 4);
+    seed->Length = at;
+}
+
+static uint32_t
+Mutate(
+    uint8_t* Data,
+    uint32_t Length
+)
+{
+    uint32_t count = 1 + Random(8);
+    uint32_t at;
+    uint32_t size;
+    uint32_t value;
+
+    while (count-- != 0) {
+        switch (Random(7)) {
+        case 0:
+            if (Length != 0) {
+                Data[Random(Length)] ^= (uint8_t)(1u << Random(8));
+            }
+            break;
+
+        case 1:
+            if (Length != 0) {
+                Data[Random(Length)] = FuzzInteresting[Random(sizeof(FuzzInteresting))];
+            }
+            break;
+
+        case 2:
+            if (Length != 0) {
+                Data[Random(Length)] = (uint8_t)Random(256);
+            }
+            break;
+
+        case 3:
+            //
+            // A length field, in a header or anywhere
+            //
+
+            at = FuzzFields[Random(sizeof(FuzzFields) / sizeof(FuzzFields[0]))];
+            if (at == 0 && Length >= 4) {
+                at = Random(Length - 3);
+            }
+            if (at + 4 > Length) {
+                break;
+            }
+            switch (Random(4)) {
+            case 0:
+                value = 0xFFFFFFFF - Random(64);
+                break;
+            case 1:
+                value = Length - Random(64);
+                break;
+            case 2:
+                value = SedOpalGet32(Data + at) + Random(9) - 4;
+                break;
+            default:
+                value = Random(2 * FUZZ_MAX_INPUT);
+                break;
+            }
+            SedOpalPut32(Data + at, value);
+            break;
+
+        case 4:
+            if (Length != 0) {
+                Length = Random(Length);
+            }
+            break;
+
+        case 5:
+            //
+            // Repeat a stretch of the input further on
+            //
+
+            if (Length < 2) {
+                break;
+            }
+            at = Random(Length);
+            size = 1 + Random(Length - at);
+            if (size > FUZZ_MAX_INPUT - Length) {
+                size = FUZZ_MAX_INPUT - Length;
+            }
+            memmove(Data + at + size, Data + at, Length - at);
+            Length += size;
+            break;
+
+        default:
+            if (Length < FUZZ_MAX_INPUT) {
+                at = Random(Length + 1);
+                memmove(Data + at + 1, Data + at, Length - at);
+                Data[at] = FuzzInteresting[Random(sizeof(FuzzInteresting))];
+                Length++;
+            }
+            break;
+        }
+    }
+
+    return Length;
+}
+
+static void
+RunOne(
+    const uint8_t* Data,
+    uint32_t Length
+)
+{
+    //
+    // An exactly sized heap copy, so that reading a byte past the end is
+    // caught by the address sanitizer
+    //
+
+    Current = malloc(Length != 0 ? Length : 1);
+    if (Current == NULL) {
+        fprintf(stderr, "opalfuzz: out of memory\n");
+        exit(1);
+    }
+    memcpy(Current, Data, Length);
+    CurrentLength = Length;
+
+    LLVMFuzzerTestOneInput(Current, Length);
+
+    free(Current);
+    Current = NULL;
+}
+
+static int
+RunFile(
+    const char* Name
+)
+{
+    static uint8_t data[FUZZ_MAX_INPUT];
+    FILE*  file = fopen(Name, "rb");
+    size_t length;
+
+    if (file == NULL) {
+        fprintf(stderr, "opalfuzz: cannot open %s\n", Name);
+        return 0;
+    }
+
+    length = fread(data, 1, sizeof(data), file);
+    fclose(file);
+
+    RunOne(data, (uint32_t)length);
+    printf("%s: %u bytes ok\n", Name, (uint32_t)length);
+    return 1;
+}
+
+int
+main(
+    int argc,
+    char** argv
+)
+{
+    static uint8_t input[FUZZ_MAX_INPUT];
+    unsigned long  iterations = 1000000;
+    unsigned long  seed = 1;
+    unsigned long  n;
+    uint32_t       length;
+    uint32_t       i;
+    int            a;
+
+#ifdef FUZZ_DEATH_CALLBACK
+    __sanitizer_set_death_callback(SaveCurrent);
+#endif
+
+    for (a = 1; a < argc && argv[a][0] == '-'; a++) {
+        if (a + 1 == argc || argv[a][1] == 0 || argv[a][2] != 0) {
+            fprintf(stderr, "usage: opalfuzz [-n iterations] [-s seed] [file...]\n");
+            return 2;
+        }
+
+        switch (argv[a][1]) {
+        case 'n':
+            iterations = strtoul(argv[++a], NULL, 10);
+            break;
+
+        case 's':
+            seed = strtoul(argv[++a], NULL, 10);
+            break;
+
+        default:
+            fprintf(stderr, "usage: opalfuzz [-n iterations] [-s seed] [file...]\n");
+            return 2;
+        }
+    }
+
+    if (a < argc) {
+        for (; a < argc; a++) {
+            if (!RunFile(argv[a])) {
+                return 1;
+            }
+        }
+        return 0;
+    }
+
+    MakeSeeds();
+
+    //
+    // The seeds themselves first, then mutations of them
+    //
+
+    for (i = 0; i < SeedCount; i++) {
+        RunOne(Seeds[i].Data, Seeds[i].Length);
+    }
+
+    State = 0x9E3779B97F4A7C15ull ^ seed;
+    for (n = 0; n < iterations; n++) {
+        FUZZ_SEED* from = &Seeds[Random(SeedCount)];
+
+        memcpy(input, from->Data, from->Length);
+        length = Mutate(input, from->Length);
+        RunOne(input, length);
+
+        if ((n + 1) % 100000 == 0) {
+            printf("%lu inputs\n", n + 1);
+            fflush(stdout);
+        }
+    }
+
+    printf("%lu inputs from %u seeds, seed %lu, no failures\n", iterations, SeedCount, seed);
+    return 0;
+}
+
+#endif // SED_OPAL_LIBFUZZER
@@ -0,0 +1,219 @@
+/*++
+
+Module Name:
+
+    pbkdf2bench.c
+
+Abstract:
+
+    Checks and times the PBKDF2 kernels in common/sedpbkdf2.c. Every
+    implementation this machine has is self tested first (RFC 6070 and the
+    SHA-256/SHA-512 vectors), then each one derives sedutil shaped keys (32
+    bytes, 20 byte serial number as salt) for 1, 2, 4 ... drives at once,
+    checked against the scalar result.
+
+    pbkdf2bench [-i iterations] [-d drives] [-h sha1|sha256|sha512] [-r runs]
+
+    -i      iterations, default 75000 as sedutil uses
+    -d      most drives derived together, default 16
+    -h      only this hash, default all three
+    -r      take the best of this many runs, default 3
+
+Environment:
+
+    User mode, POSIX
+
+--*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "sedpbkdf2.h"
+
+#define MAX_DRIVES  64
+
+static const struct {
+    const char* Name;
+    uint32_t Features;
+} Kernels[] = {
+    { "scalar", 0 },
+    { "sha-ni", SED_PBKDF2_FEATURE_SHANI },
+    { "avx2", SED_PBKDF2_FEATURE_AVX2 },
+};
+
+static const struct {
+    const char* Name;
+    SED_HASH Hash;
+} Hashes[] = {
+    { "sha1", SedHashSha1 },
+    { "sha256", SedHashSha256 },
+    { "sha512", SedHashSha512 },
+};
+
+static uint64_t
+NowNs(
+    void
+)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void
+MakeJobs(
+    SED_PBKDF2_JOB* Jobs,
+    uint32_t Drives,
+    SED_HASH Hash,
+    uint32_t Iterations,
+    char (*Passwords)[16],
+    char (*Serials)[SED_PBKDF2_SEDUTIL_SALT + 1],
+    uint8_t (*Keys)[SED_PBKDF2_SEDUTIL_KEY]
+)
+{
+    uint32_t i;
+
+    for (i = 0; i < Drives; i++) {
+        snprintf(Passwords[i], sizeof(Passwords[i]), "password%u", i);
+        snprintf(Serials[i], sizeof(Serials[i]), "%20u", 1000000 + i);
+
+        Jobs[i].Hash = Hash;
+        Jobs[i].Password = (const uint8_t*)Passwords[i];
+        Jobs[i].PasswordLength = (uint32_t)strlen(Passwords[i]);
+        Jobs[i].Salt = (const uint8_t*)Serials[i];
+        Jobs[i].SaltLength = SED_PBKDF2_SEDUTIL_SALT;
+        Jobs[i].Iterations = Iterations;
+        Jobs[i].Key = Keys[i];
+        Jobs[i].KeyLength = SED_PBKDF2_SEDUTIL_KEY;
+    }
+}
+
+int
+main(
+    int argc,
+    char** argv
+)
+{
+    static char           passwords[MAX_DRIVES][16];
+    static char           serials[MAX_DRIVES][SED_PBKDF2_SEDUTIL_SALT + 1];
+    static uint8_t        reference[MAX_DRIVES][SED_PBKDF2_SEDUTIL_KEY];
+    static uint8_t        keys[MAX_DRIVES][SED_PBKDF2_SEDUTIL_KEY];
+    static SED_PBKDF2_JOB jobs[MAX_DRIVES];
+    uint32_t              iterations = SED_PBKDF2_SEDUTIL_ITERATIONS;
+    uint32_t              maxDrives = 16;
+    uint32_t              runs = 3;
+    int                   onlyHash = -1;
+    uint32_t              available = SedPbkdf2Features();
+    uint32_t              drives;
+    uint32_t              k;
+    uint32_t              h;
+    uint32_t              r;
+    int                   failures = 0;
+    int                   i;
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-i") == 0 && i + 1 < argc) {
+            iterations = (uint32_t)strtoul(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc) {
+            maxDrives = (uint32_t)strtoul(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+            runs = (uint32_t)strtoul(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "-h") == 0 && i + 1 < argc) {
+            i++;
+            for (h = 0; h < sizeof(Hashes) / sizeof(Hashes[0]); h++) {
+                if (strcmp(argv[i], Hashes[h].Name) == 0) {
+                    onlyHash = (int)h;
+                }
+            }
+            if (onlyHash < 0) {
+                break;
+            }
+        }
+        else {
+            break;
+        }
+    }
+
+    if (i != argc || iterations == 0 || maxDrives == 0 || maxDrives > MAX_DRIVES || runs == 0) {
+        fprintf(stderr, "usage: pbkdf2bench [-i iterations] [-d drives] [-h sha1|sha256|sha512] [-r runs]\n");
+        return 2;
+    }
+
+    for (k = 0; k < sizeof(Kernels) / sizeof(Kernels[0]); k++) {
+        if ((Kernels[k].Features & available) != Kernels[k].Features) {
+            printf("%-7s not supported here\n", Kernels[k].Name);
+            continue;
+        }
+
+        if (SedPbkdf2SelfTest(Kernels[k].Features) != SED_PBKDF2_OK) {
+            printf("%-7s self test FAILED\n", Kernels[k].Name);
+            failures++;
+        }
+        else {
+            printf("%-7s self test passed\n", Kernels[k].Name);
+        }
+    }
+
+    printf("\n%u iterations, %u byte keys, best of %u\n", iterations, SED_PBKDF2_SEDUTIL_KEY, runs);
+    printf("hash    kernel   drives     total ms  ms per drive\n");
+
+    for (h = 0; h < sizeof(Hashes) / sizeof(Hashes[0]); h++) {
+        if (onlyHash >= 0 && (uint32_t)onlyHash != h) {
+            continue;
+        }
+
+        for (drives = 1; drives <= maxDrives; drives *= 2) {
+            MakeJobs(jobs, drives, Hashes[h].Hash, iterations, passwords, serials, reference);
+            SedPbkdf2(jobs, drives, 0);
+
+            for (k = 0; k < sizeof(Kernels) / sizeof(Kernels[0]); k++) {
+                uint64_t best = ~0ull;
+
+                if ((Kernels[k].Features & available) != Kernels[k].Features ||
+                    (Kernels[k].Features != 0 && Hashes[h].Hash == SedHashSha512)) {
+                    continue;
+                }
+
+                MakeJobs(jobs, drives, Hashes[h].Hash, iterations, passwords, serials, keys);
+
+                for (r = 0; r < runs; r++) {
+                    uint64_t start = NowNs();
+                    uint64_t took;
+
+                    memset(keys, 0, sizeof(keys));
+                    SedPbkdf2(jobs, drives, Kernels[k].Features);
+                    took = NowNs() - start;
+                    best = (took < best) ? took : best;
+                }
+
+                if (memcmp(keys, reference, drives * sizeof(keys[0])) != 0) {
+                    printf("%-7s %-7s %6u  keys differ from scalar\n",
+                        Hashes[h].Name, Kernels[k].Name, drives);
+                    failures++;
+                    continue;
+                }
+
+                printf("%-7s %-7s %6u %12.2f %13.2f\n",
+                    Hashes[h].Name, Kernels[k].Name, drives, best / 1e6, best / 1e6 / drives);
+            }
+
+            if (drives == maxDrives) {
+                break;
+            }
+            if (drives * 2 > maxDrives) {
+                drives = maxDrives / 2;
+            }
+        }
+    }
+
+    return failures != 0 ? 1 : 0;
+}
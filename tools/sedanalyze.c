@@ -0,0 +1,1039 @@
+/*++
+
+Module Name:
+
+    sedanalyze.c
+
+Abstract:
+
+    Offline analyzer for SEDSleep trace files (see common/sedtrace.h).
+
+    sedanalyze [-c base new] [-t percent] file ...
+
+    Every file is streamed one record at a time, so any number of traces
+    can be crunched in constant memory per drive. For every drive and
+    driver build it reports the distribution of each resume phase (offset
+    from the S0 IRP arriving), a waterfall of the median resume, how long
+    the gate stayed closed after each kind of power transition (S3, hybrid
+    sleep, hibernation, fast startup) and the IO latency distributions. With -c it instead compares two driver builds
+    drive by drive and flags phases whose median or p90 got more than
+    percent (default 10) slower. "-" reads from stdin.
+
+Environment:
+
+    User mode, any platform with a C99 compiler
+
+--*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sedtrace.h"
+
+//
+// Resume phases, as offsets from the wake event
+//
+
+enum {
+    PhaseWakeDone,
+    PhaseDeviceD0,
+    PhaseUnlockStart,
+    PhaseCommandFirst,
+    PhaseCommandLast = PhaseCommandFirst + 15,
+    PhaseUnlockDone,
+    PhaseGateOpen,
+    PhaseGateFail,
+    PhaseFirstIo,
+    PhaseCount
+};
+
+static const char*
+PhaseName(
+    int Phase
+)
+{
+    static char name[16];
+
+    switch (Phase) {
+    case PhaseWakeDone:     return "s0-irp";
+    case PhaseDeviceD0:     return "device-d0";
+    case PhaseUnlockStart:  return "unlock-start";
+    case PhaseUnlockDone:   return "unlock-done";
+    case PhaseGateOpen:     return "gate-open";
+    case PhaseGateFail:     return "gate-fail";
+    case PhaseFirstIo:      return "first-io";
+    }
+
+    snprintf(name, sizeof(name), "command-%d", Phase - PhaseCommandFirst + 1);
+    return name;
+}
+
+static const char*
+TransitionName(
+    int Transition
+)
+{
+    switch (Transition) {
+    case SedTraceTransitionSleep:         return "sleep";
+    case SedTraceTransitionHybridSleep:   return "hybrid-sleep";
+    case SedTraceTransitionHibernate:     return "hibernate";
+    case SedTraceTransitionFastStartup:   return "fast-startup";
+    }
+
+    return "unknown";
+}
+
+//
+// Phase offsets are kept at a finer resolution than the driver's latency
+// buckets (8 steps per power of two rather than 4), so a 10% regression
+// in a phase is visible. Counts are per resume, so 32 bits is plenty.
+//
+
+#define PHASE_SUB_BITS      3
+#define PHASE_SUB_BUCKETS   (1u << PHASE_SUB_BITS)
+#define PHASE_BUCKETS       (PHASE_SUB_BUCKETS * 36)
+
+static uint32_t
+PhaseBucket(
+    uint64_t Microseconds
+)
+{
+    uint32_t msb = 0;
+    uint64_t v = Microseconds;
+    uint32_t bucket;
+
+    if (Microseconds < PHASE_SUB_BUCKETS) {
+        return (uint32_t)Microseconds;
+    }
+
+    while (v >>= 1) {
+        msb++;
+    }
+
+    bucket = (msb - PHASE_SUB_BITS + 1) * PHASE_SUB_BUCKETS +
+        (uint32_t)((Microseconds >> (msb - PHASE_SUB_BITS)) & (PHASE_SUB_BUCKETS - 1));
+
+    return bucket < PHASE_BUCKETS ? bucket : PHASE_BUCKETS - 1;
+}
+
+static uint64_t
+PhaseBucketFloor(
+    uint32_t Bucket
+)
+{
+    if (Bucket < PHASE_SUB_BUCKETS) {
+        return Bucket;
+    }
+
+    return (uint64_t)(PHASE_SUB_BUCKETS + (Bucket & (PHASE_SUB_BUCKETS - 1))) <<
+        ((Bucket >> PHASE_SUB_BITS) - 1);
+}
+
+typedef struct _HISTOGRAM {
+    uint64_t Count;
+    uint64_t Max;
+    uint32_t Buckets[PHASE_BUCKETS];
+} HISTOGRAM;
+
+typedef struct _LATENCY_HISTOGRAM {
+    uint64_t Count;
+    uint64_t Max;
+    uint64_t Buckets[SEDTRACE_LATENCY_BUCKETS];
+} LATENCY_HISTOGRAM;
+
+//
+// Everything known about one drive running one driver build. The serial
+// "*" collects all drives running a build.
+//
+
+typedef struct _AGGREGATE {
+    char      SerialNumber[SEDTRACE_SERIAL_LENGTH + 1];
+    char      DriverBuild[SEDTRACE_BUILD_LENGTH + 1];
+    char      Model[SEDTRACE_MODEL_LENGTH + 1];
+    uint64_t  Resumes;
+    uint64_t  Failures;
+    HISTOGRAM Phase[PhaseCount];
+    LATENCY_HISTOGRAM Latency[2];
+
+    //
+    // Offset of the gate opening, by the kind of transition resumed from
+    //
+
+    HISTOGRAM Ready[SedTraceTransitionCount];
+
+    //
+    // Throughput from counter deltas
+    //
+
+    uint64_t  BytesRead;
+    uint64_t  BytesWritten;
+    uint64_t  Reads;
+    uint64_t  Writes;
+
+    //
+    // Resume in progress and previous cumulative snapshots, only used for
+    // per-drive aggregates
+    //
+
+    int       Open;
+    int       Transition;
+    uint64_t  WakeTimestamp;
+    int       NextCommand;
+    uint64_t  Offset[PhaseCount];
+    uint32_t  Seen[PhaseCount];
+    int       Failed;
+    int       HaveCounters;
+    SEDTRACE_COUNTERS LastCounters;
+    int       HaveLatency[2];
+    uint32_t  LastLatency[2][SEDTRACE_LATENCY_BUCKETS];
+} AGGREGATE;
+
+static AGGREGATE** Table;
+static size_t TableSize;
+static size_t TableUsed;
+
+static uint64_t
+HashKey(
+    const char* Serial,
+    const char* Build
+)
+{
+    uint64_t hash = 1469598103934665603ull;
+
+    for (; *Serial; Serial++) {
+        hash = (hash ^ (uint8_t)*Serial) * 1099511628211ull;
+    }
+    hash = (hash ^ 0xff) * 1099511628211ull;
+    for (; *Build; Build++) {
+        hash = (hash ^ (uint8_t)*Build) * 1099511628211ull;
+    }
+
+    return hash;
+}
+
+static AGGREGATE*
+Lookup(
+    const char* Serial,
+    const char* Build,
+    int Create
+);
+
+static void
+Grow(
+    void
+)
+{
+    AGGREGATE** old = Table;
+    size_t      oldSize = TableSize;
+    size_t      i;
+
+    TableSize = TableSize ? TableSize * 2 : 64;
+    Table = calloc(TableSize, sizeof(*Table));
+    if (Table == NULL) {
+        fprintf(stderr, "sedanalyze: out of memory\n");
+        exit(1);
+    }
+
+    for (i = 0; i < oldSize; i++) {
+        if (old[i] != NULL) {
+            size_t slot = HashKey(old[i]->SerialNumber, old[i]->DriverBuild) & (TableSize - 1);
+
+            while (Table[slot] != NULL) {
+                slot = (slot + 1) & (TableSize - 1);
+            }
+            Table[slot] = old[i];
+        }
+    }
+
+    free(old);
+}
+
+static AGGREGATE*
+Lookup(
+    const char* Serial,
+    const char* Build,
+    int Create
+)
+{
+    size_t     slot;
+    AGGREGATE* aggregate;
+
+    if (TableSize == 0) {
+        if (!Create) {
+            return NULL;
+        }
+        Grow();
+    }
+
+    slot = HashKey(Serial, Build) & (TableSize - 1);
+    while (Table[slot] != NULL) {
+        if (strcmp(Table[slot]->SerialNumber, Serial) == 0 &&
+            strcmp(Table[slot]->DriverBuild, Build) == 0) {
+            return Table[slot];
+        }
+        slot = (slot + 1) & (TableSize - 1);
+    }
+
+    if (!Create) {
+        return NULL;
+    }
+
+    if ((TableUsed + 1) * 10 > TableSize * 7) {
+        Grow();
+        return Lookup(Serial, Build, Create);
+    }
+
+    aggregate = calloc(1, sizeof(*aggregate));
+    if (aggregate == NULL) {
+        fprintf(stderr, "sedanalyze: out of memory\n");
+        exit(1);
+    }
+
+    snprintf(aggregate->SerialNumber, sizeof(aggregate->SerialNumber), "%s", Serial);
+    snprintf(aggregate->DriverBuild, sizeof(aggregate->DriverBuild), "%s", Build);
+    Table[slot] = aggregate;
+    TableUsed++;
+
+    return aggregate;
+}
+
+static void
+HistogramAdd(
+    HISTOGRAM* Histogram,
+    uint64_t Microseconds
+)
+{
+    Histogram->Buckets[PhaseBucket(Microseconds)]++;
+    Histogram->Count++;
+    if (Microseconds > Histogram->Max) {
+        Histogram->Max = Microseconds;
+    }
+}
+
+//
+// Percentile from bucket counts, interpolating linearly inside the bucket
+// the rank falls in
+//
+
+static uint64_t
+Percentile(
+    uint64_t Count,
+    uint64_t Max,
+    uint32_t BucketCount,
+    uint64_t (*Bucket)(const void* Histogram, uint32_t Index),
+    uint64_t (*Floor)(uint32_t Index),
+    const void* Histogram,
+    double Fraction
+)
+{
+    double   rank = Fraction * (double)Count;
+    uint64_t seen = 0;
+    uint32_t b;
+
+    if (Count == 0) {
+        return 0;
+    }
+
+    for (b = 0; b < BucketCount; b++) {
+        uint64_t inBucket = Bucket(Histogram, b);
+
+        if (inBucket != 0 && (double)(seen + inBucket) >= rank) {
+            uint64_t low = Floor(b);
+            uint64_t high = (b + 1 < BucketCount) ? Floor(b + 1) : Max + 1;
+            double   position = (rank - (double)seen) / (double)inBucket;
+            uint64_t value = low + (uint64_t)((double)(high - low) * position);
+
+            return value < Max ? value : Max;
+        }
+        seen += inBucket;
+    }
+
+    return Max;
+}
+
+static uint64_t
+PhaseBucketCount(
+    const void* Histogram,
+    uint32_t Index
+)
+{
+    return ((const HISTOGRAM*)Histogram)->Buckets[Index];
+}
+
+static uint64_t
+LatencyBucketCount(
+    const void* Histogram,
+    uint32_t Index
+)
+{
+    return ((const LATENCY_HISTOGRAM*)Histogram)->Buckets[Index];
+}
+
+static uint64_t
+LatencyBucketFloor(
+    uint32_t Index
+)
+{
+    return SedTraceLatencyBucketFloor(Index);
+}
+
+static uint64_t
+HistogramPercentile(
+    const HISTOGRAM* Histogram,
+    double Fraction
+)
+{
+    return Percentile(Histogram->Count, Histogram->Max, PHASE_BUCKETS,
+        PhaseBucketCount, PhaseBucketFloor, Histogram, Fraction);
+}
+
+static uint64_t
+LatencyPercentile(
+    const LATENCY_HISTOGRAM* Histogram,
+    double Fraction
+)
+{
+    return Percentile(Histogram->Count, Histogram->Max, SEDTRACE_LATENCY_BUCKETS,
+        LatencyBucketCount, LatencyBucketFloor, Histogram, Fraction);
+}
+
+//
+// Current device context while streaming a file
+//
+
+typedef struct _TRACE_CONTEXT {
+    AGGREGATE* Drive;
+    AGGREGATE* Build;
+    uint64_t   Frequency;
+} TRACE_CONTEXT;
+
+static void
+CloseResume(
+    TRACE_CONTEXT* Context
+)
+{
+    AGGREGATE* drive = Context->Drive;
+    int        p;
+
+    if (drive == NULL || !drive->Open) {
+        return;
+    }
+
+    drive->Resumes++;
+    Context->Build->Resumes++;
+    if (drive->Failed) {
+        drive->Failures++;
+        Context->Build->Failures++;
+    }
+
+    for (p = 0; p < PhaseCount; p++) {
+        if (drive->Seen[p]) {
+            HistogramAdd(&drive->Phase[p], drive->Offset[p]);
+            HistogramAdd(&Context->Build->Phase[p], drive->Offset[p]);
+        }
+    }
+
+    if (drive->Seen[PhaseGateOpen]) {
+        HistogramAdd(&drive->Ready[drive->Transition], drive->Offset[PhaseGateOpen]);
+        HistogramAdd(&Context->Build->Ready[drive->Transition], drive->Offset[PhaseGateOpen]);
+    }
+
+    drive->Open = 0;
+    drive->Transition = SedTraceTransitionUnknown;
+}
+
+static void
+ProcessEvent(
+    TRACE_CONTEXT* Context,
+    const SEDTRACE_EVENT* Event
+)
+{
+    AGGREGATE* drive = Context->Drive;
+    uint64_t   offset;
+    int        phase = -1;
+
+    if (Event->Event == SedTraceEventWake || Event->Event == SedTraceEventSleep) {
+        CloseResume(Context);
+
+        //
+        // Filters from before transitions were traced only saw S3
+        //
+
+        if (Event->Event == SedTraceEventSleep) {
+            drive->Transition = (Event->Arg16 == SedTraceTransitionUnknown) ?
+                SedTraceTransitionSleep :
+                (Event->Arg16 < SedTraceTransitionCount ? Event->Arg16 : SedTraceTransitionUnknown);
+        }
+
+        if (Event->Event == SedTraceEventWake) {
+            drive->Open = 1;
+            drive->WakeTimestamp = Event->Timestamp;
+            drive->NextCommand = PhaseCommandFirst;
+            drive->Failed = 0;
+            memset(drive->Seen, 0, sizeof(drive->Seen));
+        }
+        return;
+    }
+
+    if (!drive->Open || Event->Timestamp < drive->WakeTimestamp) {
+        return;
+    }
+
+    switch (Event->Event) {
+    case SedTraceEventWakeDone:     phase = PhaseWakeDone; break;
+    case SedTraceEventDeviceD0:     phase = PhaseDeviceD0; break;
+    case SedTraceEventUnlockStart:  phase = PhaseUnlockStart; break;
+    case SedTraceEventGateOpen:     phase = PhaseGateOpen; break;
+    case SedTraceEventFirstIo:      phase = PhaseFirstIo; break;
+
+    case SedTraceEventGateFail:
+        phase = PhaseGateFail;
+        drive->Failed = 1;
+        break;
+
+    case SedTraceEventUnlockDone:
+        phase = PhaseUnlockDone;
+        if ((int32_t)Event->Arg32 < 0) {
+            drive->Failed = 1;
+        }
+        break;
+
+    case SedTraceEventCommandSend:
+    case SedTraceEventCommandRecv:
+        if (drive->NextCommand <= PhaseCommandLast) {
+            phase = drive->NextCommand++;
+        }
+        if ((int32_t)Event->Arg32 < 0 || Event->Arg16 != 0) {
+            drive->Failed = 1;
+        }
+        break;
+    }
+
+    if (phase < 0 || drive->Seen[phase]) {
+        return;
+    }
+
+    offset = ((Event->Timestamp - drive->WakeTimestamp) * 1000000) / Context->Frequency;
+    drive->Offset[phase] = offset;
+    drive->Seen[phase] = 1;
+}
+
+static void
+ProcessLatency(
+    TRACE_CONTEXT* Context,
+    const SEDTRACE_LATENCY* Latency,
+    uint32_t Length
+)
+{
+    const SEDTRACE_BUCKET* bucket = (const SEDTRACE_BUCKET*)(Latency + 1);
+    AGGREGATE*             drive = Context->Drive;
+    uint32_t               current[SEDTRACE_LATENCY_BUCKETS] = { 0 };
+    uint32_t               c = Latency->LatencyClass;
+    uint32_t               i;
+    int                    reset = 0;
+
+    if (c > 1 || Latency->BucketCount > (Length - sizeof(*Latency)) / sizeof(*bucket)) {
+        return;
+    }
+
+    for (i = 0; i < Latency->BucketCount; i++) {
+        if (bucket[i].Bucket < SEDTRACE_LATENCY_BUCKETS) {
+            current[bucket[i].Bucket] = bucket[i].Count;
+        }
+    }
+
+    //
+    // Snapshots are cumulative, so only add what is new since the last one.
+    // Any bucket going backwards means the histograms were reset (or the
+    // machine rebooted) and the snapshot counts in full.
+    //
+
+    if (drive->HaveLatency[c]) {
+        for (i = 0; i < SEDTRACE_LATENCY_BUCKETS; i++) {
+            if (current[i] < drive->LastLatency[c][i]) {
+                reset = 1;
+                break;
+            }
+        }
+    }
+
+    for (i = 0; i < SEDTRACE_LATENCY_BUCKETS; i++) {
+        uint64_t delta = current[i];
+
+        if (drive->HaveLatency[c] && !reset) {
+            delta -= drive->LastLatency[c][i];
+        }
+
+        if (delta != 0) {
+            drive->Latency[c].Buckets[i] += delta;
+            drive->Latency[c].Count += delta;
+            Context->Build->Latency[c].Buckets[i] += delta;
+            Context->Build->Latency[c].Count += delta;
+        }
+    }
+
+    if (Latency->MaxMicroseconds > drive->Latency[c].Max) {
+        drive->Latency[c].Max = Latency->MaxMicroseconds;
+    }
+    if (Latency->MaxMicroseconds > Context->Build->Latency[c].Max) {
+        Context->Build->Latency[c].Max = Latency->MaxMicroseconds;
+    }
+
+    memcpy(drive->LastLatency[c], current, sizeof(current));
+    drive->HaveLatency[c] = 1;
+}
+
+static void
+ProcessCounters(
+    TRACE_CONTEXT* Context,
+    const SEDTRACE_COUNTERS* Counters
+)
+{
+    AGGREGATE*        drive = Context->Drive;
+    SEDTRACE_COUNTERS base = { 0 };
+
+    if (drive->HaveCounters &&
+        Counters->BytesRead >= drive->LastCounters.BytesRead &&
+        Counters->BytesWritten >= drive->LastCounters.BytesWritten &&
+        Counters->ReadCount >= drive->LastCounters.ReadCount &&
+        Counters->WriteCount >= drive->LastCounters.WriteCount) {
+        base = drive->LastCounters;
+    }
+
+    drive->BytesRead += Counters->BytesRead - base.BytesRead;
+    drive->BytesWritten += Counters->BytesWritten - base.BytesWritten;
+    drive->Reads += Counters->ReadCount - base.ReadCount;
+    drive->Writes += Counters->WriteCount - base.WriteCount;
+    Context->Build->BytesRead += Counters->BytesRead - base.BytesRead;
+    Context->Build->BytesWritten += Counters->BytesWritten - base.BytesWritten;
+    Context->Build->Reads += Counters->ReadCount - base.ReadCount;
+    Context->Build->Writes += Counters->WriteCount - base.WriteCount;
+
+    drive->LastCounters = *Counters;
+    drive->HaveCounters = 1;
+}
+
+static void
+CopyField(
+    char* Destination,
+    const char* Source,
+    size_t Length
+)
+{
+    memcpy(Destination, Source, Length);
+    Destination[Length] = '\0';
+}
+
+static int
+ProcessFile(
+    const char* Path
+)
+{
+    FILE*                f = strcmp(Path, "-") == 0 ? stdin : fopen(Path, "rb");
+    SEDTRACE_FILE_HEADER header;
+    SEDTRACE_RECORD      record;
+    TRACE_CONTEXT              context = { 0 };
+    static uint8_t*      buffer;
+    static size_t        bufferSize;
+    int                  result = 0;
+
+    if (f == NULL) {
+        fprintf(stderr, "sedanalyze: cannot open %s\n", Path);
+        return -1;
+    }
+
+    if (fread(&header, sizeof(header), 1, f) != 1 ||
+        header.Magic != SEDTRACE_MAGIC ||
+        header.HeaderSize < sizeof(header)) {
+        fprintf(stderr, "sedanalyze: %s: not a trace file\n", Path);
+        result = -1;
+        goto done;
+    }
+
+    if (header.Version > SEDTRACE_VERSION) {
+        fprintf(stderr, "sedanalyze: %s: trace version %u is newer than %u\n",
+            Path, header.Version, SEDTRACE_VERSION);
+        result = -1;
+        goto done;
+    }
+
+    if (header.HeaderSize > sizeof(header) &&
+        fseek(f, header.HeaderSize - sizeof(header), SEEK_CUR) != 0) {
+        result = -1;
+        goto done;
+    }
+
+    while (fread(&record, sizeof(record), 1, f) == 1) {
+        size_t body;
+
+        if (record.Length < sizeof(record) || (record.Length & 7) != 0 ||
+            record.Length > (64u << 20)) {
+            fprintf(stderr, "sedanalyze: %s: corrupt record\n", Path);
+            result = -1;
+            break;
+        }
+
+        if (record.Length > bufferSize) {
+            free(buffer);
+            bufferSize = record.Length * 2;
+            buffer = malloc(bufferSize);
+            if (buffer == NULL) {
+                fprintf(stderr, "sedanalyze: out of memory\n");
+                exit(1);
+            }
+        }
+
+        memcpy(buffer, &record, sizeof(record));
+        body = record.Length - sizeof(record);
+        if (fread(buffer + sizeof(record), 1, body, f) != body) {
+            fprintf(stderr, "sedanalyze: %s: truncated record\n", Path);
+            result = -1;
+            break;
+        }
+
+        if (record.Type == SedTraceRecordDevice && record.Length >= sizeof(SEDTRACE_DEVICE)) {
+            const SEDTRACE_DEVICE* device = (const SEDTRACE_DEVICE*)buffer;
+            char serial[SEDTRACE_SERIAL_LENGTH + 1];
+            char build[SEDTRACE_BUILD_LENGTH + 1];
+
+            CopyField(serial, device->SerialNumber, SEDTRACE_SERIAL_LENGTH);
+            CopyField(build, device->DriverBuild, SEDTRACE_BUILD_LENGTH);
+            if (serial[0] == '\0') {
+                snprintf(serial, sizeof(serial), "disk%u", device->DiskNumber);
+            }
+
+            context.Drive = Lookup(serial, build, 1);
+            context.Build = Lookup("*", build, 1);
+            context.Frequency = device->TimestampFrequency ? device->TimestampFrequency : 1;
+            CopyField(context.Drive->Model, device->Model, SEDTRACE_MODEL_LENGTH);
+            continue;
+        }
+
+        if (context.Drive == NULL) {
+            continue;
+        }
+
+        if (record.Type == SedTraceRecordEvents && record.Length >= sizeof(SEDTRACE_EVENTS)) {
+            const SEDTRACE_EVENTS* events = (const SEDTRACE_EVENTS*)buffer;
+            const SEDTRACE_EVENT*  event = (const SEDTRACE_EVENT*)(events + 1);
+            uint32_t               count = events->EventCount;
+            uint32_t               i;
+
+            if (count > (record.Length - sizeof(*events)) / sizeof(*event)) {
+                count = (uint32_t)((record.Length - sizeof(*events)) / sizeof(*event));
+            }
+            for (i = 0; i < count; i++) {
+                ProcessEvent(&context, &event[i]);
+            }
+        }
+        else if (record.Type == SedTraceRecordLatency && record.Length >= sizeof(SEDTRACE_LATENCY)) {
+            ProcessLatency(&context, (const SEDTRACE_LATENCY*)buffer, record.Length);
+        }
+        else if (record.Type == SedTraceRecordCounters && record.Length >= sizeof(SEDTRACE_COUNTERS)) {
+            ProcessCounters(&context, (const SEDTRACE_COUNTERS*)buffer);
+        }
+    }
+
+done:
+    if (f != stdin) {
+        fclose(f);
+    }
+    return result;
+}
+
+static void
+FinishAll(
+    void
+)
+{
+    size_t i;
+
+    for (i = 0; i < TableSize; i++) {
+        if (Table[i] != NULL && Table[i]->Open) {
+            TRACE_CONTEXT context = { Table[i], Lookup("*", Table[i]->DriverBuild, 0), 1 };
+
+            CloseResume(&context);
+        }
+    }
+}
+
+static int
+CompareAggregates(
+    const void* A,
+    const void* B
+)
+{
+    const AGGREGATE* a = *(const AGGREGATE* const*)A;
+    const AGGREGATE* b = *(const AGGREGATE* const*)B;
+    int order = strcmp(a->SerialNumber, b->SerialNumber);
+
+    return order ? order : strcmp(a->DriverBuild, b->DriverBuild);
+}
+
+static AGGREGATE**
+SortedAggregates(
+    size_t* Count
+)
+{
+    AGGREGATE** sorted = calloc(TableUsed + 1, sizeof(*sorted));
+    size_t      i;
+    size_t      n = 0;
+
+    if (sorted == NULL) {
+        fprintf(stderr, "sedanalyze: out of memory\n");
+        exit(1);
+    }
+
+    for (i = 0; i < TableSize; i++) {
+        if (Table[i] != NULL) {
+            sorted[n++] = Table[i];
+        }
+    }
+
+    qsort(sorted, n, sizeof(*sorted), CompareAggregates);
+    *Count = n;
+    return sorted;
+}
+
+static void
+PrintLine(
+    const char* Name,
+    uint64_t Count,
+    uint64_t P50,
+    uint64_t P90,
+    uint64_t P99,
+    uint64_t Max
+)
+{
+    printf("  %-14s %8llu %10.3f %10.3f %10.3f %10.3f\n",
+        Name, (unsigned long long)Count,
+        P50 / 1000.0, P90 / 1000.0, P99 / 1000.0, Max / 1000.0);
+}
+
+static void
+PrintHistogramLine(
+    const char* Name,
+    const HISTOGRAM* Histogram
+)
+{
+    PrintLine(Name, Histogram->Count,
+        HistogramPercentile(Histogram, 0.50),
+        HistogramPercentile(Histogram, 0.90),
+        HistogramPercentile(Histogram, 0.99),
+        Histogram->Max);
+}
+
+static void
+PrintLatencyLine(
+    const char* Name,
+    const LATENCY_HISTOGRAM* Histogram
+)
+{
+    PrintLine(Name, Histogram->Count,
+        LatencyPercentile(Histogram, 0.50),
+        LatencyPercentile(Histogram, 0.90),
+        LatencyPercentile(Histogram, 0.99),
+        Histogram->Max);
+}
+
+static void
+Report(
+    void
+)
+{
+    size_t      count;
+    AGGREGATE** sorted = SortedAggregates(&count);
+    size_t      i;
+    int         p;
+
+    for (i = 0; i < count; i++) {
+        AGGREGATE* a = sorted[i];
+        uint64_t   total = 0;
+        uint64_t   previous = 0;
+
+        if (a->Resumes == 0 && a->Latency[0].Count == 0 && a->Latency[1].Count == 0) {
+            continue;
+        }
+
+        if (strcmp(a->SerialNumber, "*") == 0) {
+            printf("all drives, build %s\n", a->DriverBuild);
+        }
+        else {
+            printf("drive %s (%s), build %s\n", a->SerialNumber, a->Model, a->DriverBuild);
+        }
+
+        printf("  %llu resumes, %llu failed, %llu reads %llu bytes, %llu writes %llu bytes\n",
+            (unsigned long long)a->Resumes, (unsigned long long)a->Failures,
+            (unsigned long long)a->Reads, (unsigned long long)a->BytesRead,
+            (unsigned long long)a->Writes, (unsigned long long)a->BytesWritten);
+
+        if (a->Resumes != 0) {
+            printf("  %-14s %8s %10s %10s %10s %10s   (ms from S0 IRP)\n",
+                "phase", "n", "p50", "p90", "p99", "max");
+            for (p = 0; p < PhaseCount; p++) {
+                if (a->Phase[p].Count != 0) {
+                    PrintHistogramLine(PhaseName(p), &a->Phase[p]);
+                    total = HistogramPercentile(&a->Phase[p], 0.50) > total ?
+                        HistogramPercentile(&a->Phase[p], 0.50) : total;
+                }
+            }
+
+            //
+            // Waterfall of the median resume: each phase runs from the end
+            // of the previous one to its own median offset
+            //
+
+            printf("  median resume waterfall:\n");
+            for (p = 0; p < PhaseCount && total != 0; p++) {
+                uint64_t end;
+                int      from;
+                int      to;
+                int      c;
+
+                if (a->Phase[p].Count == 0) {
+                    continue;
+                }
+
+                end = HistogramPercentile(&a->Phase[p], 0.50);
+                from = (int)((previous * 50) / total);
+                to = (int)((end * 50) / total);
+                printf("  %-14s |", PhaseName(p));
+                for (c = 0; c < 50; c++) {
+                    putchar(c < from ? ' ' : (c <= to ? '#' : ' '));
+                }
+                printf("| %.3f ms\n", end / 1000.0);
+                if (end > previous) {
+                    previous = end;
+                }
+            }
+
+            printf("  %-14s %8s %10s %10s %10s %10s   (ms from S0 IRP to gate open)\n",
+                "resumed from", "n", "p50", "p90", "p99", "max");
+            for (p = 0; p < SedTraceTransitionCount; p++) {
+                if (a->Ready[p].Count != 0) {
+                    PrintHistogramLine(TransitionName(p), &a->Ready[p]);
+                }
+            }
+        }
+
+        if (a->Latency[0].Count != 0 || a->Latency[1].Count != 0) {
+            printf("  %-14s %8s %10s %10s %10s %10s   (ms per IO)\n",
+                "io latency", "n", "p50", "p90", "p99", "max");
+            PrintLatencyLine("steady", &a->Latency[0]);
+            PrintLatencyLine("resume", &a->Latency[1]);
+        }
+
+        printf("\n");
+    }
+
+    free(sorted);
+}
+
+static int
+CompareBuilds(
+    const char* Base,
+    const char* Candidate,
+    double Threshold
+)
+{
+    size_t      count;
+    AGGREGATE** sorted = SortedAggregates(&count);
+    size_t      i;
+    int         p;
+    int         regressions = 0;
+
+    printf("%-20s %-14s %10s %10s %8s %10s %10s %8s\n",
+        "drive", "phase", "base p50", "new p50", "delta", "base p90", "new p90", "delta");
+
+    for (i = 0; i < count; i++) {
+        AGGREGATE* base = sorted[i];
+        AGGREGATE* candidate;
+
+        if (strcmp(base->DriverBuild, Base) != 0) {
+            continue;
+        }
+
+        candidate = Lookup(base->SerialNumber, Candidate, 0);
+        if (candidate == NULL || base->Resumes == 0 || candidate->Resumes == 0) {
+            continue;
+        }
+
+        for (p = 0; p < PhaseCount; p++) {
+            double   b50, c50, b90, c90;
+            double   d50, d90;
+            int      regressed;
+
+            if (base->Phase[p].Count == 0 || candidate->Phase[p].Count == 0) {
+                continue;
+            }
+
+            b50 = (double)HistogramPercentile(&base->Phase[p], 0.50);
+            c50 = (double)HistogramPercentile(&candidate->Phase[p], 0.50);
+            b90 = (double)HistogramPercentile(&base->Phase[p], 0.90);
+            c90 = (double)HistogramPercentile(&candidate->Phase[p], 0.90);
+            d50 = b50 > 0 ? (c50 - b50) * 100.0 / b50 : 0;
+            d90 = b90 > 0 ? (c90 - b90) * 100.0 / b90 : 0;
+            regressed = d50 > Threshold || d90 > Threshold;
+            regressions += regressed;
+
+            printf("%-20s %-14s %10.3f %10.3f %+7.1f%% %10.3f %10.3f %+7.1f%%%s\n",
+                base->SerialNumber, PhaseName(p),
+                b50 / 1000.0, c50 / 1000.0, d50,
+                b90 / 1000.0, c90 / 1000.0, d90,
+                regressed ? "  REGRESSED" : "");
+        }
+    }
+
+    free(sorted);
+    return regressions;
+}
+
+int
+main(
+    int argc,
+    char** argv
+)
+{
+    const char* base = NULL;
+    const char* candidate = NULL;
+    double      threshold = 10.0;
+    int         failed = 0;
+    int         i = 1;
+
+    while (i < argc && argv[i][0] == '-' && argv[i][1] != '\0') {
+        if (strcmp(argv[i], "-c") == 0 && i + 2 < argc) {
+            base = argv[i + 1];
+            candidate = argv[i + 2];
+            i += 3;
+        }
+        else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            threshold = atof(argv[i + 1]);
+            i += 2;
+        }
+        else {
+            break;
+        }
+    }
+
+    if (i >= argc) {
+        fprintf(stderr, "usage: sedanalyze [-c base new] [-t percent] file ...\n");
+        return 2;
+    }
+
+    for (; i < argc; i++) {
+        if (ProcessFile(argv[i]) != 0) {
+            failed++;
+        }
+    }
+
+    FinishAll();
+
+    if (base != NULL) {
+        return CompareBuilds(base, candidate, threshold) != 0 ? 3 : (failed ? 1 : 0);
+    }
+
+    Report();
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,410 @@
+/*++
+
+Module Name:
+
+    seddump.c
+
+Abstract:
+
+    Appends a SEDSleep trace chunk for each disk to a trace file (see
+    common/sedtrace.h). Meant to be run after every resume, e.g. from a
+    scheduled task triggered by the Power-Troubleshooter event.
+
+    seddump [-s statefile] tracefile [disk ...]
+    seddump -c start|stop disk ...
+    seddump -c read capturefile disk ...
+
+    Without a disk list every \\.\PhysicalDriveN that answers is dumped.
+    With -s, the last event sequence seen for each disk is kept in
+    statefile so the next run only picks up new events. Sequence numbers
+    start again from 1 when the driver loads, so the state is thrown away
+    when the machine has rebooted since it was saved.
+
+    -c controls pass-through command capture for sedreplay: start it,
+    sleep and resume, then read the captured commands into a file and stop
+    it again. The capture contains the drive credentials.
+
+Build:
+
+    cl /W4 /O2 seddump.c
+
+Environment:
+
+    Windows user mode
+
+--*/
+
+#include <windows.h>
+#include <winioctl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../SEDSleep/sedsleepioctl.h"
+#include "../common/sedtrace.h"
+
+#define SEDDUMP_MAX_DISKS 64
+
+#define SEDDUMP_BOOT_SLACK (10 * 10000000ULL)   // 10s in 100ns units
+
+static ULONG LastSequence[SEDDUMP_MAX_DISKS];
+
+static ULONGLONG
+BootTime(
+    VOID
+)
+{
+    FILETIME       now;
+    ULARGE_INTEGER time;
+
+    GetSystemTimeAsFileTime(&now);
+    time.LowPart = now.dwLowDateTime;
+    time.HighPart = now.dwHighDateTime;
+
+    return time.QuadPart - GetTickCount64() * 10000;
+}
+
+static void
+LoadState(
+    const char* Path
+)
+{
+    FILE*     f = fopen(Path, "rb");
+    ULONGLONG bootTime = 0;
+    ULONGLONG thisBoot = BootTime();
+
+    if (f == NULL) {
+        return;
+    }
+
+    if (fread(&bootTime, sizeof(bootTime), 1, f) == 1 &&
+        bootTime + SEDDUMP_BOOT_SLACK > thisBoot &&
+        bootTime < thisBoot + SEDDUMP_BOOT_SLACK) {
+        fread(LastSequence, sizeof(LastSequence), 1, f);
+    }
+
+    fclose(f);
+}
+
+static void
+SaveState(
+    const char* Path
+)
+{
+    FILE*     f = fopen(Path, "wb");
+    ULONGLONG bootTime = BootTime();
+
+    if (f != NULL) {
+        fwrite(&bootTime, sizeof(bootTime), 1, f);
+        fwrite(LastSequence, sizeof(LastSequence), 1, f);
+        fclose(f);
+    }
+}
+
+static HANDLE
+OpenDisk(
+    ULONG Disk,
+    DWORD Access
+)
+{
+    char path[64];
+
+    sprintf_s(path, sizeof(path), "\\\\.\\PhysicalDrive%lu", Disk);
+    return CreateFileA(path, Access, FILE_SHARE_READ | FILE_SHARE_WRITE,
+        NULL, OPEN_EXISTING, 0, NULL);
+}
+
+static BOOL
+SetCapture(
+    ULONG Disk,
+    BOOL Enable
+)
+{
+    HANDLE                   handle;
+    SEDSLEEP_CAPTURE_CONTROL control;
+    DWORD                    returned = 0;
+    BOOL                     ok;
+
+    handle = OpenDisk(Disk, GENERIC_READ | GENERIC_WRITE);
+    if (handle == INVALID_HANDLE_VALUE) {
+        fprintf(stderr, "seddump: disk %lu: error %lu\n", Disk, GetLastError());
+        return FALSE;
+    }
+
+    control.Flags = Enable ? SEDSLEEP_CAPTURE_ENABLE : 0;
+    control.BufferSize = 0;
+    ok = DeviceIoControl(handle, IOCTL_SEDSLEEP_SET_CAPTURE,
+        &control, sizeof(control), NULL, 0, &returned, NULL);
+    if (!ok) {
+        fprintf(stderr, "seddump: disk %lu: capture error %lu\n", Disk, GetLastError());
+    }
+
+    CloseHandle(handle);
+    return ok;
+}
+
+static BOOL
+ReadCapture(
+    FILE* Out,
+    ULONG Disk,
+    PUCHAR Buffer
+)
+{
+    HANDLE handle;
+    DWORD  returned;
+    BOOL   ok;
+
+    handle = OpenDisk(Disk, GENERIC_READ | GENERIC_WRITE);
+    if (handle == INVALID_HANDLE_VALUE) {
+        fprintf(stderr, "seddump: disk %lu: error %lu\n", Disk, GetLastError());
+        return FALSE;
+    }
+
+    //
+    // Each call hands back (and forgets) as many commands as fit, keep going
+    // until only the DEVICE record comes back
+    //
+
+    for (;;) {
+        returned = 0;
+        ok = DeviceIoControl(handle, IOCTL_SEDSLEEP_QUERY_CAPTURE,
+            NULL, 0, Buffer, SEDSLEEP_TRACE_CHUNK_SIZE, &returned, NULL);
+        if (!ok) {
+            fprintf(stderr, "seddump: disk %lu: capture error %lu\n", Disk, GetLastError());
+            break;
+        }
+
+        if (returned <= SEDTRACE_ALIGN(sizeof(SEDTRACE_DEVICE))) {
+            break;
+        }
+
+        fwrite(Buffer, 1, returned, Out);
+    }
+
+    CloseHandle(handle);
+    return ok;
+}
+
+static FILE*
+OpenTraceFile(
+    const char* Path
+)
+{
+    SEDTRACE_FILE_HEADER header;
+    FILE*                out;
+
+    out = fopen(Path, "ab");
+    if (out == NULL) {
+        fprintf(stderr, "seddump: cannot open %s\n", Path);
+        return NULL;
+    }
+
+    //
+    // New file, write the header
+    //
+
+    fseek(out, 0, SEEK_END);
+    if (ftell(out) == 0) {
+        header.Magic = SEDTRACE_MAGIC;
+        header.Version = SEDTRACE_VERSION;
+        header.HeaderSize = sizeof(header);
+        fwrite(&header, sizeof(header), 1, out);
+    }
+
+    return out;
+}
+
+static int
+CaptureUsage(
+    void
+)
+{
+    fprintf(stderr, "usage: seddump -c start|stop disk ...\n"
+        "       seddump -c read capturefile disk ...\n");
+    return 2;
+}
+
+static int
+Capture(
+    int argc,
+    char** argv
+)
+{
+    FILE*  out = NULL;
+    PUCHAR buffer = NULL;
+    int    arg = 3;
+    int    failed = 0;
+
+    if (argc < 4) {
+        return CaptureUsage();
+    }
+
+    if (strcmp(argv[2], "read") == 0) {
+        if (argc < 5) {
+            return CaptureUsage();
+        }
+
+        out = OpenTraceFile(argv[3]);
+        buffer = malloc(SEDSLEEP_TRACE_CHUNK_SIZE);
+        if (out == NULL || buffer == NULL) {
+            if (out != NULL) {
+                fclose(out);
+            }
+            free(buffer);
+            return 1;
+        }
+        arg = 4;
+    }
+    else if (strcmp(argv[2], "start") != 0 && strcmp(argv[2], "stop") != 0) {
+        return CaptureUsage();
+    }
+
+    for (; arg < argc; arg++) {
+        ULONG disk = strtoul(argv[arg], NULL, 10);
+        BOOL  ok;
+
+        if (out != NULL) {
+            ok = ReadCapture(out, disk, buffer);
+        }
+        else {
+            ok = SetCapture(disk, strcmp(argv[2], "start") == 0);
+        }
+
+        if (!ok) {
+            failed++;
+        }
+    }
+
+    if (out != NULL) {
+        fclose(out);
+    }
+    free(buffer);
+
+    return failed != 0 ? 1 : 0;
+}
+
+static BOOL
+DumpDisk(
+    FILE* Out,
+    ULONG Disk,
+    PUCHAR Buffer
+)
+{
+    HANDLE               handle;
+    SEDSLEEP_TRACE_QUERY query;
+    DWORD                returned = 0;
+    BOOL                 ok;
+    ULONG                offset;
+
+    handle = OpenDisk(Disk, 0);
+    if (handle == INVALID_HANDLE_VALUE) {
+        return FALSE;
+    }
+
+    query.FirstSequence = LastSequence[Disk] + 1;
+    ok = DeviceIoControl(handle, IOCTL_SEDSLEEP_QUERY_TRACE,
+        &query, sizeof(query),
+        Buffer, SEDSLEEP_TRACE_CHUNK_SIZE,
+        &returned, NULL);
+    CloseHandle(handle);
+
+    if (!ok) {
+        fprintf(stderr, "seddump: disk %lu: error %lu\n", Disk, GetLastError());
+        return FALSE;
+    }
+
+    //
+    // Remember the newest event we have now seen
+    //
+
+    for (offset = 0; offset + sizeof(SEDTRACE_RECORD) <= returned;) {
+        PSEDTRACE_RECORD record = (PSEDTRACE_RECORD)(Buffer + offset);
+
+        if (record->Length < sizeof(SEDTRACE_RECORD) || record->Length > returned - offset) {
+            break;
+        }
+
+        if (record->Type == SedTraceRecordEvents) {
+            PSEDTRACE_EVENTS events = (PSEDTRACE_EVENTS)record;
+            PSEDTRACE_EVENT  event = (PSEDTRACE_EVENT)(events + 1);
+
+            if (events->EventCount != 0) {
+                LastSequence[Disk] = event[events->EventCount - 1].Sequence;
+            }
+        }
+
+        offset += record->Length;
+    }
+
+    fwrite(Buffer, 1, returned, Out);
+    return TRUE;
+}
+
+int
+main(
+    int argc,
+    char** argv
+)
+{
+    const char*          statePath = NULL;
+    FILE*                out;
+    PUCHAR               buffer;
+    int                  arg = 1;
+    ULONG                disk;
+    int                  dumped = 0;
+
+    if (argc > 1 && strcmp(argv[1], "-c") == 0) {
+        return Capture(argc, argv);
+    }
+
+    if (argc > 2 && strcmp(argv[1], "-s") == 0) {
+        statePath = argv[2];
+        arg = 3;
+    }
+
+    if (arg >= argc) {
+        fprintf(stderr, "usage: seddump [-s statefile] tracefile [disk ...]\n"
+            "       seddump -c start|stop|read ...\n");
+        return 2;
+    }
+
+    if (statePath != NULL) {
+        LoadState(statePath);
+    }
+
+    out = OpenTraceFile(argv[arg]);
+    if (out == NULL) {
+        return 1;
+    }
+
+    buffer = malloc(SEDSLEEP_TRACE_CHUNK_SIZE);
+    if (buffer == NULL) {
+        fclose(out);
+        return 1;
+    }
+
+    if (++arg < argc) {
+        for (; arg < argc; arg++) {
+            disk = strtoul(argv[arg], NULL, 10);
+            if (disk < SEDDUMP_MAX_DISKS && DumpDisk(out, disk, buffer)) {
+                dumped++;
+            }
+        }
+    }
+    else {
+        for (disk = 0; disk < SEDDUMP_MAX_DISKS; disk++) {
+            if (DumpDisk(out, disk, buffer)) {
+                dumped++;
+            }
+        }
+    }
+
+    free(buffer);
+    fclose(out);
+
+    if (statePath != NULL) {
+        SaveState(statePath);
+    }
+
+    return dumped != 0 ? 0 : 1;
+}
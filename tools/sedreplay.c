@@ -0,0 +1,261 @@
+/*++
+
+Module Name:
+
+    sedreplay.c
+
+Abstract:
+
+    Lists and replays pass-through transcripts captured by the filter
+    (seddump -c read). Replaying drives the recorded command sequence
+    through the replay transport and checks that the recorded device
+    timing is reproduced, so the transport can be trusted as a stand-in
+    for the real drive in benchmarks.
+
+    sedreplay [-d disk | -S serial] [-l [-x]] [-n runs] [-s scale] file
+
+    -d, -S  pick the disk in the capture, default is the first one
+    -l      list the recorded commands, -x adds a hex dump of the data
+    -n      replay the transcript this many times, default 1
+    -s      scale recorded device times, e.g. 0.5 for a drive twice as fast
+
+Environment:
+
+    User mode, POSIX
+
+--*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sedreplay.h"
+
+static void
+HexDump(
+    const uint8_t* Data,
+    uint32_t Length
+)
+{
+    uint32_t i;
+
+    for (i = 0; i < Length; i++) {
+        printf("%s%02x", (i % 16) == 0 ? "      " : " ", Data[i]);
+        if ((i % 16) == 15 || i + 1 == Length) {
+            printf("\n");
+        }
+    }
+}
+
+static void
+List(
+    const SED_TRANSCRIPT* Transcript,
+    int Dump
+)
+{
+    uint32_t i;
+
+    printf("disk %u serial %.32s model %.40s build %.32s\n",
+        Transcript->Device.DiskNumber,
+        Transcript->Device.SerialNumber,
+        Transcript->Device.Model,
+        Transcript->Device.DriverBuild);
+    printf("%u commands, %u dropped while capturing\n",
+        Transcript->CommandCount, Transcript->Dropped);
+    printf("  seq  dir   proto comid   length     data  scsi    status      time ms\n");
+
+    for (i = 0; i < Transcript->CommandCount; i++) {
+        const SED_REPLAY_COMMAND* command = &Transcript->Commands[i];
+        const SEDTRACE_COMMAND* record = command->Record;
+
+        printf("%5u  %-4s  %5u %5u %8u %8u  %4u  %08x %12.3f\n",
+            record->Sequence,
+            command->DataIn ? "recv" : "send",
+            command->Protocol,
+            command->ComId,
+            record->TransferLength,
+            record->DataLength,
+            record->ScsiStatus,
+            record->Status,
+            command->ElapsedNs / 1e6);
+
+        if (Dump) {
+            HexDump(command->Data, record->DataLength);
+        }
+    }
+}
+
+static int
+Replay(
+    const SED_TRANSCRIPT* Transcript,
+    uint32_t Runs,
+    double Scale
+)
+
+/*++
+
+Routine Description:
+
+    Issue the recorded commands through the replay transport and compare
+    how long each took against the recording.
+
+--*/
+
+{
+    SED_REPLAY_OPTIONS options = { SED_REPLAY_STRICT, Scale };
+    SED_REPLAY_STATS   stats;
+    uint8_t*           buffer;
+    uint32_t           bufferSize = 0;
+    uint64_t           recorded = 0;
+    uint64_t           worst = 0;
+    double             errorSum = 0;
+    uint32_t           run;
+    uint32_t           i;
+    int                failures = 0;
+
+    for (i = 0; i < Transcript->CommandCount; i++) {
+        const SEDTRACE_COMMAND* record = Transcript->Commands[i].Record;
+
+        if (record->TransferLength > bufferSize) {
+            bufferSize = record->TransferLength;
+        }
+        recorded += Transcript->Commands[i].ElapsedNs;
+    }
+
+    if (Scale > 0) {
+        recorded = (uint64_t)((double)recorded * Scale);
+    }
+
+    buffer = calloc(1, bufferSize + 1);
+    if (buffer == NULL) {
+        return 1;
+    }
+
+    printf("  run   recorded ms   replayed ms\n");
+
+    for (run = 0; run < Runs; run++) {
+        SED_TRANSPORT* transport = SedReplayOpen(Transcript, &options);
+        uint64_t       runStart = SedNowNs();
+
+        if (transport == NULL) {
+            free(buffer);
+            return 1;
+        }
+
+        for (i = 0; i < Transcript->CommandCount; i++) {
+            const SED_REPLAY_COMMAND* command = &Transcript->Commands[i];
+            const SEDTRACE_COMMAND*   record = command->Record;
+            uint64_t                  expected = command->ElapsedNs;
+            uint64_t                  start = SedNowNs();
+            uint64_t                  took;
+            int                       status;
+
+            if (Scale > 0) {
+                expected = (uint64_t)((double)expected * Scale);
+            }
+
+            if (command->DataIn) {
+                status = SedIfRecv(transport, command->Protocol, command->ComId,
+                    buffer, record->TransferLength);
+                if (status == SED_OK && memcmp(buffer, command->Data, record->DataLength) != 0) {
+                    status = SED_ERROR_MISMATCH;
+                }
+            }
+            else {
+                memset(buffer, 0, record->TransferLength);
+                memcpy(buffer, command->Data, record->DataLength);
+                status = SedIfSend(transport, command->Protocol, command->ComId,
+                    buffer, record->TransferLength);
+            }
+
+            took = SedNowNs() - start;
+            worst = (took > expected + worst) ? took - expected : worst;
+            errorSum += (double)took - (double)expected;
+
+            if (status == SED_ERROR_MISMATCH || status == SED_ERROR_END) {
+                fprintf(stderr, "sedreplay: command %u: replay error %d\n",
+                    record->Sequence, status);
+                failures++;
+            }
+        }
+
+        printf("%5u %13.3f %13.3f\n", run + 1, recorded / 1e6, (SedNowNs() - runStart) / 1e6);
+
+        SedReplayGetStats(transport, &stats);
+        SedTransportClose(transport);
+    }
+
+    printf("%llu commands per run, %llu failed when recorded, %llu payload mismatches\n",
+        (unsigned long long)stats.Commands,
+        (unsigned long long)stats.Failed,
+        (unsigned long long)stats.PayloadMismatches);
+    printf("timing error per command: mean %.1f us, worst %.1f us\n",
+        errorSum / ((double)Runs * Transcript->CommandCount) / 1e3, worst / 1e3);
+
+    free(buffer);
+    return failures != 0 ? 1 : 0;
+}
+
+int
+main(
+    int argc,
+    char** argv
+)
+{
+    SED_TRANSCRIPT transcript;
+    uint32_t       disk = ~0u;
+    const char*    serial = NULL;
+    int            list = 0;
+    int            dump = 0;
+    uint32_t       runs = 1;
+    double         scale = 0;
+    int            i;
+    int            status;
+
+    for (i = 1; i < argc - 1 && argv[i][0] == '-'; i++) {
+        if (strcmp(argv[i], "-d") == 0) {
+            disk = (uint32_t)strtoul(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "-S") == 0) {
+            serial = argv[++i];
+        }
+        else if (strcmp(argv[i], "-l") == 0) {
+            list = 1;
+        }
+        else if (strcmp(argv[i], "-x") == 0) {
+            dump = 1;
+        }
+        else if (strcmp(argv[i], "-n") == 0) {
+            runs = (uint32_t)strtoul(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "-s") == 0) {
+            scale = strtod(argv[++i], NULL);
+        }
+        else {
+            break;
+        }
+    }
+
+    if (i != argc - 1 || runs == 0) {
+        fprintf(stderr, "usage: sedreplay [-d disk | -S serial] [-l [-x]] [-n runs] [-s scale] file\n");
+        return 2;
+    }
+
+    status = SedTranscriptLoad(argv[i], disk, serial, &transcript);
+    if (status != SED_OK) {
+        fprintf(stderr, "sedreplay: %s: no commands could be loaded (%d)\n", argv[i], status);
+        return 1;
+    }
+
+    if (list) {
+        List(&transcript, dump);
+        status = 0;
+    }
+    else {
+        status = Replay(&transcript, runs, scale);
+    }
+
+    SedTranscriptFree(&transcript);
+    return status;
+}
@@ -0,0 +1,460 @@
+/*++
+
+Module Name:
+
+    sedunlock.c
+
+Abstract:
+
+    Unlocks an Opal drive from Linux with the same single session unlock
+    the filter runs on resume (common/sedunlock.c): StartSession on the
+    Locking SP, every locking range and MBRDone set with the replies
+    collected together where the TPer allows, EndSession.
+
+    sedunlock [-p password | -k pin] [-a authority] [-r range]... [-m]
+              [-H sha1|sha256|sha512] [-i iterations] [-s salt]
+              [-t auto|scsi|ata|nvme] [-n] [-V] [-c runs] device
+
+    -p      password, hashed into the PIN as sedutil does: PBKDF2 salted
+            with the serial number padded to 20 bytes
+    -k      the PIN itself, in hex
+    -a      admin1 (default) or userN
+    -r      locking range to unlock, 0 being the global range; may be
+            repeated, default 0
+    -m      set MBRDone too
+    -H, -i, -s
+            hash, iterations and salt for -p, default sha1, 75000 and the
+            drive's serial number
+    -t      how to reach the drive, default auto (NVMe if it answers
+            Identify, else SCSI SECURITY PROTOCOL IN/OUT)
+    -n      wait for each reply even if the TPer takes queued commands
+    -V      do not read the columns back
+    -c      run the unlock this many times and report the times
+
+    device is a block or NVMe device, or emu:<state file> for the emulated
+    TPer in common/sedemu.c.
+
+Environment:
+
+    User mode, Linux
+
+--*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "sedemu.h"
+#include "sedlinux.h"
+#include "sedpbkdf2.h"
+#include "sedunlock.h"
+
+#define BUFFER_SIZE     2048
+#define MAX_RUNS        10000
+
+static const struct {
+    const char* Name;
+    SED_HASH Hash;
+} Hashes[] = {
+    { "sha1", SedHashSha1 },
+    { "sha256", SedHashSha256 },
+    { "sha512", SedHashSha512 },
+};
+
+static uint64_t
+NowNs(
+    void
+)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static int
+WaitMicroseconds(
+    void* Context,
+    uint32_t Microseconds
+)
+{
+    struct timespec delay;
+
+    (void)Context;
+
+    if (Microseconds != 0) {
+        delay.tv_sec = Microseconds / 1000000;
+        delay.tv_nsec = (long)(Microseconds % 1000000) * 1000;
+        nanosleep(&delay, NULL);
+    }
+
+    return 0;
+}
+
+static const char*
+ResultName(
+    int Result
+)
+{
+    switch (Result) {
+    case SED_OK:                    return "ok";
+    case SED_ERROR_IO:              return "I/O error";
+    case SED_ERROR_DEVICE:          return "drive failed the command";
+    case SED_ERROR_NO_MEMORY:       return "out of memory";
+    case SED_ERROR_INVALID:         return "invalid command";
+    case SED_ERROR_NOT_AUTHORIZED:  return "not authorized";
+    case SED_ERROR_PROTOCOL:        return "bad response";
+    case SED_ERROR_TIMEOUT:         return "timed out";
+    default:                        return "failed";
+    }
+}
+
+static int
+ParseHex(
+    const char* Text,
+    uint8_t* Bytes,
+    uint32_t Size,
+    uint32_t* Length
+)
+{
+    uint32_t i;
+
+    for (i = 0; Text[2 * i] != 0; i++) {
+        unsigned int byte;
+
+        if (i == Size || Text[2 * i + 1] == 0 || sscanf(Text + 2 * i, "%2x", &byte) != 1) {
+            return 0;
+        }
+        Bytes[i] = (uint8_t)byte;
+    }
+
+    *Length = i;
+    return i != 0;
+}
+
+static int
+ParseAuthority(
+    const char* Text,
+    uint8_t* Authority
+)
+{
+    unsigned long user;
+    char*         end;
+
+    if (strcmp(Text, "admin1") == 0) {
+        memcpy(Authority, SedUnlockAdmin1, 8);
+        return 1;
+    }
+
+    if (strncmp(Text, "user", 4) != 0) {
+        return 0;
+    }
+
+    user = strtoul(Text + 4, &end, 10);
+    if (*end != 0 || user == 0 || user > 0xFF) {
+        return 0;
+    }
+
+    memcpy(Authority, SedUnlockAdmin1, 8);
+    Authority[5] = 0x03;
+    Authority[7] = (uint8_t)user;
+    return 1;
+}
+
+static int
+CompareTimes(
+    const void* a,
+    const void* b
+)
+{
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+
+    return (x > y) - (x < y);
+}
+
+static void
+Usage(
+    void
+)
+{
+    fprintf(stderr,
+        "usage: sedunlock [-p password | -k pin] [-a authority] [-r range]... [-m]\n"
+        "                 [-H sha1|sha256|sha512] [-i iterations] [-s salt]\n"
+        "                 [-t auto|scsi|ata|nvme] [-n] [-V] [-c runs] device\n");
+}
+
+int
+main(
+    int argc,
+    char** argv
+)
+{
+    static uint8_t         command[BUFFER_SIZE];
+    static uint8_t         response[BUFFER_SIZE];
+    static SED_UNLOCK_PLAN plan;
+    static uint64_t        times[MAX_RUNS];
+    SED_TRANSPORT*         transport;
+    SED_UNLOCK             unlock;
+    SED_LINUX_KIND         kind = SedLinuxAuto;
+    SED_HASH               hash = SedHashSha1;
+    uint8_t                authority[8];
+    uint8_t                ranges[SED_UNLOCK_MAX_RANGES];
+    uint8_t                pin[SED_PBKDF2_MAX_DIGEST];
+    uint8_t                salt[SED_PBKDF2_SEDUTIL_SALT];
+    uint32_t               pinLength = 0;
+    uint32_t               rangeCount = 0;
+    uint32_t               iterations = SED_PBKDF2_SEDUTIL_ITERATIONS;
+    uint32_t               runs = 1;
+    uint32_t               completed;
+    uint32_t               h;
+    uint32_t               r;
+    const char*            password = NULL;
+    const char*            saltText = NULL;
+    const char*            device;
+    int                    results[SED_UNLOCK_MAX_METHODS];
+    int                    mbrDone = 0;
+    int                    noPipeline = 0;
+    int                    verify = 1;
+    int                    status = SED_OK;
+    uint8_t                locking;
+    int                    i;
+
+    memcpy(authority, SedUnlockAdmin1, 8);
+
+    for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+        const char* value = (i + 1 < argc) ? argv[i + 1] : NULL;
+
+        if (strcmp(argv[i], "-m") == 0) {
+            mbrDone = 1;
+            continue;
+        }
+        if (strcmp(argv[i], "-n") == 0) {
+            noPipeline = 1;
+            continue;
+        }
+        if (strcmp(argv[i], "-V") == 0) {
+            verify = 0;
+            continue;
+        }
+        if (value == NULL || argv[i][1] == 0 || argv[i][2] != 0) {
+            Usage();
+            return 2;
+        }
+
+        i++;
+
+        switch (argv[i - 1][1]) {
+        case 'p':
+            password = value;
+            break;
+
+        case 'k':
+            if (!ParseHex(value, pin, sizeof(pin), &pinLength)) {
+                Usage();
+                return 2;
+            }
+            break;
+
+        case 'a':
+            if (!ParseAuthority(value, authority)) {
+                Usage();
+                return 2;
+            }
+            break;
+
+        case 'r':
+            if (rangeCount == SED_UNLOCK_MAX_RANGES || strtoul(value, NULL, 10) > 0xFF) {
+                Usage();
+                return 2;
+            }
+            ranges[rangeCount++] = (uint8_t)strtoul(value, NULL, 10);
+            break;
+
+        case 'H':
+            for (h = 0; h < sizeof(Hashes) / sizeof(Hashes[0]) && strcmp(value, Hashes[h].Name) != 0; h++) {
+            }
+            if (h == sizeof(Hashes) / sizeof(Hashes[0])) {
+                Usage();
+                return 2;
+            }
+            hash = Hashes[h].Hash;
+            break;
+
+        case 'i':
+            iterations = (uint32_t)strtoul(value, NULL, 10);
+            break;
+
+        case 's':
+            saltText = value;
+            break;
+
+        case 't':
+            if (strcmp(value, "auto") == 0) {
+                kind = SedLinuxAuto;
+            }
+            else if (strcmp(value, "scsi") == 0) {
+                kind = SedLinuxScsi;
+            }
+            else if (strcmp(value, "ata") == 0) {
+                kind = SedLinuxAta;
+            }
+            else if (strcmp(value, "nvme") == 0) {
+                kind = SedLinuxNvme;
+            }
+            else {
+                Usage();
+                return 2;
+            }
+            break;
+
+        case 'c':
+            runs = (uint32_t)strtoul(value, NULL, 10);
+            break;
+
+        default:
+            Usage();
+            return 2;
+        }
+    }
+
+    if (i + 1 != argc || (password == NULL) == (pinLength == 0) ||
+        iterations == 0 || runs == 0 || runs > MAX_RUNS) {
+        Usage();
+        return 2;
+    }
+
+    device = argv[i];
+
+    if (rangeCount == 0) {
+        ranges[rangeCount++] = 0;
+    }
+
+    transport = (strncmp(device, "emu:", 4) == 0) ?
+        SedEmuOpen(device + 4) :
+        SedLinuxOpen(device, kind);
+    if (transport == NULL) {
+        fprintf(stderr, "sedunlock: cannot open %s: %s\n", device, strerror(errno));
+        return 1;
+    }
+
+    printf("%s: %s transport, serial number %s\n", device, transport->Name,
+        transport->SerialNumber != NULL ? transport->SerialNumber : "unknown");
+
+    memset(&unlock, 0, sizeof(unlock));
+    unlock.Transport = transport;
+    unlock.ComId = SED_UNLOCK_COMID;
+    unlock.Command = command;
+    unlock.Response = response;
+    unlock.BufferSize = BUFFER_SIZE;
+    unlock.NoPipeline = noPipeline;
+    unlock.Wait = WaitMicroseconds;
+
+    status = SedUnlockDiscover(&unlock, &locking);
+    if (status != SED_OK || !(locking & SED_OPAL_LOCKING_SUPPORTED)) {
+        fprintf(stderr, "sedunlock: %s does not support locking (%s)\n", device, ResultName(status));
+        SedTransportClose(transport);
+        return 1;
+    }
+
+    printf("locking %s, %s\n",
+        (locking & SED_OPAL_LOCKING_ENABLED) ? "enabled" : "not enabled",
+        (locking & SED_OPAL_LOCKING_LOCKED) ? "locked" : "unlocked");
+
+    if (SedUnlockQueryProperties(&unlock) == SED_OK) {
+        printf("MaxComPacketSize %u, %s\n", unlock.Properties.MaxComPacketSize,
+            unlock.Properties.Asynchronous ? "asynchronous" : "synchronous");
+    }
+
+    //
+    // The PIN sedutil would have set, salted with the serial number as the
+    // drive reports it, padded out with spaces as the filter does
+    //
+
+    if (password != NULL) {
+        SED_PBKDF2_JOB job;
+        const char*    text = (saltText != NULL) ? saltText : transport->SerialNumber;
+
+        if (text == NULL) {
+            fprintf(stderr, "sedunlock: no serial number to salt with, use -s\n");
+            SedTransportClose(transport);
+            return 1;
+        }
+
+        memset(salt, ' ', sizeof(salt));
+        memcpy(salt, text, strlen(text) < sizeof(salt) ? strlen(text) : sizeof(salt));
+
+        job.Hash = hash;
+        job.Password = (const uint8_t*)password;
+        job.PasswordLength = (uint32_t)strlen(password);
+        job.Salt = salt;
+        job.SaltLength = sizeof(salt);
+        job.Iterations = iterations;
+        job.Key = pin;
+        job.KeyLength = SED_PBKDF2_SEDUTIL_KEY;
+
+        if (SedPbkdf2(&job, 1, SedPbkdf2Features()) != SED_PBKDF2_OK) {
+            fprintf(stderr, "sedunlock: cannot derive the PIN\n");
+            SedTransportClose(transport);
+            return 1;
+        }
+        pinLength = SED_PBKDF2_SEDUTIL_KEY;
+    }
+
+    status = SedUnlockBuild(&plan, unlock.ComId, authority, pin, pinLength,
+        ranges, rangeCount, mbrDone, verify);
+    if (status != SED_OK) {
+        fprintf(stderr, "sedunlock: cannot build the unlock commands\n");
+        SedTransportClose(transport);
+        return 1;
+    }
+
+    for (r = 0; r < runs; r++) {
+        uint64_t start = NowNs();
+
+        status = SedUnlockRun(&unlock, &plan.StartSession, plan.Method, plan.MethodCount,
+            &plan.EndSession, results, &completed);
+        times[r] = NowNs() - start;
+
+        if (status != SED_OK) {
+            break;
+        }
+    }
+
+    for (h = 0; h < plan.MethodCount; h++) {
+        if (h < rangeCount) {
+            printf("range %-3u ", ranges[h]);
+        }
+        else {
+            printf("MBRDone   ");
+        }
+        printf("%s\n", (h < completed) ? ResultName(results[h]) : "not run");
+    }
+
+    if (status != SED_OK) {
+        fprintf(stderr, "sedunlock: unlock failed: %s", ResultName(status));
+        if (unlock.MethodStatus != SED_OPAL_STATUS_SUCCESS) {
+            fprintf(stderr, " (method status 0x%02x)", unlock.MethodStatus);
+        }
+        fprintf(stderr, "\n");
+        SedTransportClose(transport);
+        return 1;
+    }
+
+    qsort(times, runs, sizeof(times[0]), CompareTimes);
+    printf("unlocked in %.3f ms", times[0] / 1e6);
+    if (runs > 1) {
+        printf(" (best of %u, median %.3f ms, worst %.3f ms)",
+            runs, times[runs / 2] / 1e6, times[runs - 1] / 1e6);
+    }
+    printf(", %s, %u empty replies\n",
+        (unlock.Properties.Asynchronous && !noPipeline) ? "pipelined" : "one call at a time", unlock.Polls);
+
+    SedTransportClose(transport);
+    return 0;
+}
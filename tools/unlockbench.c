@@ -0,0 +1,608 @@
+/*++
+
+Module Name:
+
+    unlockbench.c
+
+Abstract:
+
+    Unlocks many emulated TPers (common/sedemu.c) at once with the unlock
+    core the filter and sedunlock use, as a stand in for a storage server
+    resuming with a few dozen self encrypting drives. The drives are
+    spread over a pool of worker threads, each with its own queue of
+    drives to unlock; a worker that runs out takes drives off the other
+    queues. Each worker blocks in the unlock while its drive is busy, as
+    the pass-through does, so more workers than processors can pay off.
+
+    unlockbench [-d drives] [-w workers] [-c runs] [-l latency] [-r range]...
+                [-m] [-S] [-n] [-v]
+
+    -d      emulated drives, default 24
+    -w      worker threads, default the number of processors; -w 1 unlocks
+            the drives one after another, as the filter does on resume
+    -c      unlocks of each drive, default 10
+    -l      microseconds each TPer reply takes, default 200
+    -r      locking range to unlock; may be repeated, default 0
+    -m      set MBRDone too
+    -S      synchronous TPers, one command at a time
+    -n      wait for each reply even if the TPer takes queued commands
+    -v      print every drive
+
+    It reports unlocks per second, the spread of unlock times, when the
+    drives were all first unlocked, and the heap allocations made while
+    unlocking (the core makes none; any there come from the emulator or
+    this tool).
+
+Environment:
+
+    User mode, POSIX threads, GNU ld (the allocation counts wrap malloc)
+
+--*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sedemu.h"
+#include "sedunlock.h"
+
+#define BUFFER_SIZE     2048
+#define MAX_DRIVES      256
+#define MAX_WORKERS     256
+#define MAX_RUNS        10000
+#define IDLE_WAIT_US    20
+
+static const uint8_t BenchPin[] = { 'p', 'a', 's', 's', 'w', 'o', 'r', 'd' };
+
+typedef struct _BENCH_DRIVE {
+    SED_TRANSPORT* Transport;
+    SED_UNLOCK Unlock;
+    uint8_t Command[BUFFER_SIZE];
+    uint8_t Response[BUFFER_SIZE];
+    char Serial[21];
+    uint64_t* Times;                // of each unlock, ns
+    uint64_t Ready;                 // first unlock done, ns from the start
+    uint32_t Runs;                  // unlocks done
+    uint32_t Polls;                 // empty replies over all of them
+    uint32_t Stolen;                // times another worker took it
+    int Status;
+} BENCH_DRIVE;
+
+//
+// A worker's queue of drive numbers. A drive is on at most one queue at a
+// time, so MAX_DRIVES slots always do. The owner takes from the bottom,
+// the most recently queued drive, other workers from the top.
+//
+
+typedef struct _BENCH_QUEUE {
+    pthread_mutex_t Lock;
+    uint32_t Top;
+    uint32_t Bottom;
+    uint32_t Slot[MAX_DRIVES];
+} BENCH_QUEUE;
+
+typedef struct _BENCH BENCH;
+
+typedef struct _BENCH_WORKER {
+    BENCH* Bench;
+    uint32_t Index;
+    pthread_t Thread;
+    BENCH_QUEUE Queue;
+} BENCH_WORKER;
+
+struct _BENCH {
+    BENCH_DRIVE* Drive;
+    uint32_t DriveCount;
+    BENCH_WORKER* Worker;
+    uint32_t WorkerCount;
+    uint32_t Runs;
+    const SED_UNLOCK_PLAN* Plan;
+    uint64_t Start;
+    atomic_uint Remaining;          // unlocks still to do
+    atomic_uint Steals;
+};
+
+//
+// Heap traffic, counted by wrapping malloc and friends at link time (see
+// the Makefile). Calls libc makes internally are not seen.
+//
+
+static atomic_ulong Allocations;
+static atomic_ulong AllocatedBytes;
+
+void* __real_malloc(size_t Size);
+void* __real_calloc(size_t Count, size_t Size);
+void* __real_realloc(void* Memory, size_t Size);
+
+void*
+__wrap_malloc(
+    size_t Size
+)
+{
+    atomic_fetch_add_explicit(&Allocations, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&AllocatedBytes, Size, memory_order_relaxed);
+    return __real_malloc(Size);
+}
+
+void*
+__wrap_calloc(
+    size_t Count,
+    size_t Size
+)
+{
+    atomic_fetch_add_explicit(&Allocations, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&AllocatedBytes, Count * Size, memory_order_relaxed);
+    return __real_calloc(Count, Size);
+}
+
+void*
+__wrap_realloc(
+    void* Memory,
+    size_t Size
+)
+{
+    atomic_fetch_add_explicit(&Allocations, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&AllocatedBytes, Size, memory_order_relaxed);
+    return __real_realloc(Memory, Size);
+}
+
+static uint64_t
+NowNs(
+    void
+)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void
+SleepMicroseconds(
+    uint32_t Microseconds
+)
+{
+    struct timespec delay;
+
+    delay.tv_sec = Microseconds / 1000000;
+    delay.tv_nsec = (long)(Microseconds % 1000000) * 1000;
+    nanosleep(&delay, NULL);
+}
+
+static int
+WaitMicroseconds(
+    void* Context,
+    uint32_t Microseconds
+)
+{
+    (void)Context;
+
+    if (Microseconds != 0) {
+        SleepMicroseconds(Microseconds);
+    }
+
+    return 0;
+}
+
+static void
+QueuePush(
+    BENCH_QUEUE* Queue,
+    uint32_t Drive
+)
+{
+    pthread_mutex_lock(&Queue->Lock);
+    Queue->Slot[Queue->Bottom++ % MAX_DRIVES] = Drive;
+    pthread_mutex_unlock(&Queue->Lock);
+}
+
+static int
+QueuePop(
+    BENCH_QUEUE* Queue,
+    int Top,
+    uint32_t* Drive
+)
+{
+    int found = 0;
+
+    pthread_mutex_lock(&Queue->Lock);
+    if (Queue->Top != Queue->Bottom) {
+        *Drive = Top ? Queue->Slot[Queue->Top++ % MAX_DRIVES] : Queue->Slot[--Queue->Bottom % MAX_DRIVES];
+        found = 1;
+    }
+    pthread_mutex_unlock(&Queue->Lock);
+
+    return found;
+}
+
+static int
+Steal(
+    BENCH_WORKER* Worker,
+    uint32_t* Drive
+)
+{
+    BENCH*   bench = Worker->Bench;
+    uint32_t i;
+
+    for (i = 1; i < bench->WorkerCount; i++) {
+        BENCH_WORKER* victim = &bench->Worker[(Worker->Index + i) % bench->WorkerCount];
+
+        if (QueuePop(&victim->Queue, 1, Drive)) {
+            atomic_fetch_add_explicit(&bench->Steals, 1, memory_order_relaxed);
+            bench->Drive[*Drive].Stolen++;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static void
+UnlockOnce(
+    BENCH* Bench,
+    BENCH_DRIVE* Drive
+)
+{
+    int      results[SED_UNLOCK_MAX_METHODS];
+    uint32_t completed;
+    uint64_t start = NowNs();
+    uint64_t end;
+
+    Drive->Status = SedUnlockRun(&Drive->Unlock, &Bench->Plan->StartSession, Bench->Plan->Method,
+        Bench->Plan->MethodCount, &Bench->Plan->EndSession, results, &completed);
+
+    end = NowNs();
+    Drive->Times[Drive->Runs] = end - start;
+    Drive->Polls += Drive->Unlock.Polls;
+    if (Drive->Runs++ == 0) {
+        Drive->Ready = end - Bench->Start;
+    }
+}
+
+static void*
+Worker(
+    void* Context
+)
+{
+    BENCH_WORKER* worker = Context;
+    BENCH*        bench = worker->Bench;
+    uint32_t      number;
+
+    while (atomic_load(&bench->Remaining) != 0) {
+        BENCH_DRIVE* drive;
+
+        if (!QueuePop(&worker->Queue, 0, &number) && !Steal(worker, &number)) {
+            SleepMicroseconds(IDLE_WAIT_US);
+            continue;
+        }
+
+        drive = &bench->Drive[number];
+        UnlockOnce(bench, drive);
+
+        //
+        // A drive that failed is not tried again; all its unlocks count as
+        // done
+        //
+
+        if (drive->Status != SED_OK) {
+            atomic_fetch_sub(&bench->Remaining, bench->Runs - drive->Runs + 1);
+            continue;
+        }
+
+        atomic_fetch_sub(&bench->Remaining, 1);
+        if (drive->Runs < bench->Runs) {
+            QueuePush(&worker->Queue, number);
+        }
+    }
+
+    return NULL;
+}
+
+static int
+CompareTimes(
+    const void* A,
+    const void* B
+)
+{
+    uint64_t a = *(const uint64_t*)A;
+    uint64_t b = *(const uint64_t*)B;
+
+    return (a > b) - (a < b);
+}
+
+static double
+PercentileMs(
+    const uint64_t* Sorted,
+    uint32_t Count,
+    uint32_t Percent
+)
+{
+    return Sorted[(uint64_t)(Count - 1) * Percent / 100] / 1e6;
+}
+
+static void
+Usage(
+    void
+)
+{
+    fprintf(stderr,
+        "usage: unlockbench [-d drives] [-w workers] [-c runs] [-l latency] [-r range]...\n"
+        "                   [-m] [-S] [-n] [-v]\n");
+}
+
+int
+main(
+    int argc,
+    char** argv
+)
+{
+    static SED_UNLOCK_PLAN plan;
+    static BENCH           bench;
+    SED_EMU_CONFIG         config;
+    uint8_t                ranges[SED_UNLOCK_MAX_RANGES];
+    uint32_t               rangeCount = 0;
+    uint32_t               drives = 24;
+    uint32_t               workers;
+    uint32_t               runs = 10;
+    uint32_t               latency = 200;
+    uint32_t               unlocks = 0;
+    uint32_t               failed = 0;
+    uint32_t               d;
+    uint32_t               w;
+    uint64_t*              times;
+    uint64_t*              all;
+    uint64_t*              ready;
+    uint64_t               elapsed;
+    unsigned long          setupAllocations;
+    unsigned long          setupBytes;
+    unsigned long          runAllocations;
+    unsigned long          runBytes;
+    long                   processors = sysconf(_SC_NPROCESSORS_ONLN);
+    int                    mbrDone = 0;
+    int                    synchronous = 0;
+    int                    noPipeline = 0;
+    int                    verbose = 0;
+    int                    i;
+
+    workers = (processors > 0) ? (uint32_t)processors : 1;
+
+    for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+        const char* value = (i + 1 < argc) ? argv[i + 1] : NULL;
+
+        if (strcmp(argv[i], "-m") == 0) {
+            mbrDone = 1;
+            continue;
+        }
+        if (strcmp(argv[i], "-S") == 0) {
+            synchronous = 1;
+            continue;
+        }
+        if (strcmp(argv[i], "-n") == 0) {
+            noPipeline = 1;
+            continue;
+        }
+        if (strcmp(argv[i], "-v") == 0) {
+            verbose = 1;
+            continue;
+        }
+        if (value == NULL || argv[i][1] == 0 || argv[i][2] != 0) {
+            Usage();
+            return 2;
+        }
+
+        i++;
+
+        switch (argv[i - 1][1]) {
+        case 'd':
+            drives = (uint32_t)strtoul(value, NULL, 10);
+            break;
+
+        case 'w':
+            workers = (uint32_t)strtoul(value, NULL, 10);
+            break;
+
+        case 'c':
+            runs = (uint32_t)strtoul(value, NULL, 10);
+            break;
+
+        case 'l':
+            latency = (uint32_t)strtoul(value, NULL, 10);
+            break;
+
+        case 'r':
+            if (rangeCount == SED_UNLOCK_MAX_RANGES || strtoul(value, NULL, 10) >= SED_EMU_MAX_RANGES) {
+                Usage();
+                return 2;
+            }
+            ranges[rangeCount++] = (uint8_t)strtoul(value, NULL, 10);
+            break;
+
+        default:
+            Usage();
+            return 2;
+        }
+    }
+
+    if (i != argc || drives == 0 || drives > MAX_DRIVES || workers == 0 || workers > MAX_WORKERS ||
+        runs == 0 || runs > MAX_RUNS) {
+        Usage();
+        return 2;
+    }
+
+    if (rangeCount == 0) {
+        ranges[rangeCount++] = 0;
+    }
+
+    if (SedUnlockBuild(&plan, SED_UNLOCK_COMID, SedUnlockAdmin1, BenchPin, sizeof(BenchPin),
+        ranges, rangeCount, mbrDone, 1) != SED_OK) {
+        fprintf(stderr, "unlockbench: cannot build the unlock commands\n");
+        return 1;
+    }
+
+    //
+    // Everything the run needs is allocated up front
+    //
+
+    bench.Drive = calloc(drives, sizeof(*bench.Drive));
+    bench.Worker = calloc(workers, sizeof(*bench.Worker));
+    times = calloc((size_t)drives * runs, sizeof(*times));
+    all = calloc((size_t)drives * runs, sizeof(*all));
+    ready = calloc(drives, sizeof(*ready));
+    if (bench.Drive == NULL || bench.Worker == NULL || times == NULL || all == NULL || ready == NULL) {
+        fprintf(stderr, "unlockbench: out of memory\n");
+        return 1;
+    }
+
+    bench.DriveCount = drives;
+    bench.WorkerCount = workers;
+    bench.Runs = runs;
+    bench.Plan = &plan;
+
+    memset(&config, 0, sizeof(config));
+    config.Pin = BenchPin;
+    config.PinLength = sizeof(BenchPin);
+    config.Locked = (1u << SED_EMU_MAX_RANGES) - 1;
+    config.Asynchronous = !synchronous;
+    config.LatencyUs = latency;
+
+    for (d = 0; d < drives; d++) {
+        BENCH_DRIVE* drive = &bench.Drive[d];
+
+        snprintf(drive->Serial, sizeof(drive->Serial), "EMU%013u", d);
+        config.Serial = drive->Serial;
+
+        drive->Transport = SedEmuCreate(&config);
+        if (drive->Transport == NULL) {
+            fprintf(stderr, "unlockbench: cannot create drive %u: %s\n", d, strerror(errno));
+            return 1;
+        }
+
+        drive->Times = times + (size_t)d * runs;
+        drive->Unlock.Transport = drive->Transport;
+        drive->Unlock.ComId = SED_UNLOCK_COMID;
+        drive->Unlock.Command = drive->Command;
+        drive->Unlock.Response = drive->Response;
+        drive->Unlock.BufferSize = BUFFER_SIZE;
+        drive->Unlock.NoPipeline = noPipeline;
+        drive->Unlock.Wait = WaitMicroseconds;
+
+        //
+        // The properties are known before resume, as the filter keeps them
+        // from the last time
+        //
+
+        if (SedUnlockQueryProperties(&drive->Unlock) != SED_OK) {
+            fprintf(stderr, "unlockbench: no properties from drive %u\n", d);
+            return 1;
+        }
+    }
+
+    for (w = 0; w < workers; w++) {
+        bench.Worker[w].Bench = &bench;
+        bench.Worker[w].Index = w;
+        pthread_mutex_init(&bench.Worker[w].Queue.Lock, NULL);
+    }
+
+    for (d = 0; d < drives; d++) {
+        QueuePush(&bench.Worker[d % workers].Queue, d);
+    }
+
+    atomic_store(&bench.Remaining, drives * runs);
+
+    setupAllocations = atomic_load(&Allocations);
+    setupBytes = atomic_load(&AllocatedBytes);
+
+    bench.Start = NowNs();
+    for (w = 0; w < workers; w++) {
+        if (pthread_create(&bench.Worker[w].Thread, NULL, Worker, &bench.Worker[w]) != 0) {
+            fprintf(stderr, "unlockbench: cannot start worker %u\n", w);
+            return 1;
+        }
+    }
+    for (w = 0; w < workers; w++) {
+        pthread_join(bench.Worker[w].Thread, NULL);
+    }
+    elapsed = NowNs() - bench.Start;
+
+    runAllocations = atomic_load(&Allocations) - setupAllocations;
+    runBytes = atomic_load(&AllocatedBytes) - setupBytes;
+
+    //
+    // Gather the unlock times of every drive that did not fail
+    //
+
+    for (d = 0; d < drives; d++) {
+        BENCH_DRIVE* drive = &bench.Drive[d];
+
+        if (drive->Status != SED_OK) {
+            fprintf(stderr, "unlockbench: drive %s failed after %u unlocks (%d)\n",
+                drive->Serial, drive->Runs, drive->Status);
+            failed++;
+            continue;
+        }
+
+        memcpy(all + unlocks, drive->Times, drive->Runs * sizeof(*all));
+        qsort(drive->Times, drive->Runs, sizeof(*drive->Times), CompareTimes);
+        ready[d - failed] = drive->Ready;
+        unlocks += drive->Runs;
+    }
+
+    printf("%u drives, %u workers, %u unlocks each, %s TPers, %u us per reply, %s\n",
+        drives, workers, runs, synchronous ? "synchronous" : "asynchronous", latency,
+        (!synchronous && !noPipeline) ? "pipelined" : "one call at a time");
+
+    if (verbose) {
+        printf("\ndrive             best ms  median ms   worst ms   ready ms  empty  stolen\n");
+        for (d = 0; d < drives; d++) {
+            BENCH_DRIVE* drive = &bench.Drive[d];
+
+            if (drive->Status != SED_OK) {
+                printf("%-16s failed\n", drive->Serial);
+                continue;
+            }
+            printf("%-16s %8.3f %10.3f %10.3f %10.3f %6u %7u\n", drive->Serial,
+                drive->Times[0] / 1e6, drive->Times[drive->Runs / 2] / 1e6,
+                drive->Times[drive->Runs - 1] / 1e6, drive->Ready / 1e6, drive->Polls, drive->Stolen);
+        }
+        printf("\n");
+    }
+
+    if (unlocks == 0) {
+        fprintf(stderr, "unlockbench: every drive failed\n");
+        return 1;
+    }
+
+    qsort(all, unlocks, sizeof(*all), CompareTimes);
+    qsort(ready, drives - failed, sizeof(*ready), CompareTimes);
+
+    printf("%u unlocks in %.3f ms, %.0f unlocks/s\n", unlocks, elapsed / 1e6, unlocks / (elapsed / 1e9));
+    printf("unlock ms      min %.3f  p50 %.3f  p90 %.3f  p99 %.3f  max %.3f\n",
+        all[0] / 1e6, PercentileMs(all, unlocks, 50), PercentileMs(all, unlocks, 90),
+        PercentileMs(all, unlocks, 99), all[unlocks - 1] / 1e6);
+    printf("first unlock   half the drives by %.3f ms, all by %.3f ms\n",
+        PercentileMs(ready, drives - failed, 50), ready[drives - failed - 1] / 1e6);
+    printf("steals         %u\n", atomic_load(&bench.Steals));
+    printf("allocations    %lu (%lu bytes) setting up, %lu (%lu bytes) unlocking\n",
+        setupAllocations, setupBytes, runAllocations, runBytes);
+
+    for (d = 0; d < drives; d++) {
+        SedTransportClose(bench.Drive[d].Transport);
+    }
+    for (w = 0; w < workers; w++) {
+        pthread_mutex_destroy(&bench.Worker[w].Queue.Lock);
+    }
+    free(ready);
+    free(all);
+    free(times);
+    free(bench.Worker);
+    free(bench.Drive);
+
+    return (failed != 0) ? 1 : 0;
+}